@@ -0,0 +1,269 @@
+#include "announcer.h"
+#include "env.h"
+#include "metrics.h"
+#include <algorithm>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Backoff for a 429 that did not say how long to wait
+constexpr std::chrono::milliseconds kDefaultRetryAfter{1000};
+
+struct AnnouncerMetrics {
+    Counter& creates = metrics().counter("musicbot_announce_requests_total", "Announcer REST requests",
+                                         "kind=\"create\"");
+    Counter& edits = metrics().counter("musicbot_announce_requests_total", "Announcer REST requests",
+                                       "kind=\"edit\"");
+    Counter& notices = metrics().counter("musicbot_announce_requests_total", "Announcer REST requests",
+                                         "kind=\"notice\"");
+    Counter& coalesced = metrics().counter("musicbot_announce_coalesced_total",
+                                           "Now-playing updates replaced before they were sent");
+    Counter& dropped = metrics().counter("musicbot_announce_notices_dropped_total",
+                                         "Notices dropped because too many were waiting");
+    Counter& rate_limited = metrics().counter("musicbot_announce_rate_limited_total",
+                                              "Announcer requests answered with 429");
+};
+
+AnnouncerMetrics& announcer_metrics() {
+    static AnnouncerMetrics m;
+    return m;
+}
+
+} // namespace
+
+Announcer::Announcer(std::shared_ptr<MessageTransport> transport, Options opts)
+    : transport(std::move(transport)), options(opts) {
+    thread = std::thread(&Announcer::run, this);
+}
+
+Announcer::~Announcer() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_one();
+    thread.join();
+}
+
+void Announcer::now_playing(uint64_t guild_id, uint64_t channel_id, EmbedView view) {
+    announce(guild_id, channel_id, std::move(view), false);
+}
+
+void Announcer::finished(uint64_t guild_id, uint64_t channel_id, EmbedView view) {
+    announce(guild_id, channel_id, std::move(view), true);
+}
+
+void Announcer::announce(uint64_t guild_id, uint64_t channel_id, EmbedView view, bool final) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Guild& guild = guilds[guild_id];
+        if (guild.session == 0 || guild.closed || guild.channel_id != channel_id) {
+            guild.session = next_session++;
+            guild.message_id = 0;
+            guild.closed = false;
+        }
+        guild.channel_id = channel_id;
+
+        if (guild.has_pending) {
+            announcer_metrics().coalesced.inc();
+        }
+        guild.pending = std::move(view);
+        guild.pending_final = final;
+        guild.has_pending = true;
+        waiting_guilds.insert(guild_id);
+    }
+    wake.notify_one();
+}
+
+void Announcer::notice(uint64_t channel_id, std::string text) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Channel& channel = channels[channel_id];
+        channel.notices.push_back(std::move(text));
+        while (channel.notices.size() > options.max_notices) {
+            channel.notices.pop_front();
+            announcer_metrics().dropped.inc();
+        }
+        waiting_channels.insert(channel_id);
+    }
+    wake.notify_one();
+}
+
+void Announcer::forget(uint64_t guild_id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    guilds.erase(guild_id);
+    waiting_guilds.erase(guild_id);
+}
+
+Clock::time_point Announcer::ready_at(const Channel& channel) const {
+    Clock::time_point at = channel.blocked_until;
+    if (channel.remaining == 0) {
+        at = std::max(at, channel.reset_at);
+    }
+    return at;
+}
+
+void Announcer::update_bucket(Channel& channel, const MessageResult& result) {
+    auto now = Clock::now();
+    if (result.remaining >= 0) {
+        channel.remaining = result.remaining;
+        channel.reset_at = now + result.reset_after;
+    }
+    if (result.status == 429) {
+        announcer_metrics().rate_limited.inc();
+        auto wait = result.retry_after.count() > 0 ? result.retry_after : kDefaultRetryAfter;
+        channel.blocked_until = now + wait;
+    }
+}
+
+void Announcer::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+        auto now = Clock::now();
+        auto next = Clock::time_point::max();
+        bool sent = false;
+
+        // Sending drops the lock, so start over after each request
+        for (uint64_t guild_id : waiting_guilds) {
+            Guild& guild = guilds[guild_id];
+            Channel& channel = channels[guild.channel_id];
+            if (channel.in_flight) {
+                continue; // its reply wakes us
+            }
+            auto at = std::max(guild.next_update, ready_at(channel));
+            if (at <= now) {
+                send_update(guild_id, lock);
+                sent = true;
+                break;
+            }
+            next = std::min(next, at);
+        }
+        if (sent) continue;
+
+        for (uint64_t channel_id : waiting_channels) {
+            Channel& channel = channels[channel_id];
+            if (channel.in_flight) {
+                continue;
+            }
+            auto at = ready_at(channel);
+            if (at <= now) {
+                send_notice(channel_id, lock);
+                sent = true;
+                break;
+            }
+            next = std::min(next, at);
+        }
+        if (sent) continue;
+
+        if (next == Clock::time_point::max()) {
+            wake.wait(lock);
+        } else {
+            wake.wait_until(lock, next);
+        }
+    }
+}
+
+void Announcer::send_update(uint64_t guild_id, std::unique_lock<std::mutex>& lock) {
+    Guild& guild = guilds[guild_id];
+    Channel& channel = channels[guild.channel_id];
+
+    EmbedView view = std::move(guild.pending);
+    bool final = guild.pending_final;
+    guild.has_pending = false;
+    waiting_guilds.erase(guild_id);
+    if (final) {
+        guild.closed = true;
+    }
+    guild.next_update = Clock::now() + options.coalesce_window;
+
+    channel.in_flight = true;
+    if (channel.remaining > 0) channel.remaining--;
+    else if (channel.remaining == 0) channel.remaining = -1; // bucket has reset; the reply will say
+
+    uint64_t channel_id = guild.channel_id;
+    uint64_t message_id = guild.message_id;
+    uint64_t session = guild.session;
+    auto done = [this, guild_id, channel_id, session, edit = message_id != 0, final, view](const MessageResult& result) {
+        update_done(guild_id, channel_id, session, edit, final, view, result);
+    };
+
+    lock.unlock();
+    if (message_id != 0) {
+        announcer_metrics().edits.inc();
+        transport->edit(channel_id, message_id, view, std::move(done));
+    } else {
+        announcer_metrics().creates.inc();
+        transport->create(channel_id, view, std::move(done));
+    }
+    lock.lock();
+}
+
+void Announcer::update_done(uint64_t guild_id, uint64_t channel_id, uint64_t session, bool was_edit, bool final,
+                            EmbedView view, const MessageResult& result) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Channel& channel = channels[channel_id];
+    channel.in_flight = false;
+    update_bucket(channel, result);
+
+    auto it = guilds.find(guild_id);
+    if (it != guilds.end() && it->second.session == session) {
+        Guild& guild = it->second;
+        bool resend = false;
+        if (result.ok) {
+            if (!was_edit) guild.message_id = result.message_id;
+        } else if (result.status == 429) {
+            resend = true;
+        } else if (was_edit && result.status == 404) {
+            // Someone deleted the message; post a new one
+            guild.message_id = 0;
+            resend = true;
+        }
+
+        // Unless a newer update is already waiting to replace it
+        if (resend && !guild.has_pending) {
+            guild.pending = std::move(view);
+            guild.pending_final = final;
+            guild.has_pending = true;
+            guild.closed = false;
+            guild.next_update = Clock::now();
+            waiting_guilds.insert(guild_id);
+        }
+    }
+    wake.notify_one();
+}
+
+void Announcer::send_notice(uint64_t channel_id, std::unique_lock<std::mutex>& lock) {
+    Channel& channel = channels[channel_id];
+    std::string text = std::move(channel.notices.front());
+    channel.notices.pop_front();
+    if (channel.notices.empty()) {
+        waiting_channels.erase(channel_id);
+    }
+    channel.in_flight = true;
+    if (channel.remaining > 0) channel.remaining--;
+    else if (channel.remaining == 0) channel.remaining = -1;
+
+    lock.unlock();
+    announcer_metrics().notices.inc();
+    transport->send_text(channel_id, text, [this, channel_id, text](const MessageResult& result) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            Channel& channel = channels[channel_id];
+            channel.in_flight = false;
+            update_bucket(channel, result);
+            if (result.status == 429) {
+                channel.notices.push_front(text);
+                waiting_channels.insert(channel_id);
+            }
+            wake.notify_one();
+        }
+    });
+    lock.lock();
+}
+
+Announcer::Options announcer_options_from_env() {
+    Announcer::Options opts;
+    opts.coalesce_window = std::chrono::milliseconds(env_size("ANNOUNCE_COALESCE_MS", opts.coalesce_window.count()));
+    return opts;
+}
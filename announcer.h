@@ -0,0 +1,127 @@
+#pragma once
+
+#include "views.h"
+#include <string>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <chrono>
+#include <cstdint>
+
+// Outcome of one REST call, as much of it as the Announcer needs
+struct MessageResult {
+    bool ok = false;
+    // HTTP status, 0 if the request never got an answer
+    int status = 0;
+    // Id of the message a successful create made
+    uint64_t message_id = 0;
+    // From the x-ratelimit-* headers; remaining is -1 when absent
+    int remaining = -1;
+    std::chrono::milliseconds reset_after{0};
+    // How long a 429 asked us to back off
+    std::chrono::milliseconds retry_after{0};
+};
+
+// Where the Announcer's messages go; bot.cpp implements it over dpp REST
+class MessageTransport {
+public:
+    using Done = std::function<void(const MessageResult&)>;
+
+    virtual ~MessageTransport() = default;
+
+    virtual void create(uint64_t channel_id, const EmbedView& view, Done done) = 0;
+    virtual void edit(uint64_t channel_id, uint64_t message_id, const EmbedView& view, Done done) = 0;
+    virtual void send_text(uint64_t channel_id, const std::string& text, Done done) = 0;
+};
+
+// Outbound channel messages, paced per channel.
+//
+// Each guild has one live "now playing" message that later announcements
+// edit in place. An announcement replaces any that is still waiting to go
+// out, and a guild's message is updated at most once per coalesce window,
+// so rapid skips collapse into one edit showing the latest track.
+//
+// Every channel is a rate limit bucket: one request in flight at a time,
+// and none while the bucket's last response said it was empty or a 429
+// asked us to wait. All calls are non-blocking; a dispatcher thread sends.
+class Announcer {
+public:
+    struct Options {
+        // Minimum time between two updates of one guild's message
+        std::chrono::milliseconds coalesce_window{1500};
+        // Text notices waiting per channel; the oldest are dropped beyond this
+        size_t max_notices = 5;
+    };
+
+    Announcer(std::shared_ptr<MessageTransport> transport, Options opts);
+    ~Announcer();
+
+    Announcer(const Announcer&) = delete;
+    Announcer& operator=(const Announcer&) = delete;
+
+    // Show view in the guild's now-playing message
+    void now_playing(uint64_t guild_id, uint64_t channel_id, EmbedView view);
+
+    // Last update of the session; the next now_playing() posts a new message
+    void finished(uint64_t guild_id, uint64_t channel_id, EmbedView view);
+
+    // One-off text message; not coalesced, but paced with everything else
+    void notice(uint64_t channel_id, std::string text);
+
+    // Drop the guild's waiting update and stop editing its message
+    void forget(uint64_t guild_id);
+
+private:
+    struct Guild {
+        uint64_t channel_id = 0;
+        uint64_t message_id = 0;
+        // A new message starts a new session; replies for an older one are ignored
+        uint64_t session = 0;
+        // The session's final update has gone out
+        bool closed = false;
+        bool has_pending = false;
+        bool pending_final = false;
+        EmbedView pending;
+        std::chrono::steady_clock::time_point next_update;
+    };
+
+    struct Channel {
+        bool in_flight = false;
+        // Requests left in the bucket and when it refills; -1 if unknown
+        int remaining = -1;
+        std::chrono::steady_clock::time_point reset_at;
+        std::chrono::steady_clock::time_point blocked_until;
+        std::deque<std::string> notices;
+    };
+
+    void announce(uint64_t guild_id, uint64_t channel_id, EmbedView view, bool final);
+    void run();
+    std::chrono::steady_clock::time_point ready_at(const Channel& channel) const;
+    void update_bucket(Channel& channel, const MessageResult& result);
+    void send_update(uint64_t guild_id, std::unique_lock<std::mutex>& lock);
+    void send_notice(uint64_t channel_id, std::unique_lock<std::mutex>& lock);
+    void update_done(uint64_t guild_id, uint64_t channel_id, uint64_t session, bool was_edit, bool final,
+                     EmbedView view, const MessageResult& result);
+
+    std::shared_ptr<MessageTransport> transport;
+    Options options;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::unordered_map<uint64_t, Guild> guilds;
+    std::unordered_map<uint64_t, Channel> channels;
+    // Guilds with an update waiting and channels with notices waiting
+    std::unordered_set<uint64_t> waiting_guilds;
+    std::unordered_set<uint64_t> waiting_channels;
+    uint64_t next_session = 1;
+    bool stopping = false;
+    std::thread thread;
+};
+
+// Options read from ANNOUNCE_COALESCE_MS
+Announcer::Options announcer_options_from_env();
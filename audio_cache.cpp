@@ -0,0 +1,375 @@
+#include "audio_cache.h"
+#include "env.h"
+#include "metrics.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// File layout, little-endian:
+//   "MBAC" | u8 version | u8 complete | u16 key size | key | records
+// with each record [u16 packet size][packet].
+constexpr char kMagic[4] = {'M', 'B', 'A', 'C'};
+constexpr uint8_t kVersion = 1;
+constexpr size_t kFixedHeader = 8;
+constexpr off_t kCompleteOffset = 5;
+constexpr const char* kExtension = ".mbac";
+
+// Writers hand data to the kernel in pieces this big
+constexpr size_t kFlushBytes = 64 << 10;
+
+struct AudioCacheMetrics {
+    Counter& hits = metrics().counter("musicbot_audio_cache_requests_total", "Audio cache lookups",
+                                      "result=\"hit\"");
+    Counter& partial = metrics().counter("musicbot_audio_cache_requests_total", "Audio cache lookups",
+                                         "result=\"partial\"");
+    Counter& misses = metrics().counter("musicbot_audio_cache_requests_total", "Audio cache lookups",
+                                        "result=\"miss\"");
+    Counter& evictions = metrics().counter("musicbot_audio_cache_evictions_total",
+                                           "Tracks deleted from the audio cache to stay within its budget");
+    Gauge& bytes = metrics().gauge("musicbot_audio_cache_bytes", "Size of the audio cache on disk");
+};
+
+AudioCacheMetrics& audio_cache_metrics() {
+    static AudioCacheMetrics m;
+    return m;
+}
+
+bool write_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = ::write(fd, data, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+} // namespace
+
+CachedTrack::CachedTrack(std::shared_ptr<const void> mapping, const uint8_t* records, size_t size,
+                         size_t header_size, bool complete)
+    : mapping(std::move(mapping)), records(records), records_size(size), header_size(header_size),
+      is_complete(complete) {
+    // A crash or a full disk can leave the last record cut off
+    size_t packet_size;
+    uint32_t packet_samples;
+    while (record_at(intact_bytes, packet_size, packet_samples)) {
+        intact_bytes += 2 + packet_size;
+        total_samples += packet_samples;
+    }
+}
+
+bool CachedTrack::record_at(size_t at, size_t& size, uint32_t& samples) const {
+    if (at + 2 > records_size) return false;
+    size = records[at] | (records[at + 1] << 8);
+    if (size == 0 || at + 2 + size > records_size) return false;
+    samples = opus_packet_samples(records + at + 2, size);
+    return samples != 0;
+}
+
+uint64_t CachedTrack::seek(uint64_t sample) {
+    offset = 0;
+    uint64_t position = 0;
+    size_t size;
+    uint32_t samples;
+    while (offset < intact_bytes && record_at(offset, size, samples) && position + samples <= sample) {
+        position += samples;
+        offset += 2 + size;
+    }
+    return position;
+}
+
+bool CachedTrack::next(OpusPacket& packet) {
+    size_t size;
+    uint32_t samples;
+    if (offset >= intact_bytes || !record_at(offset, size, samples)) return false;
+    packet = OpusPacket(records + offset + 2, size, samples, mapping);
+    offset += 2 + size;
+    return true;
+}
+
+AudioCache::Writer::~Writer() {
+    if (fd >= 0) finish(false);
+}
+
+void AudioCache::Writer::append(const OpusPacket& packet) {
+    if (failed || packet.size == 0 || packet.size > 0xFFFF) return;
+    buffer.push_back(static_cast<char>(packet.size & 0xFF));
+    buffer.push_back(static_cast<char>(packet.size >> 8));
+    buffer.append(reinterpret_cast<const char*>(packet.data), packet.size);
+    if (buffer.size() >= kFlushBytes) flush();
+}
+
+void AudioCache::Writer::flush() {
+    if (failed || buffer.empty()) return;
+    if (!write_all(fd, buffer.data(), buffer.size())) {
+        std::cerr << "Audio cache write failed: " << std::strerror(errno) << std::endl;
+        failed = true;
+        return;
+    }
+    size += buffer.size();
+    buffer.clear();
+    cache.resized(name, size);
+}
+
+void AudioCache::Writer::finish(bool complete) {
+    if (fd < 0) return;
+    flush();
+    if (complete && !failed) {
+        const char flag = 1;
+        failed = pwrite(fd, &flag, 1, kCompleteOffset) != 1;
+    }
+    ::close(fd);
+    fd = -1;
+    cache.done_writing(name, failed);
+}
+
+AudioCache::AudioCache(Options opts) : options(std::move(opts)) {
+    if (options.directory.empty()) return;
+
+    std::error_code ec;
+    std::filesystem::create_directories(options.directory, ec);
+    if (ec) {
+        std::cerr << "Audio cache disabled: " << options.directory << ": " << ec.message() << std::endl;
+        return;
+    }
+
+    // Recency from the previous run: files are touched whenever they are opened
+    struct Found {
+        std::filesystem::file_time_type used;
+        std::string name;
+        uint64_t bytes;
+    };
+    std::vector<Found> found;
+    for (const auto& file : std::filesystem::directory_iterator(options.directory, ec)) {
+        std::string name = file.path().filename().string();
+        if (file.path().extension() != kExtension) continue;
+        std::error_code file_ec;
+        uint64_t bytes = file.file_size(file_ec);
+        auto used = file.last_write_time(file_ec);
+        if (!file_ec) found.push_back({used, name, bytes});
+    }
+    std::sort(found.begin(), found.end(), [](const Found& a, const Found& b) { return a.used > b.used; });
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto& file : found) {
+        Entry& entry = entries[file.name];
+        entry.bytes = file.bytes;
+        entry.used = recency.insert(recency.end(), file.name);
+        total_bytes += file.bytes;
+    }
+    evict();
+    active = true;
+}
+
+bool AudioCache::wants(int duration) const {
+    return active && duration > 0 && duration <= options.max_track_seconds;
+}
+
+std::string AudioCache::file_name(const std::string& key) const {
+    // FNV-1a; the key in the file's header settles collisions
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (unsigned char c : key) {
+        hash = (hash ^ c) * 0x100000001b3ull;
+    }
+    char name[24];
+    std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(hash));
+    return name + std::string(kExtension);
+}
+
+std::string AudioCache::path(const std::string& name) const {
+    return (std::filesystem::path(options.directory) / name).string();
+}
+
+void AudioCache::touch(Entry& entry, const std::string& name) {
+    if (entry.used != recency.begin()) {
+        recency.erase(entry.used);
+        entry.used = recency.insert(recency.begin(), name);
+    }
+}
+
+std::shared_ptr<CachedTrack> AudioCache::open(const std::string& key) {
+    if (!active) return nullptr;
+    std::string name = file_name(key);
+
+    // Mapped and scanned under the lock, so a writer cannot truncate the
+    // file's cut-off tail meanwhile
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(name);
+    if (it == entries.end()) {
+        audio_cache_metrics().misses.inc();
+        return nullptr;
+    }
+    touch(it->second, name);
+
+    int fd = ::open(path(name).c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < kFixedHeader + key.size()) {
+        if (fd >= 0) ::close(fd);
+        audio_cache_metrics().misses.inc();
+        return nullptr;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // Records when the file was last used, for the next run's recency order
+    futimens(fd, nullptr);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        audio_cache_metrics().misses.inc();
+        return nullptr;
+    }
+    std::shared_ptr<const void> mapping(map, [size](const void* p) { munmap(const_cast<void*>(p), size); });
+
+    const auto* base = static_cast<const uint8_t*>(map);
+    size_t key_size = base[6] | (base[7] << 8);
+    bool valid = std::memcmp(base, kMagic, sizeof(kMagic)) == 0 && base[4] == kVersion && key_size == key.size() &&
+                 std::memcmp(base + kFixedHeader, key.data(), key.size()) == 0;
+    if (!valid) {
+        // Another key with the same hash, or damage; either way this track starts over
+        if (!it->second.writing) remove(name);
+        audio_cache_metrics().misses.inc();
+        return nullptr;
+    }
+
+    size_t header_size = kFixedHeader + key_size;
+    auto track = std::make_shared<CachedTrack>(std::move(mapping), base + header_size, size - header_size,
+                                               header_size, base[5] != 0);
+    (track->complete() ? audio_cache_metrics().hits : audio_cache_metrics().partial).inc();
+    return track;
+}
+
+std::unique_ptr<AudioCache::Writer> AudioCache::write(const std::string& key, const CachedTrack* existing) {
+    if (!active) return nullptr;
+    std::string name = file_name(key);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(name);
+    // Appending needs the file open() saw; starting over must not clobber
+    // a file someone may have mapped since
+    if (existing ? (it == entries.end() || it->second.writing) : it != entries.end()) {
+        return nullptr;
+    }
+
+    int fd;
+    uint64_t size;
+    if (existing) {
+        fd = ::open(path(name).c_str(), O_RDWR | O_CLOEXEC);
+        size = existing->intact_size();
+        // Another writer may have appended to the file, or finished it, since
+        // `existing` was mapped; cutting it back would destroy that and fault
+        // whoever mapped the longer file
+        struct stat st;
+        char complete = 1;
+        bool unchanged = fd >= 0 && fstat(fd, &st) == 0 &&
+                         static_cast<uint64_t>(st.st_size) == existing->mapped_size() &&
+                         pread(fd, &complete, 1, kCompleteOffset) == 1 && complete == 0;
+        if (fd >= 0 && (!unchanged || ftruncate(fd, static_cast<off_t>(size)) != 0 || lseek(fd, 0, SEEK_END) < 0)) {
+            ::close(fd);
+            fd = -1;
+        }
+    } else {
+        fd = ::open(path(name).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        std::string header(kMagic, sizeof(kMagic));
+        header.push_back(static_cast<char>(kVersion));
+        header.push_back(0);
+        header.push_back(static_cast<char>(key.size() & 0xFF));
+        header.push_back(static_cast<char>((key.size() >> 8) & 0xFF));
+        header += key;
+        size = header.size();
+        if (fd >= 0 && (key.size() > 0xFFFF || !write_all(fd, header.data(), header.size()))) {
+            ::close(fd);
+            ::unlink(path(name).c_str());
+            fd = -1;
+        }
+    }
+    if (fd < 0) return nullptr;
+
+    Entry& entry = existing ? it->second : entries[name];
+    if (!existing) entry.used = recency.insert(recency.begin(), name);
+    entry.writing = true;
+    total_bytes += size;
+    total_bytes -= entry.bytes;
+    entry.bytes = size;
+    audio_cache_metrics().bytes.set(static_cast<int64_t>(total_bytes));
+
+    auto writer = std::unique_ptr<Writer>(new Writer(*this, name, fd));
+    writer->size = size;
+    return writer;
+}
+
+void AudioCache::resized(const std::string& name, uint64_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(name);
+    if (it == entries.end()) return;
+    total_bytes += bytes;
+    total_bytes -= it->second.bytes;
+    it->second.bytes = bytes;
+    evict();
+}
+
+void AudioCache::done_writing(const std::string& name, bool failed) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(name);
+    if (it == entries.end()) return;
+    it->second.writing = false;
+    if (failed) {
+        remove(name);
+    }
+    evict();
+}
+
+// Called with the mutex held
+void AudioCache::remove(const std::string& name) {
+    auto it = entries.find(name);
+    if (it == entries.end()) return;
+    ::unlink(path(name).c_str());
+    total_bytes -= it->second.bytes;
+    recency.erase(it->second.used);
+    entries.erase(it);
+    audio_cache_metrics().bytes.set(static_cast<int64_t>(total_bytes));
+}
+
+// Called with the mutex held. Files being written are passed over; they
+// are counted again once they finish.
+void AudioCache::evict() {
+    auto it = recency.end();
+    while (total_bytes > options.max_bytes && it != recency.begin()) {
+        --it;
+        const std::string& name = *it;
+        if (entries[name].writing) continue;
+        std::string victim = name;
+        it = std::next(it);
+        remove(victim);
+        audio_cache_metrics().evictions.inc();
+    }
+    audio_cache_metrics().bytes.set(static_cast<int64_t>(total_bytes));
+}
+
+uint64_t AudioCache::size_bytes() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return total_bytes;
+}
+
+AudioCache::Options audio_cache_options_from_env() {
+    AudioCache::Options opts;
+    opts.directory = env_string("AUDIO_CACHE_DIR");
+    opts.max_bytes = static_cast<uint64_t>(env_size("AUDIO_CACHE_MB", opts.max_bytes >> 20)) << 20;
+    opts.max_track_seconds = static_cast<int>(env_size("AUDIO_CACHE_MAX_TRACK_SECONDS", opts.max_track_seconds));
+    return opts;
+}
+
+AudioCache& audio_cache() {
+    static AudioCache cache(audio_cache_options_from_env());
+    return cache;
+}
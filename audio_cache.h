@@ -0,0 +1,153 @@
+#pragma once
+
+#include "ogg_opus.h"
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+
+// One track's file in the audio cache, mapped read-only as it was when
+// opened. Packets read from it point into the mapping.
+class CachedTrack {
+public:
+    CachedTrack(std::shared_ptr<const void> mapping, const uint8_t* records, size_t size, size_t header_size,
+                bool complete);
+
+    // The whole stream is there; otherwise it stops where a play did
+    bool complete() const { return is_complete; }
+
+    // Samples per channel at 48 kHz in the intact records
+    uint64_t samples() const { return total_samples; }
+
+    // File size up to the end of the last intact record
+    uint64_t intact_size() const { return header_size + intact_bytes; }
+
+    // File size when it was mapped
+    uint64_t mapped_size() const { return header_size + records_size; }
+
+    // Move to the packet that holds `sample`; returns where that packet starts
+    uint64_t seek(uint64_t sample);
+
+    // The next packet, or false at the end of the intact records
+    bool next(OpusPacket& packet);
+
+private:
+    // Size and duration of the record at `offset`; false if it is cut off
+    bool record_at(size_t offset, size_t& size, uint32_t& samples) const;
+
+    std::shared_ptr<const void> mapping;
+    const uint8_t* records;
+    size_t records_size;
+    size_t header_size;
+    size_t intact_bytes = 0;
+    uint64_t total_samples = 0;
+    bool is_complete;
+    size_t offset = 0;
+};
+
+// Tracks' Opus packets on disk, so a popular track is fetched from
+// upstream once instead of every time a guild plays it.
+//
+// Each track is one file named after a hash of its page URL: a short
+// header, then its packets in order as [u16 size][packet] records. The file
+// is written while the track plays and marked complete when the stream
+// ends. A track that was skipped partway keeps what it has; the next play
+// starts from the file and fetches the rest from where it stops, appending
+// as it goes. Files are read through mmap.
+//
+// Once the files pass the byte budget, the least recently used ones are
+// deleted. Deleting a file that is being read is fine: the mapping stays.
+class AudioCache {
+public:
+    struct Options {
+        // Where the files live; empty disables the cache
+        std::string directory;
+        uint64_t max_bytes = 2ull << 30;
+        // Longer tracks, and streams of unknown length, are not cached
+        int max_track_seconds = 1800;
+    };
+
+    // Appends one track's packets to its file
+    class Writer {
+    public:
+        ~Writer();
+
+        Writer(const Writer&) = delete;
+        Writer& operator=(const Writer&) = delete;
+
+        void append(const OpusPacket& packet);
+
+        // Close the file; `complete` if the stream ended normally
+        void finish(bool complete);
+
+    private:
+        friend class AudioCache;
+        Writer(AudioCache& cache, std::string name, int fd) : cache(cache), name(std::move(name)), fd(fd) {}
+
+        void flush();
+
+        AudioCache& cache;
+        std::string name;
+        int fd;
+        uint64_t size = 0;
+        std::string buffer;
+        bool failed = false;
+    };
+
+    explicit AudioCache(Options opts);
+
+    AudioCache(const AudioCache&) = delete;
+    AudioCache& operator=(const AudioCache&) = delete;
+
+    bool enabled() const { return active; }
+
+    // Whether a track of this length (0 if unknown) belongs in the cache
+    bool wants(int duration) const;
+
+    // The track's file, or null if it has none
+    std::shared_ptr<CachedTrack> open(const std::string& key);
+
+    // Start the track's file over, or with `existing` (from open()) carry
+    // on where its intact records end. Null if the cache is off, someone
+    // else is writing the track, or the file changed since `existing` was
+    // mapped.
+    std::unique_ptr<Writer> write(const std::string& key, const CachedTrack* existing);
+
+    uint64_t size_bytes();
+
+private:
+    struct Entry {
+        uint64_t bytes = 0;
+        bool writing = false;
+        // Position in `recency`
+        std::list<std::string>::iterator used;
+    };
+
+    std::string file_name(const std::string& key) const;
+    std::string path(const std::string& name) const;
+    // Move the entry to the front of `recency`; called with the mutex held
+    void touch(Entry& entry, const std::string& name);
+    // A writer's file is now `bytes` long
+    void resized(const std::string& name, uint64_t bytes);
+    // A writer closed its file; a failed one is deleted
+    void done_writing(const std::string& name, bool failed);
+    void remove(const std::string& name);
+    void evict();
+
+    Options options;
+    bool active = false;
+
+    std::mutex mutex;
+    std::unordered_map<std::string, Entry> entries;
+    // File names, most recently used first
+    std::list<std::string> recency;
+    uint64_t total_bytes = 0;
+};
+
+// Options read from AUDIO_CACHE_DIR, AUDIO_CACHE_MB and AUDIO_CACHE_MAX_TRACK_SECONDS
+AudioCache::Options audio_cache_options_from_env();
+
+// Process-wide cache
+AudioCache& audio_cache();
@@ -0,0 +1,394 @@
+#include "audio_source.h"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+
+namespace {
+
+// Bytes read from an Opus remux at a time
+constexpr size_t kOpusReadSize = 16384;
+// Packets handed on at a time when reading from the audio cache (1 s)
+constexpr size_t kCachedBatch = 50;
+// libopus's encoder delay, which the decoder drops at the start of a track
+constexpr uint16_t kPreSkip = 312;
+
+bool write_all(int fd, const uint8_t* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+} // namespace
+
+AudioSource::AudioSource(Stream stream, size_t max_buffered, Format format, double start)
+    : stream(std::move(stream)), max_buffered(max_buffered == 0 ? 1 : max_buffered), output(format),
+      start_seconds(start) {
+    cached = !this->stream.cache_key.empty() && this->stream.codec == "opus" && this->stream.bitrate == 0 &&
+             audio_cache().wants(this->stream.duration);
+}
+
+std::shared_ptr<AudioSource> AudioSource::create(Stream stream, size_t max_buffered, Format format,
+                                                 double start_seconds) {
+    return std::shared_ptr<AudioSource>(new AudioSource(std::move(stream), max_buffered, format, start_seconds));
+}
+
+AudioSource::~AudioSource() {
+    // The last reference is usually dropped by the reader thread itself
+    if (reader.joinable()) {
+        if (reader.get_id() == std::this_thread::get_id()) {
+            reader.detach();
+        } else {
+            reader.join();
+        }
+    }
+    if (proc.pid > 0) {
+        kill_process(proc);
+    }
+    if (decoder.pid > 0) {
+        kill_process(decoder);
+    }
+}
+
+void AudioSource::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        on_readable = nullptr;
+        // Killing the children unblocks threads stuck in read() or write();
+        // the pipes are only closed once those threads are gone
+        if (proc.pid > 0) kill(proc.pid, SIGKILL);
+        if (decoder.pid > 0) kill(decoder.pid, SIGKILL);
+    }
+    cv.notify_all();
+}
+
+void AudioSource::set_max_buffered(size_t frames) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        max_buffered = frames == 0 ? 1 : frames;
+    }
+    cv.notify_all();
+}
+
+std::vector<std::string> AudioSource::input_args(double from) const {
+    std::vector<std::string> argv = {
+        "ffmpeg", "-nostdin", "-loglevel", "error",
+        "-reconnect", "1", "-reconnect_streamed", "1", "-reconnect_delay_max", "5"
+    };
+    if (from > 0) {
+        argv.insert(argv.end(), {"-ss", std::to_string(from)});
+    }
+    argv.insert(argv.end(), {"-i", stream.url, "-vn"});
+    return argv;
+}
+
+bool AudioSource::spawn_fetch(double from) {
+    std::vector<std::string> argv = input_args(from);
+    if (stream.codec != "opus" || stream.bitrate > 0) {
+        std::string bitrate = std::to_string(stream.bitrate > 0 ? stream.bitrate : 128) + "k";
+        argv.insert(argv.end(), {"-map", "0:a:0", "-c:a", "libopus", "-b:a", bitrate, "-frame_duration", "20",
+                                 "-ar", std::to_string(kSampleRate), "-ac", std::to_string(kChannels),
+                                 "-f", "ogg", "-page_duration", "20000"});
+    } else {
+        // Remux only; small pages so packets arrive as they are read
+        argv.insert(argv.end(), {"-map", "0:a:0", "-c:a", "copy", "-f", "ogg", "-page_duration", "20000"});
+    }
+    argv.push_back("pipe:1");
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (stopping) return false;
+    if (!spawn_process(argv, false, proc)) {
+        failure = "could not start ffmpeg";
+        return false;
+    }
+    return true;
+}
+
+int AudioSource::reap(Subprocess& child) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return wait_process(child);
+}
+
+bool AudioSource::start() {
+    bool spawned;
+    if (output == Format::opus) {
+        // A cached track may not need the network at all; the reader decides
+        spawned = cached || spawn_fetch(start_seconds);
+    } else if (cached) {
+        // A decoder that exits early must not take the bot down with it
+        std::signal(SIGPIPE, SIG_IGN);
+        std::vector<std::string> argv = {
+            "ffmpeg", "-nostdin", "-loglevel", "error", "-f", "ogg", "-i", "pipe:0",
+            "-f", "s16le", "-ar", std::to_string(kSampleRate), "-ac", std::to_string(kChannels), "pipe:1"
+        };
+        spawned = spawn_process(argv, true, decoder);
+    } else {
+        std::vector<std::string> argv = input_args(start_seconds);
+        argv.insert(argv.end(), {"-f", "s16le", "-ar", std::to_string(kSampleRate),
+                                 "-ac", std::to_string(kChannels), "pipe:1"});
+        spawned = spawn_process(argv, false, proc);
+    }
+
+    if (!spawned) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (failure.empty()) failure = "could not start ffmpeg";
+        eof = true;
+        return false;
+    }
+
+    reader = std::thread([self = shared_from_this()] { self->run(); });
+    return true;
+}
+
+void AudioSource::set_on_readable(std::function<void()> callback) {
+    std::lock_guard<std::mutex> lock(mutex);
+    on_readable = std::move(callback);
+}
+
+void AudioSource::run() {
+    if (output == Format::opus) {
+        auto queue = [this](std::vector<OpusPacket>& batch) { return queue_packets(batch); };
+        if (cached) {
+            finish_reading(cached_packets(queue));
+        } else {
+            fetch_packets(nullptr, queue);
+            finish_reading(reap(proc));
+        }
+    } else if (cached) {
+        std::thread feeder([this] { feed_decoder(); });
+        read_pcm(decoder.out_fd);
+        feeder.join();
+        finish_reading(reap(decoder));
+    } else {
+        read_pcm(proc.out_fd);
+        finish_reading(reap(proc));
+    }
+}
+
+bool AudioSource::read_pcm(int fd) {
+    Frame frame(kFrameValues);
+    size_t filled = 0;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return stopping || frames.size() < max_buffered; });
+            if (stopping) return false;
+        }
+
+        char* dest = reinterpret_cast<char*>(frame.data()) + filled;
+        ssize_t n = read(fd, dest, kFrameBytes - filled);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+
+        filled += static_cast<size_t>(n);
+        if (filled < kFrameBytes) continue;
+
+        std::function<void()> notify;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            frames.push_back(frame);
+            frames_decoded++;
+            notify = on_readable;
+        }
+        filled = 0;
+        cv.notify_all();
+        if (notify) notify();
+    }
+
+    // Pad a trailing partial frame with silence rather than dropping it
+    if (filled > 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::fill(frame.begin() + filled / sizeof(int16_t), frame.end(), 0);
+        frames.push_back(frame);
+        frames_decoded++;
+    }
+    return true;
+}
+
+bool AudioSource::fetch_packets(AudioCache::Writer* writer, const Deliver& deliver) {
+    OggOpusDemuxer demuxer;
+    std::vector<uint8_t> chunk(kOpusReadSize);
+    std::vector<OpusPacket> ready;
+    int fd = proc.out_fd;
+
+    while (true) {
+        ssize_t n = read(fd, chunk.data(), chunk.size());
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return true;
+
+        bool ok = demuxer.feed(chunk.data(), static_cast<size_t>(n), ready);
+        if (ok && !ready.empty()) {
+            if (writer) {
+                for (const auto& packet : ready) writer->append(packet);
+            }
+            ok = deliver(ready);
+        }
+        if (!ok) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!demuxer.error().empty()) failure = demuxer.error();
+            if (proc.pid > 0) kill(proc.pid, SIGKILL);
+            return false;
+        }
+    }
+}
+
+int AudioSource::cached_packets(const Deliver& deliver) {
+    AudioCache& cache = audio_cache();
+    auto from = static_cast<uint64_t>(start_seconds * kSampleRate);
+    auto track = cache.open(stream.cache_key);
+    std::unique_ptr<AudioCache::Writer> writer;
+
+    if (track && from < track->samples()) {
+        // Claimed before the mapped part plays, which takes as long as the
+        // part lasts, so no other writer can change the file meanwhile
+        if (!track->complete()) {
+            writer = cache.write(stream.cache_key, track.get());
+        }
+
+        // Straight out of the mapping
+        track->seek(from);
+        std::vector<OpusPacket> batch;
+        OpusPacket packet;
+        while (track->next(packet)) {
+            batch.push_back(std::move(packet));
+            if (batch.size() == kCachedBatch && !deliver(batch)) return 0;
+        }
+        if (!batch.empty() && !deliver(batch)) return 0;
+        if (track->complete()) return 0;
+
+        // The rest from the network, where the file stops
+        from = track->samples();
+    } else if (track && track->complete()) {
+        // Started past the end
+        return 0;
+    } else if (!track && from == 0) {
+        writer = cache.write(stream.cache_key, nullptr);
+    }
+    // Otherwise this starts past what the file has, and leaves it alone
+
+    if (!spawn_fetch(from / static_cast<double>(kSampleRate))) return -1;
+    bool clean = fetch_packets(writer.get(), deliver);
+    int status = reap(proc);
+    if (writer) writer->finish(clean && status == 0);
+    return status;
+}
+
+bool AudioSource::queue_packets(std::vector<OpusPacket>& batch) {
+    std::function<void()> notify;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return stopping || packets.size() < max_buffered; });
+        if (stopping) return false;
+        for (auto& packet : batch) {
+            packets.push_back(std::move(packet));
+        }
+        frames_decoded += batch.size();
+        notify = on_readable;
+    }
+    batch.clear();
+    cv.notify_all();
+    if (notify) notify();
+    return true;
+}
+
+void AudioSource::feed_decoder() {
+    OggOpusMuxer muxer;
+    std::vector<uint8_t> pages;
+    muxer.headers(start_seconds > 0 ? 0 : kPreSkip, pages);
+    int fd = decoder.in_fd;
+
+    // Backpressure comes from the decoder: it stops reading its stdin
+    // while read_pcm() leaves its stdout alone
+    bool ok = write_all(fd, pages.data(), pages.size());
+    pages.clear();
+    if (ok) {
+        cached_packets([&](std::vector<OpusPacket>& batch) {
+            for (const auto& packet : batch) {
+                muxer.packet(packet.data, packet.size, packet.samples, pages);
+            }
+            batch.clear();
+            bool written = write_all(fd, pages.data(), pages.size());
+            pages.clear();
+            return written;
+        });
+    }
+
+    // End of input lets the decoder flush and exit
+    std::lock_guard<std::mutex> lock(mutex);
+    close(decoder.in_fd);
+    decoder.in_fd = -1;
+}
+
+void AudioSource::finish_reading(int status) {
+    std::function<void()> notify;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stopping) return;
+        if (frames_decoded == 0 && failure.empty()) {
+            failure = status == 0 ? "stream contained no audio" : "could not open stream";
+        }
+        eof = true;
+        notify = on_readable;
+    }
+    cv.notify_all();
+    if (notify) notify();
+}
+
+bool AudioSource::wait_buffered(std::chrono::milliseconds amount, std::chrono::milliseconds timeout) {
+    size_t wanted = static_cast<size_t>(amount.count() / 20);
+    if (wanted > max_buffered) wanted = max_buffered;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    return cv.wait_for(lock, timeout, [this, wanted] {
+        return eof || buffered() >= wanted;
+    });
+}
+
+bool AudioSource::read_frame(Frame& frame) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (frames.empty()) return false;
+        frame = std::move(frames.front());
+        frames.pop_front();
+    }
+    cv.notify_all();
+    return true;
+}
+
+bool AudioSource::read_packet(OpusPacket& packet) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (packets.empty()) return false;
+        packet = std::move(packets.front());
+        packets.pop_front();
+    }
+    cv.notify_all();
+    return true;
+}
+
+bool AudioSource::finished() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return eof && buffered() == 0;
+}
+
+size_t AudioSource::buffered_frames() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return buffered();
+}
+
+std::string AudioSource::error() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return failure;
+}
+
+std::chrono::microseconds AudioSource::decoder_cpu() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return eof ? std::chrono::microseconds(proc.cpu_usec + decoder.cpu_usec) : std::chrono::microseconds(0);
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+#include "subprocess.h"
+#include "ogg_opus.h"
+#include "audio_cache.h"
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+// Audio for one track, as PCM or as the stream's own Opus packets.
+//
+// In PCM mode an ffmpeg child decodes the stream URL to 48 kHz stereo
+// s16le, and a reader thread slices its output into 20 ms frames. In Opus
+// mode ffmpeg only remuxes an Opus stream into Ogg without decoding it, and
+// the reader splits that into packets; a stream in any other codec is
+// encoded to Opus first. The reader stops pulling once max_buffered frames
+// or packets are waiting, so a source can be opened early and left holding
+// the first few seconds of a track.
+//
+// An Opus track with a cache key goes through the audio cache: its packets
+// come from the cached file as far as that goes, then from the network,
+// and are written to the file on the way. In PCM mode such a track is
+// decoded by a second ffmpeg fed from those packets.
+//
+// The reader thread keeps the source alive until the decoder exits, so a
+// source can be dropped from any thread (including its own callback) after
+// calling stop().
+class AudioSource : public std::enable_shared_from_this<AudioSource> {
+public:
+    static constexpr int kSampleRate = 48000;
+    static constexpr int kChannels = 2;
+    static constexpr size_t kFrameSamples = 960; // per channel, 20 ms
+    static constexpr size_t kFrameValues = kFrameSamples * kChannels;
+    static constexpr size_t kFrameBytes = kFrameValues * sizeof(int16_t);
+
+    using Frame = std::vector<int16_t>;
+
+    enum class Format { pcm, opus };
+
+    struct Stream {
+        std::string url;
+        // The audio codec as yt-dlp reports it
+        std::string codec;
+        // The track's page URL; empty keeps it out of the audio cache
+        std::string cache_key;
+        // Seconds, 0 if unknown
+        int duration = 0;
+        // Opus mode: kbps to re-encode at, 0 to pass an Opus stream through.
+        // Anything but 0 bypasses the audio cache.
+        int bitrate = 0;
+    };
+
+    // Playback starts start_seconds into the track
+    static std::shared_ptr<AudioSource> create(Stream stream, size_t max_buffered = 500,
+                                               Format format = Format::pcm, double start_seconds = 0);
+    ~AudioSource();
+
+    AudioSource(const AudioSource&) = delete;
+    AudioSource& operator=(const AudioSource&) = delete;
+
+    // Spawn the decoder. Returns false if ffmpeg could not be started.
+    bool start();
+
+    // Kill the decoder and let the reader thread exit
+    void stop();
+
+    // Raise or lower how far ahead the reader may decode
+    void set_max_buffered(size_t frames);
+
+    // Called from the reader thread whenever a new frame becomes available
+    void set_on_readable(std::function<void()> callback);
+
+    // Block until `amount` of audio is buffered, the stream ends, or timeout
+    bool wait_buffered(std::chrono::milliseconds amount, std::chrono::milliseconds timeout);
+
+    Format format() const { return output; }
+    int bitrate() const { return stream.bitrate; }
+    // What the source was opened from
+    const Stream& input() const { return stream; }
+
+    // Pop the next frame (PCM mode) or packet (Opus mode). Returns false if
+    // none is buffered right now.
+    bool read_frame(Frame& frame);
+    bool read_packet(OpusPacket& packet);
+
+    // Decoder has exited and every frame has been read
+    bool finished() const;
+
+    size_t buffered_frames() const;
+    std::string error() const;
+
+    // CPU time the ffmpeg children used, once they have exited; zero before that
+    std::chrono::microseconds decoder_cpu() const;
+
+private:
+    using Deliver = std::function<bool(std::vector<OpusPacket>& batch)>;
+
+    AudioSource(Stream stream, size_t max_buffered, Format format, double start_seconds);
+
+    // ffmpeg reading the stream from `from` seconds in, up to the output options
+    std::vector<std::string> input_args(double from) const;
+    // Start the network ffmpeg remuxing (or encoding) to Ogg Opus; from the
+    // reader side, so under the mutex in case stop() got there first
+    bool spawn_fetch(double from);
+    // Reap a child under the mutex, so stop() never signals a stale pid
+    int reap(Subprocess& child);
+
+    void run();
+    // False if stopped
+    bool read_pcm(int fd);
+    // Demux the fetch's output into `deliver`, copying it to `writer` if
+    // set. False if it stopped early.
+    bool fetch_packets(AudioCache::Writer* writer, const Deliver& deliver);
+    // The track's packets through the audio cache; returns the fetch's
+    // exit status, or 0 if the cache had it all
+    int cached_packets(const Deliver& deliver);
+    // Opus mode: wait for room in the buffer, then queue the batch
+    bool queue_packets(std::vector<OpusPacket>& batch);
+    // Two-stage PCM mode: mux packets into the decoder's stdin
+    void feed_decoder();
+    // Called once the output is exhausted; records errors and wakes readers
+    void finish_reading(int status);
+    size_t buffered() const { return frames.size() + packets.size(); }
+
+    Stream stream;
+    size_t max_buffered;
+    Format output;
+    double start_seconds;
+    // Through the audio cache
+    bool cached;
+    // The ffmpeg reading the stream, and in two-stage PCM mode the one
+    // decoding its packets
+    Subprocess proc;
+    Subprocess decoder;
+    std::thread reader;
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Frame> frames;
+    std::deque<OpusPacket> packets;
+    std::function<void()> on_readable;
+    bool eof = false;
+    bool stopping = false;
+    uint64_t frames_decoded = 0;
+    std::string failure;
+};
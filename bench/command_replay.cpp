@@ -0,0 +1,533 @@
+// Load test of the slash command path, with no Discord connection.
+//
+// Replays a command trace, as the bot writes one with COMMAND_TRACE_FILE,
+// or generates one: /play, /queue and /skip spread over thousands of
+// guilds. The commands go through MusicBot exactly as dpp events would.
+// Behind it everything is faked at the process edge: voice connections
+// come up at once and play into sinks that drain in real time, searches
+// are answered by bench/fake_ytdlp.py from a recording made up for the
+// run, and the audio comes from a scratch audio cache, so no ffmpeg runs.
+//
+//   ./build/bench/command_replay [--guilds N] [--commands N] [--rate N]
+//                                [--trace FILE] [--speed X] [--write-trace FILE]
+//
+// A command's latency runs from when the trace says it arrived until its
+// last response is out and nothing it queued is left to run. Build with
+// -DMUSICBOT_TSAN=ON (make TSAN=1) to have ThreadSanitizer watch the run;
+// races are reported on stderr and make the exit status non-zero.
+
+#include "music_bot.h"
+#include "audio_cache.h"
+#include "ogg_opus.h"
+#include <json/json.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#ifndef BENCH_DATA_DIR
+#define BENCH_DATA_DIR "bench"
+#endif
+
+#if defined(__SANITIZE_THREAD__)
+#define UNDER_TSAN 1
+#elif defined(__has_feature)
+#if __has_feature(thread_sanitizer)
+#define UNDER_TSAN 1
+#endif
+#endif
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Config {
+    size_t guilds = 2000;
+    size_t commands = 20000;
+    // Commands per second in a generated trace
+    double rate = 2000;
+    // Replay a recorded trace instead, this many times faster than recorded
+    std::string trace;
+    double speed = 1.0;
+    std::string write_trace;
+    size_t threads = std::max<size_t>(2, std::thread::hardware_concurrency());
+    size_t resolver_workers = 4;
+    // Distinct tracks the fake searches answer with, and their length
+    size_t tracks = 200;
+    int track_seconds = 30;
+    // Give up on commands still unanswered this long after the last one is sent
+    std::chrono::seconds drain{60};
+};
+
+struct TimedCommand {
+    int64_t at_ms = 0;
+    Command command;
+};
+
+// Latencies and outcomes per command name
+class Results {
+public:
+    void add(const std::string& name, double seconds, bool busy) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Row& row = rows[name];
+        row.latencies.push_back(seconds);
+        if (busy) row.busy++;
+        total++;
+        done.notify_all();
+    }
+
+    // Wait until `count` commands have finished; false on timeout
+    bool wait(size_t count, Clock::time_point deadline) {
+        std::unique_lock<std::mutex> lock(mutex);
+        return done.wait_until(lock, deadline, [&] { return total >= count; });
+    }
+
+    size_t finished() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return total;
+    }
+
+    void report(double elapsed) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::printf("%-14s %8s %10s %10s %10s %10s %10s %6s\n", "command", "count", "cmds/s", "p50", "p90",
+                    "p99", "max", "busy");
+        std::vector<double> all;
+        size_t busy = 0;
+        for (auto& [name, row] : rows) {
+            print_row(("/" + name).c_str(), row.latencies, row.busy, elapsed);
+            all.insert(all.end(), row.latencies.begin(), row.latencies.end());
+            busy += row.busy;
+        }
+        if (!all.empty()) {
+            print_row("all", all, busy, elapsed);
+        }
+    }
+
+private:
+    struct Row {
+        std::vector<double> latencies;
+        size_t busy = 0;
+    };
+
+    static std::string format_seconds(double s) {
+        char buf[32];
+        if (s < 1e-3) std::snprintf(buf, sizeof(buf), "%.1fus", s * 1e6);
+        else if (s < 1) std::snprintf(buf, sizeof(buf), "%.2fms", s * 1e3);
+        else std::snprintf(buf, sizeof(buf), "%.2fs", s);
+        return buf;
+    }
+
+    static void print_row(const char* name, std::vector<double> samples, size_t busy, double elapsed) {
+        std::sort(samples.begin(), samples.end());
+        auto pct = [&](double p) {
+            return samples[std::min(samples.size() - 1, static_cast<size_t>(p * samples.size()))];
+        };
+        std::printf("%-14s %8zu %10.0f %10s %10s %10s %10s %6zu\n", name, samples.size(), samples.size() / elapsed,
+                    format_seconds(pct(0.50)).c_str(), format_seconds(pct(0.90)).c_str(),
+                    format_seconds(pct(0.99)).c_str(), format_seconds(samples.back()).c_str(), busy);
+    }
+
+    std::mutex mutex;
+    std::condition_variable done;
+    std::map<std::string, Row> rows;
+    size_t total = 0;
+};
+
+// Records the command once the bot lets go of it, which is after its last
+// response and after every task that held on to it
+class FakeInteraction : public Interaction {
+public:
+    FakeInteraction(Command command, Results& results) : Interaction(std::move(command)), results(results) {}
+
+    ~FakeInteraction() override {
+        double seconds = std::chrono::duration<double>(Clock::now() - command().received).count();
+        results.add(command().name, seconds, busy);
+    }
+
+    void reply(const std::string& text) override { answered(text); }
+    void reply(const EmbedView& view) override { answered(view.title); }
+    void edit_reply(const std::string& text) override { answered(text); }
+
+private:
+    void answered(const std::string& text) {
+        std::lock_guard<std::mutex> lock(mutex);
+        busy = text.rfind("⏳", 0) == 0;
+    }
+
+    Results& results;
+    std::mutex mutex;
+    bool busy = false;
+};
+
+// A voice connection that plays what it is sent in real time
+class FakeSink : public VoiceSink {
+public:
+    bool ready() override { return true; }
+
+    void send_pcm(const int16_t*, size_t count) override { queue(count / 2); }
+
+    bool accepts_opus() override { return true; }
+
+    void send_opus(const uint8_t*, size_t, uint32_t samples) override {
+        packets.fetch_add(1, std::memory_order_relaxed);
+        queue(samples);
+    }
+
+    double buffered_seconds() override {
+        std::lock_guard<std::mutex> lock(mutex);
+        drain();
+        return buffered;
+    }
+
+    void clear() override {
+        std::lock_guard<std::mutex> lock(mutex);
+        buffered = 0;
+    }
+
+    void pause(bool paused) {
+        std::lock_guard<std::mutex> lock(mutex);
+        drain();
+        held = paused;
+    }
+
+    static std::atomic<uint64_t> packets;
+
+private:
+    void queue(size_t samples) {
+        std::lock_guard<std::mutex> lock(mutex);
+        drain();
+        buffered += samples / 48000.0;
+    }
+
+    // Called with the mutex held
+    void drain() {
+        auto now = Clock::now();
+        if (!held) {
+            buffered = std::max(0.0, buffered - std::chrono::duration<double>(now - drained).count());
+        }
+        drained = now;
+    }
+
+    std::mutex mutex;
+    double buffered = 0;
+    bool held = false;
+    Clock::time_point drained = Clock::now();
+};
+
+std::atomic<uint64_t> FakeSink::packets{0};
+
+// Every user is in a voice channel, and connections come up right away.
+// The bot's send scheduler keeps them fed, as it does dpp's.
+class FakeVoiceGateway : public VoiceGateway {
+public:
+    void start(MusicBot& music_bot) { bot = &music_bot; }
+
+    Lookup lookup(uint64_t guild_id, uint64_t) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        Lookup found;
+        found.guild_found = true;
+        found.user_channel = guild_id + 1;
+        found.joined = guilds.count(guild_id) > 0;
+        return found;
+    }
+
+    void connect(uint64_t guild_id, uint64_t) override {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto& sink = guilds[guild_id];
+            if (!sink) sink = std::make_shared<FakeSink>();
+        }
+        bot->voice_ready(guild_id);
+    }
+
+    void disconnect(uint64_t guild_id) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        guilds.erase(guild_id);
+    }
+
+    bool ready(uint64_t guild_id) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        return guilds.count(guild_id) > 0;
+    }
+
+    bool pause(uint64_t guild_id, bool paused) override {
+        std::shared_ptr<FakeSink> sink = find(guild_id);
+        if (!sink) return false;
+        sink->pause(paused);
+        return true;
+    }
+
+    std::shared_ptr<VoiceSink> sink(uint64_t guild_id) override {
+        std::shared_ptr<FakeSink> sink = find(guild_id);
+        return sink ? sink : std::make_shared<FakeSink>();
+    }
+
+    // Someone is always listening while connected
+    size_t listeners(uint64_t guild_id) override {
+        return ready(guild_id) ? 1 : 0;
+    }
+
+    std::vector<uint64_t> connected() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<uint64_t> ids;
+        for (const auto& [guild_id, sink] : guilds) ids.push_back(guild_id);
+        return ids;
+    }
+
+private:
+    std::shared_ptr<FakeSink> find(uint64_t guild_id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = guilds.find(guild_id);
+        return it == guilds.end() ? nullptr : it->second;
+    }
+
+    MusicBot* bot = nullptr;
+    std::mutex mutex;
+    std::unordered_map<uint64_t, std::shared_ptr<FakeSink>> guilds;
+};
+
+// Messages go nowhere and always succeed
+class FakeTransport : public MessageTransport {
+public:
+    void create(uint64_t, const EmbedView&, Done done) override { ok(done, sent.fetch_add(1) + 1); }
+    void edit(uint64_t, uint64_t, const EmbedView&, Done done) override { ok(done, sent.fetch_add(1) + 1); }
+    void send_text(uint64_t, const std::string&, Done done) override { ok(done, sent.fetch_add(1) + 1); }
+
+    std::atomic<uint64_t> sent{0};
+
+private:
+    static void ok(const Done& done, uint64_t message_id) {
+        MessageResult result;
+        result.ok = true;
+        result.status = 200;
+        result.message_id = message_id;
+        done(result);
+    }
+};
+
+std::string track_url(size_t i) {
+    char id[16];
+    std::snprintf(id, sizeof(id), "stub%07zu", i);
+    return std::string("https://www.youtube.com/watch?v=") + id;
+}
+
+std::string search_text(size_t i) {
+    return "stub song " + std::to_string(i);
+}
+
+// A recording for fake_ytdlp.py: every track under its own search and its
+// page URL, with stream URLs that stay fresh for the whole run
+void write_recording(const std::string& path, const Config& config) {
+    std::ofstream out(path, std::ios::trunc);
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    int64_t expires = std::time(nullptr) + 24 * 3600;
+    for (size_t i = 0; i < config.tracks; i++) {
+        Json::Value info;
+        info["title"] = "Stub Artist " + std::to_string(i % 37) + " - Stub Song " + std::to_string(i);
+        info["webpage_url"] = track_url(i);
+        info["url"] = "https://stub.invalid/audio/" + std::to_string(i) + "?expire=" + std::to_string(expires);
+        info["acodec"] = "opus";
+        info["duration"] = config.track_seconds;
+        info["thumbnail"] = "https://stub.invalid/thumb/" + std::to_string(i) + ".jpg";
+        for (const std::string& query : {make_search_query(search_text(i)), track_url(i)}) {
+            Json::Value record;
+            record["query"] = query;
+            record["info"] = info;
+            out << Json::writeString(builder, record) << '\n';
+        }
+    }
+}
+
+// Each track's audio, complete in the audio cache: 20 ms packets of
+// silence-sized CELT frames
+void write_audio(const Config& config) {
+    const std::vector<uint8_t> frame = {0xFC, 0xFF, 0xFE};
+    const size_t packets = static_cast<size_t>(config.track_seconds) * 50;
+    for (size_t i = 0; i < config.tracks; i++) {
+        std::unique_ptr<AudioCache::Writer> writer = audio_cache().write(track_url(i), nullptr);
+        if (!writer) continue;
+        for (size_t p = 0; p < packets; p++) {
+            writer->append(OpusPacket(frame, opus_packet_samples(frame.data(), frame.size())));
+        }
+        writer->finish(true);
+    }
+}
+
+std::vector<TimedCommand> generate(const Config& config) {
+    std::mt19937_64 rng(42);
+    std::vector<TimedCommand> trace;
+    trace.reserve(config.commands);
+    for (size_t i = 0; i < config.commands; i++) {
+        TimedCommand timed;
+        timed.at_ms = static_cast<int64_t>(i * 1000.0 / config.rate);
+        Command& command = timed.command;
+        size_t guild = rng() % config.guilds;
+        command.guild_id = 100000000000000000ull + guild * 16;
+        command.channel_id = command.guild_id + 2;
+        command.user_id = 200000000000000000ull + guild * 4 + rng() % 4;
+
+        // The first stretch is all /play, so guilds have queues before the
+        // /skips come in
+        unsigned roll = rng() % 100;
+        if (roll < 50 || i < config.guilds / 4) {
+            command.name = "play";
+            command.options["query"] = search_text(rng() % config.tracks);
+        } else if (roll < 80) {
+            command.name = "queue";
+            if (rng() % 4 == 0) command.options["page"] = static_cast<int64_t>(1 + rng() % 3);
+        } else {
+            command.name = "skip";
+        }
+        trace.push_back(std::move(timed));
+    }
+    return trace;
+}
+
+bool load_trace(const std::string& path, std::vector<TimedCommand>& trace) {
+    std::ifstream in(path);
+    if (!in) return false;
+    std::string line;
+    while (std::getline(in, line)) {
+        TimedCommand timed;
+        if (parse_command_trace(line, timed.command, timed.at_ms)) {
+            trace.push_back(std::move(timed));
+        }
+    }
+    std::stable_sort(trace.begin(), trace.end(), [](const TimedCommand& a, const TimedCommand& b) {
+        return a.at_ms < b.at_ms;
+    });
+    return true;
+}
+
+bool parse_args(int argc, char** argv, Config& config) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) return false;
+        std::string value = argv[++i];
+        if (arg == "--guilds") config.guilds = std::stoul(value);
+        else if (arg == "--commands") config.commands = std::stoul(value);
+        else if (arg == "--rate") config.rate = std::stod(value);
+        else if (arg == "--trace") config.trace = value;
+        else if (arg == "--speed") config.speed = std::stod(value);
+        else if (arg == "--write-trace") config.write_trace = value;
+        else if (arg == "--threads") config.threads = std::stoul(value);
+        else if (arg == "--tracks") config.tracks = std::stoul(value);
+        else if (arg == "--track-seconds") config.track_seconds = std::stoi(value);
+        else return false;
+    }
+    return config.guilds > 0 && config.tracks > 0 && config.rate > 0 && config.speed > 0 &&
+           config.track_seconds > 0;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Config config;
+    if (!parse_args(argc, argv, config)) {
+        std::fprintf(stderr, "usage: %s [--guilds N] [--commands N] [--rate N] [--trace FILE] [--speed X]\n"
+                             "       [--write-trace FILE] [--threads N] [--tracks N] [--track-seconds N]\n",
+                     argv[0]);
+        return 2;
+    }
+
+    // Scratch state only: the run must not touch a real bot's files
+    std::filesystem::path scratch = std::filesystem::temp_directory_path() /
+                                    ("command_replay." + std::to_string(getpid()));
+    std::filesystem::create_directories(scratch);
+    setenv("AUDIO_CACHE_DIR", (scratch / "audio").c_str(), 1);
+    unsetenv("QUEUE_STATE_DIR");
+    write_recording((scratch / "recording.jsonl").string(), config);
+    write_audio(config);
+
+    std::vector<TimedCommand> trace;
+    if (!config.trace.empty()) {
+        if (!load_trace(config.trace, trace)) {
+            std::fprintf(stderr, "cannot read %s\n", config.trace.c_str());
+            return 1;
+        }
+    } else {
+        trace = generate(config);
+    }
+    if (!config.write_trace.empty()) {
+        std::ofstream out(config.write_trace, std::ios::trunc);
+        for (const auto& timed : trace) out << command_trace_line(timed.command, timed.at_ms) << '\n';
+    }
+
+    ResolverPool::Options resolver;
+    resolver.workers = config.resolver_workers;
+    resolver.max_pending = 4096;
+    resolver.command = {"python3", "-u", BENCH_DATA_DIR "/fake_ytdlp.py", (scratch / "recording.jsonl").string()};
+    ResolverPool pool(resolver);
+    TrackCache cache(pool, TrackCache::Options());
+
+    MusicBot::Options options;
+    options.worker_threads = config.threads;
+    // Normalization and crossfades would need ffmpeg to decode; passthrough does not
+    options.player.dsp.normalize = false;
+
+    auto transport = std::make_shared<FakeTransport>();
+    Announcer announcer(transport, Announcer::Options());
+    FakeVoiceGateway voice;
+    MusicBot music_bot(voice, announcer, cache, options);
+    voice.start(music_bot);
+
+#ifdef UNDER_TSAN
+    std::printf("ThreadSanitizer build: races are reported on stderr as they are found\n");
+#endif
+    std::unordered_set<uint64_t> guild_ids;
+    for (const auto& timed : trace) guild_ids.insert(timed.command.guild_id);
+    std::printf("%zu commands across %zu guilds, %zu worker threads\n", trace.size(), guild_ids.size(),
+                config.threads);
+
+    Results results;
+    auto start = Clock::now();
+    for (auto& timed : trace) {
+        auto due = start + std::chrono::microseconds(static_cast<int64_t>(timed.at_ms * 1000 / config.speed));
+        std::this_thread::sleep_until(due);
+        // Timed from when it was due, so a driver falling behind shows up
+        timed.command.received = due;
+        music_bot.handle(std::make_shared<FakeInteraction>(std::move(timed.command), results));
+    }
+    bool drained = results.wait(trace.size(), Clock::now() + config.drain);
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    results.report(elapsed);
+    std::printf("%zu guilds with state, %zu connected, %llu Opus packets played, %llu messages posted\n",
+                music_bot.guild_count(), voice.connected().size(),
+                static_cast<unsigned long long>(FakeSink::packets.load()),
+                static_cast<unsigned long long>(transport->sent.load()));
+    if (!drained) {
+        std::printf("%zu commands still unanswered after %llds\n", trace.size() - results.finished(),
+                    static_cast<long long>(config.drain.count()));
+    }
+
+    // Stop every guild so no player calls back into the bot as it goes away
+    Results stops;
+    std::vector<uint64_t> guilds = voice.connected();
+    for (uint64_t guild_id : guilds) {
+        Command stop;
+        stop.name = "stop";
+        stop.guild_id = guild_id;
+        music_bot.handle(std::make_shared<FakeInteraction>(std::move(stop), stops));
+    }
+    stops.wait(guilds.size(), Clock::now() + config.drain);
+
+    std::error_code ec;
+    std::filesystem::remove_all(scratch, ec);
+    return drained ? 0 : 1;
+}
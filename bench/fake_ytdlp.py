@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+"""Stand-in for the resolver's yt-dlp worker that replays recorded output.
+
+Speaks the worker protocol from resolver.cpp: one query per line on stdin,
+one JSON info dict per line on stdout, then an empty line. Answers come
+from a recording with one {"query": ..., "info": {...}} object per line.
+A query not in the recording gets the recorded answers in turn, so any
+number of distinct searches can be replayed.
+
+    fake_ytdlp.py RECORDING [LATENCY_MS]
+    fake_ytdlp.py RECORDING --record QUERY...    (needs yt_dlp and network)
+"""
+
+import json
+import sys
+import time
+
+
+def load(path):
+    records = []
+    with open(path) as f:
+        for line in f:
+            if line.strip():
+                records.append(json.loads(line))
+    return records
+
+
+def record(path, queries):
+    import yt_dlp
+    ydl = yt_dlp.YoutubeDL({'format': 'bestaudio/best', 'noplaylist': True, 'quiet': True})
+    with open(path, 'a') as f:
+        for query in queries:
+            info = ydl.sanitize_info(ydl.extract_info(query, download=False))
+            f.write(json.dumps({'query': query, 'info': info}) + '\n')
+
+
+def flat_entry(info):
+    return {
+        'title': info.get('title'),
+        'webpage_url': info.get('webpage_url'),
+        'duration': info.get('duration') or 0,
+        'thumbnail': info.get('thumbnail'),
+    }
+
+
+def serve(records, latency):
+    by_query = {r['query']: json.dumps(r['info']) for r in records}
+    rotation = [json.dumps(r['info']) for r in records]
+    turn = 0
+
+    for line in sys.stdin:
+        query = line.rstrip('\n')
+        if latency:
+            time.sleep(latency)
+
+        if query.startswith('playlist\t'):
+            _, limit, _ = query.split('\t', 2)
+            for i in range(int(limit)):
+                entry = flat_entry(records[i % len(records)]['info'])
+                sys.stdout.write(json.dumps(entry) + '\n')
+        else:
+            answer = by_query.get(query)
+            if answer is None:
+                answer = rotation[turn % len(rotation)]
+                turn += 1
+            sys.stdout.write(answer + '\n')
+
+        sys.stdout.write('\n')
+        sys.stdout.flush()
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit(__doc__)
+    if len(sys.argv) > 2 and sys.argv[2] == '--record':
+        record(sys.argv[1], sys.argv[3:])
+        return
+    latency = float(sys.argv[2]) / 1000 if len(sys.argv) > 2 else 0
+    serve(load(sys.argv[1]), latency)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,204 @@
+// Benchmark: reading the resolver's five fields from yt-dlp info dicts with
+// jsoncpp (full DOM, what the resolver used to do) against JsonFields.
+//
+// Pass a file of captured yt-dlp output, one info dict per line:
+//
+//   yt-dlp -f bestaudio -j URL... > info.jsonl
+//   make bench && ./bench/json_extract_bench info.jsonl
+//
+// Without one it generates a dict with the same shape as a YouTube video's:
+// a few dozen formats with long signed URLs, headers and fragments, a few
+// dozen thumbnails, and a long description.
+
+#include "json_extract.h"
+#include <json/json.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <string>
+#include <vector>
+
+namespace {
+
+size_t allocations = 0;
+
+} // namespace
+
+void* operator new(size_t size) {
+    allocations++;
+    void* p = std::malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+std::string signed_url(int i) {
+    return "https://rr4---sn-4g5lznle.googlevideo.com/videoplayback?expire=1700000000&ei=" +
+           std::string(20, 'e') + "&ip=203.0.113.7&id=o-" + std::string(44, 'A' + i % 26) +
+           "&itag=" + std::to_string(100 + i) + "&source=youtube&requiressl=yes&mime=audio%2Fwebm" +
+           "&gir=yes&clen=3456789&dur=213.061&lmt=1690000000000000&sig=" + std::string(90, 's') +
+           "&lsig=" + std::string(80, 'l');
+}
+
+std::string synthetic_info() {
+    Json::Value info;
+    info["id"] = "dQw4w9WgXcQ";
+    info["title"] = "Artist – Song Title (Official Music Video) [4K Remaster]";
+    info["description"] = std::string(4000, 'd');
+    info["webpage_url"] = "https://www.youtube.com/watch?v=dQw4w9WgXcQ";
+    info["duration"] = 213;
+    info["thumbnail"] = "https://i.ytimg.com/vi_webp/dQw4w9WgXcQ/maxresdefault.webp";
+    info["tags"] = Json::Value(Json::arrayValue);
+    for (int i = 0; i < 30; i++) info["tags"].append("tag number " + std::to_string(i));
+
+    info["formats"] = Json::Value(Json::arrayValue);
+    for (int i = 0; i < 40; i++) {
+        Json::Value format;
+        format["format_id"] = std::to_string(100 + i);
+        format["url"] = signed_url(i);
+        format["ext"] = i % 2 ? "webm" : "m4a";
+        format["acodec"] = i % 2 ? "opus" : "mp4a.40.2";
+        format["vcodec"] = i < 6 ? "none" : "avc1.640028";
+        format["abr"] = 48.5 + i;
+        format["filesize"] = Json::Int64(1000000 + i * 12345);
+        format["http_headers"]["User-Agent"] = "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36";
+        format["http_headers"]["Accept"] = "text/html,application/xhtml+xml,application/xml;q=0.9";
+        format["http_headers"]["Accept-Language"] = "en-us,en;q=0.5";
+        format["downloader_options"]["http_chunk_size"] = 10485760;
+        if (i >= 30) {
+            // Storyboard/HLS style entries with fragment lists
+            format["fragments"] = Json::Value(Json::arrayValue);
+            for (int f = 0; f < 50; f++) {
+                Json::Value fragment;
+                fragment["url"] = "https://i.ytimg.com/sb/dQw4w9WgXcQ/storyboard3_L2/M" + std::to_string(f) + ".jpg";
+                fragment["duration"] = 4.26;
+                format["fragments"].append(fragment);
+            }
+        }
+        info["formats"].append(format);
+    }
+
+    info["thumbnails"] = Json::Value(Json::arrayValue);
+    for (int i = 0; i < 40; i++) {
+        Json::Value thumb;
+        thumb["url"] = "https://i.ytimg.com/vi/dQw4w9WgXcQ/hq" + std::to_string(i) + ".jpg?sqp=" + std::string(60, 'q');
+        thumb["preference"] = -i;
+        thumb["id"] = std::to_string(i);
+        info["thumbnails"].append(thumb);
+    }
+
+    info["url"] = signed_url(1);
+    info["format_id"] = "251";
+
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    return Json::writeString(builder, info);
+}
+
+struct Fields {
+    std::string title, webpage_url, url, thumbnail;
+    int duration = 0;
+};
+
+Fields with_jsoncpp(const std::string& line) {
+    Fields out;
+    Json::Value root;
+    Json::Reader reader;
+    if (reader.parse(line, root) && root.isObject()) {
+        out.title = root.get("title", "Unknown Title").asString();
+        out.webpage_url = root.get("webpage_url", "").asString();
+        out.url = root.get("url", "").asString();
+        out.thumbnail = root.get("thumbnail", "").asString();
+        out.duration = root.get("duration", 0).asInt();
+    }
+    return out;
+}
+
+Fields with_json_fields(JsonFields& fields, const std::string& line) {
+    Fields out;
+    if (fields.scan(line)) {
+        out.title = fields.string(0);
+        out.webpage_url = fields.string(1);
+        out.url = fields.string(2);
+        out.thumbnail = fields.string(3);
+        out.duration = static_cast<int>(fields.number(4));
+    }
+    return out;
+}
+
+size_t sink = 0;
+
+template <typename Fn>
+void run(const char* name, const std::vector<std::string>& lines, size_t bytes, size_t rounds, Fn fn) {
+    size_t allocs_before = allocations;
+    auto start = Clock::now();
+    for (size_t r = 0; r < rounds; r++) {
+        for (const auto& line : lines) {
+            Fields f = fn(line);
+            sink += f.url.size() + f.duration;
+        }
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    double per_line = seconds * 1e6 / (rounds * lines.size());
+    double allocs = double(allocations - allocs_before) / (rounds * lines.size());
+    std::printf("  %-12s %10.1f us/line %10.0f MB/s %12.1f allocs/line\n", name, per_line,
+                bytes * rounds / seconds / 1e6, allocs);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::vector<std::string> lines;
+    if (argc > 1) {
+        std::ifstream file(argv[1]);
+        std::string line;
+        while (std::getline(file, line)) {
+            if (!line.empty()) lines.push_back(line);
+        }
+    } else {
+        lines.push_back(synthetic_info());
+    }
+    if (lines.empty()) {
+        std::fprintf(stderr, "no input lines\n");
+        return 1;
+    }
+
+    size_t bytes = 0;
+    for (const auto& line : lines) bytes += line.size();
+    std::printf("%zu info dict%s, %.1f KB average (%s)\n", lines.size(), lines.size() > 1 ? "s" : "",
+                bytes / 1024.0 / lines.size(), argc > 1 ? argv[1] : "synthetic");
+
+    // Both must agree before timing means anything
+    JsonFields fields{"title", "webpage_url", "url", "thumbnail", "duration"};
+    for (const auto& line : lines) {
+        Fields a = with_jsoncpp(line);
+        Fields b = with_json_fields(fields, line);
+        if (a.title != b.title || a.webpage_url != b.webpage_url || a.url != b.url ||
+            a.thumbnail != b.thumbnail || a.duration != b.duration) {
+            std::fprintf(stderr, "mismatch on %s\n", a.webpage_url.c_str());
+            return 1;
+        }
+    }
+
+    size_t rounds = std::max<size_t>(1, 2000 * 200 * 1024 / bytes);
+    run("jsoncpp", lines, bytes, rounds, with_jsoncpp);
+    run("JsonFields", lines, bytes, rounds, [&](const std::string& line) {
+        return with_json_fields(fields, line);
+    });
+
+    return sink == 42 ? 1 : 0;
+}
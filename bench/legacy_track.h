@@ -0,0 +1,18 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+// The Track layout from before TrackInfo was split out: every queue entry
+// owns its own copy of the metadata and the requester strings. Kept for the
+// benchmarks as a baseline.
+struct LegacyTrack {
+    std::string title;
+    std::string url;
+    std::string stream_url;
+    std::string thumbnail;
+    std::string requester_id;
+    std::string requester_mention;
+    int duration = 0;
+    int64_t stream_expires = 0;
+};
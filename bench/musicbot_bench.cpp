@@ -0,0 +1,437 @@
+// Offline benchmark suite: everything the bot does that does not need a
+// Discord connection. Resolution goes through the real ResolverPool against
+// bench/fake_ytdlp.py answering from bench/data/ytdlp_synthetic.jsonl, a
+// hand-made file in yt-dlp's output format, not a capture of real traffic;
+// the resolve case measures the pool and parsing, not YouTube.
+//
+//   cmake --build build --target bench
+//   ./build/bench/musicbot_bench [--quick]
+//
+// Each case reports throughput and per-operation latency percentiles, one
+// row per case, so runs from different releases can be diffed directly.
+
+#include "track.h"
+#include "track_queue.h"
+#include "resolver.h"
+#include "views.h"
+#include "guild_queue.h"
+#include "dsp.h"
+#include "ogg_opus.h"
+#include "title_index.h"
+#include "queue_store.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef BENCH_DATA_DIR
+#define BENCH_DATA_DIR "bench"
+#endif
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+size_t sink = 0;
+bool failed = false;
+
+void header() {
+    std::printf("%-30s %12s %10s %10s %10s %10s\n", "case", "ops/s", "p50", "p90", "p99", "max");
+}
+
+std::string format_ns(double ns) {
+    char buf[32];
+    if (ns < 1e3) std::snprintf(buf, sizeof(buf), "%.0fns", ns);
+    else if (ns < 1e6) std::snprintf(buf, sizeof(buf), "%.1fus", ns / 1e3);
+    else std::snprintf(buf, sizeof(buf), "%.2fms", ns / 1e6);
+    return buf;
+}
+
+// samples are nanoseconds per operation; elapsed covers all `ops` operations
+void report(const char* name, std::vector<double> samples, double elapsed_ns, size_t ops) {
+    std::sort(samples.begin(), samples.end());
+    auto pct = [&](double p) {
+        size_t i = std::min(samples.size() - 1, static_cast<size_t>(p * samples.size()));
+        return samples[i];
+    };
+    std::printf("%-30s %12.0f %10s %10s %10s %10s\n", name, ops / (elapsed_ns / 1e9),
+                format_ns(pct(0.50)).c_str(), format_ns(pct(0.90)).c_str(),
+                format_ns(pct(0.99)).c_str(), format_ns(samples.back()).c_str());
+}
+
+// Time `samples` batches of `batch` calls; fast operations are batched so
+// the clock reads do not dominate
+template <typename Fn>
+void measure(const char* name, size_t samples, size_t batch, Fn fn) {
+    std::vector<double> times;
+    times.reserve(samples);
+    size_t i = 0;
+    auto start = Clock::now();
+    for (size_t s = 0; s < samples; s++) {
+        auto t0 = Clock::now();
+        for (size_t b = 0; b < batch; b++) fn(i++);
+        times.push_back(std::chrono::duration<double, std::nano>(Clock::now() - t0).count() / batch);
+    }
+    double elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    report(name, std::move(times), elapsed, samples * batch);
+}
+
+TrackInfoPtr make_info(size_t i) {
+    auto info = std::make_shared<TrackInfo>();
+    info->title = "Some Artist - A Reasonably Long Song Title (Official Video) #" + std::to_string(i);
+    info->url = "https://www.youtube.com/watch?v=" + std::to_string(10000000000 + i);
+    info->stream_url = "https://rr3---sn-example.googlevideo.com/videoplayback?expire=1700000000&id=" +
+                       std::to_string(i);
+    info->thumbnail = "https://i.ytimg.com/vi/" + std::to_string(i) + "/maxresdefault.jpg";
+    info->duration = 120 + static_cast<int>(i % 400);
+    return info;
+}
+
+IndexedQueue<Track> make_queue(size_t count) {
+    IndexedQueue<Track> queue;
+    for (size_t i = 0; i < count; i++) {
+        queue.push_back(Track(make_info(i), 100000000000000000ull + i % 50));
+    }
+    return queue;
+}
+
+// Concurrent resolution through the pool: latency from submit to callback
+void bench_resolver(size_t requests) {
+    ResolverPool::Options options;
+    options.workers = 4;
+    options.max_pending = requests;
+    options.command = {"python3", "-u", BENCH_DATA_DIR "/fake_ytdlp.py",
+                       BENCH_DATA_DIR "/data/ytdlp_synthetic.jsonl"};
+    ResolverPool pool(options);
+
+    // Warm up: workers start and load the answers
+    if (extract_audio_info(pool, "warm up", 1).empty()) {
+        std::printf("%-30s  (skipped: fake yt-dlp worker did not answer)\n", "resolve");
+        return;
+    }
+
+    std::vector<double> latencies(requests);
+    std::mutex mutex;
+    std::condition_variable done;
+    size_t finished = 0;
+
+    auto start = Clock::now();
+    for (size_t i = 0; i < requests; i++) {
+        auto submitted = Clock::now();
+        pool.submit(make_search_query("query " + std::to_string(i)),
+            [&, i, submitted](std::vector<TrackInfoPtr> tracks, const std::string&) {
+                latencies[i] = std::chrono::duration<double, std::nano>(Clock::now() - submitted).count();
+                std::lock_guard<std::mutex> lock(mutex);
+                sink += tracks.size();
+                if (++finished == requests) done.notify_one();
+            });
+    }
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&] { return finished == requests; });
+    }
+    double elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    report("resolve (4 workers)", std::move(latencies), elapsed, requests);
+
+    measure("extract_audio_info (serial)", requests / 4, 1, [&](size_t i) {
+        sink += extract_audio_info(pool, "serial " + std::to_string(i), 1).size();
+    });
+}
+
+// One guild's DSP work per 20 ms frame, with the same kernels the player runs
+void bench_dsp(size_t frames) {
+    std::vector<int16_t> a(1920), b(1920);
+    for (size_t i = 0; i < 960; i++) {
+        a[2 * i] = a[2 * i + 1] = static_cast<int16_t>(8000 * std::sin(i * 0.0575));
+        b[2 * i] = b[2 * i + 1] = static_cast<int16_t>(8000 * std::sin(i * 0.0863));
+    }
+
+    std::vector<int16_t> frame = a;
+    measure("dsp gain (1 frame)", frames, 10, [&](size_t i) {
+        apply_gain(frame.data(), frame.size(), 0.9f + (i & 1) * 0.2f, 0.9f + ((i + 1) & 1) * 0.2f);
+    });
+    measure("dsp crossfade (1 frame)", frames, 10, [&](size_t) {
+        frame = a;
+        mix_ramp(frame.data(), b.data(), frame.size(), 0.4f, 0.45f, 0.9f, 0.89f);
+    });
+    LoudnessMeter meter;
+    measure("dsp loudness meter (1 frame)", frames, 10, [&](size_t) {
+        meter.add(a.data(), a.size());
+    });
+    sink += static_cast<size_t>(frame[7]) + static_cast<size_t>(meter.integrated() < 0);
+}
+
+// An Ogg Opus stream like ffmpeg's remux: one 20 ms packet per page
+std::vector<uint8_t> make_ogg_opus(size_t packets) {
+    std::vector<uint8_t> stream;
+    uint32_t sequence = 0;
+    auto page = [&](const std::vector<uint8_t>& packet) {
+        const uint8_t header[] = {'O', 'g', 'g', 'S', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0};
+        stream.insert(stream.end(), header, header + sizeof(header));
+        for (int i = 0; i < 4; i++) stream.push_back(static_cast<uint8_t>(sequence >> (8 * i)));
+        stream.insert(stream.end(), 4, 0); // CRC, not checked
+        size_t size = packet.size();
+        stream.push_back(static_cast<uint8_t>(size / 255 + 1));
+        stream.insert(stream.end(), size / 255, 255);
+        stream.push_back(static_cast<uint8_t>(size % 255));
+        stream.insert(stream.end(), packet.begin(), packet.end());
+        sequence++;
+    };
+    std::vector<uint8_t> head = {'O', 'p', 'u', 's', 'H', 'e', 'a', 'd', 1, 2, 0x38, 1, 0x80, 0xBB, 0, 0, 0, 0, 0};
+    page(head);
+    page({'O', 'p', 'u', 's', 'T', 'a', 'g', 's', 0, 0, 0, 0, 0, 0, 0, 0});
+    for (size_t i = 0; i < packets; i++) {
+        std::vector<uint8_t> packet(i % 7 == 0 ? 300 : 160, static_cast<uint8_t>(i));
+        packet[0] = 0xFC; // CELT, 20 ms, one frame
+        page(packet);
+    }
+    return stream;
+}
+
+// The passthrough path's work per packet: split the remuxed stream, read in
+// the same 16 KB pieces the AudioSource reader uses
+void bench_ogg_demux(size_t packets) {
+    std::vector<uint8_t> stream = make_ogg_opus(packets);
+    std::vector<OpusPacket> out;
+    out.reserve(packets);
+    std::vector<double> samples;
+    auto start = Clock::now();
+    for (int round = 0; round < 10; round++) {
+        OggOpusDemuxer demuxer;
+        out.clear();
+        auto t0 = Clock::now();
+        for (size_t pos = 0; pos < stream.size(); pos += 16384) {
+            demuxer.feed(stream.data() + pos, std::min<size_t>(16384, stream.size() - pos), out);
+        }
+        samples.push_back(std::chrono::duration<double, std::nano>(Clock::now() - t0).count() / packets);
+    }
+    double elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    if (out.size() != packets) {
+        std::printf("%-30s  (failed: %zu of %zu packets)\n", "ogg opus demux (1 packet)", out.size(), packets);
+        return;
+    }
+    report("ogg opus demux (1 packet)", std::move(samples), elapsed, packets * 10);
+    sink += out.back().samples;
+}
+
+// /play autocomplete: lookups from several threads at once while another
+// counts plays, as happens when guilds type while others play
+void bench_autocomplete(size_t titles, size_t lookups) {
+    TitleIndex::Options options;
+    options.capacity = titles * 2;
+    TitleIndex index(options);
+    static const char* const words[] = {"love", "night", "remix", "live", "official", "dance", "summer",
+                                        "heart", "fire", "dream", "acoustic", "cover", "feat", "lofi"};
+    std::vector<TrackInfoPtr> infos;
+    for (size_t i = 0; i < titles; i++) {
+        auto info = std::make_shared<TrackInfo>(*make_info(i));
+        info->title = std::string("Artist ") + std::to_string(i % 997) + " - " + words[i % 14] + " " +
+                      words[(i / 14) % 14] + " " + words[(i / 196) % 14] + " (Official Video)";
+        index.add(*info);
+        infos.push_back(info);
+    }
+    static const char* const queries[] = {"l", "lo", "love", "love ni", "artist 12", "dream remix", "of",
+                                          "summer heart fire", "acou", "xyz"};
+
+    constexpr size_t threads = 4;
+    std::vector<std::vector<double>> latencies(threads);
+    std::atomic<bool> done{false};
+    // Far more plays than a large bot sees: 5000 a second
+    std::thread writer([&] {
+        for (size_t i = 0; !done.load(); i++) {
+            index.played(i % 50, *infos[(i * 7919) % titles]);
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    });
+    auto start = Clock::now();
+    std::vector<std::thread> readers;
+    for (size_t t = 0; t < threads; t++) {
+        readers.emplace_back([&, t] {
+            latencies[t].reserve(lookups);
+            for (size_t i = 0; i < lookups; i++) {
+                auto t0 = Clock::now();
+                auto found = index.suggest(i % 50, queries[(i + t) % 10], 25);
+                latencies[t].push_back(std::chrono::duration<double, std::nano>(Clock::now() - t0).count());
+                sink += found.size();
+            }
+        });
+    }
+    for (auto& reader : readers) reader.join();
+    double elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    done = true;
+    writer.join();
+
+    std::vector<double> all;
+    for (auto& samples : latencies) all.insert(all.end(), samples.begin(), samples.end());
+    report("autocomplete (4 threads)", std::move(all), elapsed, threads * lookups);
+}
+
+// The newest journal in a queue state directory; older ones are deleted
+// when a snapshot is written
+std::filesystem::path newest_journal(const std::filesystem::path& dir) {
+    std::filesystem::path newest;
+    uint64_t newest_generation = 0;
+    for (const auto& entry : std::filesystem::directory_iterator(dir)) {
+        std::string name = entry.path().filename().string();
+        if (name.rfind("journal-", 0) != 0) continue;
+        uint64_t generation = std::stoull(name.substr(8));
+        if (newest.empty() || generation > newest_generation) {
+            newest = entry.path();
+            newest_generation = generation;
+        }
+    }
+    return newest;
+}
+
+// Queue state restore: journal a guild's queue through every kind of
+// mutation, tear the last record as a crash would, then check a new store
+// loads the same queue the live guild has and time how long that takes
+void bench_queue_restore(size_t tracks) {
+    auto dir = std::filesystem::temp_directory_path() /
+               ("musicbot_bench_queue_" + std::to_string(Clock::now().time_since_epoch().count()));
+    QueueStore::Options options;
+    options.directory = dir.string();
+    constexpr uint64_t guild_id = 1234;
+
+    IndexedQueue<Track> live;
+    std::shared_ptr<Track> current;
+    int loop_mode = loop_queue;
+    {
+        QueueStore store(options);
+        store.set_loop(guild_id, loop_mode);
+        for (size_t i = 0; i < tracks; i++) {
+            Track track(make_info(i), 100000000000000000ull + i % 50);
+            store.push(guild_id, track);
+            live.push_back(std::move(track));
+        }
+        for (size_t i = 0; i < tracks / 100; i++) {
+            size_t position = (i * 7919) % live.size();
+            live.erase(position);
+            store.remove(guild_id, position);
+            size_t from = (i * 104729) % live.size(), to = (i * 31) % live.size();
+            live.move(from, to);
+            store.move(guild_id, from, to);
+            current = advance_queue(live, current, loop_mode);
+            store.advance(guild_id);
+        }
+        shuffle_queue(live, 42);
+        store.shuffle(guild_id, 42);
+        current = advance_queue(live, current, loop_mode);
+        store.advance(guild_id);
+
+        // Written, then torn below: the restore must stop short of it
+        store.push(guild_id, Track(make_info(tracks), 0));
+        store.flush();
+    }
+    std::filesystem::path journal = newest_journal(dir);
+    std::filesystem::resize_file(journal, std::filesystem::file_size(journal) - 10);
+
+    // The track that was playing comes back at the head of the queue
+    std::vector<const Track*> expected;
+    if (current) expected.push_back(current.get());
+    live.for_each(0, live.size(), [&](const Track& track) { expected.push_back(&track); });
+
+    constexpr size_t samples = 5;
+    std::vector<double> times;
+    auto start = Clock::now();
+    for (size_t s = 0; s < samples; s++) {
+        auto t0 = Clock::now();
+        QueueStore store(options);
+        times.push_back(std::chrono::duration<double, std::nano>(Clock::now() - t0).count());
+        std::vector<QueueStore::RestoredGuild> restored = store.take_restored();
+
+        bool same = restored.size() == 1 && restored[0].guild_id == guild_id &&
+                    restored[0].loop_mode == loop_mode && restored[0].tracks.size() == expected.size();
+        for (size_t i = 0; same && i < expected.size(); i++) {
+            const Track& got = restored[0].tracks[i];
+            same = got.requester() == expected[i]->requester() && got->url == (*expected[i])->url &&
+                   got->title == (*expected[i])->title && got->duration == (*expected[i])->duration;
+        }
+        if (!same) {
+            std::printf("%-30s  (FAILED: restored queue differs from the live one)\n", "queue restore");
+            failed = true;
+            break;
+        }
+    }
+    double elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    std::filesystem::remove_all(dir);
+    if (times.size() == samples) {
+        std::string name = "queue restore (" + std::to_string(tracks / 1000) + "k tracks)";
+        report(name.c_str(), std::move(times), elapsed, samples);
+    }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    bool quick = argc > 1 && std::strcmp(argv[1], "--quick") == 0;
+    size_t scale = quick ? 1 : 10;
+
+    header();
+
+    bench_resolver(100 * scale);
+
+    bench_dsp(1000 * scale);
+    bench_ogg_demux(5000 * scale);
+    bench_autocomplete(50000, 200 * scale);
+    bench_queue_restore(10000 * scale);
+
+    measure("format_duration", 1000 * scale, 100, [](size_t i) {
+        sink += format_duration(static_cast<int>(i % 10000)).size();
+    });
+
+    IndexedQueue<Track> queue = make_queue(1000);
+    measure("queue push_back + pop_front", 1000 * scale, 100, [&](size_t) {
+        queue.push_back(queue.pop_front());
+    });
+    measure("queue erase middle + reinsert", 1000 * scale, 100, [&](size_t) {
+        queue.insert(500, queue.erase(queue.size() / 2));
+    });
+    measure("queue move", 1000 * scale, 100, [&](size_t i) {
+        queue.move(i % queue.size(), (i * 7) % queue.size());
+    });
+
+    auto current = std::make_shared<Track>(make_info(424242), 100000000000000000ull);
+    measure("/queue view, first page", 1000 * scale, 10, [&](size_t) {
+        sink += queue_view(current.get(), queue, loop_off, 1).fields.size();
+    });
+    measure("/queue view, middle page", 1000 * scale, 10, [&](size_t) {
+        sink += queue_view(current.get(), queue, loop_off, 50).fields.size();
+    });
+
+    Player::Stats stats;
+    stats.transitions = 10;
+    stats.total_gap_ms = 120;
+    measure("/nowplaying view", 1000 * scale, 10, [&](size_t i) {
+        sink += now_playing_view(*current, loop_queue, static_cast<int>(i % 300), stats).fields.size();
+    });
+    measure("track started view", 1000 * scale, 10, [&](size_t) {
+        sink += track_started_view(*current, loop_off).fields.size();
+    });
+
+    // play_next's queue step in each loop mode. The queue is long enough
+    // that loop off never runs dry mid-measurement.
+    const char* advance_names[] = {"advance_queue (loop off)", "advance_queue (loop track)",
+                                   "advance_queue (loop queue)"};
+    for (int mode : {loop_off, loop_track, loop_queue}) {
+        IndexedQueue<Track> guild_queue;
+        TrackInfoPtr info = make_info(7);
+        for (size_t i = 0; i < 1000 * scale * 100; i++) {
+            guild_queue.push_back(Track(info, i));
+        }
+        std::shared_ptr<Track> playing = current;
+        measure(advance_names[mode], 1000 * scale, 100, [&](size_t) {
+            playing = advance_queue(guild_queue, playing, mode);
+        });
+    }
+
+    return failed || sink == 42 ? 1 : 0;
+}
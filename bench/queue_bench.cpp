@@ -0,0 +1,137 @@
+// Micro-benchmark: guild queue operations on std::queue (the old container,
+// where /queue copies the queue and /remove drains and rebuilds it) against
+// IndexedQueue. Both hold the old string-per-field track so only the
+// container differs.
+//
+//   make bench && ./bench/queue_bench [tracks]
+
+#include "bench/legacy_track.h"
+#include "track_queue.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+using Track = LegacyTrack;
+
+Track make_track(size_t i) {
+    Track track;
+    track.title = "Some Artist - A Reasonably Long Song Title (Official Video) #" + std::to_string(i);
+    track.url = "https://www.youtube.com/watch?v=" + std::to_string(10000000000 + i);
+    track.stream_url = "https://rr3---sn-example.googlevideo.com/videoplayback?expire=1700000000&id=" +
+                       std::string(380, 'x') + std::to_string(i);
+    track.thumbnail = "https://i.ytimg.com/vi/" + std::to_string(i) + "/maxresdefault.jpg";
+    track.requester_id = "123456789012345678";
+    track.requester_mention = "<@123456789012345678>";
+    track.duration = 200 + static_cast<int>(i % 100);
+    return track;
+}
+
+// Run fn `iterations` times and print the mean cost of one call
+template <typename Fn>
+void run(const char* name, size_t iterations, Fn fn) {
+    auto start = Clock::now();
+    for (size_t i = 0; i < iterations; i++) {
+        fn(i);
+    }
+    double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    std::printf("  %-28s %12.0f ns/op\n", name, ns / iterations);
+}
+
+size_t sink = 0;
+
+} // namespace
+
+int main(int argc, char** argv) {
+    size_t count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 5000;
+    const size_t page = 10;
+    std::mt19937 rng(42);
+
+    std::queue<Track> old_queue;
+    IndexedQueue<Track> new_queue;
+    for (size_t i = 0; i < count; i++) {
+        old_queue.push(make_track(i));
+        new_queue.push_back(make_track(i));
+    }
+
+    std::printf("%zu queued tracks\n", count);
+
+    std::printf("render first page\n");
+    run("std::queue (copy)", 200, [&](size_t) {
+        std::queue<Track> temp = old_queue;
+        for (size_t n = 0; n < page && !temp.empty(); n++) {
+            sink += temp.front().title.size();
+            temp.pop();
+        }
+    });
+    run("IndexedQueue::for_each", 200000, [&](size_t) {
+        new_queue.for_each(0, page, [](const Track& t) { sink += t.title.size(); });
+    });
+
+    std::printf("render page at middle\n");
+    run("std::queue (copy + skip)", 200, [&](size_t) {
+        std::queue<Track> temp = old_queue;
+        for (size_t n = 0; n < count / 2 && !temp.empty(); n++) temp.pop();
+        for (size_t n = 0; n < page && !temp.empty(); n++) {
+            sink += temp.front().title.size();
+            temp.pop();
+        }
+    });
+    run("IndexedQueue::for_each", 200000, [&](size_t) {
+        new_queue.for_each(count / 2, page, [](const Track& t) { sink += t.title.size(); });
+    });
+
+    std::printf("remove from middle (and re-add)\n");
+    run("std::queue (drain + rebuild)", 200, [&](size_t) {
+        std::vector<Track> tracks;
+        while (!old_queue.empty()) {
+            tracks.push_back(old_queue.front());
+            old_queue.pop();
+        }
+        Track removed = tracks[count / 2];
+        tracks.erase(tracks.begin() + count / 2);
+        for (const auto& t : tracks) old_queue.push(t);
+        old_queue.push(removed);
+    });
+    run("IndexedQueue::erase", 200000, [&](size_t) {
+        new_queue.push_back(new_queue.erase(count / 2));
+    });
+
+    std::printf("move middle to front\n");
+    run("IndexedQueue::move", 200000, [&](size_t) {
+        new_queue.move(count / 2, 0);
+    });
+
+    std::printf("shuffle\n");
+    run("std::queue (drain + rebuild)", 100, [&](size_t) {
+        std::vector<Track> tracks;
+        while (!old_queue.empty()) {
+            tracks.push_back(old_queue.front());
+            old_queue.pop();
+        }
+        std::shuffle(tracks.begin(), tracks.end(), rng);
+        for (const auto& t : tracks) old_queue.push(t);
+    });
+    run("IndexedQueue::shuffle", 1000, [&](size_t) {
+        new_queue.shuffle(rng);
+    });
+
+    std::printf("play_next (pop front, loop-queue push back)\n");
+    run("std::queue", 200000, [&](size_t) {
+        Track t = old_queue.front();
+        old_queue.pop();
+        old_queue.push(t);
+    });
+    run("IndexedQueue", 200000, [&](size_t) {
+        new_queue.push_back(new_queue.pop_front());
+    });
+
+    return sink == 42 ? 1 : 0;
+}
@@ -0,0 +1,144 @@
+// Memory benchmark: heap bytes per queued track with every queue entry
+// owning its strings (LegacyTrack) against Track handles that share one
+// TrackInfo per song and store the requester as a snowflake.
+//
+// Queues are filled the way /play does it: songs come out of a catalogue
+// (standing in for the track cache) and are pushed onto guild queues.
+//
+//   make bench && ./bench/track_memory_bench [tracks] [guilds] [songs]
+
+#include "track.h"
+#include "track_queue.h"
+#include "bench/legacy_track.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <malloc.h>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Live heap bytes as the allocator sees them (including its rounding)
+std::atomic<long long> live_bytes{0};
+
+} // namespace
+
+void* operator new(size_t size) {
+    void* p = std::malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    live_bytes += malloc_usable_size(p);
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    if (!p) return;
+    live_bytes -= malloc_usable_size(p);
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    operator delete(p);
+}
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+TrackInfo make_info(size_t i) {
+    TrackInfo info;
+    info.title = "Some Artist - A Reasonably Long Song Title (Official Video) #" + std::to_string(i);
+    info.url = "https://www.youtube.com/watch?v=" + std::to_string(10000000000 + i);
+    info.stream_url = "https://rr3---sn-example.googlevideo.com/videoplayback?expire=1700000000&id=" +
+                      std::string(420, 'x') + std::to_string(i);
+    info.thumbnail = "https://i.ytimg.com/vi/" + std::to_string(i) + "/maxresdefault.jpg";
+    info.duration = 200 + static_cast<int>(i % 100);
+    info.stream_expires = 1700000000;
+    return info;
+}
+
+uint64_t make_requester(size_t i) {
+    return 100000000000000000ull + i * 7919;
+}
+
+struct Result {
+    long long bytes;
+    double seconds;
+};
+
+// Fill `guilds` queues with `tracks` entries; measures only what the queues add
+template <typename Queue, typename Make>
+Result fill(std::vector<Queue>& queues, size_t tracks, size_t songs, size_t users, Make make) {
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<size_t> song(0, songs - 1);
+    std::uniform_int_distribution<size_t> user(0, users - 1);
+
+    long long before = live_bytes.load();
+    auto start = Clock::now();
+    for (size_t i = 0; i < tracks; i++) {
+        queues[i % queues.size()].push_back(make(song(rng), user(rng)));
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    return Result{live_bytes.load() - before, seconds};
+}
+
+void report(const char* name, const Result& result, size_t tracks) {
+    std::printf("  %-34s %8.1f MiB %8.1f bytes/track %8.0f ns/enqueue\n", name,
+                result.bytes / (1024.0 * 1024.0), double(result.bytes) / tracks,
+                result.seconds * 1e9 / tracks);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    size_t tracks = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+    size_t guild_count = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 10000;
+    size_t songs = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 100000;
+    const size_t users = 50000;
+    if (guild_count == 0) guild_count = 1;
+    if (songs == 0) songs = 1;
+
+    std::printf("%zu queued tracks across %zu guilds, %zu distinct songs\n", tracks, guild_count, songs);
+
+    long long before = live_bytes.load();
+    std::vector<TrackInfoPtr> catalogue;
+    catalogue.reserve(songs);
+    for (size_t i = 0; i < songs; i++) {
+        catalogue.push_back(std::make_shared<const TrackInfo>(make_info(i)));
+    }
+    long long catalogue_bytes = live_bytes.load() - before;
+    std::printf("  %-34s %8.1f MiB (held by the cache either way)\n", "song metadata",
+                catalogue_bytes / (1024.0 * 1024.0));
+
+    {
+        std::vector<IndexedQueue<LegacyTrack>> queues(guild_count);
+        Result result = fill(queues, tracks, songs, users, [&](size_t s, size_t u) {
+            const TrackInfo& info = *catalogue[s];
+            LegacyTrack track;
+            track.title = info.title;
+            track.url = info.url;
+            track.stream_url = info.stream_url;
+            track.thumbnail = info.thumbnail;
+            track.duration = info.duration;
+            track.stream_expires = info.stream_expires;
+            track.requester_id = std::to_string(make_requester(u));
+            track.requester_mention = "<@" + track.requester_id + ">";
+            return track;
+        });
+        report("LegacyTrack (strings per entry)", result, tracks);
+    }
+
+    {
+        std::vector<IndexedQueue<Track>> queues(guild_count);
+        Result result = fill(queues, tracks, songs, users, [&](size_t s, size_t u) {
+            return Track(catalogue[s], make_requester(u));
+        });
+        report("Track (shared TrackInfo)", result, tracks);
+    }
+
+    std::printf("  sizeof(LegacyTrack) = %zu, sizeof(Track) = %zu\n", sizeof(LegacyTrack), sizeof(Track));
+    return 0;
+}
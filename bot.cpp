@@ -2,158 +2,341 @@
 #include <iostream>
 #include <string>
 #include <vector>
-#include <queue>
-#include <map>
+#include <algorithm>
+#include <atomic>
 #include <memory>
 #include <chrono>
-#include <thread>
-#include <regex>
-#include <fstream>
 #include <cstdlib>
-#include <filesystem>
-#include <future>
-#include <json/json.h>
+#include "track.h"
+#include "track_cache.h"
+#include "env.h"
+#include "views.h"
+#include "metrics.h"
+#include "queue_store.h"
+#include "announcer.h"
+#include "title_index.h"
+#include "music_bot.h"
+#include "shard_supervisor.h"
 
-// Forward declarations
-class MusicBot;
-struct Track;
+// Now-playing messages and notices; set up in main() once the cluster exists
+std::unique_ptr<Announcer> announcer;
 
-// Track structure to hold song information
-struct Track {
-    std::string title;
-    std::string url;
-    std::string stream_url;
-    std::string thumbnail;
-    std::string requester_id;
-    std::string requester_mention;
-    int duration = 0;
-    
-    Track() = default;
-    Track(const std::string& t, const std::string& u, const std::string& s, 
-          const std::string& thumb, const std::string& req_id, 
-          const std::string& req_mention, int dur = 0)
-        : title(t), url(u), stream_url(s), thumbnail(thumb), 
-          requester_id(req_id), requester_mention(req_mention), duration(dur) {}
-};
+// Discord takes at most 25 autocomplete choices, each name and value at
+// most 100 characters
+const size_t autocomplete_choices = 25;
+const size_t choice_max_length = 100;
 
-// Guild music state
-struct GuildMusicState {
-    std::queue<Track> queue;
-    std::shared_ptr<Track> current_track = nullptr;
-    int loop_mode = 0; // 0 = off, 1 = track, 2 = queue
-    std::chrono::steady_clock::time_point start_time;
-    bool is_playing = false;
-    bool is_paused = false;
-    
-    void clear() {
-        while (!queue.empty()) queue.pop();
-        current_track = nullptr;
-        loop_mode = 0;
-        is_playing = false;
-        is_paused = false;
+// A title cut to fit a choice name, without splitting a UTF-8 sequence
+std::string choice_name(const std::string& title) {
+    if (title.size() <= choice_max_length) {
+        return title;
+    }
+    size_t end = choice_max_length - 3;
+    while (end > 0 && (static_cast<unsigned char>(title[end]) & 0xC0) == 0x80) {
+        end--;
     }
+    return title.substr(0, end) + "...";
+}
+
+// Latency and failures of one kind of Discord REST call
+struct RestMetrics {
+    Histogram& latency;
+    Counter& errors;
+    
+    explicit RestMetrics(const std::string& call)
+        : latency(metrics().histogram("musicbot_discord_rest_seconds", "Discord REST call latency",
+                                      "call=\"" + call + "\"")),
+          errors(metrics().counter("musicbot_discord_rest_errors_total", "Discord REST calls that failed",
+                                   "call=\"" + call + "\"")) {}
 };
 
-class MusicBot {
+RestMetrics followup_rest("followup_edit");
+RestMetrics message_rest("message_create");
+RestMetrics message_edit_rest("message_edit");
+
+// Completion callback that times the REST call it is passed to
+dpp::command_completion_event_t rest_timer(RestMetrics& rest) {
+    auto started = std::chrono::steady_clock::now();
+    return [&rest, started, log = dpp::utility::log_error()](const dpp::confirmation_callback_t& result) {
+        rest.latency.observe_since(started);
+        if (result.is_error()) {
+            rest.errors.inc();
+        }
+        log(result);
+    };
+}
+
+// Sends player output to the guild's voice connection
+class DppVoiceSink : public VoiceSink {
 private:
-    std::map<dpp::snowflake, GuildMusicState> guild_states;
+    dpp::cluster& bot;
+    dpp::snowflake guild_id;
+    
+    dpp::discord_voice_client* voice_client() {
+        dpp::voiceconn* v = bot.get_voice(guild_id);
+        if (!v || !v->voiceclient || !v->voiceclient->is_ready()) {
+            return nullptr;
+        }
+        return v->voiceclient;
+    }
     
 public:
-    GuildMusicState& get_guild_state(dpp::snowflake guild_id) {
-        if (guild_states.find(guild_id) == guild_states.end()) {
-            guild_states[guild_id] = GuildMusicState();
+    DppVoiceSink(dpp::cluster& bot, dpp::snowflake guild_id) : bot(bot), guild_id(guild_id) {}
+    
+    bool ready() override {
+        return voice_client() != nullptr;
+    }
+    
+    void send_pcm(const int16_t* samples, size_t count) override {
+        if (auto* client = voice_client()) {
+            // dpp takes the buffer as raw bytes and encodes it to Opus itself
+            client->send_audio_raw(reinterpret_cast<uint16_t*>(const_cast<int16_t*>(samples)),
+                                   count * sizeof(int16_t));
         }
-        return guild_states[guild_id];
     }
     
-    void clear_guild_state(dpp::snowflake guild_id) {
-        auto it = guild_states.find(guild_id);
-        if (it != guild_states.end()) {
-            it->second.clear();
-            guild_states.erase(it);
+    bool accepts_opus() override {
+        return true;
+    }
+    
+    void send_opus(const uint8_t* packet, size_t size, uint32_t) override {
+        if (auto* client = voice_client()) {
+            // dpp reads the packet's duration from its TOC byte
+            client->send_audio_opus(const_cast<uint8_t*>(packet), size);
+        }
+    }
+    
+    double buffered_seconds() override {
+        auto* client = voice_client();
+        return client ? client->get_secs_remaining() : 0.0;
+    }
+    
+    void clear() override {
+        if (auto* client = voice_client()) {
+            client->stop_audio();
         }
     }
 };
 
-// Global bot instance
-MusicBot music_bot;
+// Build the dpp embed for a view from views.h
+dpp::embed to_embed(const EmbedView& view) {
+    dpp::embed embed = dpp::embed()
+        .set_title(view.title)
+        .set_color(view.color);
+    if (!view.description.empty()) {
+        embed.set_description(view.description);
+    }
+    if (view.timestamp) {
+        embed.set_timestamp(time(0));
+    }
+    for (const auto& field : view.fields) {
+        embed.add_field(field.name, field.value, field.is_inline);
+    }
+    if (!view.footer.empty()) {
+        embed.set_footer(view.footer, "");
+    }
+    if (!view.thumbnail.empty()) {
+        embed.set_thumbnail(view.thumbnail);
+    }
+    return embed;
+}
 
-// YouTube-DL wrapper function
-std::vector<Track> extract_audio_info(const std::string& query, const std::string& requester_id, const std::string& requester_mention) {
-    std::vector<Track> tracks;
+// Channel messages over dpp REST, with the rate limit headers passed back
+class DppMessageTransport : public MessageTransport {
+private:
+    dpp::cluster& bot;
     
-    // Create a temporary file for yt-dlp output
-    std::string temp_file = "/tmp/ytdl_output_" + std::to_string(std::time(nullptr)) + ".json";
+    static MessageResult to_result(const dpp::confirmation_callback_t& callback) {
+        MessageResult result;
+        result.ok = !callback.is_error();
+        result.status = callback.http_info.status;
+        for (const auto& [name, value] : callback.http_info.headers) {
+            std::string key = name;
+            std::transform(key.begin(), key.end(), key.begin(), [](unsigned char c) { return std::tolower(c); });
+            if (key == "x-ratelimit-remaining") {
+                result.remaining = std::atoi(value.c_str());
+            } else if (key == "x-ratelimit-reset-after") {
+                result.reset_after = std::chrono::milliseconds(static_cast<int64_t>(std::atof(value.c_str()) * 1000));
+            } else if (key == "retry-after") {
+                result.retry_after = std::chrono::milliseconds(static_cast<int64_t>(std::atof(value.c_str()) * 1000));
+            }
+        }
+        return result;
+    }
+    
+public:
+    explicit DppMessageTransport(dpp::cluster& bot) : bot(bot) {}
     
-    // Prepare the search query
-    std::string search_query = query;
-    if (query.find("http://") != 0 && query.find("https://") != 0) {
-        search_query = "ytsearch:" + query;
+    void create(uint64_t channel_id, const EmbedView& view, Done done) override {
+        bot.message_create(dpp::message(channel_id, "").add_embed(to_embed(view)),
+            [timer = rest_timer(message_rest), done](const dpp::confirmation_callback_t& callback) {
+            timer(callback);
+            MessageResult result = to_result(callback);
+            if (result.ok) {
+                result.message_id = callback.get<dpp::message>().id;
+            }
+            done(result);
+        });
     }
     
-    // Execute yt-dlp command
-    std::string command = "yt-dlp --dump-json --no-playlist --format bestaudio/best \"" + 
-                         search_query + "\" > " + temp_file + " 2>/dev/null";
+    void edit(uint64_t channel_id, uint64_t message_id, const EmbedView& view, Done done) override {
+        dpp::message message(channel_id, "");
+        message.id = message_id;
+        message.add_embed(to_embed(view));
+        bot.message_edit(message,
+            [timer = rest_timer(message_edit_rest), done](const dpp::confirmation_callback_t& callback) {
+            timer(callback);
+            done(to_result(callback));
+        });
+    }
     
-    int result = std::system(command.c_str());
+    void send_text(uint64_t channel_id, const std::string& text, Done done) override {
+        bot.message_create(dpp::message(channel_id, text),
+            [timer = rest_timer(message_rest), done](const dpp::confirmation_callback_t& callback) {
+            timer(callback);
+            done(to_result(callback));
+        });
+    }
+};
+
+// A slash command answered through dpp
+class DppInteraction : public Interaction {
+private:
+    dpp::cluster& bot;
+    dpp::slashcommand_t event;
     
-    if (result == 0) {
-        std::ifstream file(temp_file);
-        std::string line;
-        
-        while (std::getline(file, line)) {
-            if (!line.empty()) {
-                Json::Value root;
-                Json::Reader reader;
-                
-                if (reader.parse(line, root)) {
-                    Track track;
-                    track.title = root.get("title", "Unknown Title").asString();
-                    track.url = root.get("webpage_url", "").asString();
-                    track.stream_url = root.get("url", "").asString();
-                    track.thumbnail = root.get("thumbnail", "").asString();
-                    track.duration = root.get("duration", 0).asInt();
-                    track.requester_id = requester_id;
-                    track.requester_mention = requester_mention;
-                    
-                    if (!track.stream_url.empty()) {
-                        tracks.push_back(track);
-                    }
-                }
+    // Every option any command takes
+    static Command to_command(const dpp::slashcommand_t& event) {
+        Command command;
+        command.name = event.command.get_command_name();
+        command.guild_id = event.command.guild_id;
+        command.channel_id = event.command.channel_id;
+        command.user_id = event.command.get_issuing_user().id;
+        for (const char* name : {"query", "page", "mode", "position", "from", "to", "level"}) {
+            dpp::command_value value = event.get_parameter(name);
+            if (std::holds_alternative<std::string>(value)) {
+                command.options[name] = std::get<std::string>(value);
+            } else if (std::holds_alternative<int64_t>(value)) {
+                command.options[name] = std::get<int64_t>(value);
             }
         }
-        file.close();
+        return command;
     }
     
-    // Clean up temporary file
-    std::filesystem::remove(temp_file);
+public:
+    DppInteraction(dpp::cluster& bot, const dpp::slashcommand_t& event)
+        : Interaction(to_command(event)), bot(bot), event(event) {}
     
-    return tracks;
-}
-
-// Format duration function
-std::string format_duration(int seconds) {
-    if (seconds <= 0) return "N/A";
-    
-    int hours = seconds / 3600;
-    int minutes = (seconds % 3600) / 60;
-    int secs = seconds % 60;
-    
-    if (hours > 0) {
-        return std::to_string(hours) + ":" + 
-               (minutes < 10 ? "0" : "") + std::to_string(minutes) + ":" +
-               (secs < 10 ? "0" : "") + std::to_string(secs);
-    } else {
-        return std::to_string(minutes) + ":" + 
-               (secs < 10 ? "0" : "") + std::to_string(secs);
+    void reply(const std::string& text) override {
+        event.reply(text);
     }
-}
+    
+    void reply(const EmbedView& view) override {
+        event.reply(dpp::message().add_embed(to_embed(view)));
+    }
+    
+    void edit_reply(const std::string& text) override {
+        bot.interaction_followup_edit_original(event.command.token, dpp::message(text), rest_timer(followup_rest));
+    }
+};
 
-// Play next track function
-void play_next(dpp::cluster& bot, dpp::snowflake guild_id, dpp::snowflake channel_id);
+// Voice channels and connections from dpp's guild cache and shards
+class DppVoiceGateway : public VoiceGateway {
+private:
+    dpp::cluster& bot;
+    
+    dpp::discord_voice_client* voice_client(uint64_t guild_id) {
+        dpp::voiceconn* v = bot.get_voice(guild_id);
+        if (!v || !v->voiceclient || !v->voiceclient->is_ready()) {
+            return nullptr;
+        }
+        return v->voiceclient;
+    }
+    
+public:
+    explicit DppVoiceGateway(dpp::cluster& bot) : bot(bot) {}
+    
+    Lookup lookup(uint64_t guild_id, uint64_t user_id) override {
+        Lookup found;
+        dpp::guild* g = dpp::find_guild(guild_id);
+        if (!g) {
+            return found;
+        }
+        found.guild_found = true;
+        auto vs = g->voice_members.find(user_id);
+        if (vs != g->voice_members.end()) {
+            found.user_channel = vs->second.channel_id;
+        }
+        found.joined = g->connecting_voice_channel || g->voice_channel;
+        return found;
+    }
+    
+    void connect(uint64_t guild_id, uint64_t channel_id) override {
+        bot.connect_voice(guild_id, channel_id);
+    }
+    
+    void disconnect(uint64_t guild_id) override {
+        // The guild's voice belongs to the shard its gateway session is on
+        uint32_t shards = std::max<uint32_t>(1, bot.numshards);
+        if (dpp::discord_client* shard = bot.get_shard(static_cast<uint32_t>((guild_id >> 22) % shards))) {
+            shard->disconnect_voice(guild_id);
+        }
+    }
+    
+    bool ready(uint64_t guild_id) override {
+        return voice_client(guild_id) != nullptr;
+    }
+    
+    bool pause(uint64_t guild_id, bool paused) override {
+        dpp::discord_voice_client* client = voice_client(guild_id);
+        if (!client) {
+            return false;
+        }
+        client->pause_audio(paused);
+        return true;
+    }
+    
+    std::shared_ptr<VoiceSink> sink(uint64_t guild_id) override {
+        return std::make_shared<DppVoiceSink>(bot, guild_id);
+    }
+    
+    size_t listeners(uint64_t guild_id) override {
+        dpp::guild* g = dpp::find_guild(guild_id);
+        if (!g) {
+            return 0;
+        }
+        auto own = g->voice_members.find(bot.me.id);
+        if (own == g->voice_members.end() || own->second.channel_id.empty()) {
+            return 0;
+        }
+        size_t count = 0;
+        for (const auto& [user_id, state] : g->voice_members) {
+            if (user_id == bot.me.id || state.channel_id != own->second.channel_id) {
+                continue;
+            }
+            // Users missing from the cache count; only known bots do not
+            dpp::user* u = dpp::find_user(user_id);
+            if (!u || !u->is_bot()) {
+                count++;
+            }
+        }
+        return count;
+    }
+};
 
 // Bot event handlers and commands
-int main() {
+int main(int argc, char* argv[]) {
+    // `discord-musicbot shards N` moves a running supervisor onto N workers
+    if (argc == 3 && std::string(argv[1]) == "shards") {
+        std::string error;
+        size_t workers = std::strtoul(argv[2], nullptr, 10);
+        if (!request_shard_resize(shard_supervisor_options_from_env().socket_path, workers, error)) {
+            std::cerr << "Could not resize: " << error << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+    
     // Load environment variables
     const char* token = std::getenv("DISCORD_TOKEN");
     if (!token) {
@@ -161,26 +344,104 @@ int main() {
         return 1;
     }
     
-    // Create bot cluster
-    dpp::cluster bot(token, dpp::i_default_intents | dpp::i_message_content);
+    // With SHARD_WORKERS above 1 this process only supervises; the workers
+    // it starts are copies of it, each running a share of the shards
+    ShardPlacement placement = shard_placement_from_env();
+    if (!placement.worker && env_size("SHARD_WORKERS", 1) > 1) {
+        ShardSupervisor supervisor(shard_supervisor_options_from_env());
+        return supervisor.run();
+    }
+    
+    // Create bot cluster; a worker runs the shards s with s % workers == index
+    dpp::cluster bot(token, dpp::i_default_intents | dpp::i_message_content, placement.shards, placement.index,
+                     placement.workers);
     
     // Logging
     bot.on_log(dpp::utility::cout_logger());
     
+    announcer = std::make_unique<Announcer>(std::make_shared<DppMessageTransport>(bot), announcer_options_from_env());
+    
+    // The track cache starts the resolver workers now, so the first /play
+    // does not pay for it
+    DppVoiceGateway voice(bot);
+    MusicBot music_bot(voice, *announcer, track_cache(), music_bot_options_from_env());
+    
+    start_metrics_server_from_env();
+    
+    // Queues from before the restart; voice reconnects once we are ready
+    auto restored = std::make_shared<std::vector<QueueStore::RestoredGuild>>(queue_store().take_restored());
+    
+    // After a resize a worker's queue store can hold guilds whose shard is
+    // now another worker's; those go to the supervisor instead
+    auto foreign = std::make_shared<std::vector<GuildHandoff>>();
+    for (auto it = restored->begin(); it != restored->end();) {
+        if (placement.owns(it->guild_id)) {
+            ++it;
+            continue;
+        }
+        GuildHandoff guild;
+        guild.guild_id = it->guild_id;
+        guild.text_channel_id = it->text_channel_id;
+        guild.voice_channel_id = it->voice_channel_id;
+        guild.loop_mode = it->loop_mode;
+        guild.tracks = std::move(it->tracks);
+        foreign->push_back(std::move(guild));
+        queue_store().reset(it->guild_id);
+        it = restored->erase(it);
+    }
+    music_bot.restore(*restored);
+    
+    // Multi-process mode: the supervisor moves guilds between workers
+    std::atomic<bool> draining{false};
+    std::unique_ptr<ShardLink> link;
+    if (placement.worker) {
+        ShardLink::Callbacks callbacks;
+        callbacks.drain = [&music_bot, &link, &draining]() {
+            draining = true;
+            music_bot.hand_off([&link](GuildHandoff guild) { link->hand_off(guild); }, [&link]() {
+                queue_store().flush();
+                link->drained();
+                // The supervisor starts the next worker once this one is gone,
+                // and everything worth keeping is on disk or handed off
+                std::_Exit(0);
+            });
+        };
+        callbacks.adopt = [&music_bot](GuildHandoff guild) {
+            music_bot.adopt(std::move(guild));
+        };
+        link = std::make_unique<ShardLink>(placement, std::move(callbacks));
+    }
+    auto shards_ready = std::make_shared<std::atomic<uint32_t>>(0);
+    
     // Bot ready event
-    bot.on_ready([&bot](const dpp::ready_t& event) {
+    bot.on_ready([&bot, &music_bot, &link, &placement, restored, foreign, shards_ready](const dpp::ready_t& event) {
         std::cout << "Logged in as " << bot.me.username << "!" << std::endl;
         
+        if (dpp::run_once<struct rejoin_restored_voice>()) {
+            music_bot.rejoin(*restored);
+        }
+        
+        // Adopted guilds connect voice right away, so wait for every shard
+        if (link && ++*shards_ready >= placement.own_shards() && dpp::run_once<struct shard_hello>()) {
+            link->hello();
+            for (const auto& guild : *foreign) {
+                link->hand_off(guild);
+            }
+            foreign->clear();
+        }
+        
         if (dpp::run_once<struct register_bot_commands>()) {
             // Register slash commands
             bot.global_command_create(dpp::slashcommand("play", "Play music from YouTube", bot.me.id)
-                .add_option(dpp::command_option(dpp::co_string, "query", "YouTube URL or search query", true)));
+                .add_option(dpp::command_option(dpp::co_string, "query", "YouTube URL or search query", true)
+                    .set_auto_complete(true)));
                 
             bot.global_command_create(dpp::slashcommand("skip", "Skip the current track", bot.me.id));
             bot.global_command_create(dpp::slashcommand("stop", "Stop playback and clear queue", bot.me.id));
             bot.global_command_create(dpp::slashcommand("pause", "Pause the current track", bot.me.id));
             bot.global_command_create(dpp::slashcommand("resume", "Resume playback", bot.me.id));
-            bot.global_command_create(dpp::slashcommand("queue", "Show the current queue", bot.me.id));
+            bot.global_command_create(dpp::slashcommand("queue", "Show the current queue", bot.me.id)
+                .add_option(dpp::command_option(dpp::co_integer, "page", "Page of the queue to show", false)));
             bot.global_command_create(dpp::slashcommand("clear", "Clear the queue", bot.me.id));
             bot.global_command_create(dpp::slashcommand("nowplaying", "Show current track", bot.me.id));
             
@@ -192,297 +453,67 @@ int main() {
                     
             bot.global_command_create(dpp::slashcommand("remove", "Remove track from queue", bot.me.id)
                 .add_option(dpp::command_option(dpp::co_integer, "position", "Track position in queue", true)));
-        }
-    });
-    
-    // Slash command handler
-    bot.on_slashcommand([&bot](const dpp::slashcommand_t& event) {
-        if (event.command.get_command_name() == "play") {
-            // Get user's voice channel
-            dpp::guild* g = dpp::find_guild(event.command.guild_id);
-            if (!g) {
-                event.reply("❌ Guild not found!");
-                return;
-            }
-            
-            auto vs = g->voice_members.find(event.command.get_issuing_user().id);
-            if (vs == g->voice_members.end()) {
-                event.reply("❌ You need to be in a voice channel first!");
-                return;
-            }
-            
-            dpp::snowflake user_voice_channel = g->voice_members[event.command.get_issuing_user().id].channel_id;
-            
-            // Get query parameter
-            std::string query = std::get<std::string>(event.get_parameter("query"));
-            
-            event.reply("🔄 Searching and processing: `" + query + "`...");
-            
-            // Connect to voice channel if not already connected
-            if (!g->connecting_voice_channel && !g->voice_channel) {
-                bot.connect_voice(event.command.guild_id, user_voice_channel);
-            }
-            
-            // Extract audio info in a separate thread
-            std::thread([&bot, query, event, user_voice_channel]() {
-                auto tracks = extract_audio_info(query, 
-                    std::to_string(event.command.get_issuing_user().id),
-                    event.command.get_issuing_user().get_mention());
-                
-                if (tracks.empty()) {
-                    bot.interaction_followup_edit_original(event.command.token, 
-                        dpp::message("❌ No playable tracks found!"));
-                    return;
-                }
-                
-                auto& state = music_bot.get_guild_state(event.command.guild_id);
-                
-                // Add tracks to queue
-                for (const auto& track : tracks) {
-                    state.queue.push(track);
-                }
                 
-                std::string response = "✅ Added " + std::to_string(tracks.size()) + 
-                                     " track" + (tracks.size() > 1 ? "s" : "") + " to the queue!";
+            bot.global_command_create(dpp::slashcommand("move", "Move a track to another position in the queue", bot.me.id)
+                .add_option(dpp::command_option(dpp::co_integer, "from", "Current track position", true))
+                .add_option(dpp::command_option(dpp::co_integer, "to", "New track position", true)));
                 
-                // Start playing if nothing is currently playing
-                if (!state.is_playing) {
-                    play_next(bot, event.command.guild_id, event.command.channel_id);
-                }
-                
-                bot.interaction_followup_edit_original(event.command.token, dpp::message(response));
-            }).detach();
-        }
-        else if (event.command.get_command_name() == "skip") {
-            auto& state = music_bot.get_guild_state(event.command.guild_id);
-            
-            if (!state.is_playing) {
-                event.reply("❌ Nothing is playing right now!");
-                return;
-            }
-            
-            // Stop current track (this will trigger play_next)
-            dpp::discord_voice_client* v = event.from->get_voice(event.command.guild_id);
-            if (v && v->voiceclient && v->voiceclient->is_ready()) {
-                v->voiceclient->stop_audio();
-            }
-            
-            event.reply("⏭️ Skipped!");
-        }
-        else if (event.command.get_command_name() == "stop") {
-            auto& state = music_bot.get_guild_state(event.command.guild_id);
-            
-            // Clear state
-            music_bot.clear_guild_state(event.command.guild_id);
-            
-            // Disconnect from voice
-            dpp::discord_voice_client* v = event.from->get_voice(event.command.guild_id);
-            if (v && v->voiceclient && v->voiceclient->is_ready()) {
-                v->voiceclient->stop_audio();
-            }
-            
-            event.from->disconnect_voice(event.command.guild_id);
-            event.reply("⏹️ Playback stopped, queue cleared, and disconnected.");
-        }
-        else if (event.command.get_command_name() == "pause") {
-            auto& state = music_bot.get_guild_state(event.command.guild_id);
-            
-            if (!state.is_playing || state.is_paused) {
-                event.reply("❌ Nothing is currently playing or already paused!");
-                return;
-            }
+            bot.global_command_create(dpp::slashcommand("shuffle", "Shuffle the queue", bot.me.id));
             
-            dpp::discord_voice_client* v = event.from->get_voice(event.command.guild_id);
-            if (v && v->voiceclient && v->voiceclient->is_ready()) {
-                v->voiceclient->pause_audio(true);
-                state.is_paused = true;
-            }
-            
-            event.reply("⏸️ Paused.");
-        }
-        else if (event.command.get_command_name() == "resume") {
-            auto& state = music_bot.get_guild_state(event.command.guild_id);
+            bot.global_command_create(dpp::slashcommand("volume", "Show or set the playback volume", bot.me.id)
+                .add_option(dpp::command_option(dpp::co_integer, "level", "Volume in percent (0-200)", false)));
             
-            if (!state.is_paused) {
-                event.reply("❌ The track is not paused!");
-                return;
-            }
+            bot.global_command_create(dpp::slashcommand("seek", "Jump to a position in the current track", bot.me.id)
+                .add_option(dpp::command_option(dpp::co_string, "position", "Time to jump to, like 90 or 1:30", true)));
             
-            dpp::discord_voice_client* v = event.from->get_voice(event.command.guild_id);
-            if (v && v->voiceclient && v->voiceclient->is_ready()) {
-                v->voiceclient->pause_audio(false);
-                state.is_paused = false;
-            }
-            
-            event.reply("▶️ Resumed.");
+            bot.global_command_create(dpp::slashcommand("radio", "Listen to a stream shared with other servers, or go back to the queue", bot.me.id)
+                .add_option(dpp::command_option(dpp::co_string, "query", "Stream URL or search query; leave out to turn the radio off", false)));
         }
-        else if (event.command.get_command_name() == "queue") {
-            auto& state = music_bot.get_guild_state(event.command.guild_id);
-            
-            dpp::embed embed = dpp::embed()
-                .set_title("Music Queue")
-                .set_color(0x0099ff)
-                .set_timestamp(time(0));
-            
-            // Current track
-            if (state.current_track) {
-                std::string current_info = "**[" + state.current_track->title + "](" + 
-                                         state.current_track->url + ")**\n";
-                current_info += "Duration: " + format_duration(state.current_track->duration) + "\n";
-                current_info += "Requested by: " + state.current_track->requester_mention;
-                embed.add_field("🎵 Now Playing", current_info, false);
-            } else {
-                embed.add_field("🎵 Now Playing", "Nothing", false);
-            }
-            
-            // Queue
-            if (!state.queue.empty()) {
-                std::string queue_text = "";
-                std::queue<Track> temp_queue = state.queue;
-                int position = 1;
-                
-                while (!temp_queue.empty() && position <= 10) {
-                    Track track = temp_queue.front();
-                    temp_queue.pop();
-                    
-                    std::string title = track.title;
-                    if (title.length() > 45) {
-                        title = title.substr(0, 45) + "...";
-                    }
-                    
-                    queue_text += "`" + std::to_string(position) + ".` **[" + title + "](" + 
-                                track.url + ")** | " + format_duration(track.duration) + 
-                                " | Req: " + track.requester_mention + "\n";
-                    position++;
-                }
-                
-                if (state.queue.size() > 10) {
-                    queue_text += "\n*...and " + std::to_string(state.queue.size() - 10) + 
-                                 " more track(s).*\nTotal length: " + std::to_string(state.queue.size()) + " songs";
-                }
-                
-                embed.add_field("📑 Up Next (" + std::to_string(state.queue.size()) + " tracks)", 
-                              queue_text, false);
-            } else {
-                embed.add_field("📑 Up Next", "Queue is empty", false);
-            }
-            
-            // Loop mode
-            std::vector<std::string> loop_modes = {"Disabled", "Single Track", "Queue"};
-            embed.set_footer("Loop Mode: " + loop_modes[state.loop_mode], "");
-            
-            event.reply(dpp::message().add_embed(embed));
-        }
-        else if (event.command.get_command_name() == "clear") {
-            auto& state = music_bot.get_guild_state(event.command.guild_id);
-            
-            if (state.queue.empty()) {
-                event.reply("❌ The queue is already empty!");
-                return;
-            }
-            
-            size_t queue_size = state.queue.size();
-            while (!state.queue.empty()) {
-                state.queue.pop();
-            }
-            
-            event.reply("🗑️ Cleared " + std::to_string(queue_size) + " tracks from the queue!");
+    });
+    
+    // Slash commands run on the guild's actor; see music_bot.h
+    bot.on_slashcommand([&bot, &music_bot, &draining](const dpp::slashcommand_t& event) {
+        if (draining) {
+            event.reply("🔄 The bot is moving this server to another process, please try again in a few seconds.");
+            return;
         }
-        else if (event.command.get_command_name() == "loop") {
-            auto& state = music_bot.get_guild_state(event.command.guild_id);
-            std::string mode = std::get<std::string>(event.get_parameter("mode"));
-            
-            if (mode == "off") {
-                state.loop_mode = 0;
-                event.reply("🔄 Loop mode set to: **Disabled**");
-            } else if (mode == "track") {
-                state.loop_mode = 1;
-                event.reply("🔂 Loop mode set to: **Single Track**");
-            } else if (mode == "queue") {
-                state.loop_mode = 2;
-                event.reply("🔁 Loop mode set to: **Queue**");
-            }
+        music_bot.handle(std::make_shared<DppInteraction>(bot, event));
+    });
+    
+    // /play suggestions, answered on the event thread straight from the
+    // title index; a choice's value is the track's URL, which the track
+    // cache already knows, so picking one skips the search
+    bot.on_autocomplete([&bot](const dpp::autocomplete_t& event) {
+        if (event.name != "play") {
+            return;
         }
-        else if (event.command.get_command_name() == "nowplaying") {
-            auto& state = music_bot.get_guild_state(event.command.guild_id);
-            
-            if (!state.current_track || !state.is_playing) {
-                event.reply("❌ Nothing is playing right now!");
-                return;
+        for (const auto& option : event.options) {
+            if (!option.focused || option.name != "query") {
+                continue;
             }
-            
-            dpp::embed embed = dpp::embed()
-                .set_title("Now Playing")
-                .set_color(0x0099ff)
-                .set_description("**[" + state.current_track->title + "](" + state.current_track->url + ")**");
-            
-            // Calculate progress
-            auto now = std::chrono::steady_clock::now();
-            auto duration_ms = std::chrono::duration_cast<std::chrono::seconds>(now - state.start_time);
-            int position = duration_ms.count();
-            
-            if (state.current_track->duration > 0) {
-                std::string progress_bar = "`[";
-                double percent = (double)position / state.current_track->duration;
-                int filled_blocks = (int)(percent * 10);
-                
-                for (int i = 0; i < 10; i++) {
-                    progress_bar += (i < filled_blocks) ? "▬" : "─";
+            const std::string* typed = std::get_if<std::string>(&option.value);
+            dpp::interaction_response response(dpp::ir_autocomplete_reply);
+            for (const auto& suggestion : title_index().suggest(event.command.guild_id, typed ? *typed : "",
+                                                                autocomplete_choices)) {
+                if (suggestion.url.size() > choice_max_length) {
+                    continue;
                 }
-                progress_bar += "]`";
-                
-                std::string time_text = progress_bar + "\n" + 
-                                      format_duration(position) + " / " + 
-                                      format_duration(state.current_track->duration);
-                embed.add_field("Time", time_text, false);
-            } else {
-                embed.add_field("Time", "Live Stream or Duration Unknown", false);
+                response.add_autocomplete_choice(dpp::command_option_choice(
+                    choice_name(suggestion.title), suggestion.url));
             }
-            
-            embed.add_field("Requested by", state.current_track->requester_mention, true);
-            
-            std::vector<std::string> loop_modes = {"Disabled", "Single Track", "Queue"};
-            embed.add_field("Loop Mode", loop_modes[state.loop_mode], true);
-            
-            if (!state.current_track->thumbnail.empty()) {
-                embed.set_thumbnail(state.current_track->thumbnail);
-            }
-            
-            event.reply(dpp::message().add_embed(embed));
-        }
-        else if (event.command.get_command_name() == "remove") {
-            auto& state = music_bot.get_guild_state(event.command.guild_id);
-            int position = std::get<int64_t>(event.get_parameter("position"));
-            
-            if (position < 1 || position > (int)state.queue.size()) {
-                event.reply("❌ Invalid track number. Must be between 1 and " + 
-                          std::to_string(state.queue.size()) + ".");
-                return;
-            }
-            
-            // Convert queue to vector for easier manipulation
-            std::vector<Track> tracks;
-            while (!state.queue.empty()) {
-                tracks.push_back(state.queue.front());
-                state.queue.pop();
-            }
-            
-            Track removed_track = tracks[position - 1];
-            tracks.erase(tracks.begin() + position - 1);
-            
-            // Rebuild queue
-            for (const auto& track : tracks) {
-                state.queue.push(track);
-            }
-            
-            event.reply("✂️ Removed track #" + std::to_string(position) + ": **" + 
-                       removed_track.title + "**");
+            bot.interaction_response_create(event.command.id, event.command.token, response);
+            break;
         }
     });
     
-    // Voice state update handler
-    bot.on_voice_state_update([&bot](const dpp::voice_state_update_t& event) {
-        // Handle voice state changes if needed
+    // Anyone joining or leaving may leave the bot alone in its channel
+    bot.on_voice_state_update([&music_bot](const dpp::voice_state_update_t& event) {
+        music_bot.voice_state_changed(event.state.guild_id);
+    });
+    
+    // Start the queue once the voice connection requested by /play is up
+    bot.on_voice_ready([&music_bot](const dpp::voice_ready_t& event) {
+        music_bot.voice_ready(event.voice_client->server_id);
     });
     
     // Start the bot
@@ -490,80 +521,3 @@ int main() {
     
     return 0;
 }
-
-// Play next track implementation
-void play_next(dpp::cluster& bot, dpp::snowflake guild_id, dpp::snowflake channel_id) {
-    auto& state = music_bot.get_guild_state(guild_id);
-    
-    dpp::discord_voice_client* v = bot.get_voice(guild_id);
-    if (!v || !v->voiceclient || !v->voiceclient->is_ready()) {
-        return;
-    }
-    
-    std::shared_ptr<Track> next_track = nullptr;
-    
-    // Handle loop modes
-    if (state.loop_mode == 1 && state.current_track) {
-        // Single track loop
-        next_track = state.current_track;
-    } else {
-        if (state.loop_mode == 2 && state.current_track) {
-            // Queue loop - add current track back to queue
-            state.queue.push(*state.current_track);
-        }
-        
-        if (!state.queue.empty()) {
-            next_track = std::make_shared<Track>(state.queue.front());
-            state.queue.pop();
-        } else {
-            // Queue finished
-            state.is_playing = false;
-            state.current_track = nullptr;
-            bot.message_create(dpp::message(channel_id, "📪 Queue finished."));
-            return;
-        }
-    }
-    
-    if (!next_track) {
-        return;
-    }
-    
-    state.current_track = next_track;
-    state.start_time = std::chrono::steady_clock::now();
-    state.is_playing = true;
-    state.is_paused = false;
-    
-    // Send now playing embed
-    dpp::embed embed = dpp::embed()
-        .set_title("Now Playing")
-        .set_description("🎵 **[" + next_track->title + "](" + next_track->url + ")**")
-        .set_color(0x0099ff);
-    
-    embed.add_field("Requested by", next_track->requester_mention, true);
-    if (next_track->duration > 0) {
-        embed.add_field("Duration", format_duration(next_track->duration), true);
-    }
-    if (!next_track->thumbnail.empty()) {
-        embed.set_thumbnail(next_track->thumbnail);
-    }
-    
-    std::vector<std::string> loop_modes = {"Off", "Track", "Queue"};
-    embed.set_footer("Loop: " + loop_modes[state.loop_mode], "");
-    
-    bot.message_create(dpp::message(channel_id, "").add_embed(embed));
-    
-    // Play the audio
-    v->voiceclient->play_audio_file(next_track->stream_url, [&bot, guild_id, channel_id](const std::string& error) {
-        if (!error.empty()) {
-            bot.message_create(dpp::message(channel_id, "❌ Playback error: " + error));
-        }
-        
-        // Play next track when current finishes
-        auto& current_state = music_bot.get_guild_state(guild_id);
-        if (current_state.loop_mode != 1) {
-            play_next(bot, guild_id, channel_id);
-        } else {
-            play_next(bot, guild_id, channel_id); // For single track loop
-        }
-    });
-}
\ No newline at end of file
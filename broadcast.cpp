@@ -0,0 +1,261 @@
+#include "broadcast.h"
+#include "env.h"
+#include "metrics.h"
+#include <algorithm>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr double kSampleRate = AudioSource::kSampleRate;
+// Ring slots per second of audio, for 20 ms packets
+constexpr size_t kPacketsPerSecond = 50;
+
+struct BroadcastMetrics {
+    Gauge& listeners = metrics().gauge("musicbot_broadcast_listeners", "Guilds listening to a broadcast");
+    Counter& published = metrics().counter("musicbot_broadcast_packets_total",
+                                           "Packets published to broadcast rings, once per stream");
+    Counter& sent = metrics().counter("musicbot_broadcast_sent_packets_total",
+                                      "Broadcast packets handed to listeners' voice connections");
+    Counter& skipped = metrics().counter("musicbot_broadcast_skipped_packets_total",
+                                         "Packets listeners missed because the ring moved past them");
+};
+
+BroadcastMetrics& broadcast_metrics() {
+    static BroadcastMetrics m;
+    return m;
+}
+
+} // namespace
+
+Broadcast::Broadcast(std::string key, Options opts)
+    : name(std::move(key)), config(opts),
+      ring(static_cast<size_t>((opts.history.count() + opts.lead + 1) * kPacketsPerSecond)) {}
+
+Broadcast::~Broadcast() {
+    if (source) source->stop();
+}
+
+bool Broadcast::start(const std::string& stream_url, const std::string& codec) {
+    // No cache key: a live stream has no end to cache up to
+    source = AudioSource::create({stream_url, codec, "", 0}, config.source_buffer, AudioSource::Format::opus);
+    // Whoever caught up with the source waits for its next packets
+    std::weak_ptr<Broadcast> weak = shared_from_this();
+    source->set_on_readable([weak] {
+        if (auto broadcast = weak.lock()) broadcast->source_readable();
+    });
+    return source->start();
+}
+
+Clock::time_point Broadcast::clock_of(uint64_t sample) const {
+    return epoch + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(sample / kSampleRate));
+}
+
+void Broadcast::publish(Clock::time_point now) {
+    if (ended) return;
+    auto horizon = now + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(config.lead));
+    OpusPacket packet;
+    starved = false;
+    while (!started || clock_of(published_samples) <= horizon) {
+        if (!source->read_packet(packet)) {
+            if (source->finished()) {
+                ended = true;
+                failure = source->error();
+            } else {
+                starved = true;
+            }
+            return;
+        }
+        // The first packet, and the first after a stall, plays from now
+        if (!started || clock_of(published_samples) < now) {
+            epoch = now - std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(published_samples / kSampleRate));
+            started = true;
+        }
+        Slot& slot = ring[head % ring.size()];
+        slot.sample = published_samples;
+        published_samples += packet.samples;
+        slot.packet = std::make_shared<const OpusPacket>(std::move(packet));
+        head++;
+        broadcast_metrics().published.inc();
+    }
+}
+
+uint64_t Broadcast::live_point(Clock::time_point now) const {
+    // The first packet not yet due; what comes after it is the lead
+    uint64_t oldest = head > ring.size() ? head - ring.size() : 0;
+    uint64_t point = head;
+    while (point > oldest && clock_of(ring[(point - 1) % ring.size()].sample) >= now) {
+        point--;
+    }
+    return point;
+}
+
+bool Broadcast::read(uint64_t& cursor, double seconds, std::vector<std::shared_ptr<const OpusPacket>>& out,
+                     const std::weak_ptr<BroadcastListener>& waiter) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto now = Clock::now();
+    publish(now);
+
+    uint64_t oldest = head > ring.size() ? head - ring.size() : 0;
+    if (cursor == kJoin || cursor < oldest) {
+        uint64_t live = live_point(now);
+        if (cursor != kJoin) broadcast_metrics().skipped.inc(live - cursor);
+        cursor = live;
+    }
+
+    uint64_t wanted = static_cast<uint64_t>(seconds * kSampleRate);
+    uint64_t samples = 0;
+    while (cursor < head && samples < wanted) {
+        const Slot& slot = ring[cursor % ring.size()];
+        out.push_back(slot.packet);
+        samples += slot.packet->samples;
+        cursor++;
+    }
+
+    if (ended) return cursor < head;
+    if (cursor == head && starved) {
+        bool known = std::any_of(waiting.begin(), waiting.end(), [&waiter](const auto& w) {
+            return !w.owner_before(waiter) && !waiter.owner_before(w);
+        });
+        if (!known) waiting.push_back(waiter);
+    }
+    return true;
+}
+
+void Broadcast::source_readable() {
+    std::vector<std::weak_ptr<BroadcastListener>> wake;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        wake.swap(waiting);
+    }
+    for (auto& weak : wake) {
+        if (auto listener = weak.lock()) listener->pump();
+    }
+}
+
+std::string Broadcast::error() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return failure;
+}
+
+bool Broadcast::finished() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return ended;
+}
+
+BroadcastListener::BroadcastListener(std::shared_ptr<Broadcast> broadcast, std::shared_ptr<VoiceSink> sink,
+                                     Ended ended)
+    : broadcast_key(broadcast->key()), sink(std::move(sink)), ended(std::move(ended)),
+      broadcast(std::move(broadcast)) {
+    broadcast_metrics().listeners.add(1);
+}
+
+BroadcastListener::~BroadcastListener() {
+    release();
+}
+
+std::shared_ptr<Broadcast> BroadcastListener::release() {
+    if (broadcast) broadcast_metrics().listeners.add(-1);
+    return std::move(broadcast);
+}
+
+void BroadcastListener::pump() {
+    Ended fire;
+    std::string error;
+    std::shared_ptr<Broadcast> done;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!broadcast || !sink->ready()) return;
+
+        double wanted = broadcast->options().lead - sink->buffered_seconds();
+        if (wanted <= 0) return;
+
+        bool more = broadcast->read(cursor, wanted, batch, weak_from_this());
+        for (const auto& packet : batch) {
+            sink->send_opus(packet->data, packet->size, packet->samples);
+            samples_sent += packet->samples;
+        }
+        broadcast_metrics().sent.inc(batch.size());
+        // Nothing published for us while we wanted more: the stream is behind
+        sink->feed(!more ? VoiceSink::Feed::idle
+                   : batch.empty() ? VoiceSink::Feed::starved : VoiceSink::Feed::flowing);
+        batch.clear();
+
+        if (!more) {
+            error = broadcast->error();
+            done = release();
+            fire = std::move(ended);
+        }
+    }
+    // Possibly the last reference, which stops the stream
+    done.reset();
+    if (fire) fire(error);
+}
+
+void BroadcastListener::leave() {
+    std::shared_ptr<Broadcast> old;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        old = release();
+        ended = nullptr;
+        if (old) {
+            sink->clear();
+            sink->feed(VoiceSink::Feed::idle);
+        }
+    }
+}
+
+double BroadcastListener::position() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return samples_sent / kSampleRate;
+}
+
+std::shared_ptr<BroadcastListener> BroadcastHub::join(const std::string& key, const std::string& stream_url,
+                                                      const std::string& codec, std::shared_ptr<VoiceSink> sink,
+                                                      BroadcastListener::Ended ended) {
+    if (!sink->accepts_opus()) return nullptr;
+
+    std::shared_ptr<Broadcast> broadcast;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = broadcasts.begin(); it != broadcasts.end();) {
+            it = it->second.expired() ? broadcasts.erase(it) : std::next(it);
+        }
+        auto& slot = broadcasts[key];
+        broadcast = slot.lock();
+        if (!broadcast || broadcast->finished()) {
+            broadcast = std::make_shared<Broadcast>(key, options);
+            if (!broadcast->start(stream_url, codec)) {
+                broadcasts.erase(key);
+                return nullptr;
+            }
+            slot = broadcast;
+        }
+    }
+    return std::make_shared<BroadcastListener>(std::move(broadcast), std::move(sink), std::move(ended));
+}
+
+size_t BroadcastHub::active() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return std::count_if(broadcasts.begin(), broadcasts.end(), [](const auto& entry) {
+        return !entry.second.expired();
+    });
+}
+
+Broadcast::Options broadcast_options_from_env() {
+    Broadcast::Options opts;
+    opts.history = std::chrono::seconds(env_size("BROADCAST_HISTORY_SECONDS", opts.history.count()));
+    return opts;
+}
+
+BroadcastHub& broadcast_hub() {
+    static BroadcastHub hub(broadcast_options_from_env());
+    static bool registered = [] {
+        metrics().gauge_callback("musicbot_broadcasts", "Broadcast streams with at least one listener",
+                                 [] { return static_cast<double>(hub.active()); });
+        return true;
+    }();
+    (void)registered;
+    return hub;
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+#include "audio_source.h"
+#include "player.h"
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+
+class BroadcastListener;
+
+// One stream fetched and encoded once, played in any number of guilds.
+//
+// A single AudioSource in Opus mode feeds a ring of packets that every
+// listener reads at its own cursor. Packets are shared between listeners,
+// not copied, so the cost of a stream is one ffmpeg and one demuxer however
+// many guilds hear it; each listener only pays for handing packets to its
+// sink.
+//
+// The ring advances in real time: a packet is published once the wall
+// clock is within `lead` of it, driven by whichever listener pumps first.
+// The ring keeps `history` of audio behind that, so a listener that paused
+// carries on where it stopped until the ring has moved past it, then jumps
+// back to the live point.
+class Broadcast : public std::enable_shared_from_this<Broadcast> {
+public:
+    struct Options {
+        // Audio kept in the ring behind the live point
+        std::chrono::seconds history{10};
+        // Published ahead of real time; listeners keep this much in their sink
+        double lead = 1.0;
+        // Packets decoded ahead of the ring
+        size_t source_buffer = 250;
+    };
+
+    // Where a listener is in the ring; kJoin until its first read
+    static constexpr uint64_t kJoin = ~uint64_t(0);
+
+    Broadcast(std::string key, Options opts);
+    ~Broadcast();
+
+    Broadcast(const Broadcast&) = delete;
+    Broadcast& operator=(const Broadcast&) = delete;
+
+    // Open the stream; codec decides whether ffmpeg remuxes or encodes
+    bool start(const std::string& stream_url, const std::string& codec);
+
+    // Publish whatever is due, then append to `out` the packets from
+    // `cursor` on, up to `seconds` of audio. If the listener has caught up
+    // with a stalled source, `waiter` is pumped once the source has more.
+    // Returns false once the stream is over and the cursor reached its end.
+    bool read(uint64_t& cursor, double seconds, std::vector<std::shared_ptr<const OpusPacket>>& out,
+              const std::weak_ptr<BroadcastListener>& waiter);
+
+    const std::string& key() const { return name; }
+    const Options& options() const { return config; }
+    std::string error() const;
+    // Stream ended (or failed) and nothing more will be published
+    bool finished() const;
+
+private:
+    struct Slot {
+        std::shared_ptr<const OpusPacket> packet;
+        // Position of the packet's first sample in the stream, at 48 kHz
+        uint64_t sample = 0;
+    };
+
+    void publish(std::chrono::steady_clock::time_point now);
+    uint64_t live_point(std::chrono::steady_clock::time_point now) const;
+    std::chrono::steady_clock::time_point clock_of(uint64_t sample) const;
+    void source_readable();
+
+    std::string name;
+    Options config;
+    std::shared_ptr<AudioSource> source;
+
+    mutable std::mutex mutex;
+    std::vector<Slot> ring;
+    // Sequence number of the next packet to publish
+    uint64_t head = 0;
+    uint64_t published_samples = 0;
+    // Wall time of the stream's first sample; moved forward after a stall
+    // so listeners are not sent a burst
+    std::chrono::steady_clock::time_point epoch;
+    bool started = false;
+    // The source had nothing when publish() last asked
+    bool starved = false;
+    bool ended = false;
+    std::string failure;
+    std::vector<std::weak_ptr<BroadcastListener>> waiting;
+};
+
+// One guild's subscription to a Broadcast.
+//
+// Pausing is just not pumping, and leaving only drops this listener; the
+// broadcast stops once its last listener is gone.
+class BroadcastListener : public std::enable_shared_from_this<BroadcastListener> {
+public:
+    // The stream ended or failed; not called after leave()
+    using Ended = std::function<void(const std::string& error)>;
+
+    BroadcastListener(std::shared_ptr<Broadcast> broadcast, std::shared_ptr<VoiceSink> sink, Ended ended);
+    ~BroadcastListener();
+
+    BroadcastListener(const BroadcastListener&) = delete;
+    BroadcastListener& operator=(const BroadcastListener&) = delete;
+
+    // Top the sink up from the ring
+    void pump();
+
+    // Stop listening and clear the sink; safe to call more than once
+    void leave();
+
+    const std::string& key() const { return broadcast_key; }
+
+    // Seconds of the stream sent to this listener
+    double position() const;
+
+private:
+    // Drop the broadcast; called with the mutex held
+    std::shared_ptr<Broadcast> release();
+
+    std::string broadcast_key;
+    std::shared_ptr<VoiceSink> sink;
+    Ended ended;
+
+    mutable std::mutex mutex;
+    std::shared_ptr<Broadcast> broadcast;
+    uint64_t cursor = Broadcast::kJoin;
+    uint64_t samples_sent = 0;
+    // Reused between pumps
+    std::vector<std::shared_ptr<const OpusPacket>> batch;
+};
+
+// Running broadcasts by key, so every guild asking for the same stream
+// shares one
+class BroadcastHub {
+public:
+    explicit BroadcastHub(Broadcast::Options opts) : options(opts) {}
+
+    // Listen to the stream for `key`, starting it if nobody else is. Null
+    // if the sink cannot take Opus or the stream could not be started.
+    std::shared_ptr<BroadcastListener> join(const std::string& key, const std::string& stream_url,
+                                            const std::string& codec, std::shared_ptr<VoiceSink> sink,
+                                            BroadcastListener::Ended ended);
+
+    // Streams with at least one listener
+    size_t active();
+
+private:
+    Broadcast::Options options;
+    std::mutex mutex;
+    std::unordered_map<std::string, std::weak_ptr<Broadcast>> broadcasts;
+};
+
+// Options read from BROADCAST_HISTORY_SECONDS
+Broadcast::Options broadcast_options_from_env();
+
+// Process-wide hub
+BroadcastHub& broadcast_hub();
@@ -0,0 +1,161 @@
+#include "cold_store.h"
+#include "music_bot.h"
+#include <cstring>
+#include <unordered_map>
+
+namespace {
+
+constexpr uint8_t kRecordVersion = 1;
+
+template <typename T>
+void put(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void put_string(std::string& out, const std::string& value) {
+    put<uint32_t>(out, static_cast<uint32_t>(value.size()));
+    out += value;
+}
+
+// Bounds-checked reads over one record
+class Reader {
+public:
+    explicit Reader(const std::string& data) : pos(data.data()), end(data.data() + data.size()) {}
+
+    template <typename T>
+    T get() {
+        T value{};
+        if (static_cast<size_t>(end - pos) < sizeof(T)) {
+            failed = true;
+            return value;
+        }
+        std::memcpy(&value, pos, sizeof(T));
+        pos += sizeof(T);
+        return value;
+    }
+
+    std::string get_string() {
+        uint32_t size = get<uint32_t>();
+        if (failed || static_cast<size_t>(end - pos) < size) {
+            failed = true;
+            return "";
+        }
+        std::string value(pos, size);
+        pos += size;
+        return value;
+    }
+
+    bool ok() const { return !failed; }
+    bool done() const { return pos == end; }
+
+private:
+    const char* pos;
+    const char* end;
+    bool failed = false;
+};
+
+} // namespace
+
+void ColdStore::put(uint64_t guild_id, std::string record) {
+    record.shrink_to_fit();
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& slot = records[guild_id];
+    total_bytes -= slot.size();
+    total_bytes += record.size();
+    slot = std::move(record);
+}
+
+bool ColdStore::take(uint64_t guild_id, std::string& record) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = records.find(guild_id);
+    if (it == records.end()) return false;
+    total_bytes -= it->second.size();
+    record = std::move(it->second);
+    records.erase(it);
+    return true;
+}
+
+bool ColdStore::contains(uint64_t guild_id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return records.count(guild_id) > 0;
+}
+
+std::vector<std::pair<uint64_t, std::string>> ColdStore::take_all() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<std::pair<uint64_t, std::string>> all;
+    all.reserve(records.size());
+    for (auto& entry : records) {
+        all.emplace_back(entry.first, std::move(entry.second));
+    }
+    records.clear();
+    total_bytes = 0;
+    return all;
+}
+
+size_t ColdStore::size() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return records.size();
+}
+
+size_t ColdStore::bytes() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return total_bytes;
+}
+
+std::string pack_cold_guild(const GuildHandoff& guild) {
+    std::string out;
+    put<uint8_t>(out, kRecordVersion);
+    put<uint64_t>(out, guild.text_channel_id);
+    put<uint64_t>(out, guild.voice_channel_id);
+    put<int32_t>(out, guild.loop_mode);
+    put<int32_t>(out, guild.volume);
+    put<uint8_t>(out, guild.playing ? 1 : 0);
+    put<double>(out, guild.position);
+    put<uint32_t>(out, static_cast<uint32_t>(guild.tracks.size()));
+    for (const Track& track : guild.tracks) {
+        const TrackInfo& info = track.info();
+        put<uint64_t>(out, track.requester());
+        put<int32_t>(out, info.duration);
+        put_string(out, info.title);
+        put_string(out, info.url);
+        put_string(out, info.thumbnail);
+    }
+    return out;
+}
+
+bool unpack_cold_guild(const std::string& record, GuildHandoff& guild) {
+    Reader in(record);
+    if (in.get<uint8_t>() != kRecordVersion) return false;
+    guild.text_channel_id = in.get<uint64_t>();
+    guild.voice_channel_id = in.get<uint64_t>();
+    guild.loop_mode = in.get<int32_t>();
+    guild.volume = in.get<int32_t>();
+    guild.playing = in.get<uint8_t>() != 0;
+    guild.position = in.get<double>();
+    uint32_t count = in.get<uint32_t>();
+    if (!in.ok()) return false;
+
+    // The same song queued twice shares one TrackInfo again
+    std::unordered_map<std::string, TrackInfoPtr> infos;
+    guild.tracks.clear();
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t requester = in.get<uint64_t>();
+        int32_t duration = in.get<int32_t>();
+        std::string title = in.get_string();
+        std::string url = in.get_string();
+        std::string thumbnail = in.get_string();
+        if (!in.ok()) return false;
+
+        TrackInfoPtr& info = infos[url];
+        if (!info) {
+            auto loaded = std::make_shared<TrackInfo>();
+            loaded->title = std::move(title);
+            loaded->url = url;
+            loaded->thumbnail = std::move(thumbnail);
+            loaded->duration = duration;
+            info = std::move(loaded);
+        }
+        guild.tracks.emplace_back(info, requester);
+    }
+    return in.done();
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <utility>
+#include <mutex>
+#include <cstdint>
+
+struct GuildHandoff;
+
+// Guilds nobody is using, each kept as one compact record in place of a
+// live actor, player, voice connection and queue of shared TrackInfo.
+//
+// A record holds the queue, loop mode, volume, channels and where the
+// interrupted track was, packed into a flat string: per track only the
+// requester and the fields the queue store keeps (title, page URL,
+// thumbnail, duration). Stream URLs are left out, so thawed tracks
+// re-resolve as they near the head of the queue, like restored ones.
+class ColdStore {
+public:
+    void put(uint64_t guild_id, std::string record);
+
+    // Move the guild's record out; false if there is none
+    bool take(uint64_t guild_id, std::string& record);
+
+    bool contains(uint64_t guild_id);
+
+    // Every record, leaving the store empty
+    std::vector<std::pair<uint64_t, std::string>> take_all();
+
+    size_t size();
+    size_t bytes();
+
+private:
+    std::mutex mutex;
+    std::unordered_map<uint64_t, std::string> records;
+    size_t total_bytes = 0;
+};
+
+// A guild's state as a cold record. The radio is not kept: a live stream
+// has moved on by the time anyone is back.
+std::string pack_cold_guild(const GuildHandoff& guild);
+
+// False if the record is damaged
+bool unpack_cold_guild(const std::string& record, GuildHandoff& guild);
@@ -0,0 +1,452 @@
+#include "dsp.h"
+#include "env.h"
+#include "metrics.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define DSP_HAVE_AVX2 1
+#endif
+
+namespace {
+
+// BS.1770 K-weighting at 48 kHz: a high shelf, then a high-pass
+constexpr double kShelfB0 = 1.53512485958697;
+constexpr double kShelfB1 = -2.69169618940638;
+constexpr double kShelfB2 = 1.19839281085285;
+constexpr double kShelfA1 = -1.69065929318241;
+constexpr double kShelfA2 = 0.73248077421585;
+constexpr double kHighPassA1 = -1.99004745483398;
+constexpr double kHighPassA2 = 0.99007225036621;
+
+constexpr double kAbsoluteGate = -70.0;
+constexpr double kRelativeGate = -10.0;
+constexpr double kBinWidth = 0.1;
+
+// While a track is being measured, the estimate is refreshed this often
+constexpr int kEstimateFrames = 25;
+// and only trusted once this much audio went into it
+constexpr double kMinEstimateSeconds = 3.0;
+// Normalization gain moves at most this many dB per frame (3 dB/s)
+constexpr float kGainSlewDb = 0.06f;
+// Corrections smaller than this are not worth decoding a stream for
+constexpr double kNeutralDb = 1.0;
+
+struct DspMetrics {
+    Counter& cache_hits = metrics().counter("musicbot_loudness_cache_total", "Loudness cache lookups",
+                                            "result=\"hit\"");
+    Counter& cache_misses = metrics().counter("musicbot_loudness_cache_total", "Loudness cache lookups",
+                                              "result=\"miss\"");
+    Counter& measured = metrics().counter("musicbot_loudness_frames_total", "Frames of tracks being measured",
+                                          "measured=\"true\"");
+    Counter& unmeasured = metrics().counter("musicbot_loudness_frames_total", "Frames of tracks being measured",
+                                            "measured=\"false\"");
+};
+
+DspMetrics& dsp_metrics() {
+    static DspMetrics m;
+    return m;
+}
+
+// Gain normalization applies to a track measured at `lufs`
+double correction_db(double lufs, const DspOptions& options) {
+    return std::min(options.target_lufs - lufs, options.max_boost_db);
+}
+
+double block_loudness(double energy) {
+    return -0.691 + 10.0 * std::log10(energy);
+}
+
+inline int16_t saturate(float value) {
+    value = std::min(std::max(value, -32768.0f), 32767.0f);
+    return static_cast<int16_t>(std::lrint(value));
+}
+
+// Gains ramp per stereo pair, so both channels of a pair get the same gain
+void gain_scalar(int16_t* samples, size_t begin, size_t count, float from, float step) {
+    for (size_t i = begin; i < count; i++) {
+        samples[i] = saturate(samples[i] * (from + step * static_cast<float>(i / 2)));
+    }
+}
+
+void mix_scalar(int16_t* dst, const int16_t* src, size_t begin, size_t count, float dst_from, float dst_step,
+                float src_from, float src_step) {
+    for (size_t i = begin; i < count; i++) {
+        float pair = static_cast<float>(i / 2);
+        dst[i] = saturate(dst[i] * (dst_from + dst_step * pair) + src[i] * (src_from + src_step * pair));
+    }
+}
+
+#if defined(__SSE2__)
+// Eight samples, four pairs, per iteration
+size_t gain_sse2(int16_t* samples, size_t count, float from, float step) {
+    __m128 g_lo = _mm_setr_ps(from, from, from + step, from + step);
+    __m128 g_hi = _mm_add_ps(g_lo, _mm_set1_ps(2 * step));
+    const __m128 advance = _mm_set1_ps(4 * step);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(samples + i));
+        __m128 lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+        __m128 hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16));
+        __m128i out = _mm_packs_epi32(_mm_cvtps_epi32(_mm_mul_ps(lo, g_lo)),
+                                      _mm_cvtps_epi32(_mm_mul_ps(hi, g_hi)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(samples + i), out);
+        g_lo = _mm_add_ps(g_lo, advance);
+        g_hi = _mm_add_ps(g_hi, advance);
+    }
+    return i;
+}
+
+size_t mix_sse2(int16_t* dst, const int16_t* src, size_t count, float dst_from, float dst_step,
+                float src_from, float src_step) {
+    __m128 d_lo = _mm_setr_ps(dst_from, dst_from, dst_from + dst_step, dst_from + dst_step);
+    __m128 d_hi = _mm_add_ps(d_lo, _mm_set1_ps(2 * dst_step));
+    __m128 s_lo = _mm_setr_ps(src_from, src_from, src_from + src_step, src_from + src_step);
+    __m128 s_hi = _mm_add_ps(s_lo, _mm_set1_ps(2 * src_step));
+    const __m128 d_advance = _mm_set1_ps(4 * dst_step);
+    const __m128 s_advance = _mm_set1_ps(4 * src_step);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        __m128 a_lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(a, a), 16));
+        __m128 a_hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(a, a), 16));
+        __m128 b_lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(b, b), 16));
+        __m128 b_hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(b, b), 16));
+        __m128 lo = _mm_add_ps(_mm_mul_ps(a_lo, d_lo), _mm_mul_ps(b_lo, s_lo));
+        __m128 hi = _mm_add_ps(_mm_mul_ps(a_hi, d_hi), _mm_mul_ps(b_hi, s_hi));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+                         _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi)));
+        d_lo = _mm_add_ps(d_lo, d_advance);
+        d_hi = _mm_add_ps(d_hi, d_advance);
+        s_lo = _mm_add_ps(s_lo, s_advance);
+        s_hi = _mm_add_ps(s_hi, s_advance);
+    }
+    return i;
+}
+#endif
+
+#if defined(DSP_HAVE_AVX2)
+// Gain for pairs 0-3 of a 16-sample block, for pairs 4-7 add 4 steps
+__attribute__((target("avx2"))) inline __m256 pair_gains(float from, float step) {
+    return _mm256_setr_ps(from, from, from + step, from + step, from + 2 * step, from + 2 * step,
+                          from + 3 * step, from + 3 * step);
+}
+
+// _mm256_packs_epi32 packs within 128-bit lanes; put the quarters back in order
+__attribute__((target("avx2"))) inline __m256i pack_s16(__m256 lo, __m256 hi) {
+    __m256i packed = _mm256_packs_epi32(_mm256_cvtps_epi32(lo), _mm256_cvtps_epi32(hi));
+    return _mm256_permute4x64_epi64(packed, 0xD8);
+}
+
+__attribute__((target("avx2"))) inline __m256 load_s16(const int16_t* p) {
+    return _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))));
+}
+
+// Sixteen samples, eight pairs, per iteration
+__attribute__((target("avx2"))) size_t gain_avx2(int16_t* samples, size_t count, float from, float step) {
+    __m256 g_lo = pair_gains(from, step);
+    __m256 g_hi = _mm256_add_ps(g_lo, _mm256_set1_ps(4 * step));
+    const __m256 advance = _mm256_set1_ps(8 * step);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256 lo = _mm256_mul_ps(load_s16(samples + i), g_lo);
+        __m256 hi = _mm256_mul_ps(load_s16(samples + i + 8), g_hi);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(samples + i), pack_s16(lo, hi));
+        g_lo = _mm256_add_ps(g_lo, advance);
+        g_hi = _mm256_add_ps(g_hi, advance);
+    }
+    return i;
+}
+
+__attribute__((target("avx2"))) size_t mix_avx2(int16_t* dst, const int16_t* src, size_t count, float dst_from,
+                                                float dst_step, float src_from, float src_step) {
+    __m256 d_lo = pair_gains(dst_from, dst_step);
+    __m256 d_hi = _mm256_add_ps(d_lo, _mm256_set1_ps(4 * dst_step));
+    __m256 s_lo = pair_gains(src_from, src_step);
+    __m256 s_hi = _mm256_add_ps(s_lo, _mm256_set1_ps(4 * src_step));
+    const __m256 d_advance = _mm256_set1_ps(8 * dst_step);
+    const __m256 s_advance = _mm256_set1_ps(8 * src_step);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256 lo = _mm256_add_ps(_mm256_mul_ps(load_s16(dst + i), d_lo), _mm256_mul_ps(load_s16(src + i), s_lo));
+        __m256 hi = _mm256_add_ps(_mm256_mul_ps(load_s16(dst + i + 8), d_hi),
+                                  _mm256_mul_ps(load_s16(src + i + 8), s_hi));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), pack_s16(lo, hi));
+        d_lo = _mm256_add_ps(d_lo, d_advance);
+        d_hi = _mm256_add_ps(d_hi, d_advance);
+        s_lo = _mm256_add_ps(s_lo, s_advance);
+        s_hi = _mm256_add_ps(s_hi, s_advance);
+    }
+    return i;
+}
+
+bool has_avx2() {
+    static const bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+}
+#endif
+
+} // namespace
+
+void apply_gain(int16_t* samples, size_t count, float from, float to) {
+    size_t pairs = std::max<size_t>(1, count / 2);
+    float step = (to - from) / static_cast<float>(pairs);
+    size_t done = 0;
+#if defined(DSP_HAVE_AVX2)
+    if (has_avx2()) done = gain_avx2(samples, count, from, step);
+#endif
+#if defined(__SSE2__)
+    if (done == 0) done = gain_sse2(samples, count, from, step);
+#endif
+    gain_scalar(samples, done, count, from, step);
+}
+
+void mix_ramp(int16_t* dst, const int16_t* src, size_t count, float dst_from, float dst_to,
+              float src_from, float src_to) {
+    size_t pairs = std::max<size_t>(1, count / 2);
+    float dst_step = (dst_to - dst_from) / static_cast<float>(pairs);
+    float src_step = (src_to - src_from) / static_cast<float>(pairs);
+    size_t done = 0;
+#if defined(DSP_HAVE_AVX2)
+    if (has_avx2()) done = mix_avx2(dst, src, count, dst_from, dst_step, src_from, src_step);
+#endif
+#if defined(__SSE2__)
+    if (done == 0) done = mix_sse2(dst, src, count, dst_from, dst_step, src_from, src_step);
+#endif
+    mix_scalar(dst, src, done, count, dst_from, dst_step, src_from, src_step);
+}
+
+void LoudnessMeter::add(const int16_t* samples, size_t count) {
+    constexpr double scale = 1.0 / 32768.0;
+    size_t pairs = count / 2;
+    samples_fed += pairs;
+
+    while (pairs > 0) {
+        size_t n = std::min(pairs, kStep - step_samples);
+#if defined(__SSE2__)
+        // Both channels go through the filters side by side
+        const __m128d sb0 = _mm_set1_pd(kShelfB0), sb1 = _mm_set1_pd(kShelfB1), sb2 = _mm_set1_pd(kShelfB2);
+        const __m128d sa1 = _mm_set1_pd(kShelfA1), sa2 = _mm_set1_pd(kShelfA2);
+        const __m128d ha1 = _mm_set1_pd(kHighPassA1), ha2 = _mm_set1_pd(kHighPassA2);
+        const __m128d minus_two = _mm_set1_pd(-2.0), k = _mm_set1_pd(scale);
+        __m128d s1 = _mm_loadu_pd(state[0][0]), s2 = _mm_loadu_pd(state[0][1]);
+        __m128d h1 = _mm_loadu_pd(state[1][0]), h2 = _mm_loadu_pd(state[1][1]);
+        __m128d energy = _mm_setzero_pd();
+        for (size_t i = 0; i < n; i++) {
+            __m128d x = _mm_mul_pd(_mm_setr_pd(samples[2 * i], samples[2 * i + 1]), k);
+            __m128d y = _mm_add_pd(_mm_mul_pd(sb0, x), s1);
+            // Terms that do not depend on y first, keeping the serial chain short
+            s1 = _mm_sub_pd(_mm_add_pd(_mm_mul_pd(sb1, x), s2), _mm_mul_pd(sa1, y));
+            s2 = _mm_sub_pd(_mm_mul_pd(sb2, x), _mm_mul_pd(sa2, y));
+            __m128d z = _mm_add_pd(y, h1);
+            h1 = _mm_sub_pd(_mm_add_pd(_mm_mul_pd(minus_two, y), h2), _mm_mul_pd(ha1, z));
+            h2 = _mm_sub_pd(y, _mm_mul_pd(ha2, z));
+            energy = _mm_add_pd(energy, _mm_mul_pd(z, z));
+        }
+        _mm_storeu_pd(state[0][0], s1);
+        _mm_storeu_pd(state[0][1], s2);
+        _mm_storeu_pd(state[1][0], h1);
+        _mm_storeu_pd(state[1][1], h2);
+        double sums[2];
+        _mm_storeu_pd(sums, energy);
+        step_energy += sums[0] + sums[1];
+#else
+        for (size_t i = 0; i < n; i++) {
+            for (int c = 0; c < 2; c++) {
+                double x = samples[2 * i + c] * scale;
+                double y = kShelfB0 * x + state[0][0][c];
+                state[0][0][c] = (kShelfB1 * x + state[0][1][c]) - kShelfA1 * y;
+                state[0][1][c] = kShelfB2 * x - kShelfA2 * y;
+                double z = y + state[1][0][c];
+                state[1][0][c] = (state[1][1][c] - 2.0 * y) - kHighPassA1 * z;
+                state[1][1][c] = y - kHighPassA2 * z;
+                step_energy += z * z;
+            }
+        }
+#endif
+        samples += 2 * n;
+        pairs -= n;
+        step_samples += n;
+        if (step_samples == kStep) end_step();
+    }
+}
+
+void LoudnessMeter::end_step() {
+    steps[steps_seen % steps.size()] = step_energy / kStep;
+    steps_seen++;
+    step_energy = 0;
+    step_samples = 0;
+    if (steps_seen < steps.size()) return;
+
+    double energy = (steps[0] + steps[1] + steps[2] + steps[3]) / 4;
+    if (energy <= 0) return;
+    double lufs = block_loudness(energy);
+    if (lufs < kAbsoluteGate) return;
+    int bin = static_cast<int>((lufs - kAbsoluteGate) / kBinWidth);
+    histogram[std::min(bin, kBins - 1)]++;
+}
+
+double LoudnessMeter::integrated() const {
+    // Mean energy of each bin's centre
+    static const std::array<double, kBins> energies = [] {
+        std::array<double, kBins> e{};
+        for (int i = 0; i < kBins; i++) {
+            e[i] = std::pow(10.0, (kAbsoluteGate + (i + 0.5) * kBinWidth + 0.691) / 10.0);
+        }
+        return e;
+    }();
+    double total = 0;
+    uint64_t blocks = 0;
+    for (int i = 0; i < kBins; i++) {
+        total += histogram[i] * energies[i];
+        blocks += histogram[i];
+    }
+    if (blocks == 0) return -std::numeric_limits<double>::infinity();
+
+    double threshold = block_loudness(total / blocks) + kRelativeGate;
+    int first = std::max(0, static_cast<int>(std::ceil((threshold - kAbsoluteGate) / kBinWidth - 0.5)));
+    total = 0;
+    blocks = 0;
+    for (int i = first; i < kBins; i++) {
+        total += histogram[i] * energies[i];
+        blocks += histogram[i];
+    }
+    return blocks == 0 ? -std::numeric_limits<double>::infinity() : block_loudness(total / blocks);
+}
+
+double LoudnessMeter::measured_seconds() const {
+    return samples_fed / 48000.0;
+}
+
+bool LoudnessCache::get(const std::string& url, double& lufs) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(url);
+    if (it == entries.end()) return false;
+    lufs = it->second;
+    return true;
+}
+
+void LoudnessCache::put(const std::string& url, double lufs) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto [it, inserted] = entries.emplace(url, lufs);
+    if (!inserted) {
+        it->second = lufs;
+        return;
+    }
+    order.push_back(url);
+    while (order.size() > capacity) {
+        entries.erase(order.front());
+        order.pop_front();
+    }
+}
+
+LoudnessCache& loudness_cache() {
+    static LoudnessCache cache(env_size("LOUDNESS_CACHE_ENTRIES", 20000));
+    return cache;
+}
+
+bool DspBudget::available() {
+    int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    int64_t current = now / 20000000;
+    int64_t seen = period.load(std::memory_order_relaxed);
+    if (current != seen && period.compare_exchange_strong(seen, current, std::memory_order_relaxed)) {
+        spent_ns.store(0, std::memory_order_relaxed);
+    }
+    return spent_ns.load(std::memory_order_relaxed) < budget_ns;
+}
+
+void DspBudget::charge(std::chrono::nanoseconds spent) {
+    spent_ns.fetch_add(spent.count(), std::memory_order_relaxed);
+}
+
+DspBudget& dsp_budget() {
+    static DspBudget budget(std::chrono::microseconds(env_size("DSP_BUDGET_US", 2000)));
+    return budget;
+}
+
+DspOptions dsp_options_from_env() {
+    DspOptions opts;
+    std::string target = env_string("LOUDNESS_TARGET_LUFS");
+    if (target == "off") {
+        opts.normalize = false;
+    } else if (!target.empty()) {
+        char* end = nullptr;
+        double parsed = std::strtod(target.c_str(), &end);
+        if (end && *end == '\0' && parsed < 0) opts.target_lufs = parsed;
+    }
+    opts.crossfade = std::chrono::milliseconds(env_size("CROSSFADE_MS", 0));
+    return opts;
+}
+
+TrackLevel::TrackLevel(std::string track_url, int track_duration, const DspOptions& opts)
+    : url(std::move(track_url)), duration(track_duration), options(opts) {
+    if (!options.normalize) return;
+    if (loudness_cache().get(url, lufs)) {
+        dsp_metrics().cache_hits.inc();
+        estimated = true;
+        current_gain = target_gain();
+    } else {
+        dsp_metrics().cache_misses.inc();
+        measuring = true;
+    }
+}
+
+bool level_is_neutral(const std::string& url, const DspOptions& options) {
+    if (!options.normalize) return true;
+    double lufs = 0;
+    return loudness_cache().get(url, lufs) && std::fabs(correction_db(lufs, options)) <= kNeutralDb;
+}
+
+float TrackLevel::target_gain() const {
+    if (!estimated) return 1.0f;
+    return static_cast<float>(std::pow(10.0, correction_db(lufs, options) / 20.0));
+}
+
+float TrackLevel::process(const int16_t* samples, size_t count) {
+    if (measuring) {
+        if (dsp_budget().available()) {
+            auto started = std::chrono::steady_clock::now();
+            meter.add(samples, count);
+            dsp_budget().charge(std::chrono::steady_clock::now() - started);
+            dsp_metrics().measured.inc();
+        } else {
+            dsp_metrics().unmeasured.inc();
+        }
+        if (++frames_since_estimate >= kEstimateFrames) {
+            frames_since_estimate = 0;
+            double estimate = meter.integrated();
+            if (std::isfinite(estimate) && meter.measured_seconds() >= kMinEstimateSeconds) {
+                lufs = estimate;
+                estimated = true;
+            }
+        }
+    }
+
+    // Follow the estimate slowly enough that the correction is not heard
+    static const float slew = std::pow(10.0f, kGainSlewDb / 20.0f);
+    float target = target_gain();
+    if (current_gain < target) current_gain = std::min(current_gain * slew, target);
+    else if (current_gain > target) current_gain = std::max(current_gain / slew, target);
+    return current_gain;
+}
+
+void TrackLevel::finish(bool played_to_end) {
+    if (!measuring) return;
+    measuring = false;
+
+    // Half the track is a fair sample; all of a short one is needed
+    double needed = duration > 0 ? duration * 0.5 : 60.0;
+    if (played_to_end) needed = std::min(needed, 10.0);
+    double measured = meter.integrated();
+    if (meter.measured_seconds() >= needed && std::isfinite(measured)) {
+        loudness_cache().put(url, measured);
+    }
+}
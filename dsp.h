@@ -0,0 +1,152 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+// PCM processing between the decoder and the voice sink, on interleaved
+// 48 kHz stereo s16 frames. The kernels use AVX2 when the CPU has it, SSE2
+// otherwise, and plain C++ on other architectures.
+
+// Scale samples by a gain that moves linearly from `from` to `to` across
+// the buffer, so volume changes do not click. Saturates at the s16 limits.
+void apply_gain(int16_t* samples, size_t count, float from, float to);
+
+// dst = dst * dst_gain + src * src_gain, each gain ramping linearly across
+// the buffer like apply_gain(). Used for crossfades.
+void mix_ramp(int16_t* dst, const int16_t* src, size_t count, float dst_from, float dst_to,
+              float src_from, float src_to);
+
+// Integrated loudness per EBU R128 / ITU-R BS.1770: K-weighted, in 400 ms
+// blocks overlapping by 75%, with the -70 LUFS absolute and -10 LU relative
+// gates. Block loudness is kept in a 0.1 LU histogram, so memory does not
+// grow with track length.
+class LoudnessMeter {
+public:
+    // Feed interleaved stereo samples. Frames that are left out simply do
+    // not count toward the measurement.
+    void add(const int16_t* samples, size_t count);
+
+    // Integrated loudness in LUFS; -inf until one block passed the gates
+    double integrated() const;
+
+    // Seconds of audio fed so far
+    double measured_seconds() const;
+
+private:
+    static constexpr int kBins = 800;   // -70 to +10 LUFS
+    static constexpr size_t kStep = 4800; // 100 ms of samples per channel
+
+    void end_step();
+
+    // Two biquads per channel: the K-weighting shelf and high-pass
+    double state[2][2][2] = {};
+    double step_energy = 0;
+    size_t step_samples = 0;
+    // The last four 100 ms steps make one gating block
+    std::array<double, 4> steps{};
+    size_t steps_seen = 0;
+    std::array<uint32_t, kBins> histogram{};
+    uint64_t samples_fed = 0;
+};
+
+// Measured loudness of tracks by URL, so only a track's first play has to
+// measure it
+class LoudnessCache {
+public:
+    explicit LoudnessCache(size_t capacity) : capacity(capacity) {}
+
+    bool get(const std::string& url, double& lufs) const;
+    void put(const std::string& url, double lufs);
+
+private:
+    size_t capacity;
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, double> entries;
+    // Insertion order; the oldest entries go first
+    std::deque<std::string> order;
+};
+
+// Process-wide cache (LOUDNESS_CACHE_ENTRIES)
+LoudnessCache& loudness_cache();
+
+// CPU time every player together may spend on DSP per 20 ms of wall time.
+//
+// Gain and crossfades are a fixed, small cost per frame. Measuring loudness
+// is the expensive part, and players ask before doing it: once this period's
+// budget is gone, frames go out unmeasured until the next period starts.
+class DspBudget {
+public:
+    explicit DspBudget(std::chrono::microseconds per_frame) : budget_ns(per_frame.count() * 1000) {}
+
+    bool available();
+    void charge(std::chrono::nanoseconds spent);
+
+private:
+    int64_t budget_ns;
+    std::atomic<int64_t> period{0};
+    std::atomic<int64_t> spent_ns{0};
+};
+
+// Process-wide budget (DSP_BUDGET_US)
+DspBudget& dsp_budget();
+
+struct DspOptions {
+    // Loudness tracks are normalized to; normalization is off if false
+    bool normalize = true;
+    double target_lufs = -14.0;
+    // Normalization never boosts by more than this, in dB
+    double max_boost_db = 6.0;
+    // Overlap between consecutive tracks; 0 disables crossfades
+    std::chrono::milliseconds crossfade{0};
+};
+
+// Options read from LOUDNESS_TARGET_LUFS (a number, or "off") and CROSSFADE_MS
+DspOptions dsp_options_from_env();
+
+// Whether normalization would leave the track within 1 dB of unchanged,
+// so it may skip the DSP stage. False for a track not measured yet.
+bool level_is_neutral(const std::string& url, const DspOptions& options);
+
+// Loudness normalization for one playing track.
+//
+// If the track was measured before, its gain is known from the first frame.
+// Otherwise the track is measured while it plays and the gain follows the
+// running measurement, moving slowly so the correction is not audible; the
+// result is cached once enough of the track has been heard.
+class TrackLevel {
+public:
+    TrackLevel(std::string url, int duration, const DspOptions& options);
+
+    // Account for one frame about to be sent; returns the gain for its end
+    float process(const int16_t* samples, size_t count);
+
+    float gain() const { return current_gain; }
+
+    // For a track started before its duration was known
+    void set_duration(int seconds) { duration = seconds; }
+
+    // The track stops playing; caches the measurement if it is good enough
+    void finish(bool played_to_end);
+
+private:
+    float target_gain() const;
+
+    std::string url;
+    int duration;
+    DspOptions options;
+    // Not in the cache yet, so measured while it plays
+    bool measuring = false;
+    // lufs holds the cached value or a usable running estimate
+    bool estimated = false;
+    double lufs = 0;
+    LoudnessMeter meter;
+    int frames_since_estimate = 0;
+    float current_gain = 1.0f;
+};
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstdlib>
+#include <string>
+
+// Positive integer from the environment, or fallback if unset or malformed
+inline size_t env_size(const char* name, size_t fallback) {
+    const char* value = std::getenv(name);
+    if (!value || !*value) return fallback;
+    char* end = nullptr;
+    unsigned long long parsed = std::strtoull(value, &end, 10);
+    return (end && *end == '\0' && parsed > 0) ? static_cast<size_t>(parsed) : fallback;
+}
+
+// String from the environment, or fallback if unset
+inline std::string env_string(const char* name, const std::string& fallback = "") {
+    const char* value = std::getenv(name);
+    return value ? std::string(value) : fallback;
+}
@@ -0,0 +1,25 @@
+#include "guild_queue.h"
+#include <random>
+
+std::shared_ptr<Track> advance_queue(IndexedQueue<Track>& queue, const std::shared_ptr<Track>& current,
+                                     int loop_mode) {
+    if (loop_mode == loop_track && current) {
+        // Single track loop
+        return current;
+    }
+
+    if (loop_mode == loop_queue && current) {
+        // Queue loop - add current track back to queue
+        queue.push_back(current->clone());
+    }
+
+    if (queue.empty()) {
+        return nullptr;
+    }
+    return std::make_shared<Track>(queue.pop_front());
+}
+
+void shuffle_queue(IndexedQueue<Track>& queue, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    queue.shuffle(rng);
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "track.h"
+#include "track_queue.h"
+#include <memory>
+
+// Loop modes as stored in GuildMusicState::loop_mode
+enum LoopMode { loop_off = 0, loop_track = 1, loop_queue = 2 };
+
+// Take the track play_next should start next, applying the loop mode:
+// the current track again (loop_track), or the queue head, with the
+// current track re-queued at the back first (loop_queue).
+// Returns nullptr once the queue has run out.
+std::shared_ptr<Track> advance_queue(IndexedQueue<Track>& queue, const std::shared_ptr<Track>& current,
+                                     int loop_mode);
+
+// Shuffle reproducibly: the same seed over the same queue always gives the
+// same order, so the queue journal can replay a shuffle from its seed
+void shuffle_queue(IndexedQueue<Track>& queue, uint64_t seed);
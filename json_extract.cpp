@@ -0,0 +1,282 @@
+#include "json_extract.h"
+#include <charconv>
+#include <cstring>
+#include <cstdint>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+const char* skip_ws(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')) p++;
+    return p;
+}
+
+// p is just past an opening quote; returns the closing quote or nullptr
+const char* string_end(const char* p, const char* end) {
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    while (p + 16 <= end) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                                                       _mm_cmpeq_epi8(chunk, backslash)));
+        bool jumped = false;
+        while (mask) {
+            unsigned idx = __builtin_ctz(mask);
+            if (p[idx] == '"') return p + idx;
+            // Backslash: whatever follows it is escaped
+            if (idx + 1 >= 16) {
+                p += idx + 2;
+                jumped = true;
+                break;
+            }
+            mask &= ~(3u << idx);
+        }
+        if (!jumped) p += 16;
+    }
+#endif
+    while (p < end) {
+        if (*p == '"') return p;
+        p += (*p == '\\') ? 2 : 1;
+    }
+    return nullptr;
+}
+
+// p is just past an opening [ or {; returns just past the matching close
+const char* container_end(const char* p, const char* end) {
+    int depth = 1;
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    const __m128i open = _mm_set1_epi8('{');    // '[' | 0x20 == '{'
+    const __m128i close = _mm_set1_epi8('}');   // ']' | 0x20 == '}'
+    while (p + 16 <= end) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i folded = _mm_or_si128(chunk, case_bit);
+        __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                                    _mm_or_si128(_mm_cmpeq_epi8(folded, open),
+                                                 _mm_cmpeq_epi8(folded, close)));
+        unsigned mask = _mm_movemask_epi8(hits);
+        const char* next = p + 16;
+        while (mask) {
+            unsigned idx = __builtin_ctz(mask);
+            char c = p[idx];
+            if (c == '"') {
+                const char* str_end = string_end(p + idx + 1, end);
+                if (!str_end) return nullptr;
+                if (str_end >= p + 15) {
+                    next = str_end + 1;
+                    break;
+                }
+                mask &= ~((2u << (str_end - p)) - 1);
+                continue;
+            }
+            if (c == '[' || c == '{') {
+                depth++;
+            } else if (--depth == 0) {
+                return p + idx + 1;
+            }
+            mask &= mask - 1;
+        }
+        p = next;
+    }
+#endif
+    while (p < end) {
+        char c = *p;
+        if (c == '"') {
+            p = string_end(p + 1, end);
+            if (!p) return nullptr;
+        } else if (c == '[' || c == '{') {
+            depth++;
+        } else if (c == ']' || c == '}') {
+            if (--depth == 0) return p + 1;
+        }
+        p++;
+    }
+    return nullptr;
+}
+
+// Returns just past the value starting at p, or nullptr
+const char* value_end(const char* p, const char* end) {
+    if (p >= end) return nullptr;
+    if (*p == '"') {
+        const char* close = string_end(p + 1, end);
+        return close ? close + 1 : nullptr;
+    }
+    if (*p == '{' || *p == '[') {
+        return container_end(p + 1, end);
+    }
+    // Number, true, false or null
+    const char* start = p;
+    while (p < end && *p != ',' && *p != '}' && *p != ']' &&
+           *p != ' ' && *p != '\n' && *p != '\r' && *p != '\t') {
+        p++;
+    }
+    return p > start ? p : nullptr;
+}
+
+int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+bool read_hex4(const char* p, const char* end, uint32_t& code) {
+    if (end - p < 4) return false;
+    code = 0;
+    for (int i = 0; i < 4; i++) {
+        int digit = hex_value(p[i]);
+        if (digit < 0) return false;
+        code = (code << 4) | static_cast<uint32_t>(digit);
+    }
+    return true;
+}
+
+void append_utf8(std::string& out, uint32_t code) {
+    if (code < 0x80) {
+        out += static_cast<char>(code);
+    } else if (code < 0x800) {
+        out += static_cast<char>(0xC0 | (code >> 6));
+        out += static_cast<char>(0x80 | (code & 0x3F));
+    } else if (code < 0x10000) {
+        out += static_cast<char>(0xE0 | (code >> 12));
+        out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (code & 0x3F));
+    } else {
+        out += static_cast<char>(0xF0 | (code >> 18));
+        out += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (code & 0x3F));
+    }
+}
+
+// Decode the string body [p, end) into out
+bool decode_string(const char* p, const char* end, std::string& out) {
+    const char* escape = static_cast<const char*>(std::memchr(p, '\\', end - p));
+    if (!escape) {
+        out.assign(p, end);
+        return true;
+    }
+
+    out.assign(p, escape);
+    p = escape;
+    while (p < end) {
+        if (*p != '\\') {
+            out += *p++;
+            continue;
+        }
+        if (++p >= end) return false;
+        char c = *p++;
+        switch (c) {
+            case '"': out += '"'; break;
+            case '\\': out += '\\'; break;
+            case '/': out += '/'; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u': {
+                uint32_t code;
+                if (!read_hex4(p, end, code)) return false;
+                p += 4;
+                // Characters outside the BMP arrive as a surrogate pair
+                uint32_t low;
+                if (code >= 0xD800 && code < 0xDC00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u' &&
+                    read_hex4(p + 2, end, low) && low >= 0xDC00 && low < 0xE000) {
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                    p += 6;
+                }
+                append_utf8(out, code);
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+const std::string JsonFields::empty;
+
+JsonFields::JsonFields(std::initializer_list<const char*> keys) {
+    for (const char* key : keys) {
+        Field field;
+        field.key = key;
+        fields.push_back(std::move(field));
+    }
+}
+
+bool JsonFields::scan(std::string_view json) {
+    for (auto& field : fields) {
+        field.present = false;
+        field.type = Type::Null;
+    }
+
+    const char* p = json.data();
+    const char* end = p + json.size();
+
+    p = skip_ws(p, end);
+    if (p >= end || *p != '{') return false;
+    p = skip_ws(p + 1, end);
+    if (p < end && *p == '}') return true;
+
+    while (p < end) {
+        if (*p != '"') return false;
+        const char* key_end = string_end(p + 1, end);
+        if (!key_end) return false;
+        std::string_view key(p + 1, key_end - p - 1);
+
+        p = skip_ws(key_end + 1, end);
+        if (p >= end || *p != ':') return false;
+        p = skip_ws(p + 1, end);
+
+        Field* wanted = nullptr;
+        for (auto& field : fields) {
+            if (key == field.key) {
+                wanted = &field;
+                break;
+            }
+        }
+
+        const char* after = value_end(p, end);
+        if (!after) return false;
+
+        if (wanted) {
+            if (*p == '"') {
+                if (!decode_string(p + 1, after - 1, wanted->text)) return false;
+                wanted->type = Type::String;
+                wanted->present = true;
+            } else if (*p == '-' || (*p >= '0' && *p <= '9')) {
+                auto result = std::from_chars(p, after, wanted->value);
+                if (result.ec != std::errc()) return false;
+                wanted->type = Type::Number;
+                wanted->present = true;
+            } else if (std::string_view(p, after - p) != "null") {
+                wanted->type = Type::Other;
+                wanted->present = true;
+            }
+        }
+
+        p = skip_ws(after, end);
+        if (p >= end) return false;
+        if (*p == '}') return true;
+        if (*p != ',') return false;
+        p = skip_ws(p + 1, end);
+    }
+    return false;
+}
+
+const std::string& JsonFields::string(size_t i, const std::string& fallback) const {
+    return fields[i].type == Type::String ? fields[i].text : fallback;
+}
+
+double JsonFields::number(size_t i, double fallback) const {
+    return fields[i].type == Type::Number ? fields[i].value : fallback;
+}
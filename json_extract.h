@@ -0,0 +1,45 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <initializer_list>
+
+// Reads a few top-level fields of a JSON object without building a DOM.
+//
+// yt-dlp info dicts run to hundreds of KB, almost all of it format and
+// thumbnail arrays we never look at. scan() walks the top-level object
+// once, decodes only the values of the requested keys and jumps over
+// everything else, using SSE2 to find quotes and brackets 16 bytes at a
+// time where available. It checks structure, not full JSON validity.
+class JsonFields {
+public:
+    explicit JsonFields(std::initializer_list<const char*> keys);
+
+    // Parse one object. Returns false if the text is not a JSON object.
+    bool scan(std::string_view json);
+
+    // Field i (in constructor order) was present and not null
+    bool has(size_t i) const { return fields[i].present; }
+
+    // Decoded string value, or fallback if missing or not a string
+    const std::string& string(size_t i, const std::string& fallback = empty) const;
+
+    // Numeric value, or fallback if missing or not a number
+    double number(size_t i, double fallback = 0) const;
+
+private:
+    enum class Type { Null, String, Number, Other };
+
+    struct Field {
+        std::string key;
+        bool present = false;
+        Type type = Type::Null;
+        std::string text;
+        double value = 0;
+    };
+
+    static const std::string empty;
+
+    std::vector<Field> fields;
+};
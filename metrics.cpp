@@ -0,0 +1,309 @@
+#include "metrics.h"
+#include "env.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <unordered_map>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+// Clients get this long to send their request
+constexpr int kRequestTimeoutMs = 2000;
+
+std::string format_value(double value) {
+    char buf[64];
+    std::snprintf(buf, sizeof(buf), "%.15g", value);
+    return buf;
+}
+
+std::string series_name(const std::string& name, const std::string& labels, const std::string& extra = "") {
+    std::string all = labels;
+    if (!extra.empty()) {
+        if (!all.empty()) all += ',';
+        all += extra;
+    }
+    return all.empty() ? name : name + '{' + all + '}';
+}
+
+bool write_all(int fd, const std::string& data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t n = send(fd, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        written += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+} // namespace
+
+Histogram::Histogram(std::vector<double> bounds)
+    : upper_bounds(std::move(bounds)), buckets(new std::atomic<uint64_t>[upper_bounds.size() + 1]) {
+    for (double bound : upper_bounds) {
+        bound_ns.push_back(static_cast<int64_t>(bound * 1e9));
+    }
+    for (size_t i = 0; i <= upper_bounds.size(); i++) {
+        buckets[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void Histogram::observe(std::chrono::nanoseconds elapsed) {
+    int64_t ns = elapsed.count() > 0 ? elapsed.count() : 0;
+    size_t i = 0;
+    while (i < bound_ns.size() && ns > bound_ns[i]) i++;
+    buckets[i].fetch_add(1, std::memory_order_relaxed);
+    sum_ns.fetch_add(static_cast<uint64_t>(ns), std::memory_order_relaxed);
+    total.fetch_add(1, std::memory_order_relaxed);
+}
+
+std::vector<double> latency_buckets() {
+    return {0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30};
+}
+
+MetricsRegistry::Series* MetricsRegistry::find(const std::string& name, const std::string& labels) {
+    for (auto& s : series) {
+        if (s.name == name && s.labels == labels) return &s;
+    }
+    return nullptr;
+}
+
+MetricsRegistry::Series& MetricsRegistry::add(const std::string& name, const std::string& help,
+                                              const std::string& labels, Type type) {
+    series.emplace_back();
+    Series& s = series.back();
+    s.name = name;
+    s.help = help;
+    s.labels = labels;
+    s.type = type;
+    return s;
+}
+
+Counter& MetricsRegistry::counter(const std::string& name, const std::string& help, const std::string& labels) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (Series* existing = find(name, labels)) return *existing->counter;
+    Series& s = add(name, help, labels, Type::Counter);
+    s.counter = std::make_unique<Counter>();
+    return *s.counter;
+}
+
+Gauge& MetricsRegistry::gauge(const std::string& name, const std::string& help, const std::string& labels) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (Series* existing = find(name, labels)) return *existing->gauge;
+    Series& s = add(name, help, labels, Type::Gauge);
+    s.gauge = std::make_unique<Gauge>();
+    return *s.gauge;
+}
+
+Histogram& MetricsRegistry::histogram(const std::string& name, const std::string& help,
+                                      const std::string& labels, std::vector<double> bounds) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (Series* existing = find(name, labels)) return *existing->histogram;
+    Series& s = add(name, help, labels, Type::Histogram);
+    s.histogram = std::make_unique<Histogram>(std::move(bounds));
+    return *s.histogram;
+}
+
+void MetricsRegistry::gauge_callback(const std::string& name, const std::string& help,
+                                     std::function<double()> read) {
+    Series* s;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Series* existing = find(name, "");
+        s = existing ? existing : &add(name, help, "", Type::Callback);
+    }
+    std::lock_guard<std::mutex> lock(callback_mutex);
+    s->read = std::move(read);
+}
+
+void MetricsRegistry::remove_gauge_callback(const std::string& name) {
+    Series* s;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        s = find(name, "");
+    }
+    if (!s) return;
+    std::lock_guard<std::mutex> lock(callback_mutex);
+    s->read = nullptr;
+}
+
+std::string MetricsRegistry::render() const {
+    // Series of one metric must be contiguous, under a single HELP/TYPE
+    std::unordered_map<std::string, size_t> first_index;
+    std::vector<std::vector<const Series*>> groups;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& s : series) {
+            auto it = first_index.find(s.name);
+            if (it == first_index.end()) {
+                first_index[s.name] = groups.size();
+                groups.push_back({&s});
+            } else {
+                groups[it->second].push_back(&s);
+            }
+        }
+    }
+
+    std::string out;
+    for (const auto& group : groups) {
+        const Series& head = *group.front();
+        const char* type = head.type == Type::Counter ? "counter"
+                         : head.type == Type::Histogram ? "histogram" : "gauge";
+        out += "# HELP " + head.name + ' ' + head.help + '\n';
+        out += "# TYPE " + head.name + ' ' + type + '\n';
+
+        for (const Series* s : group) {
+            switch (s->type) {
+                case Type::Counter:
+                    out += series_name(s->name, s->labels) + ' ' + std::to_string(s->counter->get()) + '\n';
+                    break;
+                case Type::Gauge:
+                    out += series_name(s->name, s->labels) + ' ' + std::to_string(s->gauge->get()) + '\n';
+                    break;
+                case Type::Callback: {
+                    // Read under the lock so a replaced or removed callback
+                    // is never called after its owner has gone
+                    std::lock_guard<std::mutex> lock(callback_mutex);
+                    if (s->read) {
+                        out += series_name(s->name, s->labels) + ' ' + format_value(s->read()) + '\n';
+                    }
+                    break;
+                }
+                case Type::Histogram: {
+                    const Histogram& h = *s->histogram;
+                    uint64_t cumulative = 0;
+                    for (size_t i = 0; i < h.bounds().size(); i++) {
+                        cumulative += h.bucket(i);
+                        out += series_name(s->name + "_bucket", s->labels, "le=\"" + format_value(h.bounds()[i]) + "\"") +
+                               ' ' + std::to_string(cumulative) + '\n';
+                    }
+                    cumulative += h.bucket(h.bounds().size());
+                    out += series_name(s->name + "_bucket", s->labels, "le=\"+Inf\"") + ' ' +
+                           std::to_string(cumulative) + '\n';
+                    out += series_name(s->name + "_sum", s->labels) + ' ' + format_value(h.sum_seconds()) + '\n';
+                    out += series_name(s->name + "_count", s->labels) + ' ' + std::to_string(cumulative) + '\n';
+                    break;
+                }
+            }
+        }
+    }
+    return out;
+}
+
+MetricsRegistry& metrics() {
+    static MetricsRegistry registry;
+    return registry;
+}
+
+MetricsServer::~MetricsServer() {
+    stop();
+}
+
+bool MetricsServer::start(const std::string& address, uint16_t port, std::string& error) {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1) {
+        error = "invalid address " + address;
+        return false;
+    }
+
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        error = std::strerror(errno);
+        return false;
+    }
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(listen_fd, 16) < 0 ||
+        pipe2(wake_pipe, O_CLOEXEC) < 0) {
+        error = std::strerror(errno);
+        close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+
+    thread = std::thread(&MetricsServer::run, this);
+    return true;
+}
+
+void MetricsServer::stop() {
+    if (!thread.joinable()) return;
+    char byte = 0;
+    (void)!write(wake_pipe[1], &byte, 1);
+    thread.join();
+    close(listen_fd);
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+    listen_fd = wake_pipe[0] = wake_pipe[1] = -1;
+}
+
+void MetricsServer::run() {
+    while (true) {
+        pollfd fds[2] = {{listen_fd, POLLIN, 0}, {wake_pipe[0], POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        if (fds[1].revents) return;
+        if (fds[0].revents & POLLIN) {
+            int client = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client >= 0) {
+                serve(client);
+                close(client);
+            }
+        }
+    }
+}
+
+void MetricsServer::serve(int client) {
+    // Read up to the end of the request headers; the body is never needed
+    std::string request;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(kRequestTimeoutMs);
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+        int remaining = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()).count());
+        pollfd pfd{client, POLLIN, 0};
+        if (remaining <= 0 || poll(&pfd, 1, remaining) <= 0) return;
+        char chunk[1024];
+        ssize_t n = recv(client, chunk, sizeof(chunk), 0);
+        if (n <= 0) return;
+        request.append(chunk, static_cast<size_t>(n));
+    }
+
+    std::string status = "200 OK";
+    std::string body;
+    if (request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 13, "GET /metrics?") == 0) {
+        body = metrics().render();
+    } else {
+        status = "404 Not Found";
+        body = "not found\n";
+    }
+
+    write_all(client, "HTTP/1.1 " + status + "\r\n"
+                      "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                      "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                      "Connection: close\r\n\r\n" + body);
+}
+
+void start_metrics_server_from_env() {
+    static MetricsServer server;
+
+    std::string port = env_string("METRICS_PORT", "9464");
+    if (port.empty() || port == "0") return;
+    std::string address = env_string("METRICS_ADDRESS", "127.0.0.1");
+
+    std::string error;
+    if (!server.start(address, static_cast<uint16_t>(std::strtoul(port.c_str(), nullptr, 10)), error)) {
+        std::cerr << "Metrics endpoint disabled: " << address << ':' << port << ": " << error << std::endl;
+    } else {
+        std::cout << "Metrics on http://" << address << ':' << port << "/metrics" << std::endl;
+    }
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Monotonic count. Updates are a single relaxed atomic add.
+class Counter {
+public:
+    void inc(uint64_t n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value{0};
+};
+
+// Value that goes up and down
+class Gauge {
+public:
+    void set(int64_t v) { value.store(v, std::memory_order_relaxed); }
+    void add(int64_t n) { value.fetch_add(n, std::memory_order_relaxed); }
+    int64_t get() const { return value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<int64_t> value{0};
+};
+
+// Latency histogram with fixed bucket bounds (in seconds). observe() is a
+// short scan of the bounds and three relaxed atomic adds; no locks.
+class Histogram {
+public:
+    explicit Histogram(std::vector<double> bounds);
+
+    void observe(std::chrono::nanoseconds elapsed);
+
+    template <typename Rep, typename Period>
+    void observe(std::chrono::duration<Rep, Period> elapsed) {
+        observe(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed));
+    }
+
+    // Observe the time since start
+    void observe_since(std::chrono::steady_clock::time_point start) {
+        observe(std::chrono::steady_clock::now() - start);
+    }
+
+    const std::vector<double>& bounds() const { return upper_bounds; }
+    uint64_t bucket(size_t i) const { return buckets[i].load(std::memory_order_relaxed); }
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+    double sum_seconds() const { return sum_ns.load(std::memory_order_relaxed) / 1e9; }
+
+private:
+    std::vector<double> upper_bounds;
+    std::vector<int64_t> bound_ns;
+    // One slot per bound plus +Inf; not cumulative until rendered
+    std::unique_ptr<std::atomic<uint64_t>[]> buckets;
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> sum_ns{0};
+};
+
+// 1ms .. 30s in 1-2.5-5 steps
+std::vector<double> latency_buckets();
+
+// Named metrics rendered in the Prometheus text format.
+//
+// Registration takes a lock and returns a reference that stays valid for
+// the life of the registry; hot paths keep that reference and never look
+// anything up. `labels` is the inside of the braces, e.g. command="play".
+class MetricsRegistry {
+public:
+    Counter& counter(const std::string& name, const std::string& help, const std::string& labels = "");
+    Gauge& gauge(const std::string& name, const std::string& help, const std::string& labels = "");
+    Histogram& histogram(const std::string& name, const std::string& help,
+                         const std::string& labels = "", std::vector<double> bounds = latency_buckets());
+
+    // Gauge computed when scraped
+    void gauge_callback(const std::string& name, const std::string& help, std::function<double()> read);
+
+    // Stop scraping a callback gauge. Once this returns the callback is not
+    // running and will not be called again, so what it captured may go.
+    void remove_gauge_callback(const std::string& name);
+
+    std::string render() const;
+
+private:
+    enum class Type { Counter, Gauge, Histogram, Callback };
+
+    struct Series {
+        std::string name;
+        std::string help;
+        std::string labels;
+        Type type;
+        std::unique_ptr<Counter> counter;
+        std::unique_ptr<Gauge> gauge;
+        std::unique_ptr<Histogram> histogram;
+        std::function<double()> read;
+    };
+
+    Series* find(const std::string& name, const std::string& labels);
+    Series& add(const std::string& name, const std::string& help, const std::string& labels, Type type);
+
+    mutable std::mutex mutex;
+    // Guards Series::read and is held while a callback runs; never taken
+    // together with `mutex`, since callbacks may register metrics
+    mutable std::mutex callback_mutex;
+    std::deque<Series> series;
+};
+
+// Process-wide registry
+MetricsRegistry& metrics();
+
+// Minimal HTTP server answering GET /metrics with metrics().render().
+// Serves one connection at a time on its own thread.
+class MetricsServer {
+public:
+    MetricsServer() = default;
+    ~MetricsServer();
+
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator=(const MetricsServer&) = delete;
+
+    // Returns false (with the reason in error) if the port cannot be bound
+    bool start(const std::string& address, uint16_t port, std::string& error);
+    void stop();
+
+private:
+    void run();
+    void serve(int client);
+
+    int listen_fd = -1;
+    int wake_pipe[2] = {-1, -1};
+    std::thread thread;
+};
+
+// Serve metrics() on METRICS_ADDRESS:METRICS_PORT (default 127.0.0.1:9464)
+// for the rest of the process; METRICS_PORT=0 turns it off
+void start_metrics_server_from_env();
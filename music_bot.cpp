@@ -0,0 +1,1273 @@
+#include "music_bot.h"
+#include "env.h"
+#include "resolver.h"
+#include "title_index.h"
+#include <json/json.h>
+#include <algorithm>
+#include <random>
+#include <thread>
+#include <ctime>
+#include <cstdlib>
+
+namespace {
+
+const char* const kCommands[] = {"play", "skip", "stop", "pause", "resume", "queue", "clear", "nowplaying",
+                                 "loop", "remove", "move", "shuffle", "volume", "radio", "seek"};
+
+struct MusicBotMetrics {
+    // Time from a slash command arriving until its handler has run on the
+    // guild's actor. Registered up front so handlers never touch the registry.
+    std::unordered_map<std::string, Histogram*> commands = [] {
+        std::unordered_map<std::string, Histogram*> map;
+        for (const char* name : kCommands) {
+            map[name] = &metrics().histogram("musicbot_command_seconds", "Slash command handler latency",
+                                             std::string("command=\"") + name + "\"");
+        }
+        return map;
+    }();
+    // /play from the command arriving until its tracks are in the queue
+    Histogram& play = metrics().histogram("musicbot_play_seconds",
+                                          "Time from /play until the resolved tracks are queued");
+    Histogram& voice_connect = metrics().histogram("musicbot_voice_connect_seconds",
+                                                   "Time from requesting a voice connection until it is ready");
+    Counter& evicted_idle = metrics().counter("musicbot_guilds_evicted_total",
+                                              "Guilds moved to cold storage", "reason=\"idle\"");
+    Counter& evicted_alone = metrics().counter("musicbot_guilds_evicted_total",
+                                               "Guilds moved to cold storage", "reason=\"alone\"");
+    Counter& thawed = metrics().counter("musicbot_guilds_thawed_total", "Guilds brought back from cold storage");
+
+    Histogram* command_latency(const std::string& command) const {
+        auto it = commands.find(command);
+        return it == commands.end() ? nullptr : it->second;
+    }
+};
+
+MusicBotMetrics& music_bot_metrics() {
+    static MusicBotMetrics m;
+    return m;
+}
+
+const char* const kBusy = "⏳ Too many songs are being looked up right now, please try again in a moment.";
+
+int64_t steady_ms(std::chrono::steady_clock::time_point at) {
+    if (at == std::chrono::steady_clock::time_point()) return 0;
+    return std::chrono::duration_cast<std::chrono::milliseconds>(at.time_since_epoch()).count();
+}
+
+bool expired(std::chrono::steady_clock::time_point since, std::chrono::steady_clock::time_point now,
+             std::chrono::seconds timeout) {
+    return since != std::chrono::steady_clock::time_point() && now - since >= timeout;
+}
+
+// Put a handed-off or cold guild's queue and settings in place, and journal
+// them. Playback waits for voice.
+void take_over(GuildMusicState& state, GuildHandoff& guild) {
+    state.text_channel_id = guild.text_channel_id;
+    state.voice_channel_id = guild.voice_channel_id;
+    state.loop_mode = guild.loop_mode;
+    state.volume = guild.volume;
+    queue_store().set_channels(guild.guild_id, guild.text_channel_id, guild.voice_channel_id);
+    queue_store().set_loop(guild.guild_id, guild.loop_mode);
+    for (auto& track : guild.tracks) {
+        queue_store().push(guild.guild_id, track);
+        state.queue.push_back(std::move(track));
+    }
+    // A command that got here first already started something
+    if (!state.is_playing && !state.radio) {
+        state.resume_position = guild.playing ? guild.position : 0;
+        state.resume_paused = guild.paused;
+        state.resume_radio = guild.radio;
+    }
+}
+
+} // namespace
+
+std::string Command::text(const std::string& option, const std::string& fallback) const {
+    auto it = options.find(option);
+    if (it == options.end() || !std::holds_alternative<std::string>(it->second)) {
+        return fallback;
+    }
+    return std::get<std::string>(it->second);
+}
+
+std::optional<int64_t> Command::integer(const std::string& option) const {
+    auto it = options.find(option);
+    if (it == options.end() || !std::holds_alternative<int64_t>(it->second)) {
+        return std::nullopt;
+    }
+    return std::get<int64_t>(it->second);
+}
+
+MusicBot::MusicBot(VoiceGateway& voice, Announcer& announcer, TrackCache& tracks, Options opts)
+    : voice(voice), announcer(announcer), tracks(tracks), options(std::move(opts)),
+      pool(std::max<size_t>(1, options.worker_threads)), sender(pool, options.send) {
+    if (!options.trace_path.empty()) {
+        trace.open(options.trace_path, std::ios::app);
+    }
+    music_bot_metrics();
+    metrics().gauge_callback("musicbot_guilds", "Guilds with music state",
+                             [this] { return static_cast<double>(guild_count()); });
+    metrics().gauge_callback("musicbot_cold_guilds", "Guilds in cold storage",
+                             [this] { return static_cast<double>(cold.size()); });
+    metrics().gauge_callback("musicbot_cold_bytes", "Size of the cold storage records",
+                             [this] { return static_cast<double>(cold.bytes()); });
+    reaper = std::thread([this] { reap(); });
+}
+
+MusicBot::~MusicBot() {
+    {
+        std::lock_guard<std::mutex> lock(reaper_mutex);
+        reaper_stopping = true;
+    }
+    reaper_wake.notify_all();
+    reaper.join();
+
+    metrics().remove_gauge_callback("musicbot_guilds");
+    metrics().remove_gauge_callback("musicbot_cold_guilds");
+    metrics().remove_gauge_callback("musicbot_cold_bytes");
+}
+
+bool MusicBot::post(uint64_t guild_id, std::function<void(GuildMusicState&)> task, bool create) {
+    std::shared_ptr<GuildActor> actor;
+    {
+        Shard& shard = shard_for(guild_id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.actors.find(guild_id);
+        if (it != shard.actors.end()) {
+            actor = it->second;
+        } else if (create) {
+            actor = std::make_shared<GuildActor>();
+            actor->strand = Strand::create(pool);
+            shard.actors.emplace(guild_id, actor);
+
+            // Posted under the shard lock so it runs before anything else
+            // that finds the new actor
+            std::string record;
+            if (cold.take(guild_id, record)) {
+                auto guild = std::make_shared<GuildHandoff>();
+                guild->guild_id = guild_id;
+                if (unpack_cold_guild(record, *guild)) {
+                    actor->strand->post([actor, guild]() {
+                        queue_store().reset(guild->guild_id);
+                        take_over(actor->state, *guild);
+                    });
+                    music_bot_metrics().thawed.inc();
+                }
+            }
+        } else {
+            return false;
+        }
+    }
+
+    // The task keeps the actor alive even if the guild is cleared meanwhile
+    actor->strand->post([this, guild_id, create, actor, task = std::move(task)]() mutable {
+        GuildMusicState& state = actor->state;
+        if (state.retired) {
+            post(guild_id, std::move(task), create);
+            return;
+        }
+        task(state);
+
+        // Only the actor touches its queue, so the delta is exact
+        size_t queued = state.queue.size();
+        if (queued != actor->last_queued) {
+            queued_tracks.add(static_cast<int64_t>(queued) - static_cast<int64_t>(actor->last_queued));
+            actor->last_queued = queued;
+        }
+
+        bool playing = (state.is_playing || state.radio) && !state.is_paused;
+        if (playing) {
+            state.idle_since = {};
+        } else if (state.idle_since == std::chrono::steady_clock::time_point()) {
+            state.idle_since = std::chrono::steady_clock::now();
+        }
+        actor->idle_since.store(steady_ms(state.idle_since), std::memory_order_relaxed);
+        actor->alone_since.store(steady_ms(state.alone_since), std::memory_order_relaxed);
+    });
+    return true;
+}
+
+void MusicBot::post_command(uint64_t guild_id, std::function<void(GuildMusicState&)> task) {
+    if (post(guild_id, task, false)) {
+        return;
+    }
+    if (cold.contains(guild_id)) {
+        post(guild_id, std::move(task));
+        return;
+    }
+    // Nothing to show or change; not worth an actor
+    GuildMusicState blank;
+    task(blank);
+}
+
+GuildHandoff MusicBot::snapshot(uint64_t guild_id, const GuildMusicState& state) {
+    GuildHandoff guild;
+    guild.guild_id = guild_id;
+    guild.text_channel_id = state.text_channel_id;
+    guild.voice_channel_id = state.voice_channel_id;
+    guild.loop_mode = state.loop_mode;
+    guild.volume = state.volume;
+    guild.radio = state.radio ? state.radio_info : state.resume_radio;
+    if (state.current_track && state.is_playing) {
+        // Back at the head of the queue, like a restored guild
+        guild.playing = true;
+        guild.paused = state.is_paused;
+        guild.position = state.player ? state.player->position() : 0;
+        guild.tracks.push_back(state.current_track->clone());
+    } else {
+        // Taken over and snapshotted again before voice came up
+        guild.playing = state.resume_position > 0;
+        guild.paused = state.resume_paused;
+        guild.position = state.resume_position;
+    }
+    state.queue.for_each([&guild](const Track& track) {
+        guild.tracks.push_back(track.clone());
+    });
+    return guild;
+}
+
+void MusicBot::reap() {
+    std::unique_lock<std::mutex> lock(reaper_mutex);
+    while (!reaper_wake.wait_for(lock, options.sweep_interval, [this] { return reaper_stopping; })) {
+        lock.unlock();
+        sweep();
+        lock.lock();
+    }
+}
+
+void MusicBot::sweep() {
+    int64_t now = steady_ms(std::chrono::steady_clock::now());
+    int64_t idle_ms = std::chrono::duration_cast<std::chrono::milliseconds>(options.idle_timeout).count();
+    int64_t alone_ms = std::chrono::duration_cast<std::chrono::milliseconds>(options.alone_timeout).count();
+    auto due = [now](const std::atomic<int64_t>& since, int64_t timeout) {
+        int64_t at = since.load(std::memory_order_relaxed);
+        return at != 0 && now - at >= timeout;
+    };
+
+    std::vector<uint64_t> guild_ids;
+    for (auto& shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for (const auto& [guild_id, actor] : shard.actors) {
+            if (due(actor->idle_since, idle_ms) || due(actor->alone_since, alone_ms)) {
+                guild_ids.push_back(guild_id);
+            }
+        }
+    }
+
+    // The actor checks again, in case a command got there first
+    for (uint64_t guild_id : guild_ids) {
+        post(guild_id, [this, guild_id](GuildMusicState& state) {
+            evict(guild_id, state);
+        }, false);
+    }
+}
+
+void MusicBot::evict(uint64_t guild_id, GuildMusicState& state) {
+    auto now = std::chrono::steady_clock::now();
+    bool alone = expired(state.alone_since, now, options.alone_timeout);
+    if (!alone && !expired(state.idle_since, now, options.idle_timeout)) {
+        return;
+    }
+
+    GuildHandoff guild = snapshot(guild_id, state);
+    // It leaves voice, and picks up again on whatever channel /play is
+    // next used from
+    guild.voice_channel_id = 0;
+    guild.paused = false;
+    guild.radio = nullptr;
+    bool keep = !guild.tracks.empty() || guild.volume != 100 || guild.loop_mode != loop_off;
+    bool connected = voice.ready(guild_id);
+    uint64_t channel_id = state.text_channel_id;
+
+    state.clear();
+    state.retired = true;
+    sender.detach(guild_id);
+    announcer.forget(guild_id);
+    if (keep) {
+        // The journal keeps the queue, so a restart brings it back too
+        queue_store().set_channels(guild_id, channel_id, 0);
+    } else {
+        queue_store().reset(guild_id);
+    }
+    {
+        // The record goes in as the actor goes away, so a post() in between
+        // cannot start the guild blank
+        std::string record = keep ? pack_cold_guild(guild) : std::string();
+        Shard& shard = shard_for(guild_id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (keep) {
+            cold.put(guild_id, std::move(record));
+        }
+        shard.actors.erase(guild_id);
+    }
+    voice.disconnect(guild_id);
+
+    (alone ? music_bot_metrics().evicted_alone : music_bot_metrics().evicted_idle).inc();
+    if (connected && channel_id != 0) {
+        std::string why = alone ? "everyone left the voice channel" : "nothing was playing for a while";
+        std::string back = keep ? " Use `/play` to pick up where it left off." : "";
+        announcer.notice(channel_id, "👋 Left since " + why + "." + back);
+    }
+}
+
+void MusicBot::hand_off(std::function<void(GuildHandoff)> each, std::function<void()> done) {
+    std::vector<uint64_t> guild_ids;
+    for (auto& shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for (const auto& entry : shard.actors) {
+            guild_ids.push_back(entry.first);
+        }
+    }
+
+    // One count per guild plus one for this call, so `done` runs exactly once
+    auto remaining = std::make_shared<std::atomic<size_t>>(guild_ids.size() + 1);
+    auto finished = [remaining, done = std::move(done)]() {
+        if (remaining->fetch_sub(1) == 1) {
+            done();
+        }
+    };
+
+    for (uint64_t guild_id : guild_ids) {
+        post(guild_id, [this, guild_id, each, finished](GuildMusicState& state) {
+            GuildHandoff guild = snapshot(guild_id, state);
+            bool idle = guild.tracks.empty() && !guild.radio;
+            clear_guild_state(guild_id, state);
+            voice.disconnect(guild_id);
+            if (!idle) {
+                each(std::move(guild));
+            }
+            finished();
+        });
+    }
+
+    for (auto& [guild_id, record] : cold.take_all()) {
+        GuildHandoff guild;
+        guild.guild_id = guild_id;
+        queue_store().reset(guild_id);
+        if (unpack_cold_guild(record, guild)) {
+            each(std::move(guild));
+        }
+    }
+    finished();
+}
+
+void MusicBot::adopt(GuildHandoff guild) {
+    uint64_t guild_id = guild.guild_id;
+    uint64_t voice_channel_id = guild.voice_channel_id;
+    auto handoff = std::make_shared<GuildHandoff>(std::move(guild));
+    post(guild_id, [handoff](GuildMusicState& state) {
+        take_over(state, *handoff);
+    });
+
+    if (voice.ready(guild_id)) {
+        voice_ready(guild_id);
+    } else if (voice_channel_id != 0) {
+        voice.connect(guild_id, voice_channel_id);
+        post(guild_id, [requested = std::chrono::steady_clock::now()](GuildMusicState& state) {
+            state.voice_requested = requested;
+        });
+    }
+}
+
+void MusicBot::after(uint64_t guild_id, std::function<void()> fn) {
+    std::shared_ptr<GuildActor> actor;
+    {
+        Shard& shard = shard_for(guild_id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.actors.find(guild_id);
+        if (it != shard.actors.end()) {
+            actor = it->second;
+        }
+    }
+    if (!actor) {
+        fn();
+        return;
+    }
+    actor->strand->post(std::move(fn));
+}
+
+size_t MusicBot::guild_count() {
+    size_t count = 0;
+    for (auto& shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        count += shard.actors.size();
+    }
+    return count;
+}
+
+void MusicBot::clear_guild_state(uint64_t guild_id, GuildMusicState& state) {
+    state.clear();
+    state.retired = true;
+    sender.detach(guild_id);
+    queue_store().reset(guild_id);
+    announcer.forget(guild_id);
+    Shard& shard = shard_for(guild_id);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.actors.erase(guild_id);
+}
+
+std::shared_ptr<VoiceSink> MusicBot::paced_sink(uint64_t guild_id) {
+    return sender.attach(guild_id, voice.sink(guild_id), [this, guild_id] {
+        refill_voice(guild_id);
+    });
+}
+
+bool MusicBot::pause_voice(uint64_t guild_id, bool paused) {
+    if (!voice.pause(guild_id, paused)) {
+        return false;
+    }
+    sender.pause(guild_id, paused);
+    return true;
+}
+
+void MusicBot::record(const Command& command) {
+    int64_t at_ms = std::chrono::duration_cast<std::chrono::milliseconds>(command.received - trace_start).count();
+    std::string line = command_trace_line(command, std::max<int64_t>(0, at_ms));
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    trace << line << '\n';
+    trace.flush();
+}
+
+void MusicBot::restore(std::vector<QueueStore::RestoredGuild>& guilds) {
+    // Stream URLs were not kept, so each track re-resolves as it comes up
+    for (auto& guild : guilds) {
+        auto tracks = std::make_shared<std::vector<Track>>(std::move(guild.tracks));
+        guild.tracks.clear();
+        post(guild.guild_id, [channel_id = guild.text_channel_id, loop_mode = guild.loop_mode,
+                              tracks](GuildMusicState& state) {
+            state.text_channel_id = channel_id;
+            state.loop_mode = loop_mode;
+            for (auto& track : *tracks) {
+                state.queue.push_back(std::move(track));
+            }
+        });
+    }
+}
+
+void MusicBot::rejoin(const std::vector<QueueStore::RestoredGuild>& guilds) {
+    auto requested = std::chrono::steady_clock::now();
+    for (const auto& guild : guilds) {
+        if (guild.voice_channel_id == 0) {
+            continue;
+        }
+        voice.connect(guild.guild_id, guild.voice_channel_id);
+        post(guild.guild_id, [requested, channel_id = guild.voice_channel_id](GuildMusicState& state) {
+            state.voice_requested = requested;
+            state.voice_channel_id = channel_id;
+        });
+    }
+}
+
+void MusicBot::voice_ready(uint64_t guild_id) {
+    post(guild_id, [this, guild_id](GuildMusicState& state) {
+        if (state.voice_requested != std::chrono::steady_clock::time_point()) {
+            music_bot_metrics().voice_connect.observe_since(state.voice_requested);
+            state.voice_requested = {};
+        }
+        if (state.resume_radio) {
+            TrackInfoPtr info = std::move(state.resume_radio);
+            state.resume_radio = nullptr;
+            retune_radio(state, guild_id, info);
+        } else if (state.radio) {
+            state.radio->pump();
+        } else if (!state.is_playing && !state.queue.empty()) {
+            play_next(state, guild_id, state.text_channel_id);
+        }
+    });
+}
+
+void MusicBot::refill_voice(uint64_t guild_id) {
+    post(guild_id, [](GuildMusicState& state) {
+        if (state.radio) {
+            state.radio->pump();
+        } else if (state.player) {
+            state.player->pump();
+        }
+    }, false);
+}
+
+void MusicBot::voice_state_changed(uint64_t guild_id) {
+    post(guild_id, [this, guild_id](GuildMusicState& state) {
+        // Nobody is there yet while the bot is still joining
+        bool joining = state.voice_requested != std::chrono::steady_clock::time_point();
+        if (joining || voice.listeners(guild_id) > 0) {
+            state.alone_since = {};
+        } else if (state.alone_since == std::chrono::steady_clock::time_point()) {
+            state.alone_since = std::chrono::steady_clock::now();
+        }
+    }, false);
+}
+
+void MusicBot::handle(std::shared_ptr<Interaction> interaction) {
+    const Command& command = interaction->command();
+    if (trace.is_open()) {
+        record(command);
+    }
+
+    // Recorded once the guild's actor has also run whatever task the
+    // handler posted
+    struct CommandTimer {
+        MusicBot& bot;
+        uint64_t guild_id;
+        Histogram* latency;
+        std::chrono::steady_clock::time_point received;
+
+        ~CommandTimer() {
+            if (latency) {
+                bot.after(guild_id, [latency = latency, received = received]() {
+                    latency->observe_since(received);
+                });
+            }
+        }
+    } timer{*this, command.guild_id, music_bot_metrics().command_latency(command.name), command.received};
+
+    const std::string& name = command.name;
+    if (name == "play") {
+        play(interaction);
+    } else if (name == "radio") {
+        radio(interaction);
+    } else if (name == "loop" || name == "volume") {
+        // Settings are kept even for a guild with nothing queued
+        post(command.guild_id, [this, interaction](GuildMusicState& state) {
+            state.idle_since = std::chrono::steady_clock::now();
+            if (interaction->command().name == "loop") {
+                loop(interaction, state);
+            } else {
+                volume(interaction, state);
+            }
+        });
+    } else if (music_bot_metrics().command_latency(name)) {
+        post_command(command.guild_id, [this, interaction](GuildMusicState& state) {
+            state.idle_since = std::chrono::steady_clock::now();
+            const std::string& name = interaction->command().name;
+            if (name == "skip") {
+                skip(interaction, state);
+            } else if (name == "stop") {
+                stop(interaction, state);
+            } else if (name == "pause" || name == "resume") {
+                pause(interaction, state, name == "pause");
+            } else if (name == "queue") {
+                show_queue(interaction, state);
+            } else if (name == "clear") {
+                clear_queue(interaction, state);
+            } else if (name == "nowplaying") {
+                now_playing(interaction, state);
+            } else if (name == "remove") {
+                remove(interaction, state);
+            } else if (name == "move") {
+                move(interaction, state);
+            } else if (name == "shuffle") {
+                shuffle(interaction, state);
+            } else if (name == "seek") {
+                seek(interaction, state);
+            }
+        });
+    }
+}
+
+void MusicBot::play(const Reply& event) {
+    const Command& command = event->command();
+
+    // Get user's voice channel
+    VoiceGateway::Lookup found = voice.lookup(command.guild_id, command.user_id);
+    if (!found.guild_found) {
+        event->reply("❌ Guild not found!");
+        return;
+    }
+    if (found.user_channel == 0) {
+        event->reply("❌ You need to be in a voice channel first!");
+        return;
+    }
+
+    std::string query = command.text("query");
+    event->reply("🔄 Searching and processing: `" + query + "`...");
+
+    // Connect to voice channel if not already connected
+    auto received = command.received;
+    bool connecting = !found.joined;
+    if (connecting) {
+        voice.connect(command.guild_id, found.user_channel);
+    }
+    // Journaled on the actor, so it stays in order with a reset from /stop
+    // or an eviction
+    post(command.guild_id, [received, connecting, guild_id = command.guild_id, text_channel = command.channel_id,
+                            voice_channel = found.user_channel](GuildMusicState& state) {
+        if (connecting) {
+            state.voice_requested = received;
+            state.voice_channel_id = voice_channel;
+        }
+        queue_store().set_channels(guild_id, text_channel, voice_channel);
+    });
+
+    uint64_t requester = command.user_id;
+
+    if (is_playlist_url(query)) {
+        post(command.guild_id, [this, event, query, requester](GuildMusicState& state) {
+            import_playlist(state, event, query, requester);
+        });
+        return;
+    }
+
+    // Resolve through the cache; misses go to the worker pool
+    bool queued = tracks.resolve(query,
+        [this, event, requester, received](std::vector<TrackInfoPtr> tracks, const std::string& error) {
+        if (tracks.empty()) {
+            std::string reason = error.empty() ? "" : " (" + error + ")";
+            event->edit_reply("❌ No playable tracks found!" + reason);
+            return;
+        }
+
+        // Back onto the guild's actor before touching its queue
+        post(event->command().guild_id,
+            [this, event, requester, received, tracks = std::move(tracks)](GuildMusicState& state) mutable {
+            const Command& command = event->command();
+            state.text_channel_id = command.channel_id;
+
+            // Add tracks to queue
+            for (auto& info : tracks) {
+                Track track(std::move(info), requester);
+                queue_store().push(command.guild_id, track);
+                state.queue.push_back(std::move(track));
+            }
+            music_bot_metrics().play.observe_since(received);
+
+            std::string response = "✅ Added " + std::to_string(tracks.size()) +
+                                   " track" + (tracks.size() > 1 ? "s" : "") + " to the queue!";
+            if (state.radio) {
+                response += " It plays once the radio is turned off.";
+            }
+
+            // Start playing if nothing is currently playing
+            if (!state.is_playing) {
+                play_next(state, command.guild_id, command.channel_id);
+            } else {
+                refresh_upcoming(state);
+            }
+
+            event->edit_reply(response);
+        });
+    });
+
+    if (!queued) {
+        event->edit_reply(kBusy);
+    }
+}
+
+void MusicBot::radio(const Reply& event) {
+    const Command& command = event->command();
+    std::string query = command.text("query");
+    if (query.empty()) {
+        post_command(command.guild_id, [this, event](GuildMusicState& state) {
+            const Command& command = event->command();
+            if (!state.radio) {
+                event->reply("❌ The radio is not on!");
+                return;
+            }
+            state.leave_radio();
+            state.is_paused = false;
+            event->reply("📻 Radio off.");
+            if (!state.queue.empty()) {
+                play_next(state, command.guild_id, command.channel_id);
+            } else {
+                announcer.finished(command.guild_id, command.channel_id, queue_finished_view());
+            }
+        });
+        return;
+    }
+
+    VoiceGateway::Lookup found = voice.lookup(command.guild_id, command.user_id);
+    if (!found.guild_found) {
+        event->reply("❌ Guild not found!");
+        return;
+    }
+    if (found.user_channel == 0) {
+        event->reply("❌ You need to be in a voice channel first!");
+        return;
+    }
+
+    event->reply("📻 Tuning in to `" + query + "`...");
+
+    if (!found.joined) {
+        voice.connect(command.guild_id, found.user_channel);
+        post(command.guild_id, [received = command.received, channel_id = found.user_channel](GuildMusicState& state) {
+            state.voice_requested = received;
+            state.voice_channel_id = channel_id;
+        });
+    }
+
+    uint64_t requester = command.user_id;
+    bool queued = tracks.resolve(query,
+        [this, event, requester](std::vector<TrackInfoPtr> tracks, const std::string& error) {
+        if (tracks.empty()) {
+            std::string reason = error.empty() ? "" : " (" + error + ")";
+            event->edit_reply("❌ No playable stream found!" + reason);
+            return;
+        }
+
+        post(event->command().guild_id, [this, event, requester, info = tracks.front()](GuildMusicState& state) {
+            const Command& command = event->command();
+            state.text_channel_id = command.channel_id;
+            tune_radio(state, command.guild_id, command.channel_id, info, requester);
+
+            std::string response = state.radio ? "📻 Tuned in to **" + info->title + "**"
+                                               : "❌ Could not start the stream!";
+            event->edit_reply(response);
+        });
+    });
+
+    if (!queued) {
+        event->edit_reply(kBusy);
+    }
+}
+
+void MusicBot::skip(const Reply& event, GuildMusicState& state) {
+    if (!state.is_playing) {
+        event->reply("❌ Nothing is playing right now!");
+        return;
+    }
+
+    // Nothing to stop yet while the track waits on a fresh stream URL, or
+    // the next one is about to start
+    if (!state.player || !state.player->active()) {
+        event->reply("⏳ The track is still starting, try again in a moment.");
+        return;
+    }
+
+    // Stop current track (this will trigger play_next)
+    state.player->skip();
+
+    event->reply("⏭️ Skipped!");
+}
+
+void MusicBot::stop(const Reply& event, GuildMusicState& state) {
+    // Clear state (stops the player and its audio)
+    clear_guild_state(event->command().guild_id, state);
+
+    voice.disconnect(event->command().guild_id);
+    event->reply("⏹️ Playback stopped, queue cleared, and disconnected.");
+}
+
+void MusicBot::pause(const Reply& event, GuildMusicState& state, bool paused) {
+    if (paused) {
+        if ((!state.is_playing && !state.radio) || state.is_paused) {
+            event->reply("❌ Nothing is currently playing or already paused!");
+            return;
+        }
+    } else if (!state.is_paused) {
+        event->reply("❌ The track is not paused!");
+        return;
+    }
+
+    if (pause_voice(event->command().guild_id, paused)) {
+        state.is_paused = paused;
+    }
+
+    event->reply(paused ? "⏸️ Paused." : "▶️ Resumed.");
+}
+
+void MusicBot::show_queue(const Reply& event, GuildMusicState& state) {
+    int64_t page = event->command().integer("page").value_or(1);
+    event->reply(queue_view(state.current_track.get(), state.queue, state.loop_mode, page));
+}
+
+void MusicBot::clear_queue(const Reply& event, GuildMusicState& state) {
+    if (state.queue.empty()) {
+        event->reply("❌ The queue is already empty!");
+        return;
+    }
+
+    size_t queue_size = state.queue.size();
+    state.queue.clear();
+    state.cancel_imports();
+    queue_store().clear_queue(event->command().guild_id);
+
+    event->reply("🗑️ Cleared " + std::to_string(queue_size) + " tracks from the queue!");
+}
+
+void MusicBot::loop(const Reply& event, GuildMusicState& state) {
+    std::string mode = event->command().text("mode");
+
+    if (mode == "off") {
+        state.loop_mode = loop_off;
+        event->reply("🔄 Loop mode set to: **Disabled**");
+    } else if (mode == "track") {
+        state.loop_mode = loop_track;
+        event->reply("🔂 Loop mode set to: **Single Track**");
+    } else if (mode == "queue") {
+        state.loop_mode = loop_queue;
+        event->reply("🔁 Loop mode set to: **Queue**");
+    }
+    queue_store().set_loop(event->command().guild_id, state.loop_mode);
+}
+
+void MusicBot::now_playing(const Reply& event, GuildMusicState& state) {
+    if (state.radio) {
+        int position = static_cast<int>(state.radio->position());
+        event->reply(now_playing_view(Track(state.radio_info, 0), state.loop_mode, position, Player::Stats(),
+                                      sender.stats(event->command().guild_id)));
+        return;
+    }
+
+    if (!state.current_track || !state.is_playing) {
+        event->reply("❌ Nothing is playing right now!");
+        return;
+    }
+
+    // From the audio actually sent, so pauses and seeks are accounted for
+    int position = state.player ? static_cast<int>(state.player->position()) : 0;
+    Player::Stats stats = state.player ? state.player->stats() : Player::Stats();
+
+    event->reply(now_playing_view(*state.current_track, state.loop_mode, position, stats,
+                                  sender.stats(event->command().guild_id)));
+}
+
+void MusicBot::remove(const Reply& event, GuildMusicState& state) {
+    int position = static_cast<int>(event->command().integer("position").value_or(0));
+
+    if (position < 1 || position > (int)state.queue.size()) {
+        event->reply("❌ Invalid track number. Must be between 1 and " +
+                     std::to_string(state.queue.size()) + ".");
+        return;
+    }
+
+    Track removed_track = state.queue.erase(position - 1);
+    queue_store().remove(event->command().guild_id, position - 1);
+
+    event->reply("✂️ Removed track #" + std::to_string(position) + ": **" +
+                 removed_track->title + "**");
+}
+
+void MusicBot::move(const Reply& event, GuildMusicState& state) {
+    int from = static_cast<int>(event->command().integer("from").value_or(0));
+    int to = static_cast<int>(event->command().integer("to").value_or(0));
+
+    if (from < 1 || from > (int)state.queue.size() || to < 1 || to > (int)state.queue.size()) {
+        event->reply("❌ Invalid track number. Must be between 1 and " +
+                     std::to_string(state.queue.size()) + ".");
+        return;
+    }
+
+    state.queue.move(from - 1, to - 1);
+    queue_store().move(event->command().guild_id, from - 1, to - 1);
+
+    event->reply("↕️ Moved track #" + std::to_string(from) + " to #" + std::to_string(to) + ": **" +
+                 state.queue.at(to - 1)->title + "**");
+}
+
+void MusicBot::shuffle(const Reply& event, GuildMusicState& state) {
+    if (state.queue.size() < 2) {
+        event->reply("❌ Not enough tracks in the queue to shuffle!");
+        return;
+    }
+
+    // Shuffled from a seed so the queue journal can replay it
+    static thread_local std::mt19937_64 rng(std::random_device{}());
+    uint64_t seed = rng();
+    shuffle_queue(state.queue, seed);
+    queue_store().shuffle(event->command().guild_id, seed);
+
+    event->reply("🔀 Shuffled " + std::to_string(state.queue.size()) + " tracks!");
+}
+
+void MusicBot::volume(const Reply& event, GuildMusicState& state) {
+    std::optional<int64_t> level = event->command().integer("level");
+    if (!level) {
+        event->reply("🔊 Volume is **" + std::to_string(state.volume) + "%**");
+        return;
+    }
+
+    if (*level < 0 || *level > 200) {
+        event->reply("❌ Volume must be between 0 and 200.");
+        return;
+    }
+
+    state.volume = static_cast<int>(*level);
+    if (state.player) {
+        state.player->set_volume(state.volume / 100.0f);
+    }
+
+    std::string note = state.radio ? " (the radio is not affected)" : "";
+    event->reply("🔊 Volume set to **" + std::to_string(state.volume) + "%**" + note);
+}
+
+void MusicBot::seek(const Reply& event, GuildMusicState& state) {
+    if (!state.current_track || !state.is_playing || !state.player) {
+        event->reply(state.radio ? "❌ The radio cannot be seeked!" : "❌ Nothing is playing right now!");
+        return;
+    }
+
+    int target = parse_duration(event->command().text("position"));
+    if (target < 0) {
+        event->reply("❌ Give the position in seconds or as m:ss, like 90 or 1:30.");
+        return;
+    }
+    int duration = state.current_track->info().duration;
+    if (duration > 0 && target >= duration) {
+        event->reply("❌ The track is only " + format_duration(duration) + " long.");
+        return;
+    }
+
+    std::string at = target > 0 ? format_duration(target) : "0:00";
+    std::shared_ptr<Player> player = state.player;
+    std::shared_ptr<Track> track = state.current_track;
+    if (!tracks.stream_stale(track->info())) {
+        player->seek(target);
+        event->reply("⏩ Jumped to **" + at + "**");
+        return;
+    }
+
+    // The signed stream URL has expired since the track started
+    event->reply("⏩ Jumping to **" + at + "**...");
+    uint64_t guild_id = event->command().guild_id;
+    bool queued = tracks.resolve(track->info().url,
+        [this, event, guild_id, track, player, target, at](std::vector<TrackInfoPtr> tracks, const std::string& error) {
+        if (tracks.empty()) {
+            std::string reason = error.empty() ? "" : " (" + error + ")";
+            event->edit_reply("❌ Could not refresh the stream to seek!" + reason);
+            return;
+        }
+        // Only a live actor still has this track playing
+        bool live = post(guild_id, [event, track, player, target, at, tracks = std::move(tracks)](GuildMusicState& state) {
+            if (state.current_track != track) {
+                event->edit_reply("❌ The track ended before it could be seeked.");
+                return;
+            }
+            track->set_info(tracks.front());
+            player->seek(target, track->info().stream_url);
+            event->edit_reply("⏩ Jumped to **" + at + "**");
+        }, false);
+        if (!live) {
+            event->edit_reply("❌ The track ended before it could be seeked.");
+        }
+    });
+
+    if (!queued) {
+        event->edit_reply(kBusy);
+    }
+}
+
+void MusicBot::play_next(GuildMusicState& state, uint64_t guild_id, uint64_t channel_id) {
+    if (state.radio) {
+        return; // the queue carries on when the radio is turned off
+    }
+
+    if (!voice.ready(guild_id)) {
+        return;
+    }
+
+    // Handle loop modes
+    std::shared_ptr<Track> next_track = advance_queue(state.queue, state.current_track, state.loop_mode);
+    queue_store().advance(guild_id);
+    if (!next_track) {
+        // Queue finished
+        state.is_playing = false;
+        state.current_track = nullptr;
+        announcer.finished(guild_id, channel_id, queue_finished_view());
+        return;
+    }
+
+    state.current_track = next_track;
+    state.is_playing = true;
+    state.is_paused = false;
+
+    // Update the guild's now-playing message; rapid skips coalesce into one edit
+    announcer.now_playing(guild_id, channel_id, track_started_view(*next_track, state.loop_mode));
+
+    if (!state.player) {
+        Player::Callbacks callbacks;
+        // Player callbacks come from decoder and voice threads; hop onto the actor
+        callbacks.near_end = [this, guild_id]() {
+            post(guild_id, [this](GuildMusicState& state) {
+                prepare_next(state);
+            }, false);
+        };
+        // The player lasts as long as the guild; /play may since have been
+        // used from another channel, so the channel is read when it fires
+        callbacks.ended = [this, guild_id](const std::string& error) {
+            // Play next track when current finishes
+            post(guild_id, [this, guild_id, error](GuildMusicState& state) {
+                if (!error.empty()) {
+                    announcer.notice(state.text_channel_id, "❌ Playback error: " + error);
+                }
+                play_next(state, guild_id, state.text_channel_id);
+            }, false);
+        };
+        state.player = Player::create(paced_sink(guild_id), callbacks, options.player);
+        state.player->set_volume(state.volume / 100.0f);
+    }
+
+    title_index().played(guild_id, next_track->info());
+
+    // A track handed over by another worker picks up where it was
+    double start = state.resume_position;
+    state.resume_position = 0;
+    if (state.resume_paused) {
+        state.resume_paused = false;
+        state.is_paused = pause_voice(guild_id, true);
+    }
+
+    // Play the audio
+    std::shared_ptr<Player> player = state.player;
+    if ((start <= 0 && player->prepared(next_track->info().url)) || !tracks.stream_stale(next_track->info())) {
+        player->play(next_track->info().url, next_track->info().stream_url, next_track->info().codec,
+                     next_track->info().duration, start);
+    } else {
+        // Queued long enough ago that the signed stream URL has expired
+        bool queued = tracks.resolve(next_track->info().url,
+            [this, guild_id, next_track, player, start](std::vector<TrackInfoPtr> tracks, const std::string&) {
+            post(guild_id, [next_track, player, start, tracks = std::move(tracks)](GuildMusicState& current_state) {
+                if (current_state.current_track != next_track) {
+                    return; // skipped or stopped while refreshing
+                }
+                if (!tracks.empty()) {
+                    next_track->set_info(tracks.front());
+                }
+                player->play(next_track->info().url, next_track->info().stream_url, next_track->info().codec,
+                             next_track->info().duration, start);
+            });
+        });
+        if (!queued) {
+            player->play(next_track->info().url, next_track->info().stream_url, next_track->info().codec,
+                         next_track->info().duration, start);
+        }
+    }
+
+    refresh_upcoming(state);
+}
+
+void MusicBot::tune_radio(GuildMusicState& state, uint64_t guild_id, uint64_t channel_id, TrackInfoPtr info,
+                          uint64_t requester) {
+    // Tuning in ends the current track like /skip; the rest of the queue waits
+    state.leave_radio();
+    if (state.player) {
+        state.player->stop();
+    }
+    if (state.current_track) {
+        queue_store().drop_current(guild_id);
+    }
+    state.current_track = nullptr;
+    state.is_playing = false;
+    state.is_paused = false;
+
+    // Lets the ended callback tell this listener from a later one
+    auto tuned = std::make_shared<std::weak_ptr<BroadcastListener>>();
+    state.radio = broadcast_hub().join(info->url, info->stream_url, info->codec, paced_sink(guild_id),
+        [this, guild_id, tuned](const std::string& error) {
+        post(guild_id, [this, guild_id, tuned, error](GuildMusicState& state) {
+            if (!state.radio || state.radio != tuned->lock()) {
+                return;
+            }
+            uint64_t channel_id = state.text_channel_id;
+            state.leave_radio();
+            announcer.notice(channel_id, error.empty() ? "📻 The stream has ended." : "❌ Stream error: " + error);
+            if (!state.queue.empty()) {
+                play_next(state, guild_id, channel_id);
+            } else {
+                announcer.finished(guild_id, channel_id, queue_finished_view());
+            }
+        });
+    });
+    if (!state.radio) {
+        return;
+    }
+    *tuned = state.radio;
+    state.radio_info = info;
+
+    announcer.now_playing(guild_id, channel_id, track_started_view(Track(info, requester), state.loop_mode));
+    state.radio->pump();
+}
+
+void MusicBot::retune_radio(GuildMusicState& state, uint64_t guild_id, TrackInfoPtr info) {
+    bool paused = state.resume_paused;
+    state.resume_paused = false;
+    if (!tracks.stream_stale(*info)) {
+        tune_radio(state, guild_id, state.text_channel_id, info, 0);
+        if (paused && state.radio) {
+            state.is_paused = pause_voice(guild_id, true);
+        }
+        return;
+    }
+
+    // The stream URL expired while the guild was being handed over
+    tracks.resolve(info->url, [this, guild_id, paused](std::vector<TrackInfoPtr> tracks, const std::string&) {
+        if (tracks.empty()) {
+            return;
+        }
+        post(guild_id, [this, guild_id, paused, info = tracks.front()](GuildMusicState& state) {
+            if (state.radio || state.is_playing) {
+                return; // something else started meanwhile
+            }
+            tune_radio(state, guild_id, state.text_channel_id, info, 0);
+            if (paused && state.radio) {
+                state.is_paused = pause_voice(guild_id, true);
+            }
+        });
+    });
+}
+
+void MusicBot::prepare_next(GuildMusicState& state) {
+    if (!state.player) {
+        return;
+    }
+
+    TrackInfoPtr upcoming;
+    if (state.loop_mode == loop_track && state.current_track) {
+        upcoming = state.current_track->shared_info();
+    } else if (!state.queue.empty()) {
+        upcoming = state.queue.front().shared_info();
+    } else if (state.loop_mode == loop_queue && state.current_track) {
+        upcoming = state.current_track->shared_info();
+    }
+    if (!upcoming) {
+        return;
+    }
+
+    std::shared_ptr<Player> player = state.player;
+    if (!tracks.stream_stale(*upcoming)) {
+        player->prepare(upcoming->url, upcoming->stream_url, upcoming->codec, upcoming->duration);
+        return;
+    }
+
+    tracks.resolve(upcoming->url, [player, url = upcoming->url](std::vector<TrackInfoPtr> tracks, const std::string&) {
+        if (!tracks.empty()) {
+            player->prepare(url, tracks.front()->stream_url, tracks.front()->codec, tracks.front()->duration);
+        }
+    });
+}
+
+void MusicBot::refresh_upcoming(const GuildMusicState& state) {
+    int64_t play_at = std::time(nullptr);
+    if (state.current_track) {
+        play_at += state.current_track->info().duration;
+    }
+
+    state.queue.for_each(0, options.lookahead_tracks, [this, &play_at](const Track& track) {
+        // Warms the cache; play_next picks the fresh URL up from there
+        if (!track->url.empty() && tracks.stream_stale(track.info(), play_at)) {
+            tracks.resolve(track->url, [](std::vector<TrackInfoPtr>, const std::string&) {});
+        }
+        play_at += track->duration;
+    });
+}
+
+void MusicBot::import_playlist(GuildMusicState& state, const Reply& event, const std::string& url,
+                               uint64_t requester) {
+    state.text_channel_id = event->command().channel_id;
+    uint64_t guild_id = event->command().guild_id;
+    uint64_t channel_id = event->command().channel_id;
+    std::shared_ptr<std::atomic<bool>> cancelled = state.imports_cancelled;
+
+    // Entries are queued as yt-dlp lists them, without stream URLs; those are
+    // resolved once the entry nears the head of the queue (refresh_upcoming,
+    // prepare_next and play_next all treat a missing stream URL as stale)
+    auto on_entry = [this, guild_id, channel_id, requester, cancelled](TrackInfoPtr entry) {
+        if (cancelled->load()) {
+            return false;
+        }
+        post(guild_id, [this, guild_id, channel_id, requester, cancelled, entry](GuildMusicState& state) {
+            if (cancelled->load()) {
+                return;
+            }
+            Track track(entry, requester);
+            queue_store().push(guild_id, track);
+            state.queue.push_back(std::move(track));
+
+            if (!state.is_playing) {
+                play_next(state, guild_id, channel_id);
+            } else if (state.queue.size() <= options.lookahead_tracks) {
+                refresh_upcoming(state);
+            }
+        });
+        return true;
+    };
+
+    size_t max_entries = options.playlist_max_entries;
+    auto on_done = [event, cancelled, max_entries](size_t entries, const std::string& error) {
+        std::string response;
+        if (entries == 0) {
+            std::string reason = error.empty() ? "" : " (" + error + ")";
+            response = "❌ No playable tracks found in the playlist!" + reason;
+        } else {
+            response = "✅ Added " + std::to_string(entries) + " track" + (entries > 1 ? "s" : "") +
+                       " from the playlist to the queue!";
+            if (cancelled->load()) {
+                response += " (import stopped when the queue was cleared)";
+            } else if (entries >= max_entries) {
+                response += " (limit is " + std::to_string(max_entries) + ")";
+            }
+        }
+        event->edit_reply(response);
+    };
+
+    if (!tracks.resolver().submit_playlist(url, max_entries, on_entry, on_done)) {
+        event->edit_reply(kBusy);
+    }
+}
+
+MusicBot::Options music_bot_options_from_env() {
+    MusicBot::Options opts;
+    opts.worker_threads = env_size("WORKER_THREADS", std::max<size_t>(2, std::thread::hardware_concurrency()));
+    opts.lookahead_tracks = env_size("LOOKAHEAD_TRACKS", opts.lookahead_tracks);
+    opts.playlist_max_entries = env_size("PLAYLIST_MAX_ENTRIES", opts.playlist_max_entries);
+    opts.player.dsp = dsp_options_from_env();
+    opts.player.opus_passthrough = env_string("OPUS_PASSTHROUGH", "on") != "off";
+    opts.trace_path = env_string("COMMAND_TRACE_FILE");
+    opts.send = send_scheduler_options_from_env();
+    opts.idle_timeout = std::chrono::seconds(env_size("IDLE_DISCONNECT_SECONDS", opts.idle_timeout.count()));
+    opts.alone_timeout = std::chrono::seconds(env_size("ALONE_DISCONNECT_SECONDS", opts.alone_timeout.count()));
+    return opts;
+}
+
+std::string command_trace_line(const Command& command, int64_t at_ms) {
+    Json::Value root;
+    root["at_ms"] = Json::Int64(at_ms);
+    root["command"] = command.name;
+    // Snowflakes as strings, the way Discord sends them
+    root["guild_id"] = std::to_string(command.guild_id);
+    root["channel_id"] = std::to_string(command.channel_id);
+    root["user_id"] = std::to_string(command.user_id);
+    Json::Value options(Json::objectValue);
+    for (const auto& [name, value] : command.options) {
+        if (std::holds_alternative<int64_t>(value)) {
+            options[name] = Json::Int64(std::get<int64_t>(value));
+        } else {
+            options[name] = std::get<std::string>(value);
+        }
+    }
+    root["options"] = options;
+
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    return Json::writeString(builder, root);
+}
+
+bool parse_command_trace(const std::string& line, Command& command, int64_t& at_ms) {
+    Json::Value root;
+    Json::Reader reader;
+    if (line.empty() || !reader.parse(line, root) || !root.isObject() || !root["command"].isString()) {
+        return false;
+    }
+    auto snowflake = [](const Json::Value& value) -> uint64_t {
+        if (value.isString()) return std::strtoull(value.asCString(), nullptr, 10);
+        return value.isIntegral() ? value.asUInt64() : 0;
+    };
+
+    command = Command();
+    command.name = root["command"].asString();
+    command.guild_id = snowflake(root["guild_id"]);
+    command.channel_id = snowflake(root["channel_id"]);
+    command.user_id = snowflake(root["user_id"]);
+    const Json::Value& options = root["options"];
+    if (options.isObject()) {
+        for (const auto& name : options.getMemberNames()) {
+            const Json::Value& value = options[name];
+            if (value.isIntegral()) {
+                command.options[name] = static_cast<int64_t>(value.asInt64());
+            } else if (value.isString()) {
+                command.options[name] = value.asString();
+            }
+        }
+    }
+    at_ms = root["at_ms"].isIntegral() ? root["at_ms"].asInt64() : 0;
+    return true;
+}
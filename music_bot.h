@@ -0,0 +1,382 @@
+#pragma once
+
+#include "track.h"
+#include "track_queue.h"
+#include "track_cache.h"
+#include "player.h"
+#include "broadcast.h"
+#include "send_scheduler.h"
+#include "cold_store.h"
+#include "announcer.h"
+#include "queue_store.h"
+#include "scheduler.h"
+#include "guild_queue.h"
+#include "views.h"
+#include "metrics.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <array>
+#include <unordered_map>
+#include <variant>
+#include <optional>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <cstdint>
+
+// One slash command as the handlers see it
+struct Command {
+    std::string name;
+    uint64_t guild_id = 0;
+    uint64_t channel_id = 0;
+    uint64_t user_id = 0;
+    // The options the user filled in; integer options are int64_t
+    std::map<std::string, std::variant<std::string, int64_t>> options;
+    std::chrono::steady_clock::time_point received = std::chrono::steady_clock::now();
+
+    // The option's text, or `fallback` if it was left out
+    std::string text(const std::string& option, const std::string& fallback = "") const;
+    std::optional<int64_t> integer(const std::string& option) const;
+};
+
+// A command and the way back to whoever sent it; bot.cpp implements it
+// over a dpp interaction. Handlers keep it alive for as long as they may
+// still answer, so it is destroyed once the command is fully handled.
+class Interaction {
+public:
+    explicit Interaction(Command command) : request(std::move(command)) {}
+    virtual ~Interaction() = default;
+
+    const Command& command() const { return request; }
+
+    // The first response
+    virtual void reply(const std::string& text) = 0;
+    virtual void reply(const EmbedView& view) = 0;
+
+    // Replace the first response, for answers that wait on a lookup
+    virtual void edit_reply(const std::string& text) = 0;
+
+private:
+    Command request;
+};
+
+// The Discord side of voice as the handlers use it; bot.cpp implements it
+// over dpp's gateway and voice clients
+class VoiceGateway {
+public:
+    struct Lookup {
+        bool guild_found = false;
+        // Voice channel the user is in, 0 if none
+        uint64_t user_channel = 0;
+        // The bot is in, or joining, one of the guild's voice channels
+        bool joined = false;
+    };
+
+    virtual ~VoiceGateway() = default;
+
+    virtual Lookup lookup(uint64_t guild_id, uint64_t user_id) = 0;
+
+    // Join a voice channel; MusicBot::voice_ready() is expected once it is up
+    virtual void connect(uint64_t guild_id, uint64_t channel_id) = 0;
+    virtual void disconnect(uint64_t guild_id) = 0;
+
+    // Whether the connection is up and takes audio
+    virtual bool ready(uint64_t guild_id) = 0;
+
+    // Hold or release the audio already handed to the connection; false if
+    // there is no connection
+    virtual bool pause(uint64_t guild_id, bool paused) = 0;
+
+    // Where the guild's player sends audio
+    virtual std::shared_ptr<VoiceSink> sink(uint64_t guild_id) = 0;
+
+    // Users other than bots in the voice channel the bot is in; 0 if the
+    // bot is in none
+    virtual size_t listeners(uint64_t guild_id) = 0;
+};
+
+// A guild's music state on its way from one worker process to another
+// (see shard_supervisor.h). When `playing`, tracks.front() is the track
+// that was playing, `position` seconds in.
+struct GuildHandoff {
+    uint64_t guild_id = 0;
+    uint64_t text_channel_id = 0;
+    uint64_t voice_channel_id = 0;
+    int loop_mode = 0;
+    int volume = 100;
+    bool playing = false;
+    bool paused = false;
+    double position = 0;
+    std::vector<Track> tracks;
+    // Set if the guild was listening to the radio
+    TrackInfoPtr radio;
+};
+
+// Guild music state
+struct GuildMusicState {
+    IndexedQueue<Track> queue;
+    std::shared_ptr<Track> current_track = nullptr;
+    int loop_mode = loop_off; // LoopMode from guild_queue.h
+    // Percent; kept when the queue is cleared
+    int volume = 100;
+    bool is_playing = false;
+    bool is_paused = false;
+    uint64_t text_channel_id = 0;
+    // Voice channel the bot was last asked to join
+    uint64_t voice_channel_id = 0;
+    std::shared_ptr<Player> player;
+    // Set while the guild listens to a shared /radio stream; the queue waits
+    std::shared_ptr<BroadcastListener> radio;
+    TrackInfoPtr radio_info;
+    // When /play asked for a voice connection; cleared once it is ready
+    std::chrono::steady_clock::time_point voice_requested;
+    // Handed over by another worker process, applied once voice is up: the
+    // first track resumes at resume_position, or the radio is retuned
+    double resume_position = 0;
+    bool resume_paused = false;
+    TrackInfoPtr resume_radio;
+    // Since when nothing has played, and since when nobody has been in the
+    // voice channel with the bot; unset while that is not the case
+    std::chrono::steady_clock::time_point idle_since;
+    std::chrono::steady_clock::time_point alone_since;
+    // Set once the actor is dropped, by /stop, a handoff or eviction to cold
+    // storage; tasks still queued on it are passed on to whichever actor
+    // takes the guild next
+    bool retired = false;
+    // Shared with playlist imports still streaming in; set when the queue is cleared
+    std::shared_ptr<std::atomic<bool>> imports_cancelled = std::make_shared<std::atomic<bool>>(false);
+
+    void cancel_imports() {
+        imports_cancelled->store(true);
+        imports_cancelled = std::make_shared<std::atomic<bool>>(false);
+    }
+
+    void leave_radio() {
+        if (radio) radio->leave();
+        radio = nullptr;
+        radio_info = nullptr;
+    }
+
+    void clear() {
+        cancel_imports();
+        leave_radio();
+        queue.clear();
+        current_track = nullptr;
+        loop_mode = loop_off;
+        is_playing = false;
+        is_paused = false;
+        if (player) player->stop();
+    }
+};
+
+// The bot's slash commands and playback, without the Discord connection:
+// bot.cpp feeds it dpp events, the load driver in bench/ synthetic ones.
+//
+// Each guild's state belongs to an actor: a strand that runs the guild's
+// commands and callbacks one at a time, so the state itself needs no lock.
+// Actors share one work-stealing pool and run in parallel with each other.
+//
+// Only guilds in use have an actor. One that has played nothing for
+// idle_timeout, or been alone in its voice channel for alone_timeout,
+// leaves voice and is packed into the cold store; the next command for it
+// unpacks it onto a new actor. Commands that only look at state run
+// without an actor for guilds the bot knows nothing about.
+class MusicBot {
+public:
+    struct Options {
+        size_t worker_threads = 2;
+        // How many queued tracks get their stream URL refreshed ahead of time
+        size_t lookahead_tracks = 3;
+        // Most entries one /play of a playlist will add
+        size_t playlist_max_entries = 500;
+        // Loudness normalization and crossfade settings shared by every player
+        Player::Options player;
+        // Pacing of every guild's voice output
+        SendScheduler::Options send;
+        // Every command is appended here as a trace line; empty disables it
+        std::string trace_path;
+        // Leave voice and go cold after this long without playing
+        std::chrono::seconds idle_timeout{300};
+        // Leave voice and go cold this long after the last listener left
+        std::chrono::seconds alone_timeout{60};
+        // How often guilds are checked against both
+        std::chrono::seconds sweep_interval{10};
+    };
+
+    MusicBot(VoiceGateway& voice, Announcer& announcer, TrackCache& tracks, Options opts);
+    ~MusicBot();
+
+    MusicBot(const MusicBot&) = delete;
+    MusicBot& operator=(const MusicBot&) = delete;
+
+    // Handle a slash command. Returns once anything that must happen on
+    // the calling thread has; the rest runs on the guild's actor.
+    void handle(std::shared_ptr<Interaction> interaction);
+
+    // Queues from before a restart, put back before any command arrives.
+    // The tracks are moved out; the rest is left for rejoin().
+    void restore(std::vector<QueueStore::RestoredGuild>& guilds);
+
+    // Reconnect the restored guilds' voice, once the gateway is up
+    void rejoin(const std::vector<QueueStore::RestoredGuild>& guilds);
+
+    // The connection connect() asked for is up
+    void voice_ready(uint64_t guild_id);
+
+    // The guild's voice output wants more audio; top it up
+    void refill_voice(uint64_t guild_id);
+
+    // Someone joined, left or moved between the guild's voice channels
+    void voice_state_changed(uint64_t guild_id);
+
+    // Give up every guild, for a worker that is shutting down so another
+    // can take its shards: each guild is snapshotted on its actor, passed
+    // to `each` and dropped, and its voice disconnected; cold guilds are
+    // passed on as they are. `done` runs after the last one.
+    void hand_off(std::function<void(GuildHandoff)> each, std::function<void()> done);
+
+    // Take over a guild another worker handed off; playback picks up where
+    // it was once the voice connection is ready
+    void adopt(GuildHandoff guild);
+
+    // Run fn once everything already posted to the guild's actor has run;
+    // right away if the guild has no actor
+    void after(uint64_t guild_id, std::function<void()> fn);
+
+    // Guilds with an actor; cold ones are not counted
+    size_t guild_count();
+
+private:
+    struct GuildActor {
+        std::shared_ptr<Strand> strand;
+        GuildMusicState state;
+        // Queue length last added to the queued tracks gauge
+        size_t last_queued = 0;
+        // The state's idle_since and alone_since in milliseconds of the
+        // steady clock, 0 if unset, for the reaper to read
+        std::atomic<int64_t> idle_since{0};
+        std::atomic<int64_t> alone_since{0};
+    };
+
+    // The actor map is split so guild lookups rarely contend
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<uint64_t, std::shared_ptr<GuildActor>> actors;
+    };
+
+    static constexpr size_t shard_count = 64;
+
+    using Reply = std::shared_ptr<Interaction>;
+
+    Shard& shard_for(uint64_t guild_id) {
+        return shards[std::hash<uint64_t>()(guild_id) % shard_count];
+    }
+
+    // Run task on the guild's actor. A guild without one gets a new actor,
+    // unpacked from the cold store if it is there; unless `create` is
+    // false, in which case the task is dropped and false returned.
+    bool post(uint64_t guild_id, std::function<void(GuildMusicState&)> task, bool create = true);
+
+    // post() for commands: a guild with neither an actor nor a cold record
+    // gets the task run right here on blank state, and no actor
+    void post_command(uint64_t guild_id, std::function<void(GuildMusicState&)> task);
+
+    // Drop the guild's state and retire its actor, so later tasks go to a
+    // fresh one. Must run on the guild's own actor.
+    void clear_guild_state(uint64_t guild_id, GuildMusicState& state);
+
+    // The guild's state as another worker or the cold store takes it
+    GuildHandoff snapshot(uint64_t guild_id, const GuildMusicState& state);
+
+    // Check every actor for guilds gone idle or alone, every sweep_interval
+    void reap();
+    void sweep();
+
+    // Move the guild to the cold store if it is still idle or alone; runs
+    // on the guild's actor
+    void evict(uint64_t guild_id, GuildMusicState& state);
+
+    // Where the guild's player or radio sends audio: the voice connection,
+    // paced by the send scheduler
+    std::shared_ptr<VoiceSink> paced_sink(uint64_t guild_id);
+
+    // Pause or resume the guild's voice output; false if there is no connection
+    bool pause_voice(uint64_t guild_id, bool paused);
+
+    void record(const Command& command);
+
+    // Command handlers; the ones taking the state run on the guild's actor
+    void play(const Reply& event);
+    void radio(const Reply& event);
+    void skip(const Reply& event, GuildMusicState& state);
+    void stop(const Reply& event, GuildMusicState& state);
+    void pause(const Reply& event, GuildMusicState& state, bool paused);
+    void show_queue(const Reply& event, GuildMusicState& state);
+    void clear_queue(const Reply& event, GuildMusicState& state);
+    void loop(const Reply& event, GuildMusicState& state);
+    void now_playing(const Reply& event, GuildMusicState& state);
+    void remove(const Reply& event, GuildMusicState& state);
+    void move(const Reply& event, GuildMusicState& state);
+    void shuffle(const Reply& event, GuildMusicState& state);
+    void volume(const Reply& event, GuildMusicState& state);
+    void seek(const Reply& event, GuildMusicState& state);
+
+    // Play next track; these all run on the guild's actor
+    void play_next(GuildMusicState& state, uint64_t guild_id, uint64_t channel_id);
+
+    // Stop the queue and listen to the broadcast of `info`, shared with every
+    // guild tuned to the same stream
+    void tune_radio(GuildMusicState& state, uint64_t guild_id, uint64_t channel_id, TrackInfoPtr info,
+                    uint64_t requester);
+
+    // tune_radio() for a guild handed over while listening to the radio
+    void retune_radio(GuildMusicState& state, uint64_t guild_id, TrackInfoPtr info);
+
+    // Open and prebuffer whatever plays after the current track
+    void prepare_next(GuildMusicState& state);
+
+    // Refresh stream URLs that will have expired by the time their track plays
+    void refresh_upcoming(const GuildMusicState& state);
+
+    // Stream a playlist into the guild queue, entry by entry
+    void import_playlist(GuildMusicState& state, const Reply& event, const std::string& url, uint64_t requester);
+
+    VoiceGateway& voice;
+    Announcer& announcer;
+    TrackCache& tracks;
+    Options options;
+
+    WorkStealingPool pool;
+    SendScheduler sender;
+    std::array<Shard, shard_count> shards;
+    ColdStore cold;
+    Gauge& queued_tracks = metrics().gauge("musicbot_queued_tracks", "Tracks waiting in all guild queues");
+
+    std::mutex trace_mutex;
+    std::ofstream trace;
+    std::chrono::steady_clock::time_point trace_start = std::chrono::steady_clock::now();
+
+    std::mutex reaper_mutex;
+    std::condition_variable reaper_wake;
+    bool reaper_stopping = false;
+    // Last, so it starts once everything it touches exists
+    std::thread reaper;
+};
+
+// Options read from WORKER_THREADS, LOOKAHEAD_TRACKS, PLAYLIST_MAX_ENTRIES,
+// OPUS_PASSTHROUGH, COMMAND_TRACE_FILE, IDLE_DISCONNECT_SECONDS,
+// ALONE_DISCONNECT_SECONDS, the DSP settings and the voice pacing settings
+MusicBot::Options music_bot_options_from_env();
+
+// Command traces: one JSON object per line with the command and when it
+// arrived, in milliseconds from the start of the trace
+std::string command_trace_line(const Command& command, int64_t at_ms);
+
+// False if the line is not a trace line
+bool parse_command_trace(const std::string& line, Command& command, int64_t& at_ms);
@@ -0,0 +1,210 @@
+#include "ogg_opus.h"
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+namespace {
+
+constexpr size_t kPageHeaderSize = 27;
+// Largest page: header, 255 lacing values, 255 segments of 255 bytes
+constexpr size_t kMaxPageSize = kPageHeaderSize + 255 + 255 * 255;
+
+// Serial number of the streams OggOpusMuxer writes; any value will do
+constexpr uint32_t kMuxSerial = 0x4D424F54;
+
+uint32_t read_le32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+void put_le(std::vector<uint8_t>& out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+}
+
+// The Ogg page checksum: CRC-32 with polynomial 0x04c11db7, not reflected,
+// zero initial value and no final xor
+uint32_t ogg_crc(const uint8_t* data, size_t size) {
+    static const auto table = [] {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i << 24;
+            for (int k = 0; k < 8; k++) c = (c & 0x80000000u) ? (c << 1) ^ 0x04c11db7u : c << 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    uint32_t crc = 0;
+    for (size_t i = 0; i < size; i++) crc = (crc << 8) ^ table[(crc >> 24) ^ data[i]];
+    return crc;
+}
+
+} // namespace
+
+uint32_t opus_packet_samples(const uint8_t* packet, size_t size) {
+    if (size == 0) return 0;
+    uint8_t toc = packet[0];
+    unsigned config = toc >> 3;
+
+    // Frame length in 48 kHz samples: SILK 10/20/40/60 ms, hybrid 10/20 ms,
+    // CELT 2.5/5/10/20 ms
+    uint32_t frame;
+    if (config < 12) {
+        static const uint32_t silk[] = {480, 960, 1920, 2880};
+        frame = silk[config & 3];
+    } else if (config < 16) {
+        frame = (config & 1) ? 960 : 480;
+    } else {
+        frame = 120u << (config & 3);
+    }
+
+    uint32_t frames;
+    switch (toc & 3) {
+        case 0: frames = 1; break;
+        case 1:
+        case 2: frames = 2; break;
+        default:
+            if (size < 2) return 0;
+            frames = packet[1] & 0x3F;
+            break;
+    }
+    // A packet holds at most 120 ms
+    uint32_t samples = frame * frames;
+    return (frames == 0 || samples > 5760) ? 0 : samples;
+}
+
+bool OggOpusDemuxer::feed(const uint8_t* data, size_t size, std::vector<OpusPacket>& out) {
+    if (!failure.empty()) return false;
+
+    // Parse pages in place where the input holds them whole; only a page
+    // split across two reads goes through `buffer`
+    const uint8_t* p = data;
+    const uint8_t* end = data + size;
+    if (!buffer.empty()) {
+        size_t before = buffer.size();
+        buffer.insert(buffer.end(), data, end);
+        size_t used = 0;
+        while (size_t n = parse_page(buffer.data() + used, buffer.size() - used, out)) {
+            used += n;
+            if (used >= before) break;
+        }
+        if (!failure.empty()) return false;
+        if (used < before) {
+            // Still no whole page
+            buffer.erase(buffer.begin(), buffer.begin() + used);
+            if (buffer.size() > kMaxPageSize) {
+                failure = "not an Ogg stream";
+                return false;
+            }
+            return true;
+        }
+        p = data + (used - before);
+        buffer.clear();
+    }
+
+    while (p < end) {
+        size_t n = parse_page(p, static_cast<size_t>(end - p), out);
+        if (!failure.empty()) return false;
+        if (n == 0) break;
+        p += n;
+    }
+    buffer.assign(p, end);
+    return true;
+}
+
+size_t OggOpusDemuxer::parse_page(const uint8_t* page, size_t size, std::vector<OpusPacket>& out) {
+    if (size < kPageHeaderSize) return 0;
+    if (std::memcmp(page, "OggS", 4) != 0 || page[4] != 0) {
+        failure = "not an Ogg stream";
+        return 0;
+    }
+    size_t segments = page[26];
+    if (size < kPageHeaderSize + segments) return 0;
+    const uint8_t* lacing = page + kPageHeaderSize;
+    size_t body = 0;
+    for (size_t i = 0; i < segments; i++) body += lacing[i];
+    size_t total = kPageHeaderSize + segments + body;
+    if (size < total) return 0;
+
+    uint32_t page_serial = read_le32(page + 14);
+    if (!have_serial) {
+        have_serial = true;
+        serial = page_serial;
+    } else if (page_serial != serial) {
+        return total; // another logical stream
+    }
+
+    // A page that does not continue a packet drops any leftover piece
+    bool continued = page[5] & 0x01;
+    if (!continued) partial.clear();
+
+    const uint8_t* data = page + kPageHeaderSize + segments;
+    size_t start = 0;
+    size_t length = 0;
+    for (size_t i = 0; i < segments; i++) {
+        length += lacing[i];
+        if (lacing[i] == 255) continue;
+        partial.insert(partial.end(), data + start, data + start + length);
+        start += length;
+        length = 0;
+        if (!packet_done(out)) return 0;
+    }
+    // The last packet goes on in the next page
+    partial.insert(partial.end(), data + start, data + start + length);
+    return total;
+}
+
+bool OggOpusDemuxer::packet_done(std::vector<OpusPacket>& out) {
+    if (headers_seen == 0) {
+        if (partial.size() < 19 || std::memcmp(partial.data(), "OpusHead", 8) != 0) {
+            failure = "not an Opus stream";
+            return false;
+        }
+        headers_seen++;
+    } else if (headers_seen == 1) {
+        headers_seen++; // OpusTags
+    } else if (uint32_t samples = opus_packet_samples(partial.data(), partial.size())) {
+        out.push_back(OpusPacket(std::move(partial), samples));
+    }
+    partial.clear();
+    return true;
+}
+
+void OggOpusMuxer::headers(uint16_t pre_skip, std::vector<uint8_t>& out) {
+    // RFC 7845 section 5: version 1, stereo, 48 kHz, no gain, mapping family 0
+    std::vector<uint8_t> head = {'O', 'p', 'u', 's', 'H', 'e', 'a', 'd', 1, 2};
+    put_le(head, pre_skip, 2);
+    put_le(head, 48000, 4);
+    put_le(head, 0, 2);
+    head.push_back(0);
+    page(head.data(), head.size(), 0x02, out);
+
+    std::vector<uint8_t> tags = {'O', 'p', 'u', 's', 'T', 'a', 'g', 's'};
+    static const char vendor[] = "musicbot";
+    put_le(tags, sizeof(vendor) - 1, 4);
+    tags.insert(tags.end(), vendor, vendor + sizeof(vendor) - 1);
+    put_le(tags, 0, 4);
+    page(tags.data(), tags.size(), 0, out);
+    // Granule positions count the skipped samples too
+    granule = pre_skip;
+}
+
+void OggOpusMuxer::packet(const uint8_t* data, size_t size, uint32_t samples, std::vector<uint8_t>& out) {
+    granule += samples;
+    page(data, size, 0, out);
+}
+
+void OggOpusMuxer::page(const uint8_t* data, size_t size, uint8_t flags, std::vector<uint8_t>& out) {
+    // An Opus packet is at most 61440 bytes, well within one page
+    size_t start = out.size();
+    out.insert(out.end(), {'O', 'g', 'g', 'S', 0, flags});
+    put_le(out, granule, 8);
+    put_le(out, kMuxSerial, 4);
+    put_le(out, sequence++, 4);
+    put_le(out, 0, 4); // checksum, filled in below
+    out.push_back(static_cast<uint8_t>(size / 255 + 1));
+    out.insert(out.end(), size / 255, 255);
+    out.push_back(static_cast<uint8_t>(size % 255));
+    out.insert(out.end(), data, data + size);
+
+    uint32_t crc = ogg_crc(out.data() + start, out.size() - start);
+    for (int i = 0; i < 4; i++) out[start + 22 + i] = static_cast<uint8_t>(crc >> (8 * i));
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+// One Opus packet as it goes to the voice connection. The bytes are either
+// the packet's own or lie in memory that `owner` keeps alive, such as a
+// mapped audio cache file, so cached audio is handed out without a copy.
+struct OpusPacket {
+    OpusPacket() = default;
+    OpusPacket(std::vector<uint8_t> bytes, uint32_t samples)
+        : samples(samples), storage(std::move(bytes)) {
+        data = storage.data();
+        size = storage.size();
+    }
+    OpusPacket(const uint8_t* data, size_t size, uint32_t samples, std::shared_ptr<const void> owner)
+        : data(data), size(size), samples(samples), owner(std::move(owner)) {}
+
+    // Moving a vector keeps its buffer, so `data` stays valid; a copy would not
+    OpusPacket(OpusPacket&&) noexcept = default;
+    OpusPacket& operator=(OpusPacket&&) noexcept = default;
+    OpusPacket(const OpusPacket&) = delete;
+    OpusPacket& operator=(const OpusPacket&) = delete;
+
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+    // Duration in samples per channel at 48 kHz
+    uint32_t samples = 0;
+
+private:
+    std::vector<uint8_t> storage;
+    std::shared_ptr<const void> owner;
+};
+
+// Samples per channel at 48 kHz that an Opus packet decodes to, read from
+// its TOC byte (RFC 6716 section 3.1); 0 if the packet is malformed
+uint32_t opus_packet_samples(const uint8_t* packet, size_t size);
+
+// Splits an Ogg Opus stream (RFC 7845) into Opus packets without decoding.
+//
+// Bytes are fed in whatever pieces they arrive in. Pages are parsed where
+// they lie in the input buffer and each packet's bytes are copied once,
+// straight into the packet handed out. The OpusHead and OpusTags headers
+// are checked and dropped; only the first logical stream is followed.
+class OggOpusDemuxer {
+public:
+    // Append every complete audio packet in `data` to `out`. Returns false
+    // once the stream turned out not to be Ogg Opus; see error().
+    bool feed(const uint8_t* data, size_t size, std::vector<OpusPacket>& out);
+
+    const std::string& error() const { return failure; }
+
+private:
+    // Parse one page at the start of `buffer`; returns bytes used, 0 if incomplete
+    size_t parse_page(const uint8_t* page, size_t size, std::vector<OpusPacket>& out);
+    bool packet_done(std::vector<OpusPacket>& out);
+
+    std::vector<uint8_t> buffer;
+    // Packet continued from the previous page
+    std::vector<uint8_t> partial;
+    bool have_serial = false;
+    uint32_t serial = 0;
+    int headers_seen = 0;
+    std::string failure;
+};
+
+// Writes Opus packets out as an Ogg Opus stream, one packet per page so a
+// decoder reading it sees each packet as soon as it is written. Used to
+// feed cached packets to ffmpeg.
+class OggOpusMuxer {
+public:
+    // The OpusHead and OpusTags pages. pre_skip is the number of samples
+    // the decoder drops at the start: 312 at the start of a track, as
+    // libopus encodes it, 0 when starting partway in.
+    void headers(uint16_t pre_skip, std::vector<uint8_t>& out);
+
+    void packet(const uint8_t* data, size_t size, uint32_t samples, std::vector<uint8_t>& out);
+
+private:
+    void page(const uint8_t* data, size_t size, uint8_t flags, std::vector<uint8_t>& out);
+
+    uint32_t sequence = 0;
+    uint64_t granule = 0;
+};
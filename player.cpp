@@ -0,0 +1,487 @@
+#include "player.h"
+#include "metrics.h"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+constexpr double kFrameSeconds = 0.02;
+constexpr double kSampleRate = AudioSource::kSampleRate;
+
+struct PlayerMetrics {
+    Histogram& gap = metrics().histogram("musicbot_transition_gap_seconds",
+                                         "Silence between the end of one track and the first frame of the next");
+    Counter& started = metrics().counter("musicbot_tracks_started_total", "Tracks started",
+                                         "prebuffered=\"false\"");
+    Counter& started_prebuffered = metrics().counter("musicbot_tracks_started_total", "Tracks started",
+                                                     "prebuffered=\"true\"");
+    Counter& errors = metrics().counter("musicbot_playback_errors_total",
+                                        "Tracks that ended because the decoder failed");
+    Counter& crossfades = metrics().counter("musicbot_crossfades_total", "Transitions made with a crossfade");
+    Histogram& dsp = metrics().histogram("musicbot_dsp_frame_seconds", "DSP time spent on one 20 ms frame", "",
+                                         {2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 1e-3});
+    // Unitless, but kept in a histogram so the two paths can be compared
+    // by distribution as well as by mean
+    Histogram& cpu_transcode = metrics().histogram(
+        "musicbot_stream_cpu_ratio", "CPU time per second of audio for tracks played to the end (ffmpeg and in process)",
+        "path=\"transcode\"", {0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25});
+    Histogram& cpu_passthrough = metrics().histogram(
+        "musicbot_stream_cpu_ratio", "CPU time per second of audio for tracks played to the end (ffmpeg and in process)",
+        "path=\"passthrough\"", {0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25});
+    Counter& passthrough = metrics().counter("musicbot_tracks_path_total", "Tracks started per audio path",
+                                             "path=\"passthrough\"");
+    Counter& transcode = metrics().counter("musicbot_tracks_path_total", "Tracks started per audio path",
+                                           "path=\"transcode\"");
+    Counter& switched = metrics().counter("musicbot_passthrough_switches_total",
+                                          "Passthrough tracks switched to decoding by a volume change");
+    Counter& seeks = metrics().counter("musicbot_seeks_total", "Tracks restarted at another position");
+    Counter& reencoded = metrics().counter("musicbot_bitrate_switches_total",
+                                           "Passthrough tracks reopened at another bitrate for a congested connection");
+};
+
+PlayerMetrics& player_metrics() {
+    static PlayerMetrics m;
+    return m;
+}
+
+} // namespace
+
+std::shared_ptr<Player> Player::create(std::shared_ptr<VoiceSink> sink, Callbacks callbacks,
+                                       Options opts) {
+    return std::shared_ptr<Player>(new Player(std::move(sink), std::move(callbacks), opts));
+}
+
+Player::Player(std::shared_ptr<VoiceSink> sink, Callbacks callbacks, Options opts)
+    : sink(std::move(sink)), callbacks(std::move(callbacks)), options(opts),
+      crossfade_frames(static_cast<uint64_t>(opts.dsp.crossfade.count() / 20)) {}
+
+Player::~Player() {
+    if (current) current->stop();
+    if (next) next->stop();
+    if (fading) fading->stop();
+}
+
+void Player::watch(const std::shared_ptr<AudioSource>& source) {
+    // Wake the player when a stalled source produces data again
+    std::weak_ptr<Player> weak = shared_from_this();
+    source->set_on_readable([weak] {
+        if (auto player = weak.lock()) player->pump();
+    });
+}
+
+AudioSource::Format Player::choose_format(const std::string& key, const std::string& codec) const {
+    bool untouched = volume == 1.0f && crossfade_frames == 0 && level_is_neutral(key, options.dsp);
+    if (options.opus_passthrough && codec == "opus" && untouched && sink->accepts_opus()) {
+        return AudioSource::Format::opus;
+    }
+    return AudioSource::Format::pcm;
+}
+
+// The current source now starts `seconds` into the track
+void Player::restart_at(double seconds) {
+    track_offset = seconds;
+    samples_sent = 0;
+    track_cpu = std::chrono::nanoseconds(0);
+}
+
+// Reopen the current Opus track as PCM where the sent audio ends; returns
+// the old source for the caller to stop
+std::shared_ptr<AudioSource> Player::switch_to_pcm() {
+    double position = sent_seconds();
+    auto pcm = AudioSource::create(current_stream, options.playing_buffer_frames, AudioSource::Format::pcm, position);
+    pcm->start();
+    watch(pcm);
+    std::shared_ptr<AudioSource> old = std::move(current);
+    current = std::move(pcm);
+    restart_at(position);
+    // Passthrough played at unity; ramp from there
+    applied_gain = 1.0f;
+    player_metrics().switched.inc();
+    return old;
+}
+
+// Reopen the current Opus track at another bitrate where the sent audio
+// ends; returns the old source, for the caller to stop
+std::shared_ptr<AudioSource> Player::reencode(int bitrate) {
+    double position = sent_seconds();
+    current_stream.bitrate = bitrate;
+    auto source = AudioSource::create(current_stream, options.playing_buffer_frames, AudioSource::Format::opus,
+                                      position);
+    source->start();
+    watch(source);
+    std::shared_ptr<AudioSource> old = std::move(current);
+    current = std::move(source);
+    restart_at(position);
+    player_metrics().reencoded.inc();
+    return old;
+}
+
+void Player::first_audio() {
+    if (!gap_pending) return;
+    // Silence is whatever time passed after the sink ran dry
+    auto now = std::chrono::steady_clock::now();
+    auto gap = now > drain_at
+        ? std::chrono::duration_cast<std::chrono::milliseconds>(now - drain_at)
+        : std::chrono::milliseconds(0);
+    counters.last_gap = gap;
+    counters.total_gap_ms += gap.count();
+    counters.transitions++;
+    player_metrics().gap.observe(gap);
+    gap_pending = false;
+}
+
+void Player::report_cpu(const AudioSource& source, uint64_t samples, std::chrono::nanoseconds in_process) {
+    auto decoder = source.decoder_cpu();
+    double audio = samples / kSampleRate;
+    // The decoder's time is only known once it has exited
+    if (decoder.count() == 0 || audio < 1.0) return;
+    double cpu = std::chrono::duration<double>(decoder + in_process).count();
+    Histogram& histogram = source.format() == AudioSource::Format::opus ? player_metrics().cpu_passthrough
+                                                                        : player_metrics().cpu_transcode;
+    histogram.observe(std::chrono::duration<double>(cpu / audio));
+}
+
+void Player::end_level(bool played_to_end) {
+    if (level) level->finish(played_to_end);
+    level.reset();
+}
+
+void Player::play(const std::string& key, const std::string& stream_url, const std::string& codec,
+                  int track_duration, double start_seconds) {
+    std::shared_ptr<AudioSource> old;
+    std::shared_ptr<AudioSource> unused;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (handed_over && current && current_key == key) {
+            // Already playing: the crossfade started it
+            handed_over = false;
+            duration = track_duration;
+            current_stream.duration = track_duration;
+            level->set_duration(track_duration);
+            return;
+        }
+        handed_over = false;
+        old = std::move(current);
+        end_level(false);
+
+        // A playlist entry is queued without its stream; the source prepared
+        // for it was opened from a freshly resolved one
+        AudioSource::Stream stream{stream_url, codec, key, track_duration, 0};
+        bool have_prepared = next && next_key == key;
+        if (have_prepared) {
+            stream.url = next->input().url;
+            stream.codec = next->input().codec;
+        }
+
+        // A prepared source is only good if the DSP stage still wants its format
+        AudioSource::Format format = choose_format(key, stream.codec);
+        int bitrate = format == AudioSource::Format::opus ? sink->opus_bitrate() : 0;
+        if (start_seconds <= 0 && have_prepared && next->format() == format && next->bitrate() == bitrate) {
+            current = std::move(next);
+            // Reopened from what the source plays, not what the caller had
+            current_stream = current->input();
+            counters.prebuffered_transitions++;
+            player_metrics().started_prebuffered.inc();
+        } else {
+            player_metrics().started.inc();
+            unused = std::move(next);
+            stream.bitrate = bitrate;
+            current_stream = stream;
+            current = AudioSource::create(current_stream, options.playing_buffer_frames, format,
+                                          std::max(0.0, start_seconds));
+            current->start();
+        }
+        (format == AudioSource::Format::opus ? player_metrics().passthrough : player_metrics().transcode).inc();
+        next_key.clear();
+        current_key = key;
+
+        current->set_max_buffered(options.playing_buffer_frames);
+        watch(current);
+        duration = track_duration;
+        restart_at(std::max(0.0, start_seconds));
+        near_end_sent = false;
+        level = std::make_unique<TrackLevel>(key, track_duration, options.dsp);
+        applied_gain = volume * level->gain();
+    }
+
+    if (old) old->stop();
+    if (unused) unused->stop();
+    pump();
+}
+
+void Player::prepare(const std::string& key, const std::string& stream_url, const std::string& codec,
+                     int track_duration) {
+    std::shared_ptr<AudioSource> old;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (next && next_key == key) return;
+
+        old = std::move(next);
+        AudioSource::Format format = choose_format(key, codec);
+        int bitrate = format == AudioSource::Format::opus ? sink->opus_bitrate() : 0;
+        next = AudioSource::create({stream_url, codec, key, track_duration, bitrate}, options.prebuffer_frames,
+                                   format);
+        next->start();
+        next_key = key;
+    }
+    if (old) old->stop();
+}
+
+bool Player::prepared(const std::string& key) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return next && next_key == key;
+}
+
+void Player::process(AudioSource::Frame& frame, std::shared_ptr<AudioSource>& faded) {
+    auto started = std::chrono::steady_clock::now();
+
+    float gain = volume * level->process(frame.data(), frame.size());
+    apply_gain(frame.data(), frame.size(), applied_gain, gain);
+    applied_gain = gain;
+
+    if (fading) {
+        // Equal-power curves, ramped within each frame. A stalled outgoing
+        // track just leaves a gap in its half of the mix.
+        constexpr float quarter_turn = 1.5707963f;
+        float t0 = static_cast<float>(fade_position) / crossfade_frames;
+        float t1 = static_cast<float>(fade_position + 1) / crossfade_frames;
+        float in_from = std::sin(t0 * quarter_turn);
+        float in_to = std::sin(t1 * quarter_turn);
+        AudioSource::Frame tail;
+        if (fading->read_frame(tail) && tail.size() == frame.size()) {
+            float out = volume * fading_level->gain();
+            mix_ramp(frame.data(), tail.data(), frame.size(), in_from, in_to,
+                     out * std::cos(t0 * quarter_turn), out * std::cos(t1 * quarter_turn));
+        } else {
+            apply_gain(frame.data(), frame.size(), in_from, in_to);
+        }
+        fade_position++;
+        if (fade_position >= crossfade_frames || fading->finished()) {
+            report_cpu(*fading, fading_samples, fading_cpu);
+            fading_level->finish(true);
+            fading_level.reset();
+            faded = std::move(fading);
+        }
+    }
+
+    player_metrics().dsp.observe_since(started);
+}
+
+bool Player::start_crossfade() {
+    if (crossfade_frames == 0 || fading || !next || duration <= 0 ||
+        sent_seconds() + crossfade_frames * kFrameSeconds < duration ||
+        next->format() != AudioSource::Format::pcm || next->buffered_frames() == 0) {
+        return false;
+    }
+
+    fading = std::move(current);
+    fading_level = std::move(level);
+    fading_samples = samples_sent;
+    fading_cpu = track_cpu;
+    fade_position = 0;
+
+    current = std::move(next);
+    current_key = std::move(next_key);
+    current_stream = current->input();
+    next_key.clear();
+    current->set_max_buffered(options.playing_buffer_frames);
+    watch(current);
+    // Unknown until play() confirms the track
+    duration = 0;
+    restart_at(0);
+    near_end_sent = false;
+    handed_over = true;
+    level = std::make_unique<TrackLevel>(current_key, 0, options.dsp);
+    applied_gain = volume * level->gain();
+
+    counters.transitions++;
+    counters.prebuffered_transitions++;
+    counters.last_gap = std::chrono::milliseconds(0);
+    player_metrics().gap.observe(std::chrono::nanoseconds(0));
+    player_metrics().started_prebuffered.inc();
+    player_metrics().crossfades.inc();
+    player_metrics().transcode.inc();
+    return true;
+}
+
+void Player::pump() {
+    bool fire_near_end = false;
+    bool fire_ended = false;
+    std::string error;
+    std::shared_ptr<AudioSource> done;
+    std::shared_ptr<AudioSource> faded;
+    std::shared_ptr<AudioSource> replaced;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!current || !sink->ready()) return;
+
+        double buffered = sink->buffered_seconds();
+        if (current->format() == AudioSource::Format::opus) {
+            int bitrate = sink->opus_bitrate();
+            if (bitrate != current->bitrate()) {
+                replaced = reencode(bitrate);
+            }
+            OpusPacket packet;
+            while (buffered < options.target_buffer && current->read_packet(packet)) {
+                first_audio();
+                auto started = std::chrono::steady_clock::now();
+                sink->send_opus(packet.data, packet.size, packet.samples);
+                track_cpu += std::chrono::steady_clock::now() - started;
+                samples_sent += packet.samples;
+                buffered += packet.samples / kSampleRate;
+            }
+        } else {
+            AudioSource::Frame frame;
+            while (buffered < options.target_buffer && current->read_frame(frame)) {
+                first_audio();
+                auto started = std::chrono::steady_clock::now();
+                process(frame, faded);
+                sink->send_pcm(frame.data(), frame.size());
+                track_cpu += std::chrono::steady_clock::now() - started;
+                samples_sent += AudioSource::kFrameSamples;
+                buffered += kFrameSeconds;
+
+                if (start_crossfade()) {
+                    fire_ended = true;
+                }
+            }
+        }
+
+        double position = sent_seconds();
+        if (!near_end_sent && duration > 0 &&
+            position + options.prepare_lead.count() >= duration) {
+            near_end_sent = true;
+            fire_near_end = true;
+        }
+
+        if (!fire_ended && current->finished()) {
+            error = current->error();
+            if (!error.empty()) player_metrics().errors.inc();
+            auto remaining = std::chrono::duration<double>(buffered > 0 ? buffered : 0);
+            drain_at = std::chrono::steady_clock::now() +
+                std::chrono::duration_cast<std::chrono::steady_clock::duration>(remaining);
+            gap_pending = true;
+            done = std::move(current);
+            if (error.empty()) report_cpu(*done, samples_sent, track_cpu);
+            end_level(error.empty());
+            if (fading) {
+                fading_level.reset();
+                faded = std::move(fading);
+            }
+            fire_ended = true;
+        }
+
+        if (done) {
+            sink->feed(VoiceSink::Feed::idle);
+        } else {
+            sink->feed(buffered < options.target_buffer ? VoiceSink::Feed::starved : VoiceSink::Feed::flowing);
+        }
+    }
+
+    if (done) done->stop();
+    if (faded) faded->stop();
+    if (replaced) replaced->stop();
+    if (fire_near_end && callbacks.near_end) callbacks.near_end();
+    if (fire_ended && callbacks.ended) callbacks.ended(error);
+}
+
+void Player::skip() {
+    std::shared_ptr<AudioSource> old;
+    std::shared_ptr<AudioSource> faded;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!current) return;
+        old = std::move(current);
+        end_level(false);
+        handed_over = false;
+        faded = std::move(fading);
+        fading_level.reset();
+        sink->clear();
+        sink->feed(VoiceSink::Feed::idle);
+        drain_at = std::chrono::steady_clock::now();
+        gap_pending = true;
+    }
+    old->stop();
+    if (faded) faded->stop();
+    if (callbacks.ended) callbacks.ended("");
+}
+
+void Player::stop() {
+    std::shared_ptr<AudioSource> old;
+    std::shared_ptr<AudioSource> unused;
+    std::shared_ptr<AudioSource> faded;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        old = std::move(current);
+        unused = std::move(next);
+        faded = std::move(fading);
+        next_key.clear();
+        end_level(false);
+        fading_level.reset();
+        handed_over = false;
+        gap_pending = false;
+        sink->clear();
+        sink->feed(VoiceSink::Feed::idle);
+    }
+    if (old) old->stop();
+    if (unused) unused->stop();
+    if (faded) faded->stop();
+}
+
+void Player::set_volume(float new_volume) {
+    std::shared_ptr<AudioSource> old;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        volume = new_volume;
+        if (current && current->format() == AudioSource::Format::opus && volume != 1.0f) {
+            old = switch_to_pcm();
+        }
+    }
+    if (old) old->stop();
+}
+
+bool Player::seek(double seconds, const std::string& stream_url) {
+    std::shared_ptr<AudioSource> old;
+    std::shared_ptr<AudioSource> faded;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!current) return false;
+        if (!stream_url.empty()) current_stream.url = stream_url;
+        if (seconds < 0) seconds = 0;
+
+        auto source = AudioSource::create(current_stream, options.playing_buffer_frames, current->format(), seconds);
+        source->start();
+        watch(source);
+        old = std::move(current);
+        current = std::move(source);
+        restart_at(seconds);
+        near_end_sent = false;
+
+        // Whatever the sink holds is from before the seek
+        faded = std::move(fading);
+        fading_level.reset();
+        sink->clear();
+        player_metrics().seeks.inc();
+    }
+    if (old) old->stop();
+    if (faded) faded->stop();
+    pump();
+    return true;
+}
+
+double Player::position() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!current) return 0;
+    return std::max(track_offset, sent_seconds() - sink->buffered_seconds());
+}
+
+bool Player::active() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return current != nullptr;
+}
+
+Player::Stats Player::stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
@@ -0,0 +1,191 @@
+#pragma once
+
+#include "audio_source.h"
+#include "dsp.h"
+#include <string>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+
+// Where decoded audio goes; bot.cpp implements it over the dpp voice client
+class VoiceSink {
+public:
+    virtual ~VoiceSink() = default;
+
+    // False while the voice connection is down; nothing is sent meanwhile
+    virtual bool ready() = 0;
+
+    // Queue one frame of interleaved 48 kHz stereo PCM
+    virtual void send_pcm(const int16_t* samples, size_t count) = 0;
+
+    // Whether send_opus() may be used instead of encoding PCM
+    virtual bool accepts_opus() = 0;
+
+    // Queue one Opus packet as is; `samples` is its length at 48 kHz
+    virtual void send_opus(const uint8_t* packet, size_t size, uint32_t samples) = 0;
+
+    // Seconds of audio queued in the sink but not yet sent
+    virtual double buffered_seconds() = 0;
+
+    // Drop everything queued
+    virtual void clear() = 0;
+
+    // Whether the sender has more audio coming: `starved` while its source
+    // has nothing buffered, `idle` once it has nothing to play. Lets a
+    // paced sink tell a slow fetch from a slow pump.
+    enum class Feed { flowing, starved, idle };
+    virtual void feed(Feed) {}
+
+    // Bitrate in kbps Opus streams should be re-encoded at to ease a
+    // congested connection; 0 sends them as they are
+    virtual int opus_bitrate() { return 0; }
+};
+
+// Feeds one guild's voice connection from an AudioSource.
+//
+// The sink is topped up to a small target buffer each time pump() runs, so
+// the decoder never runs far ahead of playback. Shortly before the current
+// track ends the player asks for the next one; prepare() opens and
+// prebuffers it so that play() can switch over without waiting on ffmpeg.
+//
+// Every frame passes through the DSP stage on its way to the sink: loudness
+// normalization and the guild's volume, and with a crossfade configured the
+// prepared track is started early and mixed over the end of the current one.
+//
+// An Opus stream skips all of that when the DSP stage would leave it as it
+// is: its packets go to the sink without being decoded and re-encoded. A
+// volume change mid-track switches such a track over to decoding, and one
+// whose sink asks for a lower bitrate is re-encoded from where it is.
+class Player : public std::enable_shared_from_this<Player> {
+public:
+    struct Options {
+        // Seconds of audio kept queued in the sink
+        double target_buffer = 1.0;
+        // Ask for the next track this long before the current one ends
+        std::chrono::seconds prepare_lead{15};
+        // Frames decoded ahead for a prepared track (150 = 3 s)
+        size_t prebuffer_frames = 150;
+        // Frames decoded ahead while playing
+        size_t playing_buffer_frames = 500;
+        DspOptions dsp;
+        // Forward Opus streams without decoding when the DSP stage allows it
+        bool opus_passthrough = true;
+    };
+
+    struct Callbacks {
+        // The current track is close to its end; time to prepare() the next
+        std::function<void()> near_end;
+        // The current track finished, failed or was skipped. With crossfades
+        // this fires as the prepared track fades in; play() it as usual.
+        std::function<void(const std::string& error)> ended;
+    };
+
+    struct Stats {
+        uint64_t transitions = 0;
+        uint64_t prebuffered_transitions = 0;
+        uint64_t total_gap_ms = 0;
+        std::chrono::milliseconds last_gap{0};
+    };
+
+    static std::shared_ptr<Player> create(std::shared_ptr<VoiceSink> sink, Callbacks callbacks,
+                                          Options opts);
+    ~Player();
+
+    Player(const Player&) = delete;
+    Player& operator=(const Player&) = delete;
+
+    // Start a track, reusing the prepared source if it was prepared for
+    // `key`. codec is the stream's audio codec as yt-dlp reports it. A
+    // track prepared for `key` plays from the stream it was prepared with,
+    // so stream_url and codec may be empty then. start_seconds picks a
+    // track up partway, as after a handoff.
+    void play(const std::string& key, const std::string& stream_url, const std::string& codec, int duration,
+              double start_seconds = 0);
+
+    // Open and prebuffer the track expected to play next
+    void prepare(const std::string& key, const std::string& stream_url, const std::string& codec, int duration);
+    bool prepared(const std::string& key) const;
+
+    // Move frames from the current source into the sink
+    void pump();
+
+    // End the current track now; fires the ended callback
+    void skip();
+
+    // Drop the current and prepared tracks without any callback
+    void stop();
+
+    // 1.0 is unchanged; the change is ramped over the next frame
+    void set_volume(float volume);
+
+    // Restart the current track `seconds` in. ffmpeg seeks the input, so
+    // the audio before that point is not fetched. stream_url replaces the
+    // track's URL if not empty (for one that has expired). False if
+    // nothing is playing.
+    bool seek(double seconds, const std::string& stream_url = "");
+
+    // Seconds into the current track that is being heard now: the audio
+    // handed to the sink, less what it still holds. Stands still while
+    // the sink is paused.
+    double position() const;
+
+    bool active() const;
+    Stats stats() const;
+
+private:
+    Player(std::shared_ptr<VoiceSink> sink, Callbacks callbacks, Options opts);
+
+    void watch(const std::shared_ptr<AudioSource>& source);
+    AudioSource::Format choose_format(const std::string& key, const std::string& codec) const;
+    double sent_seconds() const { return track_offset + samples_sent / static_cast<double>(AudioSource::kSampleRate); }
+    void restart_at(double seconds);
+    std::shared_ptr<AudioSource> switch_to_pcm();
+    std::shared_ptr<AudioSource> reencode(int bitrate);
+    void first_audio();
+    void report_cpu(const AudioSource& source, uint64_t samples, std::chrono::nanoseconds in_process);
+    void process(AudioSource::Frame& frame, std::shared_ptr<AudioSource>& faded);
+    bool start_crossfade();
+    void end_level(bool played_to_end);
+
+    std::shared_ptr<VoiceSink> sink;
+    Callbacks callbacks;
+    Options options;
+
+    mutable std::mutex mutex;
+    std::shared_ptr<AudioSource> current;
+    std::shared_ptr<AudioSource> next;
+    std::string current_key;
+    AudioSource::Stream current_stream;
+    std::string next_key;
+    int duration = 0;
+    // Where the current source started in the track (after a seek or a
+    // switch to decoding), and what it has sent since, at 48 kHz
+    double track_offset = 0;
+    uint64_t samples_sent = 0;
+    bool near_end_sent = false;
+    // Time the current track spent in this process: DSP and the sink
+    std::chrono::nanoseconds track_cpu{0};
+
+    // DSP state: the current track's normalization, and the gain that went
+    // out with the last frame, so changes ramp from there
+    std::unique_ptr<TrackLevel> level;
+    float volume = 1.0f;
+    float applied_gain = 1.0f;
+
+    // The track fading out under the current one during a crossfade
+    std::shared_ptr<AudioSource> fading;
+    std::unique_ptr<TrackLevel> fading_level;
+    uint64_t crossfade_frames = 0;
+    uint64_t fade_position = 0;
+    uint64_t fading_samples = 0;
+    std::chrono::nanoseconds fading_cpu{0};
+    // current was started by a crossfade; the play() that follows keeps it
+    bool handed_over = false;
+
+    // Set when a track ends: the moment the sink will have played it out
+    bool gap_pending = false;
+    std::chrono::steady_clock::time_point drain_at;
+    Stats counters;
+};
@@ -0,0 +1,696 @@
+#include "queue_store.h"
+#include "env.h"
+#include "guild_queue.h"
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// Journal records are [u32 payload size][u32 crc32][payload]; the payload
+// starts with the op and the guild id. Everything is little-endian.
+enum Op : uint8_t {
+    op_push = 1,
+    op_remove,
+    op_move,
+    op_shuffle,
+    op_clear,
+    op_reset,
+    op_loop,
+    op_advance,
+    op_channels,
+    // Process restart: every guild's current track goes back to the queue head
+    op_restart,
+    // The current track was given up without anything taking its place
+    op_drop,
+};
+
+constexpr size_t kRecordHeader = 8;
+
+// Snapshot layout, all sections 8-byte aligned:
+//   SnapshotHeader
+//   SnapshotGuild[guild_count]  (tracks [first_track, first_track + track_count))
+//   SnapshotInfo[info_count]    (TrackInfo shared between tracks)
+//   SnapshotTrack[track_count]
+//   char strings[strings_size]
+constexpr char kSnapshotMagic[8] = {'M', 'B', 'Q', 'S', 'N', 'A', 'P', '1'};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint64_t generation;
+    uint64_t guild_count;
+    uint64_t info_count;
+    uint64_t track_count;
+    uint64_t strings_size;
+    // Over everything after the header
+    uint32_t crc;
+    uint32_t reserved;
+};
+
+struct SnapshotGuild {
+    uint64_t guild_id;
+    uint64_t text_channel_id;
+    uint64_t voice_channel_id;
+    uint32_t loop_mode;
+    uint32_t first_track;
+    uint32_t track_count;
+    uint32_t reserved;
+};
+
+struct SnapshotString {
+    uint32_t offset;
+    uint32_t size;
+};
+
+struct SnapshotInfo {
+    SnapshotString title;
+    SnapshotString url;
+    SnapshotString thumbnail;
+    int32_t duration;
+    uint32_t reserved;
+};
+
+struct SnapshotTrack {
+    uint64_t requester;
+    uint32_t info;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(SnapshotHeader) == 56, "snapshot layout");
+static_assert(sizeof(SnapshotGuild) == 40, "snapshot layout");
+static_assert(sizeof(SnapshotInfo) == 32, "snapshot layout");
+static_assert(sizeof(SnapshotTrack) == 16, "snapshot layout");
+
+// CRC-32 (IEEE), eight bytes per step; snapshots run to megabytes
+uint32_t crc32(const char* data, size_t size) {
+    static const auto tables = [] {
+        std::array<std::array<uint32_t, 256>, 8> t{};
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            t[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; i++) {
+            for (int k = 1; k < 8; k++) t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+        }
+        return t;
+    }();
+
+    uint32_t crc = 0xffffffffu;
+    const auto* p = reinterpret_cast<const uint8_t*>(data);
+    for (; size >= 8; size -= 8, p += 8) {
+        uint32_t lo, hi;
+        std::memcpy(&lo, p, 4);
+        std::memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = tables[7][lo & 0xff] ^ tables[6][(lo >> 8) & 0xff] ^ tables[5][(lo >> 16) & 0xff] ^
+              tables[4][lo >> 24] ^ tables[3][hi & 0xff] ^ tables[2][(hi >> 8) & 0xff] ^
+              tables[1][(hi >> 16) & 0xff] ^ tables[0][hi >> 24];
+    }
+    for (; size > 0; size--, p++) {
+        crc = tables[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+    }
+    return crc ^ 0xffffffffu;
+}
+
+template <typename T>
+void put(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void put_string(std::string& out, const std::string& value) {
+    put<uint32_t>(out, static_cast<uint32_t>(value.size()));
+    out += value;
+}
+
+// Bounds-checked reads over one journal payload
+class Reader {
+public:
+    Reader(const char* data, size_t size) : pos(data), end(data + size) {}
+
+    template <typename T>
+    T get() {
+        T value{};
+        if (static_cast<size_t>(end - pos) < sizeof(T)) {
+            failed = true;
+            return value;
+        }
+        std::memcpy(&value, pos, sizeof(T));
+        pos += sizeof(T);
+        return value;
+    }
+
+    std::string get_string() {
+        uint32_t size = get<uint32_t>();
+        if (failed || static_cast<size_t>(end - pos) < size) {
+            failed = true;
+            return "";
+        }
+        std::string value(pos, size);
+        pos += size;
+        return value;
+    }
+
+    bool ok() const { return !failed; }
+
+private:
+    const char* pos;
+    const char* end;
+    bool failed = false;
+};
+
+bool write_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = ::write(fd, data, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+} // namespace
+
+QueueStore::QueueStore(Options opts) : options(std::move(opts)) {
+    if (options.directory.empty()) return;
+
+    std::error_code ec;
+    std::filesystem::create_directories(options.directory, ec);
+    if (ec) {
+        std::cerr << "Queue state disabled: " << options.directory << ": " << ec.message() << std::endl;
+        return;
+    }
+
+    auto started = std::chrono::steady_clock::now();
+    load_snapshot(generation);
+
+    std::string journal;
+    int fd = ::open(path(journal_name(generation)).c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        std::cerr << "Queue state disabled: " << path(journal_name(generation)) << ": " << std::strerror(errno)
+                  << std::endl;
+        return;
+    }
+    char chunk[65536];
+    ssize_t n;
+    while ((n = ::read(fd, chunk, sizeof(chunk))) > 0) journal.append(chunk, static_cast<size_t>(n));
+    journal_fd = fd;
+    journal_bytes = replay(journal, nullptr);
+    loaded_infos.clear();
+
+    // Cut off a record torn by the crash; new records go after the last good one
+    if (journal_bytes < journal.size() && ftruncate(journal_fd, journal_bytes) < 0) {
+        std::cerr << "Queue state disabled: cannot repair " << path(journal_name(generation)) << std::endl;
+        return;
+    }
+
+    // Whatever was playing starts over from the head of the queue
+    end_record(begin_record(op_restart, 0));
+    replay(pending, nullptr);
+    write_journal(pending);
+    pending.clear();
+    written_records = appended_records;
+
+    size_t track_total = 0;
+    for (auto it = guilds.begin(); it != guilds.end();) {
+        Guild& guild = it->second;
+        if (guild.queue.empty() && guild.loop_mode == loop_off) {
+            it = guilds.erase(it);
+            continue;
+        }
+
+        RestoredGuild r;
+        r.guild_id = it->first;
+        r.text_channel_id = guild.text_channel_id;
+        r.voice_channel_id = guild.voice_channel_id;
+        r.loop_mode = guild.loop_mode;
+        r.tracks.reserve(guild.queue.size());
+        guild.queue.for_each(0, guild.queue.size(), [&r](const Track& track) {
+            r.tracks.push_back(track.clone());
+        });
+        track_total += r.tracks.size();
+        restored.push_back(std::move(r));
+        ++it;
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started);
+    std::cout << "Restored " << track_total << " queued tracks in " << restored.size() << " guilds in "
+              << elapsed.count() / 1000.0 << " ms" << std::endl;
+
+    active = true;
+    thread = std::thread(&QueueStore::run, this);
+}
+
+QueueStore::~QueueStore() {
+    if (thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        thread.join();
+    }
+    if (journal_fd >= 0) ::close(journal_fd);
+}
+
+std::vector<QueueStore::RestoredGuild> QueueStore::take_restored() {
+    return std::move(restored);
+}
+
+size_t QueueStore::begin_record(uint8_t op, uint64_t guild_id) {
+    size_t start = pending.size();
+    pending.append(kRecordHeader, '\0');
+    put<uint8_t>(pending, op);
+    put<uint64_t>(pending, guild_id);
+    return start;
+}
+
+void QueueStore::end_record(size_t start) {
+    uint32_t size = static_cast<uint32_t>(pending.size() - start - kRecordHeader);
+    uint32_t crc = crc32(pending.data() + start + kRecordHeader, size);
+    std::memcpy(&pending[start], &size, sizeof(size));
+    std::memcpy(&pending[start + 4], &crc, sizeof(crc));
+    appended_records++;
+}
+
+void QueueStore::push(uint64_t guild_id, const Track& track) {
+    if (!active) return;
+    const TrackInfo& info = track.info();
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t start = begin_record(op_push, guild_id);
+    put<uint64_t>(pending, track.requester());
+    put<int32_t>(pending, info.duration);
+    put_string(pending, info.title);
+    put_string(pending, info.url);
+    put_string(pending, info.thumbnail);
+    end_record(start);
+    pending_infos.push_back(track.shared_info());
+}
+
+void QueueStore::remove(uint64_t guild_id, size_t position) {
+    if (!active) return;
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t start = begin_record(op_remove, guild_id);
+    put<uint32_t>(pending, static_cast<uint32_t>(position));
+    end_record(start);
+}
+
+void QueueStore::move(uint64_t guild_id, size_t from, size_t to) {
+    if (!active) return;
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t start = begin_record(op_move, guild_id);
+    put<uint32_t>(pending, static_cast<uint32_t>(from));
+    put<uint32_t>(pending, static_cast<uint32_t>(to));
+    end_record(start);
+}
+
+void QueueStore::shuffle(uint64_t guild_id, uint64_t seed) {
+    if (!active) return;
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t start = begin_record(op_shuffle, guild_id);
+    put<uint64_t>(pending, seed);
+    end_record(start);
+}
+
+void QueueStore::clear_queue(uint64_t guild_id) {
+    if (!active) return;
+    std::lock_guard<std::mutex> lock(mutex);
+    end_record(begin_record(op_clear, guild_id));
+}
+
+void QueueStore::reset(uint64_t guild_id) {
+    if (!active) return;
+    std::lock_guard<std::mutex> lock(mutex);
+    end_record(begin_record(op_reset, guild_id));
+}
+
+void QueueStore::set_loop(uint64_t guild_id, int loop_mode) {
+    if (!active) return;
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t start = begin_record(op_loop, guild_id);
+    put<uint8_t>(pending, static_cast<uint8_t>(loop_mode));
+    end_record(start);
+}
+
+void QueueStore::advance(uint64_t guild_id) {
+    if (!active) return;
+    std::lock_guard<std::mutex> lock(mutex);
+    end_record(begin_record(op_advance, guild_id));
+}
+
+void QueueStore::drop_current(uint64_t guild_id) {
+    if (!active) return;
+    std::lock_guard<std::mutex> lock(mutex);
+    end_record(begin_record(op_drop, guild_id));
+}
+
+void QueueStore::set_channels(uint64_t guild_id, uint64_t text_channel_id, uint64_t voice_channel_id) {
+    if (!active) return;
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t start = begin_record(op_channels, guild_id);
+    put<uint64_t>(pending, text_channel_id);
+    put<uint64_t>(pending, voice_channel_id);
+    end_record(start);
+}
+
+void QueueStore::flush() {
+    if (!active) return;
+    std::unique_lock<std::mutex> lock(mutex);
+    uint64_t target = appended_records;
+    flush_requested = true;
+    wake.notify_one();
+    written.wait(lock, [&] { return written_records >= target; });
+}
+
+void QueueStore::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait_for(lock, options.flush_interval, [this] { return stopping || flush_requested; });
+        flush_requested = false;
+
+        if (!pending.empty()) {
+            std::string batch;
+            std::vector<TrackInfoPtr> infos;
+            batch.swap(pending);
+            infos.swap(pending_infos);
+            uint64_t records = appended_records;
+            lock.unlock();
+
+            write_journal(batch);
+            replay(batch, &infos);
+            if (journal_bytes >= options.compact_bytes) {
+                start_generation(generation + 1);
+            }
+
+            lock.lock();
+            written_records = records;
+            written.notify_all();
+        }
+        if (stopping && pending.empty()) break;
+    }
+}
+
+// Apply journal records to `guilds`. Live batches pass the pushed tracks'
+// TrackInfo in `shared` so the copy shares it; on load, tracks with the same
+// URL share one TrackInfo instead. Stops at the first damaged record and
+// returns how many bytes were good.
+size_t QueueStore::replay(const std::string& journal, std::vector<TrackInfoPtr>* shared) {
+    size_t next_shared = 0;
+    size_t pos = 0;
+    while (journal.size() - pos >= kRecordHeader) {
+        uint32_t size, crc;
+        std::memcpy(&size, journal.data() + pos, sizeof(size));
+        std::memcpy(&crc, journal.data() + pos + 4, sizeof(crc));
+        if (journal.size() - pos - kRecordHeader < size) break;
+        const char* payload = journal.data() + pos + kRecordHeader;
+        if (crc32(payload, size) != crc) break;
+        pos += kRecordHeader + size;
+
+        Reader in(payload, size);
+        auto op = in.get<uint8_t>();
+        auto guild_id = in.get<uint64_t>();
+        if (!in.ok()) break;
+
+        if (op == op_restart) {
+            for (auto& entry : guilds) {
+                if (entry.second.current) {
+                    entry.second.queue.push_front(entry.second.current->clone());
+                    entry.second.current = nullptr;
+                }
+            }
+            continue;
+        }
+        Guild& guild = guilds[guild_id];
+
+        switch (op) {
+            case op_push: {
+                uint64_t requester = in.get<uint64_t>();
+                int32_t duration = in.get<int32_t>();
+                std::string title = in.get_string();
+                std::string url = in.get_string();
+                std::string thumbnail = in.get_string();
+                if (!in.ok()) continue;
+
+                TrackInfoPtr info;
+                if (shared && next_shared < shared->size()) {
+                    info = (*shared)[next_shared++];
+                } else {
+                    TrackInfoPtr& slot = loaded_infos[url];
+                    if (!slot) {
+                        auto loaded = std::make_shared<TrackInfo>();
+                        loaded->title = std::move(title);
+                        loaded->url = url;
+                        loaded->thumbnail = std::move(thumbnail);
+                        loaded->duration = duration;
+                        slot = std::move(loaded);
+                    }
+                    info = slot;
+                }
+                guild.queue.push_back(Track(std::move(info), requester));
+                break;
+            }
+            case op_remove: {
+                uint32_t position = in.get<uint32_t>();
+                if (in.ok() && position < guild.queue.size()) guild.queue.erase(position);
+                break;
+            }
+            case op_move: {
+                uint32_t from = in.get<uint32_t>();
+                uint32_t to = in.get<uint32_t>();
+                if (in.ok() && from < guild.queue.size() && to < guild.queue.size()) guild.queue.move(from, to);
+                break;
+            }
+            case op_shuffle: {
+                uint64_t seed = in.get<uint64_t>();
+                if (in.ok()) shuffle_queue(guild.queue, seed);
+                break;
+            }
+            case op_clear:
+                guild.queue.clear();
+                break;
+            case op_reset:
+                guilds.erase(guild_id);
+                break;
+            case op_loop: {
+                uint8_t mode = in.get<uint8_t>();
+                if (in.ok() && mode <= loop_queue) guild.loop_mode = mode;
+                break;
+            }
+            case op_advance:
+                guild.current = advance_queue(guild.queue, guild.current, guild.loop_mode);
+                break;
+            case op_drop:
+                guild.current = nullptr;
+                break;
+            case op_channels:
+                guild.text_channel_id = in.get<uint64_t>();
+                guild.voice_channel_id = in.get<uint64_t>();
+                break;
+            default:
+                // Written by a newer version; skip it
+                break;
+        }
+    }
+    return pos;
+}
+
+bool QueueStore::load_snapshot(uint64_t& loaded_generation) {
+    int fd = ::open(path("snapshot.bin").c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(SnapshotHeader)) {
+        ::close(fd);
+        return false;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) return false;
+
+    const char* base = static_cast<const char*>(map);
+    const auto* header = reinterpret_cast<const SnapshotHeader*>(base);
+    size_t expected = sizeof(SnapshotHeader) + header->guild_count * sizeof(SnapshotGuild) +
+                      header->info_count * sizeof(SnapshotInfo) + header->track_count * sizeof(SnapshotTrack) +
+                      header->strings_size;
+    bool valid = std::memcmp(header->magic, kSnapshotMagic, sizeof(kSnapshotMagic)) == 0 && expected == size &&
+                 crc32(base + sizeof(SnapshotHeader), size - sizeof(SnapshotHeader)) == header->crc;
+    if (!valid) {
+        munmap(map, size);
+        std::cerr << "Ignoring damaged queue snapshot in " << options.directory << std::endl;
+        return false;
+    }
+
+    const auto* guild_records = reinterpret_cast<const SnapshotGuild*>(base + sizeof(SnapshotHeader));
+    const auto* info_records = reinterpret_cast<const SnapshotInfo*>(guild_records + header->guild_count);
+    const auto* track_records = reinterpret_cast<const SnapshotTrack*>(info_records + header->info_count);
+    const char* strings = reinterpret_cast<const char*>(track_records + header->track_count);
+
+    auto string_at = [&](SnapshotString s) {
+        if (s.offset > header->strings_size || s.size > header->strings_size - s.offset) return std::string();
+        return std::string(strings + s.offset, s.size);
+    };
+
+    std::vector<TrackInfoPtr> infos;
+    infos.reserve(header->info_count);
+    for (uint64_t i = 0; i < header->info_count; i++) {
+        const SnapshotInfo& record = info_records[i];
+        auto info = std::make_shared<TrackInfo>();
+        info->title = string_at(record.title);
+        info->url = string_at(record.url);
+        info->thumbnail = string_at(record.thumbnail);
+        info->duration = record.duration;
+        infos.push_back(std::move(info));
+    }
+
+    for (uint64_t i = 0; i < header->guild_count; i++) {
+        const SnapshotGuild& record = guild_records[i];
+        Guild& guild = guilds[record.guild_id];
+        guild.text_channel_id = record.text_channel_id;
+        guild.voice_channel_id = record.voice_channel_id;
+        guild.loop_mode = record.loop_mode <= loop_queue ? static_cast<int>(record.loop_mode) : loop_off;
+        for (uint64_t t = record.first_track;
+             t < static_cast<uint64_t>(record.first_track) + record.track_count && t < header->track_count; t++) {
+            const SnapshotTrack& track = track_records[t];
+            if (track.info < infos.size()) guild.queue.push_back(Track(infos[track.info], track.requester));
+        }
+    }
+
+    loaded_generation = header->generation;
+    munmap(map, size);
+    return true;
+}
+
+bool QueueStore::write_snapshot(uint64_t snapshot_generation) {
+    std::vector<SnapshotGuild> guild_records;
+    std::vector<SnapshotInfo> info_records;
+    std::vector<SnapshotTrack> track_records;
+    std::string strings;
+    std::unordered_map<const TrackInfo*, uint32_t> info_index;
+
+    auto add_string = [&strings](const std::string& value) {
+        SnapshotString s{static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(value.size())};
+        strings += value;
+        return s;
+    };
+    auto add_track = [&](const Track& track) {
+        auto it = info_index.find(track.shared_info().get());
+        if (it == info_index.end()) {
+            const TrackInfo& info = track.info();
+            SnapshotInfo record{add_string(info.title), add_string(info.url), add_string(info.thumbnail),
+                                info.duration, 0};
+            it = info_index.emplace(track.shared_info().get(), static_cast<uint32_t>(info_records.size())).first;
+            info_records.push_back(record);
+        }
+        track_records.push_back(SnapshotTrack{track.requester(), it->second, 0});
+    };
+
+    for (const auto& [guild_id, guild] : guilds) {
+        if (!guild.current && guild.queue.empty() && guild.loop_mode == loop_off) continue;
+        SnapshotGuild record{guild_id, guild.text_channel_id, guild.voice_channel_id,
+                             static_cast<uint32_t>(guild.loop_mode), static_cast<uint32_t>(track_records.size()), 0, 0};
+        // The current track goes first; loading puts it back at the head
+        if (guild.current) add_track(*guild.current);
+        guild.queue.for_each(0, guild.queue.size(), add_track);
+        record.track_count = static_cast<uint32_t>(track_records.size() - record.first_track);
+        guild_records.push_back(record);
+    }
+    strings.resize((strings.size() + 7) & ~size_t(7), '\0');
+
+    std::string data;
+    data.reserve(sizeof(SnapshotHeader) + guild_records.size() * sizeof(SnapshotGuild) +
+                 info_records.size() * sizeof(SnapshotInfo) + track_records.size() * sizeof(SnapshotTrack) +
+                 strings.size());
+    data.append(sizeof(SnapshotHeader), '\0');
+    data.append(reinterpret_cast<const char*>(guild_records.data()), guild_records.size() * sizeof(SnapshotGuild));
+    data.append(reinterpret_cast<const char*>(info_records.data()), info_records.size() * sizeof(SnapshotInfo));
+    data.append(reinterpret_cast<const char*>(track_records.data()), track_records.size() * sizeof(SnapshotTrack));
+    data += strings;
+
+    SnapshotHeader header{};
+    std::memcpy(header.magic, kSnapshotMagic, sizeof(kSnapshotMagic));
+    header.generation = snapshot_generation;
+    header.guild_count = guild_records.size();
+    header.info_count = info_records.size();
+    header.track_count = track_records.size();
+    header.strings_size = strings.size();
+    header.crc = crc32(data.data() + sizeof(SnapshotHeader), data.size() - sizeof(SnapshotHeader));
+    std::memcpy(&data[0], &header, sizeof(header));
+
+    // Write beside the old snapshot, then swap it in atomically
+    std::string temp_path = path("snapshot.bin.tmp");
+    int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    bool ok = write_all(fd, data.data(), data.size()) && fsync(fd) == 0;
+    ::close(fd);
+    if (!ok || std::rename(temp_path.c_str(), path("snapshot.bin").c_str()) != 0) {
+        ::unlink(temp_path.c_str());
+        return false;
+    }
+
+    int dir = ::open(options.directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir >= 0) {
+        fsync(dir);
+        ::close(dir);
+    }
+    return true;
+}
+
+// Snapshot the current state as `next` and switch to its (empty) journal.
+// A crash in between is harmless: the snapshot names the journal to replay.
+bool QueueStore::start_generation(uint64_t next) {
+    if (!write_snapshot(next)) return false;
+
+    int fd = ::open(path(journal_name(next)).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    if (journal_fd >= 0) ::close(journal_fd);
+    journal_fd = fd;
+    journal_bytes = 0;
+
+    // Older journals are covered by the snapshot now
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(options.directory, ec)) {
+        std::string name = entry.path().filename().string();
+        if (name.rfind("journal-", 0) == 0 && name != journal_name(next)) {
+            std::filesystem::remove(entry.path(), ec);
+        }
+    }
+    generation = next;
+    return true;
+}
+
+bool QueueStore::write_journal(const std::string& batch) {
+    if (journal_fd < 0) return false;
+    if (!write_all(journal_fd, batch.data(), batch.size())) {
+        std::cerr << "Queue journal write failed: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    fdatasync(journal_fd);
+    journal_bytes += batch.size();
+    return true;
+}
+
+std::string QueueStore::path(const std::string& name) const {
+    return (std::filesystem::path(options.directory) / name).string();
+}
+
+std::string QueueStore::journal_name(uint64_t journal_generation) const {
+    return "journal-" + std::to_string(journal_generation) + ".log";
+}
+
+QueueStore::Options queue_store_options_from_env() {
+    QueueStore::Options opts;
+    opts.directory = env_string("QUEUE_STATE_DIR");
+    return opts;
+}
+
+QueueStore& queue_store() {
+    static QueueStore store(queue_store_options_from_env());
+    return store;
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include "track.h"
+#include "track_queue.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <unordered_map>
+#include <chrono>
+#include <cstdint>
+
+// Crash-safe copy of every guild's queue, loop mode and channels.
+//
+// Each queue mutation is appended to a journal by the guild actor that made
+// it; a background thread writes the journal in batches and replays it onto
+// its own copy of the queues (sharing TrackInfo with the live ones). Once
+// the journal grows past a limit that copy is written out as a snapshot in
+// a flat binary layout that loads with one mmap, and a new journal starts.
+//
+// Stream URLs are not stored. Restored tracks look stale, so they are
+// re-resolved only as they near the head of the queue.
+class QueueStore {
+public:
+    struct Options {
+        // Where the snapshot and journal live; empty disables the store
+        std::string directory;
+        // Appended mutations are written and synced at least this often
+        std::chrono::milliseconds flush_interval{100};
+        // Journal size that triggers a new snapshot
+        size_t compact_bytes = 8 << 20;
+    };
+
+    // A guild as it was when the previous process stopped. The track that
+    // was playing is back at the head of the queue.
+    struct RestoredGuild {
+        uint64_t guild_id = 0;
+        uint64_t text_channel_id = 0;
+        uint64_t voice_channel_id = 0;
+        int loop_mode = 0;
+        std::vector<Track> tracks;
+    };
+
+    explicit QueueStore(Options opts);
+    ~QueueStore();
+
+    QueueStore(const QueueStore&) = delete;
+    QueueStore& operator=(const QueueStore&) = delete;
+
+    bool enabled() const { return active; }
+
+    // State loaded at startup; hands it over once
+    std::vector<RestoredGuild> take_restored();
+
+    // Mutations, recorded by the guild's actor in the order it applies them
+    // to the live queue
+    void push(uint64_t guild_id, const Track& track);
+    void remove(uint64_t guild_id, size_t position);
+    void move(uint64_t guild_id, size_t from, size_t to);
+    void shuffle(uint64_t guild_id, uint64_t seed);
+    void clear_queue(uint64_t guild_id);
+    void reset(uint64_t guild_id);
+    void set_loop(uint64_t guild_id, int loop_mode);
+    void advance(uint64_t guild_id);
+    // The current track stops with nothing after it, whatever the loop mode
+    void drop_current(uint64_t guild_id);
+    void set_channels(uint64_t guild_id, uint64_t text_channel_id, uint64_t voice_channel_id);
+
+    // Block until everything appended so far is on disk
+    void flush();
+
+private:
+    struct Guild {
+        uint64_t text_channel_id = 0;
+        uint64_t voice_channel_id = 0;
+        int loop_mode = 0;
+        std::shared_ptr<Track> current;
+        IndexedQueue<Track> queue;
+    };
+
+    size_t begin_record(uint8_t op, uint64_t guild_id);
+    void end_record(size_t start);
+
+    void run();
+    size_t replay(const std::string& journal, std::vector<TrackInfoPtr>* shared);
+    bool load_snapshot(uint64_t& generation);
+    bool write_snapshot(uint64_t generation);
+    bool start_generation(uint64_t generation);
+    bool write_journal(const std::string& batch);
+    std::string path(const std::string& name) const;
+    std::string journal_name(uint64_t generation) const;
+
+    Options options;
+    bool active = false;
+    std::vector<RestoredGuild> restored;
+
+    // Appended by guild actors, taken by the writer thread
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable written;
+    std::string pending;
+    std::vector<TrackInfoPtr> pending_infos;
+    uint64_t appended_records = 0;
+    uint64_t written_records = 0;
+    bool flush_requested = false;
+    bool stopping = false;
+
+    // Writer thread only
+    std::unordered_map<uint64_t, Guild> guilds;
+    std::unordered_map<std::string, TrackInfoPtr> loaded_infos;
+    uint64_t generation = 0;
+    int journal_fd = -1;
+    size_t journal_bytes = 0;
+    std::thread thread;
+};
+
+// Options read from QUEUE_STATE_DIR
+QueueStore::Options queue_store_options_from_env();
+
+// Process-wide store
+QueueStore& queue_store();
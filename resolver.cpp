@@ -0,0 +1,458 @@
+#include "resolver.h"
+#include "env.h"
+#include "json_extract.h"
+#include "metrics.h"
+#include <future>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <poll.h>
+#include <unistd.h>
+
+namespace {
+
+// Long-lived worker: pays the interpreter and yt_dlp import cost once.
+//
+// "playlist\t<limit>\t<url>" requests list the playlist flat (no per-entry
+// page fetch) and write each entry as soon as yt-dlp yields it.
+const char* kWorkerScript = R"PY(
+import itertools, json, sys
+import yt_dlp
+
+ydl = yt_dlp.YoutubeDL({
+    'format': 'bestaudio/best',
+    'noplaylist': True,
+    'quiet': True,
+    'no_warnings': True,
+    'skip_download': True,
+})
+
+flat = yt_dlp.YoutubeDL({
+    'extract_flat': 'in_playlist',
+    'lazy_playlist': True,
+    'quiet': True,
+    'no_warnings': True,
+    'skip_download': True,
+})
+
+def emit_flat(entry):
+    thumbs = entry.get('thumbnails') or []
+    sys.stdout.write(json.dumps({
+        'title': entry.get('title'),
+        'webpage_url': entry.get('webpage_url') or entry.get('url'),
+        'duration': entry.get('duration') or 0,
+        'thumbnail': thumbs[-1].get('url') if thumbs else entry.get('thumbnail'),
+    }) + '\n')
+    sys.stdout.flush()
+
+def list_playlist(limit, url):
+    info = flat.extract_info(url, download=False, process=False)
+    if not info:
+        return
+    if info.get('_type') not in ('playlist', 'multi_video'):
+        emit_flat(info)
+        return
+    entries = info.get('entries') or []
+    if hasattr(entries, 'getslice'):
+        entries = entries.getslice(0, limit)
+    for entry in itertools.islice(entries, limit):
+        if entry:
+            emit_flat(entry)
+
+for line in sys.stdin:
+    query = line.rstrip('\n')
+    try:
+        if query.startswith('playlist\t'):
+            _, limit, url = query.split('\t', 2)
+            list_playlist(int(limit), url)
+            sys.stdout.write('\n')
+            sys.stdout.flush()
+            continue
+        info = ydl.extract_info(query, download=False)
+        entries = [info] if info else []
+        if info and info.get('_type') == 'playlist':
+            entries = [e for e in (info.get('entries') or []) if e][:1]
+        for entry in entries:
+            sys.stdout.write(json.dumps(ydl.sanitize_info(entry)) + '\n')
+    except Exception as e:
+        sys.stdout.write(json.dumps({'_error': str(e)}) + '\n')
+    sys.stdout.write('\n')
+    sys.stdout.flush()
+)PY";
+
+// The only fields read from a yt-dlp info dict
+enum InfoField { kTitle, kWebpageUrl, kUrl, kThumbnail, kDuration, kError, kAcodec };
+
+// Per thread so the decoded-string buffers are reused from line to line
+JsonFields& info_fields() {
+    thread_local JsonFields fields{"title", "webpage_url", "url", "thumbnail", "duration", "_error", "acodec"};
+    return fields;
+}
+
+const std::string kUnknownTitle = "Unknown Title";
+
+bool track_from_fields(const JsonFields& fields, TrackInfo& track) {
+    track.title = fields.string(kTitle, kUnknownTitle);
+    track.url = fields.string(kWebpageUrl);
+    track.stream_url = fields.string(kUrl);
+    track.codec = fields.string(kAcodec);
+    track.thumbnail = fields.string(kThumbnail);
+    track.duration = static_cast<int>(fields.number(kDuration));
+    track.stream_expires = stream_expiry_from_url(track.stream_url);
+
+    return !track.stream_url.empty();
+}
+
+// Playlist entries only carry page metadata; the stream URL comes later
+bool flat_entry_from_fields(const JsonFields& fields, TrackInfo& track) {
+    track.title = fields.string(kTitle, kUnknownTitle);
+    track.url = fields.string(kWebpageUrl);
+    track.thumbnail = fields.string(kThumbnail);
+    track.duration = static_cast<int>(fields.number(kDuration));
+
+    return !track.url.empty();
+}
+
+// The worker protocol is line and tab based
+std::string protocol_safe(const std::string& text) {
+    std::string safe = text;
+    for (auto& c : safe) {
+        if (c == '\n' || c == '\r' || c == '\t') c = ' ';
+    }
+    return safe;
+}
+
+struct ResolverMetrics {
+    Histogram& wait = metrics().histogram("musicbot_resolver_wait_seconds",
+                                          "Time resolver requests spend queued before a worker takes them");
+    Histogram& resolve = metrics().histogram("musicbot_resolver_seconds",
+                                             "Time a worker spends resolving one query", "kind=\"track\"");
+    Histogram& playlist = metrics().histogram("musicbot_resolver_seconds",
+                                              "Time a worker spends resolving one query", "kind=\"playlist\"");
+    Counter& errors = metrics().counter("musicbot_resolver_errors_total", "Resolver requests that failed");
+    Counter& rejected = metrics().counter("musicbot_resolver_rejected_total",
+                                          "Resolver requests refused because the queue was full");
+};
+
+ResolverMetrics& resolver_metrics() {
+    static ResolverMetrics m;
+    return m;
+}
+
+} // namespace
+
+ResolverPool::ResolverPool(Options opts) : options(std::move(opts)) {
+    if (options.command.empty()) {
+        options.command = {"python3", "-u", "-c", kWorkerScript};
+    }
+    if (options.workers == 0) options.workers = 1;
+
+    // A worker that dies mid-request must not take the bot down with it
+    std::signal(SIGPIPE, SIG_IGN);
+
+    for (size_t i = 0; i < options.workers; i++) {
+        threads.emplace_back(&ResolverPool::run, this);
+    }
+}
+
+ResolverPool::~ResolverPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+bool ResolverPool::submit(const std::string& query, Callback callback) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stopping || requests.size() >= options.max_pending) {
+            resolver_metrics().rejected.inc();
+            return false;
+        }
+        Request request;
+        request.query = query;
+        request.callback = std::move(callback);
+        requests.push_back(std::move(request));
+    }
+    cv.notify_one();
+    return true;
+}
+
+bool ResolverPool::submit_playlist(const std::string& url, size_t max_entries,
+                                   EntryCallback on_entry, PlaylistCallback on_done) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stopping || requests.size() >= options.max_pending) {
+            resolver_metrics().rejected.inc();
+            return false;
+        }
+        Request request;
+        request.query = url;
+        request.max_entries = max_entries;
+        request.on_entry = std::move(on_entry);
+        request.on_done = std::move(on_done);
+        requests.push_back(std::move(request));
+    }
+    cv.notify_one();
+    return true;
+}
+
+size_t ResolverPool::pending() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return requests.size();
+}
+
+void ResolverPool::run() {
+    Worker worker;
+    spawn(worker);
+
+    while (true) {
+        Request request;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return stopping || !requests.empty(); });
+            if (stopping) break;
+            request = std::move(requests.front());
+            requests.pop_front();
+        }
+        auto started = std::chrono::steady_clock::now();
+        resolver_metrics().wait.observe(started - request.submitted);
+
+        std::vector<TrackInfoPtr> tracks;
+        size_t entries = 0;
+        std::string error;
+        bool playlist = static_cast<bool>(request.on_entry);
+        if (!worker.proc.running() && !spawn(worker)) {
+            error = "resolver worker unavailable";
+        } else if (playlist ? !resolve_playlist(worker, request, entries, error)
+                            : !resolve(worker, request.query, tracks, error)) {
+            // The worker is in an unknown state; replace it before the next request
+            kill_worker(worker);
+            spawn(worker);
+        }
+        (playlist ? resolver_metrics().playlist : resolver_metrics().resolve).observe_since(started);
+        if (!error.empty()) resolver_metrics().errors.inc();
+
+        if (playlist) {
+            if (request.on_done) request.on_done(entries, error);
+        } else if (request.callback) {
+            request.callback(std::move(tracks), error);
+        }
+    }
+
+    kill_worker(worker);
+
+    // Fail whatever is still queued so callers are not left waiting
+    std::deque<Request> leftover;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        leftover.swap(requests);
+    }
+    for (auto& request : leftover) {
+        if (request.on_done) request.on_done(0, "resolver shutting down");
+        if (request.callback) request.callback({}, "resolver shutting down");
+    }
+}
+
+bool ResolverPool::spawn(Worker& worker) {
+    worker.buffer.clear();
+    return spawn_process(options.command, true, worker.proc);
+}
+
+void ResolverPool::kill_worker(Worker& worker) {
+    kill_process(worker.proc);
+    worker.buffer.clear();
+}
+
+bool ResolverPool::read_line(Worker& worker, std::string& line,
+                             std::chrono::steady_clock::time_point deadline, std::string& error) {
+    while (true) {
+        size_t newline = worker.buffer.find('\n');
+        if (newline != std::string::npos) {
+            line.assign(worker.buffer, 0, newline);
+            worker.buffer.erase(0, newline + 1);
+            return true;
+        }
+
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()).count();
+        if (remaining <= 0) {
+            error = "resolver timed out";
+            return false;
+        }
+
+        pollfd pfd{worker.proc.out_fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, static_cast<int>(remaining));
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            error = "resolver poll failed";
+            return false;
+        }
+        if (ready == 0) continue;
+
+        char chunk[65536];
+        ssize_t n = read(worker.proc.out_fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            error = "resolver worker exited";
+            return false;
+        }
+        worker.buffer.append(chunk, static_cast<size_t>(n));
+    }
+}
+
+bool ResolverPool::send(Worker& worker, const std::string& request, std::string& error) {
+    size_t written = 0;
+    while (written < request.size()) {
+        ssize_t n = write(worker.proc.in_fd, request.data() + written, request.size() - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            error = "resolver worker exited";
+            return false;
+        }
+        written += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool ResolverPool::resolve(Worker& worker, const std::string& query,
+                           std::vector<TrackInfoPtr>& tracks, std::string& error) {
+    if (!send(worker, protocol_safe(query) + '\n', error)) {
+        return false;
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + options.timeout;
+    std::string line;
+    while (read_line(worker, line, deadline, error)) {
+        if (line.empty()) {
+            return true;
+        }
+
+        JsonFields& fields = info_fields();
+        if (!fields.scan(line)) {
+            continue;
+        }
+        if (fields.has(kError)) {
+            error = fields.string(kError);
+            continue;
+        }
+
+        TrackInfo track;
+        if (track_from_fields(fields, track)) {
+            tracks.push_back(std::make_shared<const TrackInfo>(std::move(track)));
+        }
+    }
+    return false;
+}
+
+bool ResolverPool::resolve_playlist(Worker& worker, const Request& request,
+                                    size_t& entries, std::string& error) {
+    std::string line = "playlist\t" + std::to_string(request.max_entries) + "\t" +
+                       protocol_safe(request.query) + '\n';
+    if (!send(worker, line, error)) {
+        return false;
+    }
+
+    // Large playlists take a while in total, so the timeout is per entry
+    bool wanted = true;
+    while (read_line(worker, line, std::chrono::steady_clock::now() + options.timeout, error)) {
+        if (line.empty()) {
+            return true;
+        }
+
+        JsonFields& fields = info_fields();
+        if (!fields.scan(line)) {
+            continue;
+        }
+        if (fields.has(kError)) {
+            error = fields.string(kError);
+            continue;
+        }
+
+        // Once the caller has lost interest the rest is read and dropped
+        TrackInfo entry;
+        if (wanted && flat_entry_from_fields(fields, entry)) {
+            entries++;
+            wanted = request.on_entry(std::make_shared<const TrackInfo>(std::move(entry)));
+        }
+    }
+    return false;
+}
+
+ResolverPool::Options resolver_options_from_env() {
+    ResolverPool::Options opts;
+    opts.workers = env_size("RESOLVER_WORKERS", opts.workers);
+    opts.max_pending = env_size("RESOLVER_QUEUE", opts.max_pending);
+    opts.timeout = std::chrono::milliseconds(env_size("RESOLVER_TIMEOUT_MS", opts.timeout.count()));
+    return opts;
+}
+
+ResolverPool& resolver_pool() {
+    static ResolverPool pool(resolver_options_from_env());
+    static bool registered = [] {
+        metrics().gauge_callback("musicbot_resolver_queue_depth", "Resolver requests waiting for a worker",
+                                 [] { return static_cast<double>(pool.pending()); });
+        return true;
+    }();
+    (void)registered;
+    return pool;
+}
+
+bool parse_track_json(const std::string& line, TrackInfo& track) {
+    JsonFields& fields = info_fields();
+    return fields.scan(line) && track_from_fields(fields, track);
+}
+
+int64_t stream_expiry_from_url(const std::string& stream_url) {
+    for (const char* key : {"?expire=", "&expire=", "/expire/"}) {
+        size_t pos = stream_url.find(key);
+        if (pos != std::string::npos) {
+            return std::strtoll(stream_url.c_str() + pos + std::strlen(key), nullptr, 10);
+        }
+    }
+    return 0;
+}
+
+bool is_playlist_url(const std::string& query) {
+    if (query.find("http://") != 0 && query.find("https://") != 0) {
+        return false;
+    }
+    return query.find("/playlist") != std::string::npos ||
+           query.find("?list=") != std::string::npos ||
+           query.find("&list=") != std::string::npos;
+}
+
+std::string make_search_query(const std::string& query) {
+    if (query.find("http://") != 0 && query.find("https://") != 0) {
+        return "ytsearch:" + query;
+    }
+    return query;
+}
+
+std::vector<Track> extract_audio_info(ResolverPool& pool, const std::string& query, uint64_t requester) {
+    auto promise = std::make_shared<std::promise<std::vector<TrackInfoPtr>>>();
+    auto future = promise->get_future();
+
+    bool queued = pool.submit(make_search_query(query),
+        [promise](std::vector<TrackInfoPtr> tracks, const std::string&) {
+            promise->set_value(std::move(tracks));
+        });
+    if (!queued) {
+        return {};
+    }
+
+    std::vector<Track> tracks;
+    for (auto& info : future.get()) {
+        tracks.emplace_back(std::move(info), requester);
+    }
+    return tracks;
+}
+
+std::vector<Track> extract_audio_info(const std::string& query, uint64_t requester) {
+    return extract_audio_info(resolver_pool(), query, requester);
+}
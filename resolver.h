@@ -0,0 +1,113 @@
+#pragma once
+
+#include "track.h"
+#include "subprocess.h"
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <chrono>
+
+// Bounded pool of long-lived yt-dlp worker processes.
+//
+// Each worker is a Python interpreter that has already imported yt_dlp and
+// reads one query per line on stdin. It answers with one JSON info dict per
+// line, followed by an empty line. Requests wait in a bounded queue;
+// submit() refuses new work once the queue is full instead of spawning more
+// processes.
+class ResolverPool {
+public:
+    struct Options {
+        size_t workers = 4;
+        size_t max_pending = 64;
+        std::chrono::milliseconds timeout{30000};
+        // Worker argv. Empty means the built-in yt-dlp worker script.
+        std::vector<std::string> command;
+    };
+
+    // Called on a pool thread with the resolved tracks, or an error message.
+    using Callback = std::function<void(std::vector<TrackInfoPtr> tracks, const std::string& error)>;
+
+    // Called on a pool thread for each playlist entry as it arrives; the
+    // entry has no stream URL yet. Return false to drop the remaining entries.
+    using EntryCallback = std::function<bool(TrackInfoPtr entry)>;
+
+    // Called once a playlist request is over, with the number of entries delivered
+    using PlaylistCallback = std::function<void(size_t entries, const std::string& error)>;
+
+    explicit ResolverPool(Options opts);
+    ~ResolverPool();
+
+    ResolverPool(const ResolverPool&) = delete;
+    ResolverPool& operator=(const ResolverPool&) = delete;
+
+    // Queue a query. Returns false if the pool is saturated.
+    bool submit(const std::string& query, Callback callback);
+
+    // Queue a flat playlist listing of at most max_entries entries.
+    // Returns false if the pool is saturated.
+    bool submit_playlist(const std::string& url, size_t max_entries,
+                         EntryCallback on_entry, PlaylistCallback on_done);
+
+    size_t pending() const;
+
+private:
+    struct Request {
+        std::string query;
+        Callback callback;
+        std::chrono::steady_clock::time_point submitted = std::chrono::steady_clock::now();
+        // Set for playlist requests only
+        size_t max_entries = 0;
+        EntryCallback on_entry;
+        PlaylistCallback on_done;
+    };
+
+    // One child process and the pipe ends we hold for it
+    struct Worker {
+        Subprocess proc;
+        std::string buffer;
+    };
+
+    void run();
+    bool spawn(Worker& worker);
+    void kill_worker(Worker& worker);
+    bool send(Worker& worker, const std::string& request, std::string& error);
+    bool resolve(Worker& worker, const std::string& query,
+                 std::vector<TrackInfoPtr>& tracks, std::string& error);
+    bool resolve_playlist(Worker& worker, const Request& request,
+                          size_t& entries, std::string& error);
+    bool read_line(Worker& worker, std::string& line,
+                   std::chrono::steady_clock::time_point deadline, std::string& error);
+
+    Options options;
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Request> requests;
+    std::vector<std::thread> threads;
+    bool stopping = false;
+};
+
+// Options read from RESOLVER_WORKERS, RESOLVER_QUEUE and RESOLVER_TIMEOUT_MS
+ResolverPool::Options resolver_options_from_env();
+
+// Process-wide pool, started on first use
+ResolverPool& resolver_pool();
+
+// Parse a single line of yt-dlp --dump-json output
+bool parse_track_json(const std::string& line, TrackInfo& track);
+
+// YouTube-DL wrapper function (blocks until the pool answers)
+std::vector<Track> extract_audio_info(ResolverPool& pool, const std::string& query, uint64_t requester);
+std::vector<Track> extract_audio_info(const std::string& query, uint64_t requester);
+
+// Expiry encoded in a signed googlevideo URL (expire=...), or 0
+int64_t stream_expiry_from_url(const std::string& stream_url);
+
+// True for URLs that name a playlist (list= or /playlist)
+bool is_playlist_url(const std::string& query);
+
+// Turn a user query into something yt-dlp accepts
+std::string make_search_query(const std::string& query);
@@ -0,0 +1,152 @@
+#include "scheduler.h"
+#include <iostream>
+#include <exception>
+
+namespace {
+
+// Which pool (if any) the current thread works for, and its deque
+thread_local const WorkStealingPool* current_pool = nullptr;
+thread_local size_t current_index = 0;
+
+// Tasks a strand runs before yielding its thread to other strands
+constexpr size_t kStrandBatch = 64;
+
+void run_task(const std::function<void()>& task) {
+    try {
+        task();
+    } catch (const std::exception& e) {
+        std::cerr << "Unhandled exception in worker task: " << e.what() << std::endl;
+    }
+}
+
+} // namespace
+
+WorkStealingPool::WorkStealingPool(size_t count) {
+    if (count == 0) count = 1;
+    for (size_t i = 0; i < count; i++) {
+        workers.push_back(std::make_unique<Worker>());
+    }
+    for (size_t i = 0; i < count; i++) {
+        threads.emplace_back(&WorkStealingPool::run, this, i);
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+void WorkStealingPool::submit(Task task) {
+    push(std::move(task), false);
+}
+
+void WorkStealingPool::defer(Task task) {
+    push(std::move(task), true);
+}
+
+void WorkStealingPool::push(Task task, bool to_front) {
+    size_t index = current_pool == this
+        ? current_index
+        : next_worker.fetch_add(1, std::memory_order_relaxed) % workers.size();
+    {
+        // Owners pop from the back, so the front is where yielded work waits
+        std::lock_guard<std::mutex> lock(workers[index]->mutex);
+        if (to_front) {
+            workers[index]->tasks.push_front(std::move(task));
+        } else {
+            workers[index]->tasks.push_back(std::move(task));
+        }
+    }
+    {
+        // Taking the lock orders this with a worker checking `pending` before sleeping
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        pending.fetch_add(1, std::memory_order_release);
+    }
+    wake.notify_one();
+}
+
+bool WorkStealingPool::pop_local(size_t index, Task& task) {
+    Worker& worker = *workers[index];
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    if (worker.tasks.empty()) return false;
+    task = std::move(worker.tasks.back());
+    worker.tasks.pop_back();
+    return true;
+}
+
+bool WorkStealingPool::steal(size_t index, Task& task) {
+    for (size_t i = 1; i < workers.size(); i++) {
+        Worker& victim = *workers[(index + i) % workers.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkStealingPool::run(size_t index) {
+    current_pool = this;
+    current_index = index;
+
+    while (true) {
+        Task task;
+        if (pop_local(index, task) || steal(index, task)) {
+            pending.fetch_sub(1, std::memory_order_acq_rel);
+            run_task(task);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        wake.wait(lock, [this] {
+            return stopping || pending.load(std::memory_order_acquire) > 0;
+        });
+        if (stopping) return;
+    }
+}
+
+std::shared_ptr<Strand> Strand::create(WorkStealingPool& pool) {
+    return std::shared_ptr<Strand>(new Strand(pool));
+}
+
+void Strand::post(Task task) {
+    bool schedule = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(std::move(task));
+        if (!scheduled) {
+            scheduled = true;
+            schedule = true;
+        }
+    }
+    if (schedule) {
+        pool.submit([self = shared_from_this()] { self->drain(); });
+    }
+}
+
+void Strand::drain() {
+    for (size_t n = 0; n < kStrandBatch; n++) {
+        Task task;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (tasks.empty()) {
+                scheduled = false;
+                return;
+            }
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        run_task(task);
+    }
+
+    // Still busy: go to the back of the line so other guilds get a turn
+    pool.defer([self = shared_from_this()] { self->drain(); });
+}
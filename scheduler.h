@@ -0,0 +1,77 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <atomic>
+
+// Fixed-size thread pool with per-thread task deques.
+//
+// A worker pushes follow-up tasks onto its own deque and pops them LIFO,
+// which keeps a guild's work on a warm cache. Idle workers steal FIFO from
+// the other deques. Tasks submitted from outside the pool are spread
+// round-robin.
+class WorkStealingPool {
+public:
+    using Task = std::function<void()>;
+
+    explicit WorkStealingPool(size_t threads);
+    ~WorkStealingPool();
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    void submit(Task task);
+
+    // Like submit(), but queued behind everything the calling worker already has
+    void defer(Task task);
+
+    size_t size() const { return workers.size(); }
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void push(Task task, bool to_front);
+    void run(size_t index);
+    bool pop_local(size_t index, Task& task);
+    bool steal(size_t index, Task& task);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    std::atomic<size_t> pending{0};
+    std::atomic<size_t> next_worker{0};
+    bool stopping = false;
+};
+
+// Serial executor on top of a WorkStealingPool.
+//
+// Tasks posted to one strand never run concurrently and run in the order
+// they were posted, but may run on any pool thread. Different strands run
+// in parallel.
+class Strand : public std::enable_shared_from_this<Strand> {
+public:
+    using Task = std::function<void()>;
+
+    static std::shared_ptr<Strand> create(WorkStealingPool& pool);
+
+    void post(Task task);
+
+private:
+    explicit Strand(WorkStealingPool& pool) : pool(pool) {}
+
+    void drain();
+
+    WorkStealingPool& pool;
+    std::mutex mutex;
+    std::deque<Task> tasks;
+    bool scheduled = false;
+};
@@ -0,0 +1,449 @@
+#include "send_scheduler.h"
+#include "audio_source.h"
+#include "metrics.h"
+#include "env.h"
+#include <algorithm>
+#include <sstream>
+
+namespace {
+
+constexpr double kFrameSeconds = AudioSource::kFrameSamples / static_cast<double>(AudioSource::kSampleRate);
+// Packets kept for reuse per sink (1 s of audio)
+constexpr size_t kSparePackets = 50;
+// A sender that was asked for audio and sent none is asked again after this
+constexpr std::chrono::milliseconds kRefillRetry{100};
+// Least time between two steps down, so one congested spell costs one step
+constexpr std::chrono::seconds kBitrateHold{5};
+// Depth is sampled into the histogram once per this many ticks (1 s)
+constexpr uint64_t kDepthSampleTicks = 50;
+// Sinks serviced per pool task; one task per sink would cost more in
+// queueing than the service itself
+constexpr size_t kSinksPerTask = 16;
+
+struct SendMetrics {
+    Counter& fetch_underruns = metrics().counter(
+        "musicbot_voice_underruns_total", "Times a playing voice connection ran dry", "cause=\"fetch\"");
+    Counter& decode_underruns = metrics().counter(
+        "musicbot_voice_underruns_total", "Times a playing voice connection ran dry", "cause=\"decode\"");
+    Counter& overruns = metrics().counter("musicbot_voice_overruns_total",
+                                          "Times a voice connection held audio without sending it (network)");
+    Counter& bitrate_steps = metrics().counter("musicbot_voice_bitrate_steps_total",
+                                               "Steps down the Opus bitrate ladder after an overrun");
+    Gauge& reduced = metrics().gauge("musicbot_voice_reduced_bitrate_guilds",
+                                     "Guilds sending passed-through Opus at a reduced bitrate");
+    Gauge& paced = metrics().gauge("musicbot_voice_paced_guilds", "Guilds with a paced voice sink");
+    Histogram& depth = metrics().histogram("musicbot_voice_buffer_seconds",
+                                           "Audio held ahead of a playing voice connection, sampled once a second", "",
+                                           {0.02, 0.05, 0.1, 0.2, 0.35, 0.5, 0.75, 1, 1.5});
+    Histogram& lag = metrics().histogram("musicbot_send_tick_lag_seconds",
+                                         "How late the send scheduler's 20 ms tick ran", "",
+                                         {1e-4, 5e-4, 1e-3, 2.5e-3, 5e-3, 1e-2, 2e-2, 5e-2, 0.1});
+};
+
+SendMetrics& send_metrics() {
+    static SendMetrics m;
+    return m;
+}
+
+} // namespace
+
+PacedSink::PacedSink(SendScheduler& scheduler, std::shared_ptr<VoiceSink> connection, std::function<void()> refill)
+    : scheduler(&scheduler), connection(std::move(connection)), refill(std::move(refill)), parked(true) {}
+
+bool PacedSink::ready() {
+    return connection->ready();
+}
+
+bool PacedSink::accepts_opus() {
+    return connection->accepts_opus();
+}
+
+PacedSink::Packet PacedSink::spare_packet() {
+    if (spare.empty()) return Packet();
+    Packet packet = std::move(spare.back());
+    spare.pop_back();
+    return packet;
+}
+
+void PacedSink::recycle(Packet& packet) {
+    if (spare.size() < kSparePackets) spare.push_back(std::move(packet));
+}
+
+void PacedSink::send_pcm(const int16_t* samples, size_t count) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Packet packet = spare_packet();
+    packet.pcm.assign(samples, samples + count);
+    packet.opus.clear();
+    packet.samples = static_cast<uint32_t>(count / AudioSource::kChannels);
+    push(std::move(packet));
+}
+
+void PacedSink::send_opus(const uint8_t* data, size_t size, uint32_t samples) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Packet packet = spare_packet();
+    packet.opus.assign(data, data + size);
+    packet.pcm.clear();
+    packet.samples = samples;
+    push(std::move(packet));
+}
+
+void PacedSink::push(Packet packet) {
+    if (detached) return;
+    queued_samples += packet.samples;
+    queue.push_back(std::move(packet));
+    // Whatever was asked for has arrived
+    refill_requested = std::chrono::steady_clock::time_point();
+    if (parked && !paused && scheduler) {
+        parked = false;
+        scheduler->wake(shared_from_this());
+    }
+}
+
+double PacedSink::buffered_seconds() {
+    double held = connection->ready() ? connection->buffered_seconds() : 0.0;
+    std::lock_guard<std::mutex> lock(mutex);
+    return held + queued_samples / static_cast<double>(AudioSource::kSampleRate);
+}
+
+void PacedSink::clear() {
+    {
+        std::lock_guard<std::mutex> sending_lock(send_mutex);
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& packet : queue) recycle(packet);
+        queue.clear();
+        queued_samples = 0;
+        primed = false;
+        underrunning = false;
+    }
+    connection->clear();
+}
+
+void PacedSink::feed(Feed feed_state) {
+    std::lock_guard<std::mutex> lock(mutex);
+    state = feed_state;
+    if (state == Feed::idle) {
+        primed = false;
+        underrunning = false;
+    }
+}
+
+int PacedSink::opus_bitrate() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters.bitrate;
+}
+
+PacedSink::Stats PacedSink::stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    Stats copy = counters;
+    copy.buffered = queued_samples / static_cast<double>(AudioSource::kSampleRate);
+    copy.connection = connection_held;
+    return copy;
+}
+
+void PacedSink::adapt_bitrate(std::chrono::steady_clock::time_point now, bool overrun) {
+    const auto& steps = scheduler->options().bitrates;
+    size_t level = bitrate_level;
+    if (overrun) {
+        last_overrun = now;
+        if (level < steps.size() && now - last_bitrate_change >= kBitrateHold) level++;
+    } else if (level > 0 && now - last_overrun >= scheduler->options().recover_after &&
+               now - last_bitrate_change >= scheduler->options().recover_after) {
+        level--;
+    }
+    if (level == bitrate_level) return;
+
+    if (level > bitrate_level) send_metrics().bitrate_steps.inc();
+    if (bitrate_level == 0) send_metrics().reduced.add(1);
+    if (level == 0) send_metrics().reduced.add(-1);
+    bitrate_level = level;
+    last_bitrate_change = now;
+    counters.bitrate = level == 0 ? 0 : steps[level - 1];
+}
+
+PacedSink::Next PacedSink::service() {
+    std::function<void()> ask;
+    Next next = Next::tick;
+    {
+        std::lock_guard<std::mutex> sending_lock(send_mutex);
+        bool up = connection->ready();
+        double held = up ? connection->buffered_seconds() : 0.0;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (detached) return Next::drop;
+            const SendScheduler::Options& options = scheduler->options();
+            auto now = std::chrono::steady_clock::now();
+            connection_held = held;
+            ticks++;
+
+            if (!up || paused) {
+                // A paused connection sends nothing and is not stalled
+                stalled_since = std::chrono::steady_clock::time_point();
+                held_after = 0;
+                parked = true;
+                return Next::idle;
+            }
+
+            // Backed up: the connection has audio but is not sending it
+            bool drained = held < held_after - kFrameSeconds / 2;
+            if (held < kFrameSeconds || drained) {
+                stalled_since = std::chrono::steady_clock::time_point();
+            } else if (stalled_since == std::chrono::steady_clock::time_point()) {
+                stalled_since = now;
+            }
+            bool overrun = stalled_since != std::chrono::steady_clock::time_point() &&
+                           now - stalled_since >= options.stall_after;
+            if (overrun && !overrunning) {
+                counters.overruns++;
+                send_metrics().overruns.inc();
+            }
+            adapt_bitrate(now, overrun && !overrunning);
+            overrunning = overrun;
+
+            // Ran dry while more was expected; once per episode
+            bool dry = held < kFrameSeconds;
+            if (dry && primed && state != Feed::idle) {
+                if (!underrunning) {
+                    underrunning = true;
+                    if (queue.empty() && state == Feed::starved) {
+                        counters.fetch_underruns++;
+                        send_metrics().fetch_underruns.inc();
+                    } else {
+                        counters.decode_underruns++;
+                        send_metrics().decode_underruns.inc();
+                    }
+                }
+            } else if (!dry) {
+                underrunning = false;
+            }
+
+            while (held < options.lead && !queue.empty()) {
+                held += queue.front().samples / static_cast<double>(AudioSource::kSampleRate);
+                queued_samples -= queue.front().samples;
+                sending.push_back(std::move(queue.front()));
+                queue.pop_front();
+            }
+            if (!sending.empty()) primed = true;
+            held_after = held;
+
+            double total = held + queued_samples / static_cast<double>(AudioSource::kSampleRate);
+            if (state != Feed::idle) {
+                if (total < options.refill_below && now - refill_requested >= kRefillRetry) {
+                    refill_requested = now;
+                    ask = refill;
+                }
+                if (ticks % kDepthSampleTicks == 0) {
+                    send_metrics().depth.observe(std::chrono::duration<double>(total));
+                }
+            } else if (queue.empty() && sending.empty()) {
+                parked = true;
+                next = Next::idle;
+            }
+        }
+
+        for (auto& packet : sending) {
+            if (!packet.opus.empty()) {
+                connection->send_opus(packet.opus.data(), packet.opus.size(), packet.samples);
+            } else {
+                connection->send_pcm(packet.pcm.data(), packet.pcm.size());
+            }
+        }
+        if (!sending.empty()) {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto& packet : sending) recycle(packet);
+        }
+        sending.clear();
+    }
+
+    if (ask) ask();
+    return next;
+}
+
+SendScheduler::SendScheduler(WorkStealingPool& pool, Options opts)
+    : pool(pool), config(std::move(opts)), wheel(kSlots) {
+    idle_ticks = std::clamp<size_t>(config.idle_interval / kTick, 1, kSlots - 1);
+    thread = std::thread([this] { run(); });
+}
+
+SendScheduler::~SendScheduler() {
+    std::unordered_map<uint64_t, std::shared_ptr<PacedSink>> remaining;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        stopping = true;
+        changed.notify_all();
+        changed.wait(lock, [this] { return in_flight == 0; });
+        remaining.swap(sinks);
+    }
+    thread.join();
+
+    // Players may hold on to their sink for a while yet
+    for (auto& entry : remaining) {
+        std::lock_guard<std::mutex> lock(entry.second->mutex);
+        entry.second->scheduler = nullptr;
+        entry.second->detached = true;
+        if (entry.second->bitrate_level > 0) send_metrics().reduced.add(-1);
+    }
+    send_metrics().paced.add(-static_cast<int64_t>(remaining.size()));
+}
+
+std::shared_ptr<PacedSink> SendScheduler::attach(uint64_t guild_id, std::shared_ptr<VoiceSink> connection,
+                                                 std::function<void()> refill) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& sink = sinks[guild_id];
+    if (!sink) {
+        sink = std::shared_ptr<PacedSink>(new PacedSink(*this, std::move(connection), std::move(refill)));
+        send_metrics().paced.add(1);
+    }
+    return sink;
+}
+
+void SendScheduler::detach(uint64_t guild_id) {
+    std::shared_ptr<PacedSink> sink;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = sinks.find(guild_id);
+        if (it == sinks.end()) return;
+        sink = std::move(it->second);
+        sinks.erase(it);
+    }
+    send_metrics().paced.add(-1);
+
+    // Left in the wheel; its next service sees it is detached
+    std::lock_guard<std::mutex> lock(sink->mutex);
+    sink->detached = true;
+    sink->queue.clear();
+    sink->queued_samples = 0;
+    if (sink->bitrate_level > 0) send_metrics().reduced.add(-1);
+    sink->bitrate_level = 0;
+}
+
+void SendScheduler::pause(uint64_t guild_id, bool paused) {
+    std::shared_ptr<PacedSink> sink;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = sinks.find(guild_id);
+        if (it == sinks.end()) return;
+        sink = it->second;
+    }
+
+    std::lock_guard<std::mutex> lock(sink->mutex);
+    sink->paused = paused;
+    if (!paused && sink->parked && sink->scheduler) {
+        sink->parked = false;
+        wake(sink);
+    }
+}
+
+std::optional<PacedSink::Stats> SendScheduler::stats(uint64_t guild_id) {
+    std::shared_ptr<PacedSink> sink;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = sinks.find(guild_id);
+        if (it == sinks.end()) return std::nullopt;
+        sink = it->second;
+    }
+    return sink->stats();
+}
+
+void SendScheduler::schedule(const std::shared_ptr<PacedSink>& sink, size_t ticks) {
+    sink->due = tick + std::clamp<size_t>(ticks, 1, kSlots - 1);
+    wheel[sink->due % kSlots].push_back({sink, sink->due});
+}
+
+void SendScheduler::wake(const std::shared_ptr<PacedSink>& sink) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (stopping) return;
+    if (sink->in_service) {
+        // Put back on the next tick once the service running now is done
+        sink->wake_pending = true;
+    } else if (sink->due == 0 || sink->due > tick + 1) {
+        schedule(sink, 1);
+    }
+}
+
+void SendScheduler::dispatch(std::vector<std::shared_ptr<PacedSink>> batch) {
+    pool.submit([this, batch = std::move(batch)] {
+        std::vector<PacedSink::Next> next;
+        next.reserve(batch.size());
+        for (const auto& sink : batch) next.push_back(sink->service());
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < batch.size(); i++) {
+            const auto& sink = batch[i];
+            sink->in_service = false;
+            if (next[i] != PacedSink::Next::drop && !stopping) {
+                bool soon = next[i] == PacedSink::Next::tick || sink->wake_pending;
+                schedule(sink, soon ? 1 : idle_ticks);
+            }
+            sink->wake_pending = false;
+        }
+        in_flight -= batch.size();
+        if (stopping) changed.notify_all();
+    });
+}
+
+void SendScheduler::run() {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::shared_ptr<PacedSink>> due_now;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+        auto target = start + kTick * (tick + 1);
+        if (changed.wait_until(lock, target, [this] { return stopping; })) break;
+
+        auto now = std::chrono::steady_clock::now();
+        send_metrics().lag.observe(now - target);
+
+        // Every tick that passed, visiting each slot at most once. After a
+        // stall the clock just moves on: a late sink is serviced once and
+        // tops its connection up, with no burst of catch-up ticks.
+        uint64_t reached = std::max<uint64_t>(tick + 1, (now - start) / kTick);
+        for (uint64_t t = tick + 1; t <= reached && t <= tick + kSlots; t++) {
+            auto& slot = wheel[t % kSlots];
+            size_t kept = 0;
+            for (auto& entry : slot) {
+                if (entry.tick > reached) {
+                    slot[kept++] = std::move(entry);
+                    continue;
+                }
+                auto sink = entry.sink.lock();
+                // Stale if the sink was woken or rescheduled since
+                if (!sink || sink->due != entry.tick || sink->in_service) continue;
+                sink->due = 0;
+                sink->in_service = true;
+                in_flight++;
+                due_now.push_back(std::move(sink));
+            }
+            slot.resize(kept);
+        }
+        tick = reached;
+
+        lock.unlock();
+        for (size_t i = 0; i < due_now.size(); i += kSinksPerTask) {
+            auto end = due_now.begin() + std::min(due_now.size(), i + kSinksPerTask);
+            dispatch({due_now.begin() + i, end});
+        }
+        due_now.clear();
+        lock.lock();
+    }
+}
+
+SendScheduler::Options send_scheduler_options_from_env() {
+    SendScheduler::Options options;
+    options.lead = env_size("VOICE_LEAD_MS", 200) / 1000.0;
+    options.refill_below = env_size("VOICE_REFILL_MS", 500) / 1000.0;
+    options.recover_after = std::chrono::seconds(env_size("VOICE_BITRATE_RECOVER_SECONDS", 30));
+
+    options.stall_after = std::chrono::milliseconds(env_size("VOICE_STALL_MS", 300));
+
+    std::string steps = env_string("VOICE_BITRATE_STEPS");
+    if (!steps.empty()) {
+        options.bitrates.clear();
+        std::istringstream in(steps);
+        std::string step;
+        while (std::getline(in, step, ',')) {
+            int kbps = std::atoi(step.c_str());
+            // libopus takes 6 to 510 kbps
+            if (kbps >= 6 && kbps <= 510) options.bitrates.push_back(kbps);
+        }
+    }
+    return options;
+}
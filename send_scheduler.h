@@ -0,0 +1,209 @@
+#pragma once
+
+#include "player.h"
+#include "scheduler.h"
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <optional>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+
+class SendScheduler;
+
+// One guild's jitter buffer in front of its voice connection.
+//
+// Players and radio listeners write into it as into any sink; the
+// scheduler moves the audio on to the connection a frame at a time, so the
+// connection itself only ever holds a short lead. That keeps the audio in
+// this process where it can be measured: an underrun is the connection
+// running dry, and it is put down to fetch when the sender's source had
+// nothing buffered, or to decode when audio was there but the in-process
+// work (DSP, encoding, pumping) did not get it here in time. An overrun is
+// the connection holding audio it does not send, which is the network;
+// each one steps the Opus bitrate down for tracks that are
+// passed through, and a quiet spell steps it back up.
+class PacedSink : public VoiceSink, public std::enable_shared_from_this<PacedSink> {
+public:
+    struct Stats {
+        // Seconds in the jitter buffer, and held by the connection
+        double buffered = 0;
+        double connection = 0;
+        uint64_t fetch_underruns = 0;
+        uint64_t decode_underruns = 0;
+        uint64_t overruns = 0;
+        // kbps passed-through Opus is re-encoded at; 0 if it is not
+        int bitrate = 0;
+    };
+
+    bool ready() override;
+    void send_pcm(const int16_t* samples, size_t count) override;
+    bool accepts_opus() override;
+    void send_opus(const uint8_t* packet, size_t size, uint32_t samples) override;
+    // The jitter buffer and the connection together
+    double buffered_seconds() override;
+    void clear() override;
+    void feed(Feed state) override;
+    int opus_bitrate() override;
+
+    Stats stats();
+
+private:
+    friend class SendScheduler;
+
+    struct Packet {
+        std::vector<int16_t> pcm;
+        std::vector<uint8_t> opus;
+        // Length at 48 kHz
+        uint32_t samples = 0;
+    };
+
+    // What the sink wants after a service
+    enum class Next { tick, idle, drop };
+
+    PacedSink(SendScheduler& scheduler, std::shared_ptr<VoiceSink> connection, std::function<void()> refill);
+
+    // One tick: top the connection up and check it for underruns and
+    // overruns. Only the scheduler calls it, so `scheduler` is set.
+    Next service();
+    // Called with the mutex held
+    Packet spare_packet();
+    void push(Packet packet);
+    void recycle(Packet& packet);
+    void adapt_bitrate(std::chrono::steady_clock::time_point now, bool overrun);
+
+    // Cleared, under the mutex, when the scheduler goes away
+    SendScheduler* scheduler;
+    std::shared_ptr<VoiceSink> connection;
+    std::function<void()> refill;
+
+    // Held while audio is handed to the connection, so a clear() cannot
+    // land between taking packets off the buffer and sending them
+    std::mutex send_mutex;
+    std::mutex mutex;
+    std::deque<Packet> queue;
+    std::vector<Packet> spare;
+    uint64_t queued_samples = 0;
+    Feed state = Feed::idle;
+    bool paused = false;
+    // Not in the wheel until audio arrives or the idle check comes round
+    bool parked = false;
+    bool detached = false;
+    // Something reached the connection since it last went idle; an empty
+    // connection before that is a track starting, not an underrun
+    bool primed = false;
+    bool underrunning = false;
+    bool overrunning = false;
+    std::chrono::steady_clock::time_point refill_requested;
+    double connection_held = 0;
+    // What the connection held after the last top-up, and since when it
+    // has not sent any of it
+    double held_after = 0;
+    std::chrono::steady_clock::time_point stalled_since;
+    Stats counters;
+
+    // Steps down the scheduler's bitrates, 0 for none
+    size_t bitrate_level = 0;
+    std::chrono::steady_clock::time_point last_overrun;
+    std::chrono::steady_clock::time_point last_bitrate_change;
+    uint64_t ticks = 0;
+    // Only touched under send_mutex
+    std::vector<Packet> sending;
+
+    // Wheel bookkeeping, guarded by the scheduler's mutex
+    uint64_t due = 0;
+    bool in_service = false;
+    bool wake_pending = false;
+};
+
+// Paces every guild's voice output from one timer wheel.
+//
+// A single thread ticks every 20 ms and hands the sinks due on that tick
+// to the worker pool in batches, where each moves audio on to its connection and asks
+// to be woken again: next tick while playing, after idle_interval while
+// paused or silent. Audio arriving at a parked sink brings it back on the
+// next tick. So the cost is one thread for the bot, not one per
+// connection, and a guild with nothing to play costs nothing per frame.
+class SendScheduler {
+public:
+    struct Options {
+        // Audio kept in the connection ahead of what it is sending
+        double lead = 0.2;
+        // The connection holding audio but sending none of it for this
+        // long is an overrun
+        std::chrono::milliseconds stall_after{300};
+        // Ask the sender for more once the jitter buffer and connection
+        // together fall below this
+        double refill_below = 0.5;
+        // Steps, in kbps, that overruns move passed-through Opus down
+        std::vector<int> bitrates = {96, 64, 48, 32};
+        // Quiet time before a step back up
+        std::chrono::seconds recover_after{30};
+        // How often a parked sink is looked at
+        std::chrono::milliseconds idle_interval{200};
+    };
+
+    static constexpr std::chrono::milliseconds kTick{20};
+
+    SendScheduler(WorkStealingPool& pool, Options opts);
+    ~SendScheduler();
+
+    SendScheduler(const SendScheduler&) = delete;
+    SendScheduler& operator=(const SendScheduler&) = delete;
+
+    // The guild's paced sink in front of `connection`, created on first
+    // use. `refill` runs, on a pool thread, when the sink wants audio.
+    std::shared_ptr<PacedSink> attach(uint64_t guild_id, std::shared_ptr<VoiceSink> connection,
+                                      std::function<void()> refill);
+
+    // Stop pacing the guild; its sink drops whatever it holds
+    void detach(uint64_t guild_id);
+
+    // The guild's connection was paused or resumed
+    void pause(uint64_t guild_id, bool paused);
+
+    std::optional<PacedSink::Stats> stats(uint64_t guild_id);
+
+    const Options& options() const { return config; }
+
+private:
+    friend class PacedSink;
+
+    static constexpr size_t kSlots = 64;
+
+    struct Entry {
+        std::weak_ptr<PacedSink> sink;
+        uint64_t tick = 0;
+    };
+
+    void run();
+    // Put the sink back in the wheel `ticks` from now; guarded by mutex
+    void schedule(const std::shared_ptr<PacedSink>& sink, size_t ticks);
+    void wake(const std::shared_ptr<PacedSink>& sink);
+    // Service the sinks on the pool, then put them back in the wheel
+    void dispatch(std::vector<std::shared_ptr<PacedSink>> batch);
+
+    WorkStealingPool& pool;
+    Options config;
+    size_t idle_ticks = 10;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<std::vector<Entry>> wheel;
+    uint64_t tick = 0;
+    std::unordered_map<uint64_t, std::shared_ptr<PacedSink>> sinks;
+    // Services handed to the pool and not yet finished
+    size_t in_flight = 0;
+    bool stopping = false;
+    std::thread thread;
+};
+
+// Options read from VOICE_LEAD_MS, VOICE_STALL_MS, VOICE_REFILL_MS,
+// VOICE_BITRATE_STEPS (comma-separated kbps, e.g. 96,64,48,32) and
+// VOICE_BITRATE_RECOVER_SECONDS
+SendScheduler::Options send_scheduler_options_from_env();
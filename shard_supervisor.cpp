@@ -0,0 +1,702 @@
+#include "shard_supervisor.h"
+#include "env.h"
+#include "audio_cache.h"
+#include "track_cache.h"
+#include "metrics.h"
+#include <json/json.h>
+#include <algorithm>
+#include <iostream>
+#include <csignal>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+namespace {
+
+// A worker that ran this long before crashing starts over at the first backoff
+constexpr auto kHealthyRun = std::chrono::minutes(1);
+constexpr size_t kMaxWorkers = 256;
+
+struct ShardMetrics {
+    Counter& handed_off = metrics().counter("musicbot_guilds_handed_off_total",
+                                            "Guilds this worker gave up for another worker to adopt");
+    Counter& adopted = metrics().counter("musicbot_guilds_adopted_total",
+                                         "Guilds this worker took over from another worker");
+};
+
+ShardMetrics& shard_metrics() {
+    static ShardMetrics m;
+    return m;
+}
+
+std::string json_line(const Json::Value& value) {
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    return Json::writeString(builder, value) + "\n";
+}
+
+bool parse_line(const std::string& line, Json::Value& value) {
+    Json::Reader reader;
+    return !line.empty() && reader.parse(line, value) && value.isObject();
+}
+
+uint64_t snowflake(const Json::Value& value) {
+    if (value.isString()) return std::strtoull(value.asCString(), nullptr, 10);
+    return value.isIntegral() ? value.asUInt64() : 0;
+}
+
+Json::Value handoff_to_json(const GuildHandoff& guild) {
+    Json::Value value;
+    // Snowflakes as strings, the way Discord sends them
+    value["guild_id"] = std::to_string(guild.guild_id);
+    value["text_channel_id"] = std::to_string(guild.text_channel_id);
+    value["voice_channel_id"] = std::to_string(guild.voice_channel_id);
+    value["loop_mode"] = guild.loop_mode;
+    value["volume"] = guild.volume;
+    value["playing"] = guild.playing;
+    value["paused"] = guild.paused;
+    value["position"] = guild.position;
+    // Stream URLs go along, so the new owner only re-resolves stale ones
+    Json::Value tracks(Json::arrayValue);
+    for (const Track& track : guild.tracks) {
+        Json::Value entry = track_to_json(track.info());
+        entry["requester"] = std::to_string(track.requester());
+        tracks.append(entry);
+    }
+    value["tracks"] = tracks;
+    if (guild.radio) {
+        value["radio"] = track_to_json(*guild.radio);
+    }
+    return value;
+}
+
+GuildHandoff handoff_from_json(const Json::Value& value) {
+    GuildHandoff guild;
+    guild.guild_id = snowflake(value["guild_id"]);
+    guild.text_channel_id = snowflake(value["text_channel_id"]);
+    guild.voice_channel_id = snowflake(value["voice_channel_id"]);
+    int loop_mode = value.get("loop_mode", loop_off).asInt();
+    guild.loop_mode = loop_mode >= loop_off && loop_mode <= loop_queue ? loop_mode : loop_off;
+    guild.volume = value.get("volume", 100).asInt();
+    guild.playing = value.get("playing", false).asBool();
+    guild.paused = value.get("paused", false).asBool();
+    guild.position = value.get("position", 0.0).asDouble();
+    for (const auto& entry : value["tracks"]) {
+        guild.tracks.emplace_back(track_from_json(entry), snowflake(entry["requester"]));
+    }
+    if (value["radio"].isObject()) {
+        guild.radio = track_from_json(value["radio"]);
+    }
+    return guild;
+}
+
+std::string adopt_line(const std::string& guild_json) {
+    return "{\"type\":\"adopt\",\"guild\":" + guild_json + "}\n";
+}
+
+bool write_all(int fd, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Blocking; false once the connection is closed
+bool read_line(int fd, std::string& buffer, std::string& line) {
+    for (;;) {
+        size_t newline = buffer.find('\n');
+        if (newline != std::string::npos) {
+            line = buffer.substr(0, newline);
+            buffer.erase(0, newline + 1);
+            return true;
+        }
+        char chunk[4096];
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buffer.append(chunk, static_cast<size_t>(n));
+    }
+}
+
+bool socket_address(const std::string& path, sockaddr_un& addr) {
+    addr = sockaddr_un{};
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) return false;
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+int connect_socket(const std::string& path) {
+    sockaddr_un addr;
+    if (!socket_address(path, addr)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+} // namespace
+
+uint32_t ShardPlacement::own_shards() const {
+    if (workers <= 1) return shards;
+    return shards / workers + (index < shards % workers ? 1 : 0);
+}
+
+bool ShardPlacement::owns(uint64_t guild_id) const {
+    if (!worker || shards == 0 || workers <= 1) return true;
+    return ((guild_id >> 22) % shards) % workers == index;
+}
+
+ShardPlacement shard_placement_from_env() {
+    ShardPlacement placement;
+    // Not through env_size: worker 0 is a valid index
+    std::string index = env_string("MUSICBOT_WORKER_INDEX");
+    if (index.empty()) return placement;
+    placement.worker = true;
+    placement.index = static_cast<uint32_t>(std::strtoul(index.c_str(), nullptr, 10));
+    placement.workers = static_cast<uint32_t>(env_size("MUSICBOT_WORKERS", 1));
+    placement.shards = static_cast<uint32_t>(env_size("MUSICBOT_SHARDS", placement.workers));
+    placement.socket_path = env_string("SHARD_SOCKET", ShardSupervisor::Options().socket_path);
+    return placement;
+}
+
+ShardSupervisor::ShardSupervisor(Options opts) : options(std::move(opts)) {
+    options.workers = std::clamp<size_t>(options.workers, 1, kMaxWorkers);
+}
+
+ShardSupervisor::~ShardSupervisor() {
+    for (const auto& entry : connections) {
+        close(entry.first);
+    }
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(options.socket_path.c_str());
+    }
+    if (signal_fd >= 0) close(signal_fd);
+}
+
+bool ShardSupervisor::listen_socket() {
+    sockaddr_un addr;
+    if (!socket_address(options.socket_path, addr)) {
+        std::cerr << "Shard socket path is empty or too long: " << options.socket_path << std::endl;
+        return false;
+    }
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) return false;
+
+    // Left behind by a supervisor that did not exit cleanly
+    unlink(options.socket_path.c_str());
+    if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listen_fd, 64) != 0) {
+        std::cerr << "Could not listen on " << options.socket_path << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    chmod(options.socket_path.c_str(), 0600);
+    return true;
+}
+
+int ShardSupervisor::run() {
+    // Signals are read from a descriptor so the loop below handles them in order
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, nullptr);
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0 || !listen_socket()) {
+        return 1;
+    }
+
+    workers.assign(options.workers, Worker());
+    shards = std::max(options.shards, workers.size());
+    std::cerr << "Supervising " << workers.size() << " workers over " << shards << " shards on "
+              << options.socket_path << std::endl;
+    start_all();
+
+    for (;;) {
+        bool running = std::any_of(workers.begin(), workers.end(), [](const Worker& w) { return w.pid > 0; });
+        if (phase == Phase::stopping && !running) {
+            break;
+        }
+
+        std::vector<pollfd> fds;
+        fds.push_back({signal_fd, POLLIN, 0});
+        fds.push_back({listen_fd, POLLIN, 0});
+        for (const auto& entry : connections) {
+            fds.push_back({entry.first, POLLIN, 0});
+        }
+        // Timers are coarse: restarts and drain deadlines are seconds apart
+        if (poll(fds.data(), fds.size(), 200) < 0 && errno != EINTR) {
+            std::cerr << "Supervisor poll failed: " << std::strerror(errno) << std::endl;
+            stop();
+        }
+
+        if (fds[0].revents & POLLIN) {
+            signalfd_siginfo info;
+            while (read(signal_fd, &info, sizeof(info)) == static_cast<ssize_t>(sizeof(info))) {
+                if (info.ssi_signo == SIGCHLD) {
+                    reap();
+                } else if (info.ssi_signo == SIGHUP) {
+                    rebalance(workers.size());
+                } else if (phase != Phase::stopping) {
+                    stop();
+                }
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            accept_connection();
+        }
+        for (size_t i = 2; i < fds.size(); i++) {
+            // Handling one connection can close another
+            if (fds[i].revents && connections.count(fds[i].fd)) {
+                read_connection(fds[i].fd);
+            }
+        }
+        tick();
+    }
+
+    std::cerr << "All workers stopped" << std::endl;
+    return 0;
+}
+
+bool ShardSupervisor::spawn(size_t index) {
+    std::vector<std::string> env = environment(index);
+    std::vector<char*> envp;
+    for (auto& entry : env) {
+        envp.push_back(const_cast<char*>(entry.c_str()));
+    }
+    envp.push_back(nullptr);
+    std::vector<char*> argv;
+    for (auto& arg : options.command) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid < 0) {
+        return false;
+    }
+    if (pid == 0) {
+        // A worker goes down with the supervisor rather than keep its
+        // shards where no rebalance can reach them
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != parent) _exit(1);
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, nullptr);
+        execve(argv[0], argv.data(), envp.data());
+        _exit(127);
+    }
+
+    Worker& worker = workers[index];
+    worker.pid = pid;
+    worker.fd = -1;
+    worker.started = std::chrono::steady_clock::now();
+    std::cerr << "Started worker " << index << " (pid " << pid << ")" << std::endl;
+    return true;
+}
+
+void ShardSupervisor::start_all() {
+    for (size_t i = 0; i < workers.size(); i++) {
+        if (!spawn(i)) {
+            std::cerr << "Could not start worker " << i << ": " << std::strerror(errno) << std::endl;
+            workers[i].backoff = options.restart_backoff;
+            workers[i].restart_at = std::chrono::steady_clock::now() + workers[i].backoff;
+        }
+    }
+}
+
+void ShardSupervisor::rebalance(size_t count) {
+    if (phase != Phase::running) {
+        return;
+    }
+    std::cerr << "Rebalancing from " << workers.size() << " to " << count << " workers" << std::endl;
+    phase = Phase::draining;
+    next_workers = count;
+    deadline = std::chrono::steady_clock::now() + options.drain_timeout;
+    for (Worker& worker : workers) {
+        if (worker.fd >= 0 && send(worker.fd, "{\"type\":\"drain\"}\n")) {
+            continue;
+        }
+        // Not up yet: it has adopted nothing, and what it restored is
+        // still in its queue store for the next worker at its index
+        if (worker.pid > 0) {
+            kill(worker.pid, SIGTERM);
+        }
+    }
+}
+
+void ShardSupervisor::stop() {
+    phase = Phase::stopping;
+    deadline = std::chrono::steady_clock::now() + options.drain_timeout;
+    for (const Worker& worker : workers) {
+        if (worker.pid > 0) {
+            kill(worker.pid, SIGTERM);
+        }
+    }
+}
+
+void ShardSupervisor::accept_connection() {
+    int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd >= 0) {
+        connections[fd] = Connection();
+    }
+}
+
+bool ShardSupervisor::read_connection(int fd) {
+    char chunk[65536];
+    ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+    if (n < 0 && errno == EINTR) {
+        return true;
+    }
+    if (n <= 0) {
+        close_connection(fd);
+        return false;
+    }
+    connections[fd].buffer.append(chunk, static_cast<size_t>(n));
+
+    for (;;) {
+        auto it = connections.find(fd);
+        if (it == connections.end()) {
+            return false;
+        }
+        size_t newline = it->second.buffer.find('\n');
+        if (newline == std::string::npos) {
+            return true;
+        }
+        std::string line = it->second.buffer.substr(0, newline);
+        it->second.buffer.erase(0, newline + 1);
+        handle(fd, line);
+    }
+}
+
+void ShardSupervisor::handle(int fd, const std::string& line) {
+    Json::Value message;
+    if (!parse_line(line, message)) {
+        return;
+    }
+    std::string type = message["type"].asString();
+
+    if (type == "hello") {
+        size_t index = message["worker"].isIntegral() ? message["worker"].asUInt64() : workers.size();
+        if (index >= workers.size() || workers[index].pid <= 0) {
+            close_connection(fd);
+            return;
+        }
+        Worker& worker = workers[index];
+        if (worker.fd >= 0 && worker.fd != fd) {
+            close_connection(worker.fd);
+        }
+        worker.fd = fd;
+        connections[fd].worker = static_cast<int>(index);
+        std::cerr << "Worker " << index << " is up" << std::endl;
+        if (phase == Phase::draining) {
+            send(fd, "{\"type\":\"drain\"}\n");
+        } else {
+            deliver_pending(index);
+        }
+    } else if (type == "handoff") {
+        const Json::Value& guild = message["guild"];
+        uint64_t guild_id = snowflake(guild["guild_id"]);
+        if (guild_id != 0) {
+            std::string guild_json = json_line(guild);
+            guild_json.pop_back();
+            route(guild_id, guild_json);
+        }
+    } else if (type == "drained") {
+        std::cerr << "Worker " << connections[fd].worker << " handed off its guilds" << std::endl;
+    } else if (type == "resize") {
+        size_t count = message["workers"].isIntegral() ? message["workers"].asUInt64() : 0;
+        Json::Value reply;
+        if (count == 0 || count > kMaxWorkers) {
+            reply["type"] = "error";
+            reply["error"] = "workers must be between 1 and " + std::to_string(kMaxWorkers);
+        } else if (phase != Phase::running) {
+            reply["type"] = "error";
+            reply["error"] = "a rebalance is already in progress";
+        } else {
+            reply["type"] = "ok";
+            rebalance(count);
+        }
+        send(fd, json_line(reply));
+    }
+}
+
+void ShardSupervisor::close_connection(int fd) {
+    auto it = connections.find(fd);
+    if (it == connections.end()) {
+        return;
+    }
+    int index = it->second.worker;
+    if (index >= 0 && static_cast<size_t>(index) < workers.size() && workers[index].fd == fd) {
+        workers[index].fd = -1;
+    }
+    connections.erase(it);
+    close(fd);
+}
+
+bool ShardSupervisor::send(int fd, const std::string& line) {
+    if (write_all(fd, line)) {
+        return true;
+    }
+    close_connection(fd);
+    return false;
+}
+
+void ShardSupervisor::reap() {
+    int status = 0;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (size_t i = 0; i < workers.size(); i++) {
+            if (workers[i].pid != pid) {
+                continue;
+            }
+            if (WIFSIGNALED(status)) {
+                std::cerr << "Worker " << i << " was killed by signal " << WTERMSIG(status) << std::endl;
+            } else {
+                std::cerr << "Worker " << i << " exited with status " << WEXITSTATUS(status) << std::endl;
+            }
+            exited(i);
+        }
+    }
+}
+
+void ShardSupervisor::exited(size_t index) {
+    Worker& worker = workers[index];
+    worker.pid = -1;
+    // Its last handoffs may still be unread; the connection closes itself
+    // once they are
+    worker.fd = -1;
+    if (phase != Phase::running) {
+        return;
+    }
+
+    // A crash: only this worker's shards went down, and its queue store
+    // brings their guilds back when it restarts
+    auto now = std::chrono::steady_clock::now();
+    if (now - worker.started >= kHealthyRun || worker.backoff.count() == 0) {
+        worker.backoff = options.restart_backoff;
+    } else {
+        worker.backoff = std::min(worker.backoff * 2, options.max_restart_backoff);
+    }
+    worker.restart_at = now + worker.backoff;
+    std::cerr << "Restarting worker " << index << " in " << worker.backoff.count() << " ms" << std::endl;
+}
+
+void ShardSupervisor::tick() {
+    auto now = std::chrono::steady_clock::now();
+    bool running = std::any_of(workers.begin(), workers.end(), [](const Worker& w) { return w.pid > 0; });
+
+    if (phase == Phase::running) {
+        for (size_t i = 0; i < workers.size(); i++) {
+            Worker& worker = workers[i];
+            if (worker.pid <= 0 && worker.restart_at <= now && !spawn(i)) {
+                worker.restart_at = now + std::max(worker.backoff, options.restart_backoff);
+            }
+        }
+    } else if (phase == Phase::draining && !running) {
+        // Everyone has handed off; the new set adopts the guilds in pending
+        workers.assign(next_workers, Worker());
+        shards = std::max(options.shards, workers.size());
+        phase = Phase::running;
+        std::cerr << "Starting " << workers.size() << " workers over " << shards << " shards with "
+                  << pending.size() << " guilds to adopt" << std::endl;
+        start_all();
+    } else if (running && now >= deadline) {
+        for (const Worker& worker : workers) {
+            if (worker.pid > 0) {
+                kill(worker.pid, SIGKILL);
+            }
+        }
+    }
+}
+
+void ShardSupervisor::route(uint64_t guild_id, const std::string& guild_json) {
+    if (phase == Phase::running) {
+        const Worker& worker = workers[owner(guild_id)];
+        if (worker.fd >= 0 && send(worker.fd, adopt_line(guild_json))) {
+            return;
+        }
+    }
+    pending[guild_id] = guild_json;
+}
+
+void ShardSupervisor::deliver_pending(size_t index) {
+    for (auto it = pending.begin(); it != pending.end();) {
+        if (owner(it->first) != index) {
+            ++it;
+            continue;
+        }
+        if (workers[index].fd < 0 || !send(workers[index].fd, adopt_line(it->second))) {
+            return; // kept for the worker's next hello
+        }
+        it = pending.erase(it);
+    }
+}
+
+size_t ShardSupervisor::owner(uint64_t guild_id) const {
+    return ((guild_id >> 22) % shards) % workers.size();
+}
+
+std::vector<std::string> ShardSupervisor::environment(size_t index) const {
+    std::map<std::string, std::string> env;
+    for (char** entry = environ; *entry; entry++) {
+        std::string pair = *entry;
+        size_t equals = pair.find('=');
+        if (equals != std::string::npos) {
+            env[pair.substr(0, equals)] = pair.substr(equals + 1);
+        }
+    }
+
+    env["MUSICBOT_WORKER_INDEX"] = std::to_string(index);
+    env["MUSICBOT_WORKERS"] = std::to_string(workers.size());
+    env["MUSICBOT_SHARDS"] = std::to_string(shards);
+    env["SHARD_SOCKET"] = options.socket_path;
+
+    // Nothing on disk is shared between workers
+    std::string suffix = "worker-" + std::to_string(index);
+    auto per_worker = [&env, &suffix](const char* name, const char* separator) {
+        auto it = env.find(name);
+        if (it != env.end() && !it->second.empty()) {
+            it->second += separator + suffix;
+        }
+    };
+    per_worker("QUEUE_STATE_DIR", "/");
+    per_worker("AUDIO_CACHE_DIR", "/");
+    per_worker("TRACK_CACHE_FILE", ".");
+    per_worker("COMMAND_TRACE_FILE", ".");
+    uint64_t audio_cache_mb = audio_cache_options_from_env().max_bytes >> 20;
+    env["AUDIO_CACHE_MB"] = std::to_string(std::max<uint64_t>(1, audio_cache_mb / workers.size()));
+
+    // Each worker serves its own metrics, on consecutive ports
+    auto port = env.find("METRICS_PORT");
+    unsigned long base = std::strtoul(port == env.end() ? "9464" : port->second.c_str(), nullptr, 10);
+    if (base != 0) {
+        env["METRICS_PORT"] = std::to_string(base + index);
+    }
+
+    std::vector<std::string> flat;
+    for (const auto& [name, value] : env) {
+        flat.push_back(name + "=" + value);
+    }
+    return flat;
+}
+
+ShardSupervisor::Options shard_supervisor_options_from_env() {
+    ShardSupervisor::Options opts;
+    opts.workers = env_size("SHARD_WORKERS", opts.workers);
+    opts.shards = env_size("SHARD_COUNT", opts.shards);
+    opts.socket_path = env_string("SHARD_SOCKET", opts.socket_path);
+    return opts;
+}
+
+bool request_shard_resize(const std::string& socket_path, size_t workers, std::string& error) {
+    int fd = connect_socket(socket_path);
+    if (fd < 0) {
+        error = "no supervisor listening on " + socket_path;
+        return false;
+    }
+    Json::Value request;
+    request["type"] = "resize";
+    request["workers"] = Json::UInt64(workers);
+    std::string buffer;
+    std::string line;
+    Json::Value reply;
+    bool answered = write_all(fd, json_line(request)) && read_line(fd, buffer, line) && parse_line(line, reply);
+    close(fd);
+    if (!answered) {
+        error = "the supervisor closed the connection";
+        return false;
+    }
+    if (reply["type"].asString() != "ok") {
+        error = reply["error"].asString();
+        return false;
+    }
+    return true;
+}
+
+ShardLink::ShardLink(const ShardPlacement& placement, Callbacks callbacks)
+    : placement(placement), callbacks(std::move(callbacks)) {
+    fd = connect_socket(placement.socket_path);
+    if (fd < 0) {
+        std::cerr << "Could not reach the shard supervisor on " << placement.socket_path << std::endl;
+        return;
+    }
+    reader = std::thread(&ShardLink::run, this);
+}
+
+ShardLink::~ShardLink() {
+    if (fd >= 0) {
+        shutdown(fd, SHUT_RDWR);
+    }
+    if (reader.joinable()) {
+        reader.join();
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+void ShardLink::run() {
+    std::string buffer;
+    std::string line;
+    while (read_line(fd, buffer, line)) {
+        Json::Value message;
+        if (!parse_line(line, message)) {
+            continue;
+        }
+        std::string type = message["type"].asString();
+        if (type == "drain" && callbacks.drain) {
+            callbacks.drain();
+        } else if (type == "adopt" && callbacks.adopt) {
+            shard_metrics().adopted.inc();
+            callbacks.adopt(handoff_from_json(message["guild"]));
+        }
+    }
+}
+
+void ShardLink::hello() {
+    Json::Value message;
+    message["type"] = "hello";
+    message["worker"] = placement.index;
+    send(json_line(message));
+}
+
+void ShardLink::hand_off(const GuildHandoff& guild) {
+    Json::Value message;
+    message["type"] = "handoff";
+    message["guild"] = handoff_to_json(guild);
+    shard_metrics().handed_off.inc();
+    send(json_line(message));
+}
+
+void ShardLink::drained() {
+    send("{\"type\":\"drained\"}\n");
+}
+
+void ShardLink::send(const std::string& line) {
+    if (fd < 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(write_mutex);
+    write_all(fd, line);
+}
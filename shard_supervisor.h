@@ -0,0 +1,182 @@
+#pragma once
+
+#include "music_bot.h"
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <functional>
+#include <cstdint>
+#include <sys/types.h>
+
+// Multi-process mode.
+//
+// The supervisor starts N copies of the bot. Worker i runs its dpp cluster
+// with cluster_id i out of N, so it holds the gateway shards s with
+// s % N == i and with them every guild on those shards; a guild is on
+// shard (guild_id >> 22) % shards. Each worker gets its own queue store,
+// track cache file, audio cache directory and metrics port, so nothing
+// on disk is shared between processes.
+//
+// Supervisor and workers talk over a Unix socket, one JSON object a line:
+//
+//   worker -> supervisor   {"type":"hello","worker":i}     ready to adopt guilds
+//                          {"type":"handoff","guild":{}}   a guild it gave up
+//                          {"type":"drained"}              all handed off, exiting
+//   supervisor -> worker   {"type":"drain"}
+//                          {"type":"adopt","guild":{}}
+//   control -> supervisor  {"type":"resize","workers":n}   answered with
+//                          {"type":"ok"} or {"type":"error","error":"..."}
+//
+// A rebalance (SIGHUP keeps the worker count, a resize changes it) drains
+// every worker, holds on to the guilds they hand off, starts the new set
+// and sends each guild to the worker that now owns its shard once that
+// worker says hello. The queue, loop mode, volume and position go along,
+// so playback resumes where it was. A worker that crashes is restarted on
+// its own, with backoff, and recovers its guilds from its queue store.
+
+// Where this process sits, from the environment the supervisor starts
+// each worker with
+struct ShardPlacement {
+    // Started by a supervisor
+    bool worker = false;
+    uint32_t index = 0;
+    uint32_t workers = 1;
+    // Gateway shards across all workers; 0 lets dpp ask Discord
+    uint32_t shards = 0;
+    std::string socket_path;
+
+    // How many gateway shards this worker runs
+    uint32_t own_shards() const;
+
+    bool owns(uint64_t guild_id) const;
+};
+
+ShardPlacement shard_placement_from_env();
+
+class ShardSupervisor {
+public:
+    struct Options {
+        size_t workers = 2;
+        // Gateway shards; raised to the worker count if lower
+        size_t shards = 0;
+        std::string socket_path = "/tmp/discord-musicbot.sock";
+        // Started once per worker
+        std::vector<std::string> command = {"/proc/self/exe"};
+        // Workers still running this long after a drain are killed
+        std::chrono::milliseconds drain_timeout{15000};
+        // First delay before restarting a crashed worker; doubles per crash
+        std::chrono::milliseconds restart_backoff{1000};
+        std::chrono::milliseconds max_restart_backoff{30000};
+    };
+
+    explicit ShardSupervisor(Options opts);
+    ~ShardSupervisor();
+
+    ShardSupervisor(const ShardSupervisor&) = delete;
+    ShardSupervisor& operator=(const ShardSupervisor&) = delete;
+
+    // Run until SIGINT or SIGTERM. Returns the process exit status.
+    int run();
+
+private:
+    struct Worker {
+        pid_t pid = -1;
+        // Connection it said hello on, -1 until then
+        int fd = -1;
+        std::chrono::steady_clock::time_point started;
+        // When to start it again after a crash
+        std::chrono::steady_clock::time_point restart_at;
+        std::chrono::milliseconds backoff{0};
+    };
+
+    struct Connection {
+        std::string buffer;
+        // Worker index once it said hello
+        int worker = -1;
+    };
+
+    enum class Phase { running, draining, stopping };
+
+    bool listen_socket();
+    bool spawn(size_t index);
+    void start_all();
+    void rebalance(size_t workers);
+    void stop();
+
+    void accept_connection();
+    // False once the connection is closed
+    bool read_connection(int fd);
+    void handle(int fd, const std::string& line);
+    void close_connection(int fd);
+    // Closes the connection if the write fails
+    bool send(int fd, const std::string& line);
+
+    void reap();
+    void exited(size_t index);
+    void tick();
+
+    // Hand the guild to its owner if that worker is up, else keep it
+    void route(uint64_t guild_id, const std::string& guild_json);
+    void deliver_pending(size_t index);
+    size_t owner(uint64_t guild_id) const;
+
+    std::vector<std::string> environment(size_t index) const;
+
+    Options options;
+    size_t shards = 1;
+    Phase phase = Phase::running;
+    size_t next_workers = 0;
+    std::chrono::steady_clock::time_point deadline;
+
+    int listen_fd = -1;
+    int signal_fd = -1;
+    std::vector<Worker> workers;
+    std::map<int, Connection> connections;
+    // Handed-off guilds, as JSON, waiting for their new owner to say hello
+    std::unordered_map<uint64_t, std::string> pending;
+};
+
+// Options read from SHARD_WORKERS, SHARD_COUNT and SHARD_SOCKET
+ShardSupervisor::Options shard_supervisor_options_from_env();
+
+// Ask the supervisor listening on socket_path to rebalance onto `workers`
+// processes. False, with the reason in `error`, if it could not.
+bool request_shard_resize(const std::string& socket_path, size_t workers, std::string& error);
+
+// A worker's connection to its supervisor. The callbacks run on the
+// link's reader thread.
+class ShardLink {
+public:
+    struct Callbacks {
+        // Give up every guild with hand_off(), then call drained() and exit
+        std::function<void()> drain;
+        std::function<void(GuildHandoff)> adopt;
+    };
+
+    ShardLink(const ShardPlacement& placement, Callbacks callbacks);
+    ~ShardLink();
+
+    ShardLink(const ShardLink&) = delete;
+    ShardLink& operator=(const ShardLink&) = delete;
+
+    bool connected() const { return fd >= 0; }
+
+    // The worker's shards are up; the supervisor starts sending guilds
+    void hello();
+    void hand_off(const GuildHandoff& guild);
+    void drained();
+
+private:
+    void run();
+    void send(const std::string& line);
+
+    ShardPlacement placement;
+    Callbacks callbacks;
+    int fd = -1;
+    std::mutex write_mutex;
+    std::thread reader;
+};
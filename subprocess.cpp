@@ -0,0 +1,99 @@
+#include "subprocess.h"
+#include <csignal>
+#include <fcntl.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+namespace {
+
+void close_pipes(Subprocess& proc) {
+    if (proc.in_fd >= 0) close(proc.in_fd);
+    if (proc.out_fd >= 0) close(proc.out_fd);
+    proc.in_fd = -1;
+    proc.out_fd = -1;
+}
+
+// waitpid() that also records the child's CPU time
+pid_t reap(Subprocess& proc, int* status) {
+    rusage usage{};
+    pid_t pid = wait4(proc.pid, status, 0, &usage);
+    if (pid == proc.pid) {
+        proc.cpu_usec = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000L +
+                        usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+    }
+    return pid;
+}
+
+} // namespace
+
+bool spawn_process(const std::vector<std::string>& args, bool pipe_stdin, Subprocess& proc) {
+    if (args.empty()) return false;
+
+    int in_pipe[2] = {-1, -1};
+    int out_pipe[2];
+    if (pipe_stdin && pipe2(in_pipe, O_CLOEXEC) != 0) return false;
+    if (pipe2(out_pipe, O_CLOEXEC) != 0) {
+        if (pipe_stdin) {
+            close(in_pipe[0]);
+            close(in_pipe[1]);
+        }
+        return false;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (pipe_stdin) {
+        posix_spawn_file_actions_adddup2(&actions, in_pipe[0], STDIN_FILENO);
+    } else {
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    }
+    posix_spawn_file_actions_adddup2(&actions, out_pipe[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+    std::vector<char*> argv;
+    for (auto& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    pid_t pid = -1;
+    int rc = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (pipe_stdin) close(in_pipe[0]);
+    close(out_pipe[1]);
+    if (rc != 0) {
+        if (pipe_stdin) close(in_pipe[1]);
+        close(out_pipe[0]);
+        return false;
+    }
+
+    proc.pid = pid;
+    proc.in_fd = pipe_stdin ? in_pipe[1] : -1;
+    proc.out_fd = out_pipe[0];
+    return true;
+}
+
+void kill_process(Subprocess& proc) {
+    close_pipes(proc);
+    if (proc.pid > 0) {
+        kill(proc.pid, SIGKILL);
+        reap(proc, nullptr);
+    }
+    proc.pid = -1;
+}
+
+int wait_process(Subprocess& proc) {
+    close_pipes(proc);
+    int status = 0;
+    int result = -1;
+    if (proc.pid > 0 && reap(proc, &status) == proc.pid && WIFEXITED(status)) {
+        result = WEXITSTATUS(status);
+    }
+    proc.pid = -1;
+    return result;
+}
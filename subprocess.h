@@ -0,0 +1,25 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+// A child process with pipes to its stdin and stdout. stderr goes to /dev/null.
+struct Subprocess {
+    pid_t pid = -1;
+    int in_fd = -1;   // child's stdin, -1 if not piped
+    int out_fd = -1;  // child's stdout
+    // User plus system CPU time of the child, once it has been reaped
+    long cpu_usec = 0;
+
+    bool running() const { return pid > 0; }
+};
+
+// Start argv[0] (looked up in PATH). Returns false if it could not be spawned.
+bool spawn_process(const std::vector<std::string>& argv, bool pipe_stdin, Subprocess& proc);
+
+// Close the pipes, SIGKILL the child and reap it
+void kill_process(Subprocess& proc);
+
+// Close the pipes and wait for a normal exit. Returns the exit status, or -1.
+int wait_process(Subprocess& proc);
@@ -0,0 +1,332 @@
+#include "title_index.h"
+#include "env.h"
+#include "metrics.h"
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <mutex>
+
+namespace {
+
+constexpr uint32_t kNone = std::numeric_limits<uint32_t>::max();
+// A play in the asking guild counts for this many plays elsewhere
+constexpr uint64_t kGuildWeight = 10;
+// A query whose shortest posting list is this long or less has all its
+// matches ranked; past that only the newest kScanMatches
+constexpr size_t kScanAll = 2048;
+constexpr size_t kScanMatches = 256;
+// Most played titles kept, overall and per guild
+constexpr size_t kPopular = 128;
+constexpr size_t kGuildTop = 64;
+
+struct TitleIndexMetrics {
+    Histogram& lookup = metrics().histogram("musicbot_autocomplete_seconds", "Title index lookup latency", "",
+                                            {0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01});
+    Counter& compactions = metrics().counter("musicbot_title_index_compactions_total",
+                                             "Times the title index dropped its less played half");
+};
+
+TitleIndexMetrics& title_index_metrics() {
+    static TitleIndexMetrics m;
+    return m;
+}
+
+std::vector<std::string> split_words(const std::string& folded) {
+    std::vector<std::string> words;
+    size_t start = 0;
+    while (start < folded.size()) {
+        size_t end = folded.find(' ', start);
+        if (end == std::string::npos) end = folded.size();
+        if (end > start) words.push_back(folded.substr(start, end - start));
+        start = end + 1;
+    }
+    return words;
+}
+
+// Whether `word` starts one of the words in `folded`
+bool starts_word(const std::string& folded, const std::string& word) {
+    for (size_t pos = folded.find(word); pos != std::string::npos; pos = folded.find(word, pos + 1)) {
+        if (pos == 0 || folded[pos - 1] == ' ') return true;
+    }
+    return false;
+}
+
+// Move `id` into place in `top`, a list of at most `cap` ids sorted by
+// count, most first, now that its count went up by one
+template <typename Count>
+void rank(std::vector<uint32_t>& top, size_t cap, uint32_t id, Count count) {
+    auto pos = std::find(top.begin(), top.end(), id);
+    if (pos == top.end()) {
+        if (top.size() < cap) {
+            top.push_back(id);
+        } else if (count(top.back()) < count(id)) {
+            top.back() = id;
+        } else {
+            return;
+        }
+        pos = top.end() - 1;
+    }
+    while (pos != top.begin() && count(*(pos - 1)) < count(*pos)) {
+        std::iter_swap(pos - 1, pos);
+        --pos;
+    }
+}
+
+} // namespace
+
+TitleIndex::TitleIndex(Options opts) : options(opts) {
+    if (options.capacity < 2) options.capacity = 2;
+}
+
+std::string TitleIndex::fold(const std::string& text) {
+    std::string folded;
+    folded.reserve(text.size());
+    for (unsigned char c : text) {
+        if (c >= 0x80 || (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z')) {
+            folded += static_cast<char>(c);
+        } else if (c >= 'A' && c <= 'Z') {
+            folded += static_cast<char>(c - 'A' + 'a');
+        } else if (!folded.empty() && folded.back() != ' ') {
+            folded += ' ';
+        }
+    }
+    if (!folded.empty() && folded.back() == ' ') folded.pop_back();
+    return folded;
+}
+
+void TitleIndex::trigrams(const std::string& folded, std::vector<uint32_t>& out) {
+    out.clear();
+    for (const auto& word : split_words(folded)) {
+        std::string padded = "  " + word;
+        for (size_t i = 0; i + 3 <= padded.size(); i++) {
+            out.push_back(static_cast<uint32_t>(static_cast<unsigned char>(padded[i])) << 16 |
+                          static_cast<uint32_t>(static_cast<unsigned char>(padded[i + 1])) << 8 |
+                          static_cast<unsigned char>(padded[i + 2]));
+        }
+    }
+    std::sort(out.begin(), out.end());
+    out.erase(std::unique(out.begin(), out.end()), out.end());
+}
+
+void TitleIndex::add(const TrackInfo& track) {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    insert(track);
+}
+
+void TitleIndex::played(uint64_t guild_id, const TrackInfo& track) {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    uint32_t id = insert(track);
+    if (id == kNone) return;
+    titles[id].plays++;
+    rank(popular, kPopular, id, [this](uint32_t other) { return titles[other].plays; });
+    GuildPlays& guild = guilds[guild_id];
+    guild.counts[id]++;
+    rank(guild.top, kGuildTop, id, [&guild](uint32_t other) { return guild.counts[other]; });
+}
+
+uint32_t TitleIndex::insert(const TrackInfo& track) {
+    if (track.url.empty() || track.title.empty()) return kNone;
+    auto it = by_url.find(track.url);
+    if (it != by_url.end()) return it->second;
+
+    if (titles.size() >= options.capacity) compact();
+    auto id = static_cast<uint32_t>(titles.size());
+    titles.push_back(Title{track.title, track.url, fold(track.title)});
+    by_url[track.url] = id;
+    index_title(id);
+    return id;
+}
+
+void TitleIndex::index_title(uint32_t id) {
+    std::vector<uint32_t> grams;
+    trigrams(titles[id].folded, grams);
+    // Ids only grow between compactions, so the lists stay sorted
+    for (uint32_t gram : grams) {
+        postings[gram].push_back(id);
+    }
+}
+
+void TitleIndex::compact() {
+    // Keep the more played half, newer titles first among equals
+    std::vector<uint32_t> order(titles.size());
+    for (uint32_t i = 0; i < order.size(); i++) order[i] = i;
+    size_t keep = options.capacity / 2;
+    std::nth_element(order.begin(), order.begin() + keep, order.end(), [this](uint32_t a, uint32_t b) {
+        return titles[a].plays != titles[b].plays ? titles[a].plays > titles[b].plays : a > b;
+    });
+    order.resize(keep);
+    std::sort(order.begin(), order.end());
+
+    std::vector<uint32_t> remap(titles.size(), kNone);
+    std::vector<Title> kept;
+    kept.reserve(options.capacity);
+    for (uint32_t old_id : order) {
+        remap[old_id] = static_cast<uint32_t>(kept.size());
+        kept.push_back(std::move(titles[old_id]));
+    }
+    titles = std::move(kept);
+
+    by_url.clear();
+    postings.clear();
+    for (uint32_t id = 0; id < titles.size(); id++) {
+        by_url[titles[id].url] = id;
+        index_title(id);
+    }
+
+    auto remap_ids = [&remap](std::vector<uint32_t>& ids) {
+        size_t kept_ids = 0;
+        for (uint32_t old_id : ids) {
+            if (remap[old_id] != kNone) ids[kept_ids++] = remap[old_id];
+        }
+        ids.resize(kept_ids);
+    };
+    remap_ids(popular);
+    for (auto guild = guilds.begin(); guild != guilds.end();) {
+        std::unordered_map<uint32_t, uint32_t> counts;
+        for (const auto& [old_id, count] : guild->second.counts) {
+            if (remap[old_id] != kNone) counts[remap[old_id]] = count;
+        }
+        if (counts.empty()) {
+            guild = guilds.erase(guild);
+        } else {
+            guild->second.counts = std::move(counts);
+            remap_ids(guild->second.top);
+            ++guild;
+        }
+    }
+    title_index_metrics().compactions.inc();
+}
+
+bool TitleIndex::matches(uint32_t id, const std::vector<std::string>& words) const {
+    const std::string& folded = titles[id].folded;
+    return std::all_of(words.begin(), words.end(), [&folded](const std::string& word) {
+        return starts_word(folded, word);
+    });
+}
+
+void TitleIndex::intersect(const std::vector<const std::vector<uint32_t>*>& lists,
+                           const std::vector<std::string>& words, size_t limit, std::vector<uint32_t>& out) const {
+    // Walk the shortest list from its newest end; in the others, only the
+    // part before the last id looked at is left to search
+    std::vector<size_t> ends;
+    for (const auto* list : lists) ends.push_back(list->size());
+    const auto& shortest = *lists.front();
+    size_t found = 0;
+    for (auto it = shortest.rbegin(); it != shortest.rend() && found < limit; ++it) {
+        uint32_t id = *it;
+        bool everywhere = true;
+        for (size_t i = 1; i < lists.size() && everywhere; i++) {
+            auto begin = lists[i]->begin();
+            auto after = std::upper_bound(begin, begin + ends[i], id);
+            ends[i] = after - begin;
+            everywhere = after != begin && *(after - 1) == id;
+        }
+        // The trigrams may come from different words
+        if (everywhere && matches(id, words)) {
+            out.push_back(id);
+            found++;
+        }
+    }
+}
+
+std::vector<TitleIndex::Suggestion> TitleIndex::suggest(uint64_t guild_id, const std::string& query,
+                                                        size_t limit) const {
+    auto started = std::chrono::steady_clock::now();
+    std::string folded = fold(query);
+    std::vector<std::string> words = split_words(folded);
+    std::vector<uint32_t> grams;
+    trigrams(folded, grams);
+
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    auto guild_it = guilds.find(guild_id);
+    const GuildPlays* guild = guild_it == guilds.end() ? nullptr : &guild_it->second;
+
+    std::vector<const std::vector<uint32_t>*> lists;
+    for (uint32_t gram : grams) {
+        auto it = postings.find(gram);
+        if (it == postings.end()) {
+            title_index_metrics().lookup.observe_since(started);
+            return {};
+        }
+        lists.push_back(&it->second);
+    }
+    std::sort(lists.begin(), lists.end(), [](const auto* a, const auto* b) { return a->size() < b->size(); });
+
+    std::vector<uint32_t> candidates;
+    if (!lists.empty() && lists.front()->size() <= kScanAll) {
+        intersect(lists, words, lists.front()->size(), candidates);
+    } else {
+        // Too many to rank: the newest matches, then whatever has plays
+        if (!lists.empty()) {
+            intersect(lists, words, kScanMatches, candidates);
+        } else {
+            auto newest = static_cast<uint32_t>(std::min(titles.size(), kScanMatches));
+            for (uint32_t i = 1; i <= newest; i++) candidates.push_back(static_cast<uint32_t>(titles.size()) - i);
+        }
+        if (guild) {
+            for (uint32_t id : guild->top) {
+                if (matches(id, words)) candidates.push_back(id);
+            }
+        }
+        for (uint32_t id : popular) {
+            if (matches(id, words)) candidates.push_back(id);
+        }
+    }
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+    struct Ranked {
+        uint64_t score;
+        bool leading;
+        uint32_t id;
+    };
+    std::vector<Ranked> ranked;
+    ranked.reserve(candidates.size());
+    for (uint32_t id : candidates) {
+        uint64_t score = titles[id].plays;
+        if (guild) {
+            auto it = guild->counts.find(id);
+            if (it != guild->counts.end()) score += kGuildWeight * it->second;
+        }
+        bool leading = !folded.empty() && titles[id].folded.compare(0, folded.size(), folded) == 0;
+        ranked.push_back({score, leading, id});
+    }
+    size_t count = std::min(limit, ranked.size());
+    std::partial_sort(ranked.begin(), ranked.begin() + count, ranked.end(), [](const Ranked& a, const Ranked& b) {
+        if (a.score != b.score) return a.score > b.score;
+        if (a.leading != b.leading) return a.leading;
+        return a.id > b.id;
+    });
+
+    std::vector<Suggestion> suggestions;
+    suggestions.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        const Title& title = titles[ranked[i].id];
+        suggestions.push_back({title.title, title.url});
+    }
+    lock.unlock();
+    title_index_metrics().lookup.observe_since(started);
+    return suggestions;
+}
+
+size_t TitleIndex::size() const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    return titles.size();
+}
+
+TitleIndex::Options title_index_options_from_env() {
+    TitleIndex::Options opts;
+    opts.capacity = env_size("TITLE_INDEX_SIZE", opts.capacity);
+    return opts;
+}
+
+TitleIndex& title_index() {
+    static TitleIndex index(title_index_options_from_env());
+    static bool registered = [] {
+        metrics().gauge_callback("musicbot_title_index_titles", "Titles /play autocomplete can suggest",
+                                 [] { return static_cast<double>(index.size()); });
+        return true;
+    }();
+    (void)registered;
+    return index;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "track.h"
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <shared_mutex>
+#include <cstdint>
+
+// Titles of tracks the bot has resolved, for /play autocomplete.
+//
+// Titles are folded to lowercase words and indexed by trigram, each word
+// padded with two leading spaces: "  a" and " ab" stand for words starting
+// with those letters, so one posting list lookup serves a one-letter query
+// as well as a long one. A query intersects its trigrams' posting lists,
+// shortest first, keeps the titles where every query word starts a word,
+// and ranks them by plays in the asking guild, then plays anywhere.
+//
+// A short query can match most titles. Then a lookup only ranks the
+// newest few hundred matches plus the matches among the guild's and the
+// whole bot's most played titles, which is where the plays to rank by are.
+//
+// Lookups share a reader lock. Adding a title or counting a play takes it
+// exclusively, which only happens when a track is resolved or starts.
+class TitleIndex {
+public:
+    struct Options {
+        // Titles kept; past this the less played half is dropped
+        size_t capacity = 50000;
+    };
+
+    struct Suggestion {
+        std::string title;
+        std::string url;
+    };
+
+    explicit TitleIndex(Options opts);
+
+    TitleIndex(const TitleIndex&) = delete;
+    TitleIndex& operator=(const TitleIndex&) = delete;
+
+    // Index a resolved track's title; tracks without a page URL are ignored
+    void add(const TrackInfo& track);
+
+    // A track started playing in the guild
+    void played(uint64_t guild_id, const TrackInfo& track);
+
+    // Best `limit` titles matching what has been typed so far. An empty
+    // query gets the guild's most played tracks.
+    std::vector<Suggestion> suggest(uint64_t guild_id, const std::string& query, size_t limit) const;
+
+    size_t size() const;
+
+private:
+    struct Title {
+        std::string title;
+        std::string url;
+        std::string folded;
+        uint64_t plays = 0;
+    };
+
+    // Lowercase ASCII letters and digits in words split on everything else;
+    // other UTF-8 is kept as is
+    static std::string fold(const std::string& text);
+    static void trigrams(const std::string& folded, std::vector<uint32_t>& out);
+
+    struct GuildPlays {
+        // Title id -> plays
+        std::unordered_map<uint32_t, uint32_t> counts;
+        // The guild's most played titles, most first
+        std::vector<uint32_t> top;
+    };
+
+    // Whether every query word starts one of the title's words
+    bool matches(uint32_t id, const std::vector<std::string>& words) const;
+    // Titles in every list that match the words, newest first, stopping
+    // after `limit`
+    void intersect(const std::vector<const std::vector<uint32_t>*>& lists, const std::vector<std::string>& words,
+                   size_t limit, std::vector<uint32_t>& out) const;
+
+    // Called with the lock held exclusively
+    uint32_t insert(const TrackInfo& track);
+    void index_title(uint32_t id);
+    void compact();
+
+    Options options;
+    mutable std::shared_mutex mutex;
+    std::vector<Title> titles;
+    std::unordered_map<std::string, uint32_t> by_url;
+    // Title ids in ascending order for each trigram
+    std::unordered_map<uint32_t, std::vector<uint32_t>> postings;
+    // The most played titles, most first
+    std::vector<uint32_t> popular;
+    std::unordered_map<uint64_t, GuildPlays> guilds;
+};
+
+// Options read from TITLE_INDEX_SIZE
+TitleIndex::Options title_index_options_from_env();
+
+// Process-wide index
+TitleIndex& title_index();
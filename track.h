@@ -0,0 +1,62 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <cstdint>
+
+// Song metadata as resolved by yt-dlp.
+//
+// Once built it is never modified: the resolver and the cache hand out
+// shared pointers to it, so every queue entry for the same song in every
+// guild points at one copy. A refreshed stream URL means a new TrackInfo.
+struct TrackInfo {
+    std::string title;
+    std::string url;
+    std::string stream_url;
+    // Audio codec of stream_url as yt-dlp names it ("opus", "mp4a.40.2", ...)
+    std::string codec;
+    std::string thumbnail;
+    int duration = 0;
+    // Unix time the signed stream_url stops working, 0 if unknown
+    int64_t stream_expires = 0;
+};
+
+using TrackInfoPtr = std::shared_ptr<const TrackInfo>;
+
+// Queue entry: shared song metadata plus who asked for it.
+//
+// Move-only so queue operations never touch the reference count by
+// accident; use clone() where a second entry is really wanted.
+class Track {
+public:
+    Track() = default;
+    Track(TrackInfoPtr info, uint64_t requester) : metadata(std::move(info)), requester_id(requester) {}
+
+    Track(Track&&) noexcept = default;
+    Track& operator=(Track&&) noexcept = default;
+
+    Track clone() const { return Track(metadata, requester_id); }
+
+    const TrackInfo& info() const { return metadata ? *metadata : empty_info(); }
+    const TrackInfo* operator->() const { return &info(); }
+    const TrackInfoPtr& shared_info() const { return metadata; }
+
+    // Swap in refreshed metadata (e.g. a new stream URL) for the same song
+    void set_info(TrackInfoPtr info) { metadata = std::move(info); }
+
+    // Discord snowflake of the requesting user
+    uint64_t requester() const { return requester_id; }
+    std::string requester_mention() const { return "<@" + std::to_string(requester_id) + ">"; }
+
+private:
+    Track(const Track&) = default;
+    Track& operator=(const Track&) = default;
+
+    static const TrackInfo& empty_info() {
+        static const TrackInfo empty;
+        return empty;
+    }
+
+    TrackInfoPtr metadata;
+    uint64_t requester_id = 0;
+};
@@ -0,0 +1,377 @@
+#include "track_cache.h"
+#include "env.h"
+#include "title_index.h"
+#include <json/json.h>
+#include <algorithm>
+#include <cctype>
+#include <ctime>
+#include <cstdio>
+
+namespace {
+
+bool is_video_id_char(char c) {
+    return std::isalnum(static_cast<unsigned char>(c)) || c == '-' || c == '_';
+}
+
+// 11-character YouTube video id starting at pos, or empty
+std::string video_id_at(const std::string& url, size_t pos) {
+    size_t end = pos;
+    while (end < url.size() && is_video_id_char(url[end])) end++;
+    return end - pos == 11 ? url.substr(pos, 11) : "";
+}
+
+// Map the many YouTube URL shapes onto one watch URL
+std::string canonical_url(const std::string& url) {
+    std::string id;
+    size_t pos;
+    if ((pos = url.find("youtu.be/")) != std::string::npos) {
+        id = video_id_at(url, pos + 9);
+    } else if (url.find("youtube.com/") != std::string::npos) {
+        if ((pos = url.find("v=")) != std::string::npos &&
+            (url[pos - 1] == '?' || url[pos - 1] == '&')) {
+            id = video_id_at(url, pos + 2);
+        } else if ((pos = url.find("/shorts/")) != std::string::npos) {
+            id = video_id_at(url, pos + 8);
+        }
+    }
+    return id.empty() ? url : "https://www.youtube.com/watch?v=" + id;
+}
+
+} // namespace
+
+Json::Value track_to_json(const TrackInfo& track) {
+    Json::Value value;
+    value["title"] = track.title;
+    value["url"] = track.url;
+    value["stream_url"] = track.stream_url;
+    value["codec"] = track.codec;
+    value["thumbnail"] = track.thumbnail;
+    value["duration"] = track.duration;
+    value["stream_expires"] = Json::Int64(track.stream_expires);
+    return value;
+}
+
+namespace {
+
+// One line of the cache file
+std::string disk_record(const std::string& key, const std::vector<TrackInfoPtr>& tracks) {
+    Json::Value root;
+    root["key"] = key;
+    root["tracks"] = Json::Value(Json::arrayValue);
+    for (const auto& track : tracks) {
+        root["tracks"].append(track_to_json(*track));
+    }
+
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    return Json::writeString(builder, root) + '\n';
+}
+
+} // namespace
+
+TrackInfoPtr track_from_json(const Json::Value& value) {
+    auto track = std::make_shared<TrackInfo>();
+    track->title = value.get("title", "Unknown Title").asString();
+    track->url = value.get("url", "").asString();
+    track->stream_url = value.get("stream_url", "").asString();
+    track->codec = value.get("codec", "").asString();
+    track->thumbnail = value.get("thumbnail", "").asString();
+    track->duration = value.get("duration", 0).asInt();
+    track->stream_expires = value.get("stream_expires", 0).asInt64();
+    return track;
+}
+
+TrackCache::TrackCache(ResolverPool& pool, Options opts) : pool(pool), options(std::move(opts)) {
+    if (options.capacity == 0) options.capacity = 1;
+    if (!options.disk_path.empty()) {
+        load_disk();
+        disk_writer = std::thread([this] { run_disk(); });
+    }
+}
+
+TrackCache::~TrackCache() {
+    if (!disk_writer.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(disk_mutex);
+        disk_stopping = true;
+    }
+    disk_wake.notify_one();
+    disk_writer.join();
+}
+
+std::string TrackCache::normalize(const std::string& query) {
+    // Trim and collapse runs of whitespace
+    std::string collapsed;
+    for (char c : query) {
+        if (std::isspace(static_cast<unsigned char>(c))) {
+            if (!collapsed.empty() && collapsed.back() != ' ') collapsed += ' ';
+        } else {
+            collapsed += c;
+        }
+    }
+    if (!collapsed.empty() && collapsed.back() == ' ') collapsed.pop_back();
+
+    if (collapsed.find("http://") == 0 || collapsed.find("https://") == 0) {
+        return canonical_url(collapsed);
+    }
+
+    std::transform(collapsed.begin(), collapsed.end(), collapsed.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    return "search:" + collapsed;
+}
+
+bool TrackCache::stream_stale(const TrackInfo& track) const {
+    return stream_stale(track, std::time(nullptr));
+}
+
+bool TrackCache::stream_stale(const TrackInfo& track, int64_t play_at) const {
+    if (track.stream_url.empty()) return true;
+    if (track.stream_expires == 0) return false;
+    return play_at + options.expiry_margin.count() >= track.stream_expires;
+}
+
+bool TrackCache::resolve(const std::string& query, ResolverPool::Callback callback) {
+    std::string key = normalize(query);
+    std::vector<TrackInfoPtr> cached;
+    std::string request;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(key);
+        if (it != index.end()) {
+            lru.splice(lru.begin(), lru, it->second);
+            cached = it->second->tracks;
+        }
+
+        bool fresh = !cached.empty() &&
+            std::none_of(cached.begin(), cached.end(),
+                         [this](const TrackInfoPtr& t) { return stream_stale(*t); });
+        if (fresh) {
+            counters.hits++;
+        } else {
+            auto pending = inflight.find(key);
+            if (pending != inflight.end()) {
+                counters.coalesced++;
+                pending->second.push_back(std::move(callback));
+                return true;
+            }
+            inflight[key].push_back(std::move(callback));
+
+            // Metadata is still good; only the signed stream URL needs redoing
+            if (cached.size() == 1 && !cached.front()->url.empty()) {
+                counters.stream_refreshes++;
+                request = cached.front()->url;
+            } else {
+                counters.misses++;
+                cached.clear();
+                request = make_search_query(query);
+            }
+        }
+    }
+
+    if (request.empty()) {
+        callback(std::move(cached), "");
+        return true;
+    }
+
+    bool queued = pool.submit(request, [this, key, cached](std::vector<TrackInfoPtr> tracks, const std::string& error) {
+        finish(key, cached, std::move(tracks), error);
+    });
+
+    if (!queued) {
+        std::vector<ResolverPool::Callback> waiters;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto pending = inflight.find(key);
+            if (pending != inflight.end()) {
+                waiters = std::move(pending->second);
+                inflight.erase(pending);
+            }
+        }
+        // The first waiter is our own caller, who sees the false return instead
+        for (size_t i = 1; i < waiters.size(); i++) {
+            waiters[i]({}, "resolver busy");
+        }
+    }
+    return queued;
+}
+
+void TrackCache::finish(const std::string& key, const std::vector<TrackInfoPtr>& cached,
+                        std::vector<TrackInfoPtr> tracks, const std::string& error) {
+    if (!cached.empty() && !tracks.empty()) {
+        auto merged = std::make_shared<TrackInfo>(*cached.front());
+        merged->stream_url = tracks.front()->stream_url;
+        merged->codec = tracks.front()->codec;
+        merged->stream_expires = tracks.front()->stream_expires;
+        tracks = {merged};
+    }
+
+    if (!tracks.empty()) {
+        int64_t now = std::time(nullptr);
+        for (auto& track : tracks) {
+            if (track->stream_expires == 0) {
+                auto dated = std::make_shared<TrackInfo>(*track);
+                dated->stream_expires = now + options.default_stream_ttl.count();
+                track = dated;
+            }
+        }
+        store(key, tracks, true);
+        for (const auto& track : tracks) {
+            title_index().add(*track);
+        }
+
+        // A search result is also a hit for its own URL
+        if (tracks.size() == 1 && !tracks.front()->url.empty()) {
+            std::string url_key = normalize(tracks.front()->url);
+            if (url_key != key) store(url_key, tracks, true);
+        }
+    }
+
+    std::vector<ResolverPool::Callback> waiters;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto pending = inflight.find(key);
+        if (pending != inflight.end()) {
+            waiters = std::move(pending->second);
+            inflight.erase(pending);
+        }
+    }
+    for (auto& waiter : waiters) {
+        waiter(tracks, error);
+    }
+}
+
+void TrackCache::store(const std::string& key, const std::vector<TrackInfoPtr>& tracks, bool persist) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto it = index.find(key);
+        if (it != index.end()) {
+            it->second->tracks = tracks;
+            lru.splice(lru.begin(), lru, it->second);
+        } else {
+            lru.push_front(Entry{key, tracks});
+            index[key] = lru.begin();
+            while (lru.size() > options.capacity) {
+                index.erase(lru.back().key);
+                lru.pop_back();
+            }
+        }
+    }
+
+    if (persist && disk_writer.joinable()) {
+        append_disk(key, tracks);
+    }
+}
+
+void TrackCache::load_disk() {
+    {
+        std::ifstream file(options.disk_path);
+        std::string line;
+        while (std::getline(file, line)) {
+            Json::Value root;
+            Json::Reader reader;
+            if (line.empty() || !reader.parse(line, root) || !root.isObject()) {
+                continue;
+            }
+
+            std::vector<TrackInfoPtr> tracks;
+            for (const auto& value : root["tracks"]) {
+                tracks.push_back(track_from_json(value));
+            }
+            if (!tracks.empty()) {
+                store(root["key"].asString(), tracks, false);
+                for (const auto& track : tracks) {
+                    title_index().add(*track);
+                }
+            }
+        }
+    }
+
+    // The writer thread has not started yet
+    std::vector<Entry> entries(lru.rbegin(), lru.rend());
+    compact_disk(entries);
+    disk_records = entries.size();
+}
+
+void TrackCache::append_disk(const std::string& key, const std::vector<TrackInfoPtr>& tracks) {
+    std::string record = disk_record(key, tracks);
+    {
+        std::lock_guard<std::mutex> lock(disk_mutex);
+        disk_pending += record;
+    }
+    disk_wake.notify_one();
+}
+
+void TrackCache::run_disk() {
+    std::unique_lock<std::mutex> lock(disk_mutex);
+    while (true) {
+        disk_wake.wait(lock, [this] { return disk_stopping || !disk_pending.empty(); });
+        if (disk_pending.empty()) return;
+
+        std::string batch = std::move(disk_pending);
+        disk_pending.clear();
+        disk_records += static_cast<size_t>(std::count(batch.begin(), batch.end(), '\n'));
+        // Superseded and evicted records pile up; rewrite once they dominate
+        bool compact = disk_records > options.capacity * 2;
+        lock.unlock();
+
+        disk << batch;
+        disk.flush();
+        size_t compacted = 0;
+        if (compact) {
+            // A copy of the entries, so the rewrite holds no lock; records
+            // stored meanwhile follow it as appends
+            std::vector<Entry> entries;
+            {
+                std::lock_guard<std::mutex> cache_lock(mutex);
+                entries.assign(lru.rbegin(), lru.rend());
+            }
+            compact_disk(entries);
+            compacted = entries.size();
+        }
+
+        lock.lock();
+        if (compact) {
+            disk_records = compacted;
+        }
+    }
+}
+
+void TrackCache::compact_disk(const std::vector<Entry>& entries) {
+    if (disk.is_open()) disk.close();
+
+    std::string temp_path = options.disk_path + ".tmp";
+    {
+        std::ofstream out(temp_path, std::ios::trunc);
+        // Oldest first, so replaying the file rebuilds the same LRU order
+        for (const Entry& entry : entries) {
+            out << disk_record(entry.key, entry.tracks);
+        }
+    }
+    std::rename(temp_path.c_str(), options.disk_path.c_str());
+
+    disk.open(options.disk_path, std::ios::app);
+}
+
+TrackCache::Stats TrackCache::stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
+
+size_t TrackCache::size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return lru.size();
+}
+
+TrackCache::Options track_cache_options_from_env() {
+    TrackCache::Options opts;
+    opts.capacity = env_size("TRACK_CACHE_SIZE", opts.capacity);
+    opts.disk_path = env_string("TRACK_CACHE_FILE");
+    return opts;
+}
+
+TrackCache& track_cache() {
+    static TrackCache cache(resolver_pool(), track_cache_options_from_env());
+    return cache;
+}
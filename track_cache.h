@@ -0,0 +1,115 @@
+#pragma once
+
+#include "track.h"
+#include "resolver.h"
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <fstream>
+
+namespace Json {
+class Value;
+}
+
+// LRU cache of resolved tracks in front of the resolver pool.
+//
+// Entries are keyed by the normalized query (or canonical URL) and keep the
+// track metadata for as long as they stay in the LRU. The signed stream URL
+// expires much sooner, so a hit with a stale stream URL re-resolves only the
+// track's page URL and swaps in the new stream URL. Concurrent misses for the
+// same key share a single resolver request.
+class TrackCache {
+public:
+    struct Options {
+        size_t capacity = 4096;
+        // Stream URLs without an expire= parameter are trusted this long
+        std::chrono::seconds default_stream_ttl{std::chrono::hours(1)};
+        // Refresh this long before the stream URL actually expires
+        std::chrono::seconds expiry_margin{std::chrono::minutes(5)};
+        // Append-only file that survives restarts; empty disables it. A
+        // writer thread appends to it and rewrites it, off the cache lock.
+        std::string disk_path;
+    };
+
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t stream_refreshes = 0;
+        uint64_t coalesced = 0;
+    };
+
+    TrackCache(ResolverPool& pool, Options opts);
+    ~TrackCache();
+
+    TrackCache(const TrackCache&) = delete;
+    TrackCache& operator=(const TrackCache&) = delete;
+
+    // Resolve through the cache. Fresh hits call back immediately on the
+    // calling thread; everything else calls back on a resolver thread.
+    // Returns false if a resolver request was needed and the pool is full.
+    bool resolve(const std::string& query, ResolverPool::Callback callback);
+
+    // True if the track's stream URL is missing or about to expire
+    bool stream_stale(const TrackInfo& track) const;
+
+    // Same, for a track expected to start playing at unix time play_at
+    bool stream_stale(const TrackInfo& track, int64_t play_at) const;
+
+    Stats stats() const;
+    size_t size() const;
+
+    // The pool misses go to; playlists are listed through it directly
+    ResolverPool& resolver() { return pool; }
+
+    static std::string normalize(const std::string& query);
+
+private:
+    struct Entry {
+        std::string key;
+        // Shared with every queue entry that came from this cache entry
+        std::vector<TrackInfoPtr> tracks;
+    };
+
+    void finish(const std::string& key, const std::vector<TrackInfoPtr>& cached,
+                std::vector<TrackInfoPtr> tracks, const std::string& error);
+    void store(const std::string& key, const std::vector<TrackInfoPtr>& tracks, bool persist);
+    void load_disk();
+    // Hand one record to the writer thread
+    void append_disk(const std::string& key, const std::vector<TrackInfoPtr>& tracks);
+    void run_disk();
+    // Rewrite the file as `entries`, oldest first; only the writer thread
+    // (or the constructor, before it starts) touches the file
+    void compact_disk(const std::vector<Entry>& entries);
+
+    ResolverPool& pool;
+    Options options;
+    mutable std::mutex mutex;
+    std::list<Entry> lru;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    std::unordered_map<std::string, std::vector<ResolverPool::Callback>> inflight;
+    Stats counters;
+
+    std::ofstream disk;
+    // Records waiting for the writer thread, guarded by disk_mutex
+    std::mutex disk_mutex;
+    std::condition_variable disk_wake;
+    std::string disk_pending;
+    size_t disk_records = 0;
+    bool disk_stopping = false;
+    std::thread disk_writer;
+};
+
+// Options read from TRACK_CACHE_SIZE and TRACK_CACHE_FILE
+TrackCache::Options track_cache_options_from_env();
+
+// Process-wide cache over resolver_pool()
+TrackCache& track_cache();
+
+// TrackInfo as the cache file (and the shard handoff) stores it
+Json::Value track_to_json(const TrackInfo& track);
+TrackInfoPtr track_from_json(const Json::Value& value);
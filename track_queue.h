@@ -0,0 +1,265 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+
+// Sequence container for guild queues.
+//
+// An implicit treap: nodes are ordered by position rather than by key, and
+// each node caches the size of its subtree. That gives O(log n) indexed
+// access, insertion, removal and moves, and slice iteration that skips
+// straight to an offset. Values sit in a node pool and are never copied by
+// the queue operations; shuffle() only relinks nodes.
+template <typename T>
+class IndexedQueue {
+public:
+    IndexedQueue() = default;
+
+    size_t size() const { return root == kNil ? 0 : nodes[root].size; }
+    bool empty() const { return root == kNil; }
+
+    void clear() {
+        nodes.clear();
+        free_nodes.clear();
+        root = kNil;
+    }
+
+    void push_back(T value) {
+        root = merge(root, allocate(std::move(value)));
+    }
+
+    void push_front(T value) {
+        root = merge(allocate(std::move(value)), root);
+    }
+
+    // Insert so that the new value ends up at `pos` (clamped to size())
+    void insert(size_t pos, T value) {
+        uint32_t left, right;
+        split(root, std::min(pos, size()), left, right);
+        root = merge(merge(left, allocate(std::move(value))), right);
+    }
+
+    // Remove and return the value at `pos`
+    T erase(size_t pos) {
+        check(pos);
+        uint32_t left, middle, right;
+        split(root, pos, left, right);
+        split(right, 1, middle, right);
+        T value = std::move(nodes[middle].value);
+        release(middle);
+        root = merge(left, right);
+        return value;
+    }
+
+    T pop_front() { return erase(0); }
+
+    T& front() { return at(0); }
+    const T& front() const { return at(0); }
+
+    T& at(size_t pos) { return nodes[find(pos)].value; }
+    const T& at(size_t pos) const { return nodes[find(pos)].value; }
+
+    T& operator[](size_t pos) { return at(pos); }
+    const T& operator[](size_t pos) const { return at(pos); }
+
+    // Move the value at `from` so that it ends up at `to`
+    void move(size_t from, size_t to) {
+        check(from);
+        uint32_t left, middle, right;
+        split(root, from, left, right);
+        split(right, 1, middle, right);
+        root = merge(left, right);
+
+        split(root, std::min(to, size()), left, right);
+        root = merge(merge(left, middle), right);
+    }
+
+    // Call fn(value) for up to `count` values starting at `offset`
+    template <typename Fn>
+    void for_each(size_t offset, size_t count, Fn&& fn) const {
+        walk(root, offset, count, fn);
+    }
+
+    template <typename Fn>
+    void for_each(Fn&& fn) const {
+        size_t offset = 0;
+        size_t count = size();
+        walk(root, offset, count, fn);
+    }
+
+    // Random permutation in O(n); values are not copied or moved
+    template <typename Rng>
+    void shuffle(Rng& rng) {
+        std::vector<uint32_t> order;
+        order.reserve(size());
+        collect(root, order);
+        std::shuffle(order.begin(), order.end(), rng);
+        root = build(order);
+    }
+
+private:
+    static constexpr uint32_t kNil = UINT32_MAX;
+
+    struct Node {
+        T value;
+        uint32_t left = kNil;
+        uint32_t right = kNil;
+        uint32_t size = 1;
+        uint32_t priority = 0;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<uint32_t> free_nodes;
+    uint32_t root = kNil;
+    uint32_t seed = 0x9e3779b9u;
+
+    uint32_t next_priority() {
+        // xorshift32; only has to be well spread, not unpredictable
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    }
+
+    uint32_t allocate(T value) {
+        uint32_t index;
+        if (!free_nodes.empty()) {
+            index = free_nodes.back();
+            free_nodes.pop_back();
+            nodes[index].value = std::move(value);
+        } else {
+            index = static_cast<uint32_t>(nodes.size());
+            nodes.push_back(Node{std::move(value)});
+        }
+        Node& node = nodes[index];
+        node.left = node.right = kNil;
+        node.size = 1;
+        node.priority = next_priority();
+        return index;
+    }
+
+    void release(uint32_t index) {
+        nodes[index].value = T();
+        free_nodes.push_back(index);
+    }
+
+    void check(size_t pos) const {
+        if (pos >= size()) throw std::out_of_range("IndexedQueue position out of range");
+    }
+
+    uint32_t subtree(uint32_t index) const {
+        return index == kNil ? 0 : nodes[index].size;
+    }
+
+    void update(uint32_t index) {
+        Node& node = nodes[index];
+        node.size = 1 + subtree(node.left) + subtree(node.right);
+    }
+
+    uint32_t merge(uint32_t a, uint32_t b) {
+        if (a == kNil) return b;
+        if (b == kNil) return a;
+        if (nodes[a].priority > nodes[b].priority) {
+            nodes[a].right = merge(nodes[a].right, b);
+            update(a);
+            return a;
+        }
+        nodes[b].left = merge(a, nodes[b].left);
+        update(b);
+        return b;
+    }
+
+    // First `count` values into `a`, the rest into `b`
+    void split(uint32_t index, size_t count, uint32_t& a, uint32_t& b) {
+        if (index == kNil) {
+            a = b = kNil;
+            return;
+        }
+        size_t left_size = subtree(nodes[index].left);
+        if (count <= left_size) {
+            split(nodes[index].left, count, a, nodes[index].left);
+            b = index;
+        } else {
+            split(nodes[index].right, count - left_size - 1, nodes[index].right, b);
+            a = index;
+        }
+        update(index);
+    }
+
+    uint32_t find(size_t pos) const {
+        check(pos);
+        uint32_t index = root;
+        while (true) {
+            size_t left_size = subtree(nodes[index].left);
+            if (pos < left_size) {
+                index = nodes[index].left;
+            } else if (pos == left_size) {
+                return index;
+            } else {
+                pos -= left_size + 1;
+                index = nodes[index].right;
+            }
+        }
+    }
+
+    // In-order walk that skips whole subtrees lying before `offset`
+    template <typename Fn>
+    void walk(uint32_t index, size_t& offset, size_t& count, Fn& fn) const {
+        if (index == kNil || count == 0) return;
+        const Node& node = nodes[index];
+        if (offset >= node.size) {
+            offset -= node.size;
+            return;
+        }
+        walk(node.left, offset, count, fn);
+        if (count == 0) return;
+        if (offset > 0) {
+            offset--;
+        } else {
+            fn(node.value);
+            count--;
+        }
+        walk(node.right, offset, count, fn);
+    }
+
+    void collect(uint32_t index, std::vector<uint32_t>& out) const {
+        if (index == kNil) return;
+        collect(nodes[index].left, out);
+        out.push_back(index);
+        collect(nodes[index].right, out);
+    }
+
+    // Treap over `order` in O(n) using the usual rightmost-spine stack
+    uint32_t build(const std::vector<uint32_t>& order) {
+        std::vector<uint32_t> spine;
+        for (uint32_t index : order) {
+            nodes[index].left = nodes[index].right = kNil;
+            nodes[index].size = 1;
+            uint32_t last = kNil;
+            while (!spine.empty() && nodes[spine.back()].priority < nodes[index].priority) {
+                last = spine.back();
+                update(last);
+                spine.pop_back();
+                if (!spine.empty()) {
+                    nodes[spine.back()].right = last;
+                }
+            }
+            nodes[index].left = last;
+            if (!spine.empty()) {
+                nodes[spine.back()].right = index;
+            }
+            spine.push_back(index);
+        }
+        uint32_t top = kNil;
+        while (!spine.empty()) {
+            top = spine.back();
+            update(top);
+            spine.pop_back();
+        }
+        return top;
+    }
+};
@@ -0,0 +1,178 @@
+#include "views.h"
+#include <algorithm>
+
+namespace {
+
+const char* const kLoopModeNames[] = {"Disabled", "Single Track", "Queue"};
+const char* const kLoopModeShortNames[] = {"Off", "Track", "Queue"};
+
+} // namespace
+
+std::string format_duration(int seconds) {
+    if (seconds <= 0) return "N/A";
+
+    int hours = seconds / 3600;
+    int minutes = (seconds % 3600) / 60;
+    int secs = seconds % 60;
+
+    if (hours > 0) {
+        return std::to_string(hours) + ":" +
+               (minutes < 10 ? "0" : "") + std::to_string(minutes) + ":" +
+               (secs < 10 ? "0" : "") + std::to_string(secs);
+    } else {
+        return std::to_string(minutes) + ":" +
+               (secs < 10 ? "0" : "") + std::to_string(secs);
+    }
+}
+
+int parse_duration(const std::string& text) {
+    int total = 0;
+    int field = -1;
+    int fields = 0;
+    for (char c : text) {
+        if (c >= '0' && c <= '9') {
+            field = (field < 0 ? 0 : field * 10) + (c - '0');
+            if (field > 1000000) return -1;
+        } else if (c == ':' && field >= 0 && fields < 2) {
+            // Minutes and seconds after a colon stay below 60
+            if (fields > 0 && field >= 60) return -1;
+            total = total * 60 + field;
+            field = -1;
+            fields++;
+        } else {
+            return -1;
+        }
+    }
+    if (field < 0 || (fields > 0 && field >= 60)) return -1;
+    return total * 60 + field;
+}
+
+EmbedView queue_view(const Track* current, const IndexedQueue<Track>& queue, int loop_mode, int64_t page) {
+    EmbedView embed;
+    embed.title = "Music Queue";
+    embed.timestamp = true;
+
+    // Current track
+    if (current) {
+        std::string current_info = "**[" + current->info().title + "](" + current->info().url + ")**\n";
+        current_info += "Duration: " + format_duration(current->info().duration) + "\n";
+        current_info += "Requested by: " + current->requester_mention();
+        embed.fields.push_back({"🎵 Now Playing", current_info, false});
+    } else {
+        embed.fields.push_back({"🎵 Now Playing", "Nothing", false});
+    }
+
+    // Queue
+    if (!queue.empty()) {
+        size_t pages = (queue.size() + queue_page_size - 1) / queue_page_size;
+        page = std::clamp<int64_t>(page, 1, (int64_t)pages);
+
+        std::string queue_text = "";
+        size_t offset = (page - 1) * queue_page_size;
+        size_t position = offset + 1;
+
+        // Only the visible slice is walked; nothing is copied
+        queue.for_each(offset, queue_page_size, [&](const Track& track) {
+            std::string title = track->title;
+            if (title.length() > 45) {
+                title = title.substr(0, 45) + "...";
+            }
+
+            queue_text += "`" + std::to_string(position) + ".` **[" + title + "](" +
+                        track->url + ")** | " + format_duration(track->duration) +
+                        " | Req: " + track.requester_mention() + "\n";
+            position++;
+        });
+
+        if (pages > 1) {
+            queue_text += "\n*Page " + std::to_string(page) + " of " + std::to_string(pages) +
+                         ".*\nTotal length: " + std::to_string(queue.size()) + " songs";
+        }
+
+        embed.fields.push_back({"📑 Up Next (" + std::to_string(queue.size()) + " tracks)", queue_text, false});
+    } else {
+        embed.fields.push_back({"📑 Up Next", "Queue is empty", false});
+    }
+
+    // Loop mode
+    embed.footer = std::string("Loop Mode: ") + kLoopModeNames[loop_mode];
+    return embed;
+}
+
+EmbedView now_playing_view(const Track& current, int loop_mode, int position_seconds,
+                           const Player::Stats& stats, const std::optional<PacedSink::Stats>& voice) {
+    const TrackInfo& info = current.info();
+
+    EmbedView embed;
+    embed.title = "Now Playing";
+    embed.description = "**[" + info.title + "](" + info.url + ")**";
+
+    if (info.duration > 0) {
+        std::string progress_bar = "`[";
+        double percent = (double)position_seconds / info.duration;
+        int filled_blocks = (int)(percent * 10);
+
+        for (int i = 0; i < 10; i++) {
+            progress_bar += (i < filled_blocks) ? "▬" : "─";
+        }
+        progress_bar += "]`";
+
+        std::string time_text = progress_bar + "\n" +
+                              format_duration(position_seconds) + " / " +
+                              format_duration(info.duration);
+        embed.fields.push_back({"Time", time_text, false});
+    } else {
+        embed.fields.push_back({"Time", "Live Stream or Duration Unknown", false});
+    }
+
+    embed.fields.push_back({"Requested by", current.requester_mention(), true});
+    embed.fields.push_back({"Loop Mode", kLoopModeNames[loop_mode], true});
+
+    if (stats.transitions > 0) {
+        embed.fields.push_back({"Track Gap", std::to_string(stats.last_gap.count()) + " ms (avg " +
+                                std::to_string(stats.total_gap_ms / stats.transitions) + " ms)", true});
+    }
+
+    if (voice) {
+        int buffered_ms = static_cast<int>((voice->buffered + voice->connection) * 1000);
+        std::string text = std::to_string(buffered_ms) + " ms buffered";
+        if (voice->fetch_underruns + voice->decode_underruns > 0) {
+            text += "\nUnderruns: " + std::to_string(voice->fetch_underruns) + " fetch, " +
+                    std::to_string(voice->decode_underruns) + " decode";
+        }
+        if (voice->overruns > 0) {
+            text += "\nNetwork stalls: " + std::to_string(voice->overruns);
+        }
+        if (voice->bitrate > 0) {
+            text += "\nReduced to " + std::to_string(voice->bitrate) + " kbps";
+        }
+        embed.fields.push_back({"Voice", text, true});
+    }
+
+    embed.thumbnail = info.thumbnail;
+    return embed;
+}
+
+EmbedView track_started_view(const Track& track, int loop_mode) {
+    const TrackInfo& info = track.info();
+
+    EmbedView embed;
+    embed.title = "Now Playing";
+    embed.description = "🎵 **[" + info.title + "](" + info.url + ")**";
+
+    embed.fields.push_back({"Requested by", track.requester_mention(), true});
+    if (info.duration > 0) {
+        embed.fields.push_back({"Duration", format_duration(info.duration), true});
+    }
+    embed.thumbnail = info.thumbnail;
+
+    embed.footer = std::string("Loop: ") + kLoopModeShortNames[loop_mode];
+    return embed;
+}
+
+EmbedView queue_finished_view() {
+    EmbedView embed;
+    embed.title = "Queue Finished";
+    embed.description = "📪 Nothing left to play. Use `/play` to add more.";
+    return embed;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "track.h"
+#include "track_queue.h"
+#include "player.h"
+#include "send_scheduler.h"
+#include <string>
+#include <vector>
+#include <optional>
+#include <cstdint>
+
+// Message content for the bot's embeds, built without dpp so it can be
+// benchmarked offline. bot.cpp turns an EmbedView into a dpp::embed.
+struct EmbedView {
+    struct Field {
+        std::string name;
+        std::string value;
+        bool is_inline = false;
+    };
+
+    std::string title;
+    std::string description;
+    std::string thumbnail;
+    std::string footer;
+    uint32_t color = 0x0099ff;
+    bool timestamp = false;
+    std::vector<Field> fields;
+};
+
+// Tracks shown per /queue page
+constexpr size_t queue_page_size = 10;
+
+// Format duration function
+std::string format_duration(int seconds);
+
+// Seconds from "90", "1:30" or "1:02:30"; -1 if malformed
+int parse_duration(const std::string& text);
+
+// /queue: current track, one page of the queue (1-based, clamped) and loop mode
+EmbedView queue_view(const Track* current, const IndexedQueue<Track>& queue, int loop_mode, int64_t page);
+
+// /nowplaying, position_seconds into the current track, with the guild's
+// voice output stats if it has any
+EmbedView now_playing_view(const Track& current, int loop_mode, int position_seconds,
+                           const Player::Stats& stats, const std::optional<PacedSink::Stats>& voice = std::nullopt);
+
+// Announcement posted when play_next starts a track
+EmbedView track_started_view(const Track& track, int loop_mode);
+
+// Last state of the now-playing message once the queue has run out
+EmbedView queue_finished_view();